@@ -9,10 +9,110 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
 #include "../src/lab.h"
+#include "../src/jobs.h"
+#include "../src/pipeline.h"
+#include "../src/script.h"
+#include "../src/parse.h"
+#include "../src/vm.h"
+
+/* Line handed over by readline's callback interface */
+static char *read_result;
+static bool read_done;
+
+/** Called by readline once a full line, or EOF, was read. */
+static void line_ready(char *line)
+{
+    // keep readline from drawing the prompt again while the command runs
+    rl_callback_handler_remove();
+    read_result = line;
+    read_done = true;
+}
+
+/** Terminal input, readline takes one character at a time. */
+static void on_input(struct evloop *l, int fd, unsigned events, void *arg)
+{
+    (void)l;
+    (void)fd;
+    (void)events;
+    (void)arg;
+    rl_callback_read_char();
+}
+
+/** SIGCHLD arrived, reap and tell about jobs that changed. */
+static void on_child(struct evloop *l, int fd, unsigned events, void *arg)
+{
+    struct shell *sh = arg;
+    (void)l;
+    (void)fd;
+    (void)events;
+    jobs_reap(sh);
+    if (sh->options[SH_OPT_NOTIFY] && jobs_pending(&sh->jobs))
+    {
+        // print below the line being edited and draw it again
+        rl_crlf();
+        jobs_notify(sh);
+        rl_on_new_line();
+        rl_redisplay();
+    }
+}
+
+/** A slow prompt segment arrived late, draw the main prompt again. */
+static void on_prompt(struct evloop *l, int fd, unsigned events, void *arg)
+{
+    (void)l;
+    (void)fd;
+    (void)events;
+    char *updated = prompt_update(arg);
+    if (updated)
+    {
+        rl_set_prompt(updated);
+        rl_forced_update_display();
+        free(updated);
+    }
+}
+
+/**
+ * Read a line with readline while the event loop also watches the SIGCHLD
+ * signalfd, so background jobs are reaped as soon as they change state
+ * instead of lingering as zombies until the next command.
+ */
+static char *read_line(struct shell *sh, const char *prompt, bool main_prompt)
+{
+    jobs_notify(sh);
+    read_result = NULL;
+    read_done = false;
+    int in = ev_add(&sh->loop, STDIN_FILENO, EV_READ, on_input, sh);
+    if (in == -1)
+    {
+        perror("event loop");
+        return NULL;
+    }
+    int child = sh->jobs.sigfd != -1 ? ev_add(&sh->loop, sh->jobs.sigfd, EV_READ, on_child, sh) : -1;
+    int slow = main_prompt && prompt_fd(sh) != -1 ? ev_add(&sh->loop, prompt_fd(sh), EV_READ, on_prompt, sh) : -1;
+
+    rl_callback_handler_install(prompt, line_ready);
+    while (!read_done)
+    {
+        if (ev_run_once(&sh->loop, -1) == -1 && errno != EINTR)
+        {
+            perror("event loop");
+            rl_callback_handler_remove();
+            break;
+        }
+    }
+    // the watches belong to the prompt, commands must not see input events
+    ev_del(&sh->loop, slow);
+    ev_del(&sh->loop, child);
+    ev_del(&sh->loop, in);
+    return read_result;
+}
 static void explain_waitpid(int status)
 {
-    if (!WIFEXITED(status))
+    if (WIFEXITED(status))
     {
         fprintf(stderr, "Child exited with status %d\n", WEXITSTATUS(status));
     }
@@ -29,66 +129,217 @@ static void explain_waitpid(int status)
         fprintf(stderr, "Child was resumed by delivery of SIGCONT\n");
     }
 }
+/** Microseconds on clock. */
+static int64_t now_us(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* When and where a line started, for its history record */
+struct line_start
+{
+    int64_t wall;
+    int64_t mono;
+    char cwd[PATH_MAX];
+};
+
+/** Note the start of a line, only needed when there is a history file. */
+static void line_begin(const struct shell *sh, struct line_start *ls)
+{
+    if (sh->history.fd == -1)
+        return;
+    ls->wall = now_us(CLOCK_REALTIME);
+    ls->mono = now_us(CLOCK_MONOTONIC);
+    if (!getcwd(ls->cwd, sizeof(ls->cwd)))
+        ls->cwd[0] = '\0';
+}
+
+/** Append a finished line to the history file. */
+static void line_end(struct shell *sh, const struct line_start *ls, const char *line)
+{
+    if (sh->history.fd == -1)
+        return;
+    uint64_t duration = (uint64_t)(now_us(CLOCK_MONOTONIC) - ls->mono);
+    if (histdb_append(&sh->history, line, ls->cwd, ls->wall, duration, sh->last_status) == -1)
+        perror("history");
+}
+
+/* Source of a command that may go on for several lines */
+struct source
+{
+    char *text;
+    size_t len;
+    size_t cap;
+    int status;     // what program_parse said about text, 0 when it is empty
+};
+
+/** Forget the text, keeping the buffer. */
+static void source_reset(struct source *src)
+{
+    src->len = 0;
+    src->status = 0;
+}
+
+/**
+ * Add a line to the source and parse it when the line can finish it, so
+ * a long loop body is not parsed again for every line. Returns the
+ * program once the source is complete. NULL means more lines are needed,
+ * when status is one of the PARSE_MORE codes, or a syntax error.
+ */
+static struct program *source_add(struct shell *sh, struct source *src, const char *line)
+{
+    size_t len = strlen(line);
+    bool first = src->len == 0 && src->status <= 0;
+    if (src->len + len + 2 > src->cap)
+    {
+        size_t cap = src->cap ? src->cap : 256;
+        while (cap < src->len + len + 2)
+            cap *= 2;
+        char *grown = realloc(src->text, cap);
+        if (!grown)
+        {
+            perror("realloc");
+            src->status = PARSE_ERROR;
+            return NULL;
+        }
+        src->text = grown;
+        src->cap = cap;
+    }
+    if (!first)
+        src->text[src->len++] = '\n';
+    memcpy(src->text + src->len, line, len + 1);
+    src->len += len;
+    if (!first && !parse_may_complete(src->status, line))
+        return NULL;
+
+    struct program *prog;
+    src->status = program_parse(src->text, src->len, &prog);
+    if (src->status == PARSE_ERROR)
+        sh->last_status = 2;
+    return prog;
+}
+
+/** Run a program and drop it, explaining how its last command died. */
+static void run_program(struct shell *sh, struct program *prog)
+{
+    int64_t start = now_us(CLOCK_MONOTONIC);
+    int status = program_run(sh, prog);
+    sh->prompt_state.elapsed_us = now_us(CLOCK_MONOTONIC) - start;
+    program_unref(prog);
+    if (status == -1)
+    {
+        fprintf(stderr, "Wait pid failed with -1\n");
+    }
+    else if (WIFSIGNALED(status))
+    {
+        explain_waitpid(status);
+    }
+}
+
+/**
+ * Run a script file, a -c string or stdin that is not a terminal. Lines
+ * come straight from a mapped file or a large buffer, readline, the prompt
+ * and the history file are never touched. Commands that span lines are
+ * collected until they are complete. A syntax error ends the script.
+ */
+static int run_script(struct shell *sh, const char *name)
+{
+    struct script sc;
+    if (sh->command)
+    {
+        script_open_string(&sc, sh->command);
+    }
+    else if ((sh->script ? script_open_file(&sc, sh->script) : script_open_fd(&sc, STDIN_FILENO)) == -1)
+    {
+        fprintf(stderr, "%s: %s: %s\n", name, sh->script ? sh->script : "stdin", strerror(errno));
+        return 127;
+    }
+    if (sh->script)
+        name = sh->script;
+
+    struct source src = {0};
+    char *line;
+    for (;;)
+    {
+        arena_reset(&sh->line_arena);
+        if (!(line = script_next(&sc, &sh->line_arena)))
+            break;
+        struct program *prog = source_add(sh, &src, line);
+        if (src.status > 0)
+            continue;
+        if (!prog)
+        {
+            fprintf(stderr, "%s: line %zu: `%s'\n", name, sc.line_no, line);
+            break;
+        }
+        // background jobs are only cleaned up, scripts do not report them
+        if (sh->jobs.n)
+        {
+            jobs_reap(sh);
+            jobs_notify(sh);
+        }
+        run_program(sh, prog);
+        source_reset(&src);
+    }
+    if (src.status > 0)
+    {
+        fprintf(stderr, "%s: line %zu: syntax error: unexpected end of file\n", name, sc.line_no);
+        sh->last_status = 2;
+    }
+    free(src.text);
+    script_close(&sc);
+    return sh->last_status;
+}
+
 int main(int argc, char *argv[])
 {
-    parse_args(argc, argv);
-    struct shell sh;
+    struct shell sh = {0};
+    parse_args(&sh, argc, argv);
     sh_init(&sh);
-    char *line = (char *)NULL;
-    while ((line = readline(sh.prompt)))
+    if (!sh.shell_is_interactive)
+    {
+        int status = run_script(&sh, argv[0]);
+        sh_destroy(&sh);
+        return status;
+    }
+
+    char *raw = (char *)NULL;
+    struct source src = {0};
+    struct line_start ls;
+    for (;;)
     {
+        // a command that is not complete yet asks for more with a prompt of its own
+        char *prompt = src.status > 0 ? NULL : prompt_render(&sh);
+        raw = read_line(&sh, prompt ? prompt : "> ", prompt != NULL);
+        free(prompt);
+        if (!raw)
+            break;
+        // everything allocated for the previous line is dead now
+        arena_reset(&sh.line_arena);
         // do nothing on blank lines don't save history or attempt to exec
-        line = trim_white(line);
-        if (!*line)
+        char *line = trim_white(raw);
+        if (!*line && src.status <= 0)
         {
-            free(line);
+            free(raw);
             continue;
         }
-        add_history(line);
-        // check to see if we are launching a built in command
-        char **cmd = cmd_parse(line);
-        if (!do_builtin(&sh, cmd))
-        {
-            pid_t pid = fork();
-            if (pid == 0)
-            {
-                /*This is the child process*/
-                pid_t child = getpid();
-                setpgid(child, child);
-                tcsetpgrp(sh.shell_terminal, child);
-                signal(SIGINT, SIG_DFL);
-                signal(SIGQUIT, SIG_DFL);
-                signal(SIGTSTP, SIG_DFL);
-                signal(SIGTTIN, SIG_DFL);
-                signal(SIGTTOU, SIG_DFL);
-                execvp(cmd[0], cmd);
-                exit(EXIT_FAILURE);
-            }
-            else if (pid < 0)
-            {
-                // If fork failed we are in trouble!
-                perror("fork return < 0 Process creation failed!");
-                abort();
-            }
-            /*
-            This is in the parent put the child process into its own
-            process group and give it control of the terminal
-            to avoid a race condition
-            */
-            // printf("shell:%d , child%d\n",sh.shell_pgid, pid);
-            setpgid(pid, pid);
-            tcsetpgrp(sh.shell_terminal, pid);
-            int status;
-            int rval = waitpid(pid, &status, 0);
-            if (rval == -1)
-            {
-                fprintf(stderr, "Wait pid failed with -1\n");
-                explain_waitpid(status);
-            }
-            cmd_free(cmd);
-            // get control of the shell
-            tcsetpgrp(sh.shell_terminal, sh.shell_pgid);
-        }
+        if (src.status <= 0)
+            line_begin(&sh, &ls);
+        struct program *prog = source_add(&sh, &src, line);
+        free(raw);
+        if (src.status > 0)
+            continue;
+        add_history(src.text);
+        if (prog)
+            run_program(&sh, prog);
+        line_end(&sh, &ls, src.text);
+        source_reset(&src);
     }
+    if (src.status > 0)
+        fprintf(stderr, "syntax error: unexpected end of file\n");
+    free(src.text);
     sh_destroy(&sh);
+    return sh.last_status;
 }
@@ -0,0 +1,299 @@
+/**
+ * bench-shell.c
+ * Latency of the shell's hot paths: parsing, prompt, builtin dispatch and
+ * the fork/exec/wait round trip. Every benchmark is warmed up, then timed
+ * as repeated samples. A sample is a batch of calls sized so the clock
+ * overhead disappears, and percentiles are taken over the per-call time
+ * of the samples.
+ *
+ * usage: bench-shell [-f text|csv|json] [-n samples] [-w warmup] [-m MiB] [filter]
+ *
+ * -m touches that much memory before the benchmarks run, to see how the
+ * process backends cope with a shell that has grown.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "../src/lab.h"
+#include "../src/pipeline.h"
+#include "../src/vm.h"
+#include "../src/glob.h"
+
+// Smallest batch duration, far above the cost of reading the clock
+#define MIN_BATCH_NS 20000.0
+#define MAX_INNER (1u << 20)
+
+extern char **environ;
+
+static const char *const sample_line = "gcc -O2 -Wall -c 'my file.c' -o out.o";
+static const char *const padded_line = "   \t gcc -O2 -Wall -c foo.c -o foo.o  \t  ";
+
+struct bench {
+    const char *name;
+    void (*run)(struct shell *sh);
+    bool process;   // starts a process, fewer samples and no batching
+};
+
+struct result {
+    const char *name;
+    size_t samples;
+    size_t inner;
+    double min, p50, p90, p99, max, mean, stddev;
+};
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void run_cmd_parse(struct shell *sh) {
+    UNUSED(sh)
+    cmd_free(cmd_parse(sample_line));
+}
+
+static void run_cmd_parse_arena(struct shell *sh) {
+    cmd_parse_arena(&sh->line_arena, sample_line);
+    arena_reset(&sh->line_arena);
+}
+
+static void run_pipeline_parse(struct shell *sh) {
+    struct pipeline pl;
+    pipeline_parse(&sh->line_arena, "ls -l /tmp | grep -v x > out.txt 2>&1", &pl);
+    arena_reset(&sh->line_arena);
+}
+
+static const char *const loop_src = "for i in 1 2 3 4 5 6 7 8; do if test $i = 4; then continue; fi; : $i; done";
+
+static void run_program_parse(struct shell *sh) {
+    UNUSED(sh)
+    struct program *p;
+    program_parse(loop_src, strlen(loop_src), &p);
+    program_unref(p);
+}
+
+static void run_program_loop(struct shell *sh) {
+    // Parsed once, like a loop body on its second pass
+    static struct program *p;
+    if (!p) program_parse(loop_src, strlen(loop_src), &p);
+    program_run(sh, p);
+}
+
+static void run_glob(struct shell *sh, struct glob_cache *cache) {
+    // A directory every system has, with enough entries to matter
+    struct glob_result r = {0};
+    glob_expand(cache, &sh->line_arena, "/usr/bin/*sh", &r);
+    free(r.v);
+    arena_reset(&sh->line_arena);
+}
+
+static void run_glob_dir(struct shell *sh) {
+    run_glob(sh, NULL);
+}
+
+static void run_glob_cached(struct shell *sh) {
+    run_glob(sh, &sh->glob);
+}
+
+static void run_complete(struct shell *sh) {
+    // Built on the first call, later calls only drain inotify
+    struct completion c;
+    complete_command(sh, "g", &c);
+    completion_free(&c);
+}
+
+static void run_trim_white(struct shell *sh) {
+    UNUSED(sh)
+    // trim_white writes into the line, so it needs a fresh copy each time
+    char buf[64];
+    memcpy(buf, padded_line, strlen(padded_line) + 1);
+    volatile char c = *trim_white(buf);
+    UNUSED(c)
+}
+
+static void run_get_prompt(struct shell *sh) {
+    UNUSED(sh)
+    free(get_prompt("MY_PROMPT"));
+}
+
+static void run_builtin_hit(struct shell *sh) {
+    static char *argv[] = {"set", "-o", "relay", NULL};
+    do_builtin(sh, argv);
+}
+
+static void run_builtin_miss(struct shell *sh) {
+    static char *argv[] = {"ls", "-l", NULL};
+    do_builtin(sh, argv);
+}
+
+static void run_exec(struct shell *sh, bool spawn) {
+    // A path, true alone is a builtin and would never exec
+    static char *argv[] = {"/bin/true", NULL};
+    sh->options[SH_OPT_SPAWN] = spawn;
+    execute_command(sh, argv);
+}
+
+static void run_exec_fork(struct shell *sh) {
+    run_exec(sh, false);
+}
+
+static void run_exec_spawn(struct shell *sh) {
+    run_exec(sh, true);
+}
+
+static void run_exec_zygote(struct shell *sh) {
+    sh->options[SH_OPT_ZYGOTE] = true;
+    run_exec(sh, false);
+    sh->options[SH_OPT_ZYGOTE] = false;
+}
+
+static const struct bench benches[] = {
+    {"cmd_parse+cmd_free", run_cmd_parse, false},
+    {"cmd_parse_arena", run_cmd_parse_arena, false},
+    {"pipeline_parse", run_pipeline_parse, false},
+    {"program_parse_loop", run_program_parse, false},
+    {"program_run_loop", run_program_loop, false},
+    {"glob_dir", run_glob_dir, false},
+    {"glob_dir_cached", run_glob_cached, false},
+    {"complete_command", run_complete, false},
+    {"trim_white", run_trim_white, false},
+    {"get_prompt", run_get_prompt, false},
+    {"do_builtin_hit", run_builtin_hit, false},
+    {"do_builtin_miss", run_builtin_miss, false},
+    {"fork_exec_wait", run_exec_fork, true},
+    {"spawn_exec_wait", run_exec_spawn, true},
+    {"zygote_exec_wait", run_exec_zygote, true},
+};
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/** Nearest-rank percentile of sorted samples. */
+static double percentile(const double *v, size_t n, double p) {
+    size_t rank = (size_t)ceil(p / 100.0 * (double)n);
+    return v[rank ? rank - 1 : 0];
+}
+
+/** Calls per sample so that a sample takes at least MIN_BATCH_NS. */
+static size_t calibrate(const struct bench *b, struct shell *sh) {
+    if (b->process) return 1;
+    size_t inner = 1;
+    for (;;) {
+        double start = now_ns();
+        for (size_t i = 0; i < inner; i++) b->run(sh);
+        if (now_ns() - start >= MIN_BATCH_NS || inner >= MAX_INNER) return inner;
+        inner *= 2;
+    }
+}
+
+static int measure(const struct bench *b, struct shell *sh, size_t samples, size_t warmup,
+                   struct result *r) {
+    double *v = malloc(samples * sizeof(*v));
+    if (!v) return -1;
+    size_t inner = calibrate(b, sh);
+    for (size_t i = 0; i < warmup * inner; i++) b->run(sh);
+
+    double sum = 0;
+    for (size_t s = 0; s < samples; s++) {
+        double start = now_ns();
+        for (size_t i = 0; i < inner; i++) b->run(sh);
+        v[s] = (now_ns() - start) / (double)inner;
+        sum += v[s];
+    }
+    qsort(v, samples, sizeof(*v), cmp_double);
+
+    double mean = sum / (double)samples, var = 0;
+    for (size_t s = 0; s < samples; s++) var += (v[s] - mean) * (v[s] - mean);
+    *r = (struct result){
+        .name = b->name, .samples = samples, .inner = inner,
+        .min = v[0], .p50 = percentile(v, samples, 50), .p90 = percentile(v, samples, 90),
+        .p99 = percentile(v, samples, 99), .max = v[samples - 1], .mean = mean,
+        .stddev = samples > 1 ? sqrt(var / (double)(samples - 1)) : 0,
+    };
+    free(v);
+    return 0;
+}
+
+static void print_result(const char *format, const struct result *r, bool first) {
+    if (strcmp(format, "csv") == 0) {
+        if (first) printf("name,unit,samples,inner,min,p50,p90,p99,max,mean,stddev\n");
+        printf("%s,ns,%zu,%zu,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n", r->name, r->samples,
+               r->inner, r->min, r->p50, r->p90, r->p99, r->max, r->mean, r->stddev);
+    } else if (strcmp(format, "json") == 0) {
+        printf("%s\n    {\"name\": \"%s\", \"unit\": \"ns\", \"samples\": %zu, \"inner\": %zu, "
+               "\"min\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f, "
+               "\"mean\": %.1f, \"stddev\": %.1f}",
+               first ? "{\"benchmarks\": [" : ",", r->name, r->samples, r->inner, r->min,
+               r->p50, r->p90, r->p99, r->max, r->mean, r->stddev);
+    } else {
+        if (first)
+            printf("%-20s %8s %8s %10s %10s %10s %10s %10s\n", "benchmark (ns/op)", "samples",
+                   "inner", "min", "p50", "p90", "p99", "max");
+        printf("%-20s %8zu %8zu %10.1f %10.1f %10.1f %10.1f %10.1f\n", r->name, r->samples,
+               r->inner, r->min, r->p50, r->p90, r->p99, r->max);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    const char *format = "text";
+    long samples = 0, warmup = -1, ballast_mb = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:n:w:m:")) != -1) {
+        switch (opt) {
+        case 'f': format = optarg; break;
+        case 'n': samples = atol(optarg); break;
+        case 'w': warmup = atol(optarg); break;
+        case 'm': ballast_mb = atol(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-f text|csv|json] [-n samples] [-w warmup] [-m MiB] [filter]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    if (strcmp(format, "text") && strcmp(format, "csv") && strcmp(format, "json")) {
+        fprintf(stderr, "%s: unknown format %s\n", argv[0], format);
+        return 2;
+    }
+    const char *filter = optind < argc ? argv[optind] : NULL;
+
+    // The same setup the tests use, a shell that never touches the terminal
+    struct shell sh;
+    memset(&sh, 0, sizeof(sh));
+    arena_init(&sh.line_arena, 0);
+    cmd_hash_init(&sh.cmd_hash);
+    jobs_init(&sh.jobs);
+    sh.history.fd = -1;
+    vars_import(&sh, environ);
+
+    // The helper is forked while the process is small, like sh_init does
+    if (zygote_start(&sh) == -1) perror("zygote");
+    size_t ballast_size = ballast_mb > 0 ? (size_t)ballast_mb << 20 : 0;
+    char *ballast = ballast_size ? malloc(ballast_size) : NULL;
+    if (ballast) memset(ballast, 1, ballast_size);
+
+    bool first = true;
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        const struct bench *b = &benches[i];
+        if (filter && !strstr(b->name, filter)) continue;
+        size_t n = samples > 0 ? (size_t)samples : b->process ? 200 : 2000;
+        size_t w = warmup >= 0 ? (size_t)warmup : b->process ? 20 : 200;
+        struct result r;
+        if (measure(b, &sh, n, w, &r) == -1) {
+            perror("bench");
+            return 1;
+        }
+        print_result(format, &r, first);
+        first = false;
+    }
+    if (strcmp(format, "json") == 0) printf(first ? "{\"benchmarks\": []}\n" : "\n]}\n");
+    sh_destroy(&sh);
+    free(ballast);
+    return 0;
+}
@@ -0,0 +1,67 @@
+/**
+ * bench-tokenize.c
+ * Throughput of tokenize for each classifier on long generated lines.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../src/tokenize.h"
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/** Fill buf with words of 1-12 chars, mixed separators and some quoting. */
+static void gen_line(char *buf, size_t len, unsigned seed) {
+    size_t i = 0;
+    while (i < len) {
+        seed = seed * 1103515245 + 12345;
+        unsigned r = seed >> 16;
+        size_t w = 1 + r % 12;
+        if (r % 17 == 0 && i + w + 2 < len) {
+            buf[i++] = '\'';
+            for (size_t k = 0; k < w; k++) buf[i++] = (k == w / 2) ? ' ' : 'a' + (char)(k % 26);
+            buf[i++] = '\'';
+        } else {
+            for (size_t k = 0; k < w && i < len; k++) buf[i++] = 'a' + (char)((r + k) % 26);
+        }
+        if (i < len) buf[i++] = (r % 5 == 0) ? '\t' : ' ';
+    }
+    buf[len] = '\0';
+}
+
+int main(void) {
+    static const size_t sizes[] = {64, 1024, 64 * 1024, 1024 * 1024};
+    static const char *impls[] = {"scalar", "sse2", "avx2"};
+
+    printf("%-8s %10s %10s %12s\n", "impl", "bytes", "tokens", "bytes/ns");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t len = sizes[s];
+        char *line = malloc(len + 1);
+        if (!line) return 1;
+        gen_line(line, len, 42);
+
+        // Aim for roughly 64MB of input per measurement
+        size_t iters = (64u * 1024 * 1024) / len;
+        for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); k++) {
+            if (tok_select(impls[k]) == -1) continue;
+            struct tok_index idx;
+            tok_index_init(&idx);
+            tokenize(line, len, &idx); // warm up and size the index
+
+            double start = now_ns();
+            for (size_t i = 0; i < iters; i++) tokenize(line, len, &idx);
+            double elapsed = now_ns() - start;
+
+            printf("%-8s %10zu %10zu %12.3f\n", impls[k], len, idx.n,
+                   (double)len * (double)iters / elapsed);
+            tok_index_free(&idx);
+        }
+        free(line);
+    }
+    return 0;
+}
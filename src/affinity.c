@@ -0,0 +1,261 @@
+/**
+ * affinity.c
+ * CPU and NUMA placement of launched programs. A placement is a CPU mask
+ * and a preferred memory node, applied in the child between fork and
+ * exec. The session placement comes from the affinity builtin, a cpus=
+ * prefix places one command and set -o spread deals background and
+ * parallel jobs out over the nodes or CPUs round robin.
+ */
+
+#define _GNU_SOURCE
+#include "affinity.h"
+#include "lab.h"
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define NODE_DIR "/sys/devices/system/node"
+
+/** Set bit i. */
+static void bit_set(uint64_t *bits, size_t i) {
+    bits[i / 64] |= UINT64_C(1) << (i % 64);
+}
+
+/** True when bit i is set. */
+static bool bit_test(const uint64_t *bits, size_t i) {
+    return bits[i / 64] >> (i % 64) & 1;
+}
+
+/** Number of bits set. */
+static size_t bit_count(const uint64_t *bits) {
+    size_t n = 0;
+    for (size_t w = 0; w < AFFINITY_WORDS; w++) n += (size_t)__builtin_popcountll(bits[w]);
+    return n;
+}
+
+/** a &= b, returns true when anything is left. */
+static bool bit_and(uint64_t *a, const uint64_t *b) {
+    uint64_t any = 0;
+    for (size_t w = 0; w < AFFINITY_WORDS; w++) any |= a[w] &= b[w];
+    return any != 0;
+}
+
+/** Parse a list like 0-3,8 into bits, trailing whitespace allowed. */
+static int list_parse(const char *s, uint64_t *bits, size_t max) {
+    memset(bits, 0, AFFINITY_WORDS * sizeof(*bits));
+    const char *p = s;
+    do {
+        char *end;
+        errno = 0;
+        unsigned long lo = strtoul(p, &end, 10), hi = lo;
+        if (end == p || errno) return -1;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtoul(p, &end, 10);
+            if (end == p || errno || hi < lo) return -1;
+        }
+        if (hi >= max) return -1;
+        for (unsigned long i = lo; i <= hi; i++) bit_set(bits, i);
+        p = end;
+    } while (*p == ',' && *++p);
+    while (*p == '\n' || *p == ' ') p++;
+    return *p ? -1 : 0;
+}
+
+/** Print bits as a list like 0-3,8. */
+static void list_print(FILE *f, const uint64_t *bits) {
+    const char *sep = "";
+    for (size_t i = 0; i < AFFINITY_MAX_CPUS; i++) {
+        if (!bit_test(bits, i)) continue;
+        size_t j = i;
+        while (j + 1 < AFFINITY_MAX_CPUS && bit_test(bits, j + 1)) j++;
+        if (j == i) fprintf(f, "%s%zu", sep, i);
+        else fprintf(f, "%s%zu-%zu", sep, i, j);
+        sep = ",";
+        i = j;
+    }
+}
+
+/** Read a list from a sysfs file. */
+static int list_read(const char *path, uint64_t *bits, size_t max) {
+    FILE *f = fopen(path, "re");
+    if (!f) return -1;
+    char line[4096];
+    int rc = fgets(line, sizeof(line), f) ? list_parse(line, bits, max) : -1;
+    fclose(f);
+    return rc;
+}
+
+/** Read which CPUs the shell may use and the nodes they belong to. */
+static int load(struct affinity *a) {
+    if (a->loaded) return 0;
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == -1) return -1;
+    memset(a->allowed, 0, sizeof(a->allowed));
+    for (size_t i = 0; i < AFFINITY_MAX_CPUS; i++)
+        if (CPU_ISSET(i, &set)) bit_set(a->allowed, i);
+
+    uint64_t online[AFFINITY_WORDS];
+    size_t n = 0;
+    if (list_read(NODE_DIR "/online", online, AFFINITY_MAX_NODES) == 0) n = bit_count(online);
+    a->nodes = calloc(n ? n : 1, sizeof(*a->nodes));
+    if (!a->nodes) return -1;
+    a->nnodes = 0;
+    for (size_t id = 0; id < AFFINITY_MAX_NODES && n; id++) {
+        if (!bit_test(online, id)) continue;
+        struct affinity_node *nd = &a->nodes[a->nnodes];
+        char path[64];
+        snprintf(path, sizeof(path), NODE_DIR "/node%zu/cpulist", id);
+        // Memory-only nodes and nodes of CPUs the shell may not use are left out
+        if (list_read(path, nd->cpus, AFFINITY_MAX_CPUS) == -1 || !bit_and(nd->cpus, a->allowed)) continue;
+        nd->id = (int)id;
+        a->nnodes++;
+    }
+    if (!a->nnodes) {
+        a->nodes[0].id = 0;
+        memcpy(a->nodes[0].cpus, a->allowed, sizeof(a->allowed));
+        a->nnodes = 1;
+    }
+    a->loaded = true;
+    return 0;
+}
+
+/** Parse a placement. */
+int placement_parse(struct shell *sh, const char *spec, struct placement *p) {
+    struct affinity *a = &sh->affinity;
+    *p = (struct placement){0};
+    if (strcmp(spec, "all") == 0) return 0;
+    if (load(a) == -1) return -1;
+    if (strncmp(spec, "node", 4) == 0) {
+        char *end;
+        errno = 0;
+        long id = strtol(spec + 4, &end, 10);
+        for (size_t i = 0; end != spec + 4 && !*end && !errno && i < a->nnodes; i++) {
+            if (a->nodes[i].id != id) continue;
+            memcpy(p->cpus, a->nodes[i].cpus, sizeof(p->cpus));
+            p->has_cpus = p->has_node = true;
+            p->node = (int)id;
+            return 0;
+        }
+    } else if (list_parse(spec, p->cpus, AFFINITY_MAX_CPUS) == 0 && bit_and(p->cpus, a->allowed)) {
+        p->has_cpus = true;
+        return 0;
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+/** Apply a placement to the calling process. */
+void placement_apply(const struct placement *p) {
+    if (p->has_cpus) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (size_t i = 0; i < AFFINITY_MAX_CPUS; i++)
+            if (bit_test(p->cpus, i)) CPU_SET(i, &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+    if (p->has_node) {
+        // Preferred rather than bound, a full node spills over instead of
+        // getting the program killed
+        unsigned long mask[AFFINITY_MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+        mask[p->node / (8 * sizeof(unsigned long))] |= 1UL << (p->node % (8 * sizeof(unsigned long)));
+        syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, AFFINITY_MAX_NODES + 1);
+    }
+}
+
+/** The placement launch applies now. */
+const struct placement *affinity_current(struct shell *sh) {
+    const struct affinity *a = &sh->affinity;
+    const struct placement *p = a->scope ? a->scope : &a->session;
+    return p->has_cpus || p->has_node ? p : NULL;
+}
+
+/** The next round robin slot. */
+bool affinity_spread(struct shell *sh, struct placement *p) {
+    struct affinity *a = &sh->affinity;
+    if (!sh->options[SH_OPT_SPREAD] || load(a) == -1) return false;
+    const struct placement *cur = affinity_current(sh);
+    const uint64_t *base = cur && cur->has_cpus ? cur->cpus : a->allowed;
+
+    // Whole nodes when there are several, so memory stays next to its CPUs
+    size_t usable[a->nnodes], nusable = 0;
+    for (size_t i = 0; i < a->nnodes && !(cur && cur->has_node); i++) {
+        uint64_t both[AFFINITY_WORDS];
+        memcpy(both, a->nodes[i].cpus, sizeof(both));
+        if (bit_and(both, base)) usable[nusable++] = i;
+    }
+    *p = (struct placement){0};
+    if (nusable > 1) {
+        const struct affinity_node *nd = &a->nodes[usable[a->next++ % nusable]];
+        memcpy(p->cpus, nd->cpus, sizeof(p->cpus));
+        bit_and(p->cpus, base);
+        p->has_cpus = p->has_node = true;
+        p->node = nd->id;
+        return true;
+    }
+    size_t n = bit_count(base);
+    if (n < 2) return false;
+    size_t k = a->next++ % n;
+    for (size_t i = 0; i < AFFINITY_MAX_CPUS; i++) {
+        if (bit_test(base, i) && k-- == 0) {
+            bit_set(p->cpus, i);
+            break;
+        }
+    }
+    p->has_cpus = true;
+    if (cur && cur->has_node) {
+        p->has_node = true;
+        p->node = cur->node;
+    }
+    return true;
+}
+
+/** Free the layout. */
+void affinity_destroy(struct affinity *a) {
+    free(a->nodes);
+    memset(a, 0, sizeof(*a));
+}
+
+/** Print a placement as cpus=... node=... */
+static void placement_print(const struct placement *p) {
+    printf("cpus=");
+    if (p->has_cpus) list_print(stdout, p->cpus);
+    else printf("all");
+    if (p->has_node) printf(" node=%d", p->node);
+    printf("\n");
+}
+
+/** affinity [cpus | nodeN | all] */
+int builtin_affinity(struct shell *sh, char **argv) {
+    struct affinity *a = &sh->affinity;
+    if (argv[1] && argv[2]) {
+        fprintf(stderr, "affinity: usage: affinity [cpus | nodeN | all]\n");
+        return 2;
+    }
+    if (argv[1]) {
+        struct placement p;
+        if (placement_parse(sh, argv[1], &p) == -1) {
+            fprintf(stderr, "affinity: %s: %s\n", argv[1], strerror(errno));
+            return 1;
+        }
+        a->session = p;
+        return 0;
+    }
+    if (load(a) == -1) {
+        perror("affinity");
+        return 1;
+    }
+    printf("session ");
+    placement_print(&a->session);
+    for (size_t i = 0; i < a->nnodes; i++) {
+        printf("node%d cpus=", a->nodes[i].id);
+        list_print(stdout, a->nodes[i].cpus);
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,119 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct shell;
+
+// CPUs a placement can name, as many as a cpu_set_t holds
+#define AFFINITY_MAX_CPUS 1024
+#define AFFINITY_WORDS (AFFINITY_MAX_CPUS / 64)
+// Highest NUMA node number plus one that memory can be placed on
+#define AFFINITY_MAX_NODES 64
+
+/**
+ * @brief Where a launched program runs: the CPUs it may use and the NUMA
+ * node its memory is preferably taken from. What is not set is inherited
+ * from the shell.
+ */
+struct placement {
+    uint64_t cpus[AFFINITY_WORDS];
+    bool has_cpus;
+    bool has_node;
+    int node;
+};
+
+/* A NUMA node and the CPUs of it the shell may use */
+struct affinity_node {
+    int id;
+    uint64_t cpus[AFFINITY_WORDS];
+};
+
+/**
+ * @brief Placement state of a shell. The machine's layout is read from
+ * sysfs the first time it is needed; a kernel without NUMA counts as one
+ * node. All zero is a valid state with nothing placed.
+ */
+struct affinity {
+    struct placement session;       // set with the affinity builtin
+    const struct placement *scope;  // a cpus= prefix or spread slot, wins over session
+    unsigned next;                  // round robin slot of the next spread job
+    bool loaded;
+    uint64_t allowed[AFFINITY_WORDS];   // CPUs the shell itself may run on
+    struct affinity_node *nodes;    // nodes with allowed CPUs
+    size_t nnodes;
+};
+
+/**
+ * @brief Parse a placement: a CPU list like 0-3,8, nodeN for the CPUs and
+ * memory of node N, or all for none at all
+ *
+ * @param sh The shell, for the CPUs it may use
+ * @param spec The text
+ * @param p Receives the placement
+ * @return 0 on success, -1 with errno EINVAL when spec names no CPU the
+ * shell may use
+ */
+int placement_parse(struct shell *sh, const char *spec, struct placement *p);
+
+/**
+ * @brief Apply a placement to the calling process. Only system calls, so
+ * it is safe in a raw clone. A placement the kernel refuses is ignored,
+ * the program still runs.
+ *
+ * @param p The placement
+ */
+void placement_apply(const struct placement *p);
+
+/**
+ * @brief The placement launch gives programs started now
+ *
+ * @param sh The shell
+ * @return The scope or session placement, NULL when there is none
+ */
+const struct placement *affinity_current(struct shell *sh);
+
+/**
+ * @brief The next round robin slot for a background or parallel job while
+ * set -o spread is on. With several NUMA nodes every job gets the CPUs
+ * and memory of the next node, otherwise the next single CPU. Only the
+ * CPUs of the current placement are used.
+ *
+ * @param sh The shell
+ * @param p Receives the slot
+ * @return true when p was filled, false when spread is off or there is
+ * nothing to spread over
+ */
+bool affinity_spread(struct shell *sh, struct placement *p);
+
+/**
+ * @brief Free the layout that was read
+ *
+ * @param a The state, all zero afterwards
+ */
+void affinity_destroy(struct affinity *a);
+
+/**
+ * @brief affinity [cpus | nodeN | all]
+ *
+ * Without an argument print the session placement and the CPUs of every
+ * node. With one, place every program the shell starts from now on.
+ * A single command is placed with a cpus= prefix instead.
+ *
+ * @param sh The shell
+ * @param argv The builtin's arguments
+ * @return 0 on success, 1 for a bad placement, 2 on a usage error
+ */
+int builtin_affinity(struct shell *sh, char **argv);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // AFFINITY_H
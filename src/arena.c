@@ -0,0 +1,100 @@
+/**
+ * arena.c
+ * Chunked bump allocator with a reset-per-line lifetime.
+ */
+
+#include "arena.h"
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t used;
+    size_t cap;
+    alignas(max_align_t) unsigned char data[];
+};
+
+#define ARENA_ALIGN(n) (((n) + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1))
+
+/** Set up an empty arena. */
+void arena_init(struct arena *a, size_t chunk_size) {
+    a->head = NULL;
+    a->chunk_size = chunk_size ? chunk_size : 4096;
+}
+
+/** Allocate a new chunk big enough for size bytes and push it on the list. */
+static struct arena_chunk *arena_grow(struct arena *a, size_t size) {
+    size_t cap = a->chunk_size;
+    // Double relative to the current chunk so long lines settle quickly
+    if (a->head && a->head->cap * 2 > cap) cap = a->head->cap * 2;
+    if (cap < size) cap = size;
+
+    struct arena_chunk *c = malloc(sizeof(*c) + cap);
+    if (!c) return NULL;
+    c->next = a->head;
+    c->used = 0;
+    c->cap = cap;
+    a->head = c;
+    return c;
+}
+
+/** Bump allocate from the current chunk. */
+void *arena_alloc(struct arena *a, size_t size) {
+    if (size > SIZE_MAX - alignof(max_align_t)) return NULL;
+    size = ARENA_ALIGN(size);
+
+    struct arena_chunk *c = a->head;
+    if (!c || c->cap - c->used < size) {
+        c = arena_grow(a, size);
+        if (!c) return NULL;
+    }
+    void *p = c->data + c->used;
+    c->used += size;
+    return p;
+}
+
+/** Drop everything but the newest (largest) chunk and rewind it. */
+void arena_reset(struct arena *a) {
+    struct arena_chunk *c = a->head;
+    if (!c) return;
+
+    struct arena_chunk *old = c->next;
+    while (old) {
+        struct arena_chunk *next = old->next;
+        free(old);
+        old = next;
+    }
+    c->next = NULL;
+    c->used = 0;
+}
+
+/** Current chunk and fill level. */
+struct arena_mark arena_mark(const struct arena *a) {
+    return (struct arena_mark){a->head, a->head ? a->head->used : 0};
+}
+
+/** Free the chunks added after m and rewind the one it points into. */
+void arena_rewind(struct arena *a, struct arena_mark m) {
+    if (!m.chunk) {
+        arena_reset(a);
+        return;
+    }
+    while (a->head != m.chunk) {
+        struct arena_chunk *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+    m.chunk->used = m.used;
+}
+
+/** Free every chunk. */
+void arena_destroy(struct arena *a) {
+    struct arena_chunk *c = a->head;
+    while (c) {
+        struct arena_chunk *next = c->next;
+        free(c);
+        c = next;
+    }
+    a->head = NULL;
+}
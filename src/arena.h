@@ -0,0 +1,86 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct arena_chunk;
+
+/**
+ * @brief Bump allocator used for per-line scratch memory. Allocations are
+ * never freed individually; the whole arena is rewound with arena_reset
+ * once the line has been executed.
+ */
+struct arena {
+    struct arena_chunk *head;
+    size_t chunk_size;
+};
+
+/**
+ * @brief A position in an arena, everything allocated after it can be
+ * released with arena_rewind while older allocations stay valid.
+ */
+struct arena_mark {
+    struct arena_chunk *chunk;
+    size_t used;
+};
+
+/**
+ * @brief Initialize an arena. No memory is allocated until the first call
+ * to arena_alloc.
+ *
+ * @param a The arena
+ * @param chunk_size Minimum size of each backing chunk in bytes
+ */
+void arena_init(struct arena *a, size_t chunk_size);
+
+/**
+ * @brief Allocate size bytes aligned for any object type. The memory stays
+ * valid until the next arena_reset or arena_destroy.
+ *
+ * @param a The arena
+ * @param size Number of bytes
+ * @return Pointer to the memory or NULL if malloc failed
+ */
+void *arena_alloc(struct arena *a, size_t size);
+
+/**
+ * @brief Release every allocation made from the arena. The largest chunk
+ * is kept so steady state operation does not touch malloc at all.
+ *
+ * @param a The arena
+ */
+void arena_reset(struct arena *a);
+
+/**
+ * @brief Remember the current position of the arena.
+ *
+ * @param a The arena
+ * @return The mark to pass to arena_rewind
+ */
+struct arena_mark arena_mark(const struct arena *a);
+
+/**
+ * @brief Release everything allocated since m was taken. Marks nest, a
+ * rewind invalidates every mark taken after m.
+ *
+ * @param a The arena
+ * @param m A mark of a taken since the last arena_reset
+ */
+void arena_rewind(struct arena *a, struct arena_mark m);
+
+/**
+ * @brief Free all memory owned by the arena.
+ *
+ * @param a The arena
+ */
+void arena_destroy(struct arena *a);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // ARENA_H
@@ -0,0 +1,30 @@
+#ifndef BUILTINS_H
+#define BUILTINS_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Hash shared by the builtin table that tools/gen-builtins.c generates at
+ * build time and the lookups in lab.c. The generator picks a seed that
+ * gives every builtin in src/builtins.def a slot of its own, so a lookup
+ * is one hash and at most one strcmp.
+ */
+
+/**
+ * @brief FNV-1a of name, mixed with seed
+ */
+static inline uint32_t builtin_name_hash(const char *name, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for (; *name; name++) h = (h ^ (unsigned char)*name) * 16777619u;
+    return h ^ (h >> 15);
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // BUILTINS_H
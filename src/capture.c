@@ -0,0 +1,128 @@
+/**
+ * capture.c
+ * Reading the output of command substitutions. Small outputs land in a
+ * buffer taken from a pool, large ones spill into a memfd that is mapped
+ * when complete, so the cost stays linear in the size of the output.
+ */
+
+#define _GNU_SOURCE
+#include "capture.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Bytes asked of one splice into the memfd
+#define CAPTURE_SPLICE (1 << 20)
+
+/** A buffer from the pool, or a new one. */
+static char *pool_get(struct capture_pool *pool) {
+    return pool->nfree ? pool->free[--pool->nfree] : malloc(CAPTURE_BUF_SIZE);
+}
+
+/** Keep a buffer for the next capture, or free it when the pool is full. */
+static void pool_put(struct capture_pool *pool, char *buf) {
+    if (pool->nfree < CAPTURE_POOL) pool->free[pool->nfree++] = buf;
+    else free(buf);
+}
+
+/** Write all of buf to fd. */
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) return -1;
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * Move the rest of fd into a memfd that starts with head, returning the
+ * memfd and its size in *size.
+ */
+static int spill(int fd, const char *head, size_t len, size_t *size) {
+    int mfd = memfd_create("lab-capture", MFD_CLOEXEC);
+    if (mfd == -1) return -1;
+    if (write_all(mfd, head, len) == -1) goto fail;
+    *size = len;
+    bool copy = false;
+    char buf[4096];
+    for (;;) {
+        ssize_t n;
+        if (!copy) {
+            n = splice(fd, NULL, mfd, NULL, CAPTURE_SPLICE, SPLICE_F_MOVE);
+            // Not a pipe after all, copy through user space
+            if (n == -1 && errno == EINVAL) {
+                copy = true;
+                continue;
+            }
+        } else {
+            n = read(fd, buf, sizeof(buf));
+            if (n > 0 && write_all(mfd, buf, (size_t)n) == -1) goto fail;
+        }
+        if (n == 0) return mfd;
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) goto fail;
+        *size += (size_t)n;
+    }
+
+fail:;
+    int err = errno;
+    close(mfd);
+    errno = err;
+    return -1;
+}
+
+/** Read fd until end of file. */
+int capture_read(struct capture_pool *pool, int fd, struct capture *c) {
+    *c = (struct capture){0};
+    char *buf = pool_get(pool);
+    if (!buf) return -1;
+    size_t len = 0;
+    while (len < CAPTURE_BUF_SIZE) {
+        ssize_t n = read(fd, buf + len, CAPTURE_BUF_SIZE - len);
+        if (n == 0) break;
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) {
+            pool_put(pool, buf);
+            return -1;
+        }
+        len += (size_t)n;
+    }
+
+    if (len < CAPTURE_BUF_SIZE) {
+        c->buf = buf;
+        c->data = buf;
+    } else {
+        size_t size;
+        int mfd = spill(fd, buf, len, &size);
+        pool_put(pool, buf);
+        if (mfd == -1) return -1;
+        void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, mfd, 0);
+        close(mfd);
+        if (map == MAP_FAILED) return -1;
+        c->map = map;
+        c->map_size = size;
+        c->data = map;
+        len = size;
+    }
+    while (len && c->data[len - 1] == '\n') len--;
+    c->len = len;
+    return 0;
+}
+
+/** Give the buffer back or unmap. */
+void capture_release(struct capture_pool *pool, struct capture *c) {
+    if (c->buf) pool_put(pool, c->buf);
+    if (c->map) munmap(c->map, c->map_size);
+    *c = (struct capture){0};
+}
+
+/** Free the pooled buffers. */
+void capture_pool_destroy(struct capture_pool *pool) {
+    while (pool->nfree) free(pool->free[--pool->nfree]);
+}
@@ -0,0 +1,67 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Size of a pooled buffer, output up to this size never leaves it
+#define CAPTURE_BUF_SIZE (64 * 1024)
+// Buffers the pool keeps for reuse
+#define CAPTURE_POOL 4
+
+/**
+ * @brief Buffers for captured output, handed out again instead of freed.
+ * All zero is an empty pool.
+ */
+struct capture_pool {
+    char *free[CAPTURE_POOL];
+    size_t nfree;
+};
+
+/**
+ * @brief Output read from a descriptor. Output that fits a pooled buffer
+ * stays there. Anything larger is moved on into a memfd with splice and
+ * mapped once it is complete, so it is never copied through a growing
+ * buffer. Trailing newlines are dropped by shortening len.
+ */
+struct capture {
+    const char *data;
+    size_t len;
+    char *buf;          // the pooled buffer holding data, NULL when mapped
+    void *map;          // the mapped memfd, NULL when pooled
+    size_t map_size;
+};
+
+/**
+ * @brief Read fd until end of file
+ *
+ * @param pool Where the buffer comes from
+ * @param fd The descriptor, usually the read end of a pipe
+ * @param c Receives the output, release it with capture_release
+ * @return 0 on success, -1 with errno set, c is empty then
+ */
+int capture_read(struct capture_pool *pool, int fd, struct capture *c);
+
+/**
+ * @brief Give the buffer back to the pool or unmap the output
+ *
+ * @param pool The pool the capture was read with
+ * @param c The capture, empty afterwards
+ */
+void capture_release(struct capture_pool *pool, struct capture *c);
+
+/**
+ * @brief Free the buffers of a pool
+ *
+ * @param pool The pool
+ */
+void capture_pool_destroy(struct capture_pool *pool);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // CAPTURE_H
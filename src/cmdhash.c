@@ -0,0 +1,224 @@
+/**
+ * cmdhash.c
+ * Open addressing table mapping command names to the file PATH resolved
+ * them to, so exec does not have to walk PATH on every launch.
+ */
+
+#define _GNU_SOURCE
+#include "cmdhash.h"
+#include <errno.h>
+#include <limits.h>
+#include <paths.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define CMD_HASH_MIN 64
+
+/** FNV-1a, command names are short so this is plenty. */
+static uint32_t hash_str(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (uint8_t)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/** Set up an empty table. */
+void cmd_hash_init(struct cmd_hash *h) {
+    h->slots = NULL;
+    h->cap = 0;
+    h->n = 0;
+    h->path_env = NULL;
+    h->var_path = NULL;
+    h->from_var = false;
+}
+
+/** Free the names and paths of every entry. */
+void cmd_hash_clear(struct cmd_hash *h) {
+    for (size_t i = 0; i < h->cap; i++) {
+        free(h->slots[i].name);
+        free(h->slots[i].path);
+        h->slots[i].name = NULL;
+        h->slots[i].path = NULL;
+    }
+    h->n = 0;
+}
+
+/** Free everything. */
+void cmd_hash_destroy(struct cmd_hash *h) {
+    cmd_hash_clear(h);
+    free(h->slots);
+    free(h->path_env);
+    cmd_hash_init(h);
+}
+
+/** Slot holding name, or the empty slot where it would go. */
+static struct cmd_hash_entry *find_slot(struct cmd_hash *h, const char *name, uint32_t hv) {
+    size_t mask = h->cap - 1;
+    for (size_t i = hv & mask;; i = (i + 1) & mask) {
+        struct cmd_hash_entry *e = &h->slots[i];
+        if (!e->name || (e->hval == hv && strcmp(e->name, name) == 0)) return e;
+    }
+}
+
+/** Double the table keeping the load factor under one half. */
+static int grow(struct cmd_hash *h) {
+    size_t cap = h->cap ? h->cap * 2 : CMD_HASH_MIN;
+    struct cmd_hash_entry *old = h->slots;
+    size_t old_cap = h->cap;
+
+    h->slots = calloc(cap, sizeof(*h->slots));
+    if (!h->slots) {
+        h->slots = old;
+        return -1;
+    }
+    h->cap = cap;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].name) *find_slot(h, old[i].name, old[i].hval) = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+/** Insert or replace an entry, path is copied. */
+static struct cmd_hash_entry *insert(struct cmd_hash *h, const char *name, const char *path) {
+    if ((h->n + 1) * 2 > h->cap && grow(h) == -1) return NULL;
+
+    uint32_t hv = hash_str(name);
+    struct cmd_hash_entry *e = find_slot(h, name, hv);
+    char *p = strdup(path);
+    if (!p) return NULL;
+    if (e->name) {
+        free(e->path);
+    } else {
+        e->name = strdup(name);
+        if (!e->name) {
+            free(p);
+            return NULL;
+        }
+        e->hval = hv;
+        h->n++;
+    }
+    e->path = p;
+    e->hits = 0;
+    return e;
+}
+
+/** Empty the table if PATH no longer matches what the entries came from. */
+void cmd_hash_refresh(struct cmd_hash *h) {
+    const char *path = h->from_var ? h->var_path : getenv("PATH");
+    if (!path) path = _PATH_DEFPATH;
+    if (h->path_env && strcmp(h->path_env, path) == 0) return;
+
+    cmd_hash_clear(h);
+    free(h->path_env);
+    h->path_env = strdup(path);
+}
+
+/** Follow the shell's PATH variable from now on. */
+void cmd_hash_use_path(struct cmd_hash *h, const char *path) {
+    h->var_path = path;
+    h->from_var = true;
+}
+
+/** Walk PATH the way execvp would, buf receives the first executable match. */
+static int search_path(const char *path, const char *name, char *buf, size_t size) {
+    size_t nlen = strlen(name);
+    const char *p = path;
+    for (;;) {
+        const char *end = strchrnul(p, ':');
+        size_t dlen = (size_t)(end - p);
+        // An empty element means the current directory
+        const char *dir = dlen ? p : ".";
+        if (!dlen) dlen = 1;
+
+        if (dlen + nlen + 2 <= size) {
+            memcpy(buf, dir, dlen);
+            buf[dlen] = '/';
+            memcpy(buf + dlen + 1, name, nlen + 1);
+            struct stat st;
+            if (stat(buf, &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0111)) return 0;
+        }
+        if (!*end) break;
+        p = end + 1;
+    }
+    errno = ENOENT;
+    return -1;
+}
+
+/** Look up name, searching PATH on a miss; hit says whether to count it. */
+static const char *resolve(struct cmd_hash *h, const char *name, int *cached, bool hit) {
+    if (cached) *cached = 0;
+    if (strchr(name, '/')) return name;
+    if (!*name) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    cmd_hash_refresh(h);
+    if (h->cap) {
+        struct cmd_hash_entry *e = find_slot(h, name, hash_str(name));
+        if (e->name) {
+            if (hit) e->hits++;
+            if (cached) *cached = 1;
+            return e->path;
+        }
+    }
+
+    char buf[PATH_MAX];
+    if (search_path(h->path_env ? h->path_env : _PATH_DEFPATH, name, buf, sizeof(buf)) == -1)
+        return NULL;
+    struct cmd_hash_entry *e = insert(h, name, buf);
+    if (!e) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    e->hits = hit;
+    return e->path;
+}
+
+/** Look up name for running it. */
+const char *cmd_hash_lookup(struct cmd_hash *h, const char *name, int *cached) {
+    return resolve(h, name, cached, true);
+}
+
+/** Look up name without counting a hit. */
+const char *cmd_hash_find(struct cmd_hash *h, const char *name) {
+    return resolve(h, name, NULL, false);
+}
+
+/** Add an explicit mapping. */
+int cmd_hash_set(struct cmd_hash *h, const char *name, const char *path) {
+    cmd_hash_refresh(h);
+    return insert(h, name, path) ? 0 : -1;
+}
+
+/** Remove name, shifting later entries of the probe run back into the hole. */
+int cmd_hash_forget(struct cmd_hash *h, const char *name) {
+    if (!h->cap) return -1;
+    struct cmd_hash_entry *e = find_slot(h, name, hash_str(name));
+    if (!e->name) return -1;
+
+    free(e->name);
+    free(e->path);
+    e->name = NULL;
+    e->path = NULL;
+    h->n--;
+
+    size_t mask = h->cap - 1;
+    size_t hole = (size_t)(e - h->slots);
+    for (size_t i = (hole + 1) & mask; h->slots[i].name; i = (i + 1) & mask) {
+        size_t home = h->slots[i].hval & mask;
+        // Move the entry if its home slot is not between the hole and i
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            h->slots[hole] = h->slots[i];
+            h->slots[i].name = NULL;
+            h->slots[i].path = NULL;
+            hole = i;
+        }
+    }
+    return 0;
+}
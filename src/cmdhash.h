@@ -0,0 +1,93 @@
+#ifndef CMDHASH_H
+#define CMDHASH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct cmd_hash_entry {
+    char *name;     // NULL marks an empty slot
+    char *path;
+    uint32_t hval;
+    unsigned hits;
+};
+
+/**
+ * @brief Cache of command name to absolute path, the same idea as the bash
+ * hash table. Lookups that miss walk PATH once and remember the result so
+ * later launches exec the file directly. The table is emptied when PATH
+ * changes.
+ */
+struct cmd_hash {
+    struct cmd_hash_entry *slots;
+    size_t cap;     // always a power of two
+    size_t n;
+    char *path_env; // value of PATH the entries were resolved against
+    const char *var_path;   // the shell's PATH once cmd_hash_use_path was called
+    bool from_var;
+};
+
+void cmd_hash_init(struct cmd_hash *h);
+void cmd_hash_destroy(struct cmd_hash *h);
+
+/**
+ * @brief Find the executable for name. Names containing a slash are not
+ * looked up and are returned as is.
+ *
+ * @param h The table
+ * @param name The command name
+ * @param cached Set to true when the answer came from the table, may be NULL
+ * @return The path (owned by the table) or NULL with errno set to ENOENT
+ */
+const char *cmd_hash_lookup(struct cmd_hash *h, const char *name, int *cached);
+
+/**
+ * @brief Find the executable for name like cmd_hash_lookup without counting
+ * a hit, for reports such as hash -t
+ */
+const char *cmd_hash_find(struct cmd_hash *h, const char *name);
+
+/**
+ * @brief Empty the table if PATH changed since the entries were resolved.
+ * Lookups do this themselves, call it before going through the entries.
+ */
+void cmd_hash_refresh(struct cmd_hash *h);
+
+/**
+ * @brief Search the shell's own PATH instead of the process environment.
+ * Called whenever the variable changes, the pointer must stay valid until
+ * the next call.
+ *
+ * @param h The table
+ * @param path The new PATH, NULL when it is unset
+ */
+void cmd_hash_use_path(struct cmd_hash *h, const char *path);
+
+/**
+ * @brief Remember path for name without searching PATH, like hash -p
+ *
+ * @return 0 on success, -1 if memory ran out
+ */
+int cmd_hash_set(struct cmd_hash *h, const char *name, const char *path);
+
+/**
+ * @brief Drop the entry for name if there is one
+ *
+ * @return 0 if an entry was removed, -1 otherwise
+ */
+int cmd_hash_forget(struct cmd_hash *h, const char *name);
+
+/**
+ * @brief Drop every entry, like hash -r
+ */
+void cmd_hash_clear(struct cmd_hash *h);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // CMDHASH_H
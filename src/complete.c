@@ -0,0 +1,330 @@
+/**
+ * complete.c
+ * Command name completion. The executables on PATH go into a trie once,
+ * inotify watches on the PATH directories report what changes afterwards
+ * and the queued events are applied right before a completion, so Tab
+ * never reads a directory or stats a file that did not change. Builtins
+ * and functions are few and change at run time, they are looked at on
+ * every completion.
+ */
+
+#define _GNU_SOURCE
+#include "complete.h"
+#include "lab.h"
+#include "vars.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <readline/readline.h>
+
+// What changes the set of executables in a directory
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | \
+                      IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+/** Add a node for byte ch, returns its index or 0 if memory ran out. */
+static uint32_t trie_new(struct completer *c, unsigned char ch) {
+    if (c->n == c->cap) {
+        size_t cap = c->cap ? c->cap * 2 : 1024;
+        struct trie_node *grown = realloc(c->nodes, cap * sizeof(*grown));
+        if (!grown) return 0;
+        c->nodes = grown;
+        c->cap = cap;
+    }
+    c->nodes[c->n] = (struct trie_node){.c = ch};
+    return (uint32_t)c->n++;
+}
+
+/** The node for name, created when create is set. 0 if it is not there. */
+static uint32_t trie_find(struct completer *c, const char *name, bool create) {
+    uint32_t at = 0;
+    for (const unsigned char *s = (const unsigned char *)name; *s; s++) {
+        // Children are sorted, stop at the first one not below *s
+        uint32_t prev = 0, k = c->nodes[at].child;
+        while (k && c->nodes[k].c < *s) {
+            prev = k;
+            k = c->nodes[k].next;
+        }
+        if (!k || c->nodes[k].c != *s) {
+            if (!create) return 0;
+            uint32_t added = trie_new(c, *s);
+            if (!added) return 0;
+            c->nodes[added].next = k;
+            if (prev) c->nodes[prev].next = added;
+            else c->nodes[at].child = added;
+            k = added;
+        }
+        at = k;
+    }
+    return at;
+}
+
+/** True if dir/name is an executable that is not a directory. */
+static bool is_command(int dirfd, const char *name) {
+    struct stat st;
+    return fstatat(dirfd, name, &st, 0) == 0 && !S_ISDIR(st.st_mode) &&
+           faccessat(dirfd, name, X_OK, AT_EACCESS) == 0;
+}
+
+/** Note whether directory i holds an executable called name. */
+static int trie_update(struct completer *c, size_t i, int dirfd, const char *name) {
+    uint64_t bit = 1ull << (i < COMPLETE_MAX_DIRS ? i : COMPLETE_MAX_DIRS - 1);
+    bool present = is_command(dirfd, name);
+    uint32_t at = trie_find(c, name, present);
+    if (!at) return present ? -1 : 0;
+    if (present) c->nodes[at].dirs |= bit;
+    else c->nodes[at].dirs &= ~bit;
+    return 0;
+}
+
+/** Add the executables of directory i. */
+static int scan_dir(struct completer *c, size_t i) {
+    DIR *d = opendir(c->dirs[i]);
+    if (!d) return 0;
+    int rc = 0;
+    struct dirent *e;
+    while (rc == 0 && (e = readdir(d))) {
+        if (e->d_name[0] == '.' || e->d_type == DT_DIR) continue;
+        rc = trie_update(c, i, dirfd(d), e->d_name);
+    }
+    closedir(d);
+    return rc;
+}
+
+/** Forget the trie, the directories and the watches. */
+static void completer_clear(struct completer *c) {
+    if (c->built && c->ifd != -1) close(c->ifd);
+    for (size_t i = 0; i < c->ndirs; i++) free(c->dirs[i]);
+    free(c->dirs);
+    free(c->wds);
+    free(c->nodes);
+    free(c->path);
+    memset(c, 0, sizeof(*c));
+}
+
+/** Build the trie for path from scratch. */
+static int completer_build(struct completer *c, const char *path) {
+    completer_clear(c);
+    c->built = true;
+    c->path = strdup(path);
+    c->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    size_t max = 1;
+    for (const char *s = path; *s; s++) max += *s == ':';
+    c->dirs = calloc(max, sizeof(*c->dirs));
+    c->wds = calloc(max, sizeof(*c->wds));
+    if (!c->path || !c->dirs || !c->wds) return -1;
+    trie_new(c, 0);
+    if (c->n != 1) return -1;
+
+    for (const char *s = path;;) {
+        const char *end = strchrnul(s, ':');
+        // An empty entry means the current directory, which has nothing to watch
+        if (end > s) {
+            char *dir = strndup(s, (size_t)(end - s));
+            if (!dir) return -1;
+            bool dup = false;
+            for (size_t i = 0; i < c->ndirs && !dup; i++) dup = strcmp(c->dirs[i], dir) == 0;
+            if (dup) {
+                free(dir);
+            } else {
+                size_t i = c->ndirs++;
+                c->dirs[i] = dir;
+                // Past the last bit a directory is only read, never watched
+                c->wds[i] = c->ifd != -1 && i < COMPLETE_MAX_DIRS - 1
+                                ? inotify_add_watch(c->ifd, dir, WATCH_EVENTS)
+                                : -1;
+                if (scan_dir(c, i) == -1) return -1;
+            }
+        }
+        if (!*end) break;
+        s = end + 1;
+    }
+    return 0;
+}
+
+/** Apply the inotify events that queued up since the last completion. */
+static int completer_drain(struct completer *c) {
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while (c->ifd != -1 && (len = read(c->ifd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len;) {
+            const struct inotify_event *ev = (const void *)p;
+            p += sizeof(*ev) + ev->len;
+            if (ev->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                c->stale = true;
+                continue;
+            }
+            if (!ev->len) continue;
+            for (size_t i = 0; i < c->ndirs; i++) {
+                if (c->wds[i] != ev->wd) continue;
+                int dirfd = open(c->dirs[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                int rc = trie_update(c, i, dirfd, ev->name);
+                if (dirfd != -1) close(dirfd);
+                if (rc == -1) return -1;
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+/** Bring the trie up to date for path. */
+int completer_refresh(struct completer *c, const char *path) {
+    if (!path) path = "";
+    if (c->built && !c->stale && strcmp(c->path, path) == 0) return completer_drain(c);
+    if (completer_build(c, path) == 0) return 0;
+    completer_clear(c);
+    return -1;
+}
+
+/** Add a copy of name to the candidates. */
+static int add_candidate(struct completion *out, const char *name) {
+    if (out->n == out->cap) {
+        size_t cap = out->cap ? out->cap * 2 : 32;
+        char **grown = realloc(out->v, cap * sizeof(*grown));
+        if (!grown) return -1;
+        out->v = grown;
+        out->cap = cap;
+    }
+    if (!(out->v[out->n] = strdup(name))) return -1;
+    out->n++;
+    return 0;
+}
+
+/** Add every name below node at, whose first len bytes are already in name. */
+static int trie_collect(const struct completer *c, uint32_t at, char *name, size_t len,
+                        struct completion *out) {
+    const struct trie_node *node = &c->nodes[at];
+    if (node->dirs) {
+        name[len] = '\0';
+        if (add_candidate(out, name) == -1) return -1;
+    }
+    if (len + 1 >= NAME_MAX + 1) return 0;
+    for (uint32_t k = node->child; k; k = c->nodes[k].next) {
+        name[len] = (char)c->nodes[k].c;
+        if (trie_collect(c, k, name, len + 1, out) == -1) return -1;
+    }
+    return 0;
+}
+
+/* What builtin_each hands a candidate to */
+struct builtin_match {
+    struct completion *out;
+    const char *prefix;
+    size_t len;
+    int rc;
+};
+
+/** Add a builtin that starts with the prefix. */
+static void match_builtin(const char *name, void *arg) {
+    struct builtin_match *m = arg;
+    if (m->rc == 0 && strncmp(name, m->prefix, m->len) == 0) m->rc = add_candidate(m->out, name);
+}
+
+/** Byte order. */
+static int cmp_names(const void *x, const void *y) {
+    return strcmp(*(char *const *)x, *(char *const *)y);
+}
+
+/** Command names starting with prefix. */
+int complete_command(struct shell *sh, const char *prefix, struct completion *out) {
+    struct completer *c = &sh->complete;
+    *out = (struct completion){0};
+    size_t len = strlen(prefix);
+    if (completer_refresh(c, var_get(sh, "PATH")) == -1) return -1;
+
+    uint32_t at = trie_find(c, prefix, false);
+    char name[NAME_MAX + 1];
+    if ((at || !*prefix) && len <= NAME_MAX) {
+        memcpy(name, prefix, len);
+        if (trie_collect(c, at, name, len, out) == -1) return -1;
+    }
+    size_t from_path = out->n;
+
+    struct builtin_match m = {out, prefix, len, 0};
+    builtin_each(sh, match_builtin, &m);
+    for (size_t i = 0; i < sh->vm.funcs_cap && m.rc == 0; i++)
+        if (sh->vm.funcs[i].name) match_builtin(sh->vm.funcs[i].name, &m);
+    if (m.rc == -1) return -1;
+
+    // The trie gave its names in order, only the rest needs sorting in
+    if (out->n > from_path) {
+        qsort(out->v, out->n, sizeof(*out->v), cmp_names);
+        size_t j = 0;
+        for (size_t i = 0; i < out->n; i++) {
+            if (j && strcmp(out->v[j - 1], out->v[i]) == 0) free(out->v[i]);
+            else out->v[j++] = out->v[i];
+        }
+        out->n = j;
+    }
+    return 0;
+}
+
+/** Free the candidates. */
+void completion_free(struct completion *out) {
+    for (size_t i = 0; i < out->n; i++) free(out->v[i]);
+    free(out->v);
+    *out = (struct completion){0};
+}
+
+/** Free the trie. */
+void completer_destroy(struct completer *c) {
+    completer_clear(c);
+}
+
+/* Readline completion functions get no context */
+static struct shell *complete_shell;
+static struct completion candidates;
+static size_t next_candidate;
+
+/** Hand readline the candidates one at a time, it frees them. */
+static char *command_generator(const char *text, int state) {
+    if (!state) {
+        completion_free(&candidates);
+        next_candidate = 0;
+        if (complete_command(complete_shell, text, &candidates) == -1) return NULL;
+    }
+    if (next_candidate == candidates.n) {
+        // Ownership went to readline string by string
+        free(candidates.v);
+        candidates = (struct completion){0};
+        return NULL;
+    }
+    return candidates.v[next_candidate++];
+}
+
+/** True if the word starting at start is where a command name goes. */
+static bool command_position(const char *line, int start) {
+    int i = start;
+    while (i > 0 && (line[i - 1] == ' ' || line[i - 1] == '\t')) i--;
+    if (i == 0 || strchr(";|&({!", line[i - 1])) return true;
+    // After a keyword that is followed by a command
+    static const char *const keywords[] = {"then", "do", "else", "elif", "if", "while", "until", "time"};
+    int end = i;
+    while (i > 0 && line[i - 1] != ' ' && line[i - 1] != '\t' && !strchr(";|&(", line[i - 1])) i--;
+    for (size_t k = 0; k < sizeof(keywords) / sizeof(keywords[0]); k++) {
+        if (strlen(keywords[k]) == (size_t)(end - i) && strncmp(line + i, keywords[k], (size_t)(end - i)) == 0)
+            return command_position(line, i);
+    }
+    return false;
+}
+
+/** Commands where a command name goes, readline's filenames everywhere else. */
+static char **complete_line(const char *text, int start, int end) {
+    UNUSED(end);
+    if (strchr(text, '/') || !command_position(rl_line_buffer, start)) return NULL;
+    rl_attempted_completion_over = 1;
+    return rl_completion_matches(text, command_generator);
+}
+
+/** Complete command names with Tab. */
+void complete_install(struct shell *sh) {
+    complete_shell = sh;
+    rl_attempted_completion_function = complete_line;
+}
@@ -0,0 +1,100 @@
+#ifndef COMPLETE_H
+#define COMPLETE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct shell;
+
+// PATH directories that get a bit of their own in trie_node.dirs
+#define COMPLETE_MAX_DIRS 64
+
+/**
+ * @brief A node of the command trie. Children of a node form a list
+ * sorted by byte, so walking the trie yields names in order.
+ */
+struct trie_node {
+    uint32_t child;     // first child, 0 for none (the root is never a child)
+    uint32_t next;      // next sibling, 0 for none
+    uint64_t dirs;      // PATH directories with an executable of this name
+    unsigned char c;
+};
+
+/**
+ * @brief Names of the executables on PATH in a prefix trie, built once
+ * and kept up to date through inotify instead of reading the directories
+ * again on every Tab. Names that disappear only lose their directory bits,
+ * nodes are reclaimed when the trie is rebuilt for a new PATH. All zero is
+ * a valid state with nothing built yet.
+ */
+struct completer {
+    struct trie_node *nodes;    // nodes[0] is the root
+    size_t n;
+    size_t cap;
+    char *path;         // the PATH the trie was built from
+    char **dirs;        // its directories, an index is a bit in dirs
+    int *wds;           // inotify watch of each directory, -1 when unwatched
+    size_t ndirs;
+    int ifd;            // inotify descriptor, valid while built
+    bool built;
+    bool stale;         // a watched directory went away, rebuild on next use
+};
+
+/* Candidates for one completion */
+struct completion {
+    char **v;           // sorted and unique, each one malloced
+    size_t n;
+    size_t cap;
+};
+
+/**
+ * @brief Bring the trie up to date for path. It is built when path differs
+ * from the last one, otherwise only the queued inotify events are applied.
+ *
+ * @param c The completer
+ * @param path The shell's PATH, NULL when unset
+ * @return 0 on success, -1 if memory ran out
+ */
+int completer_refresh(struct completer *c, const char *path);
+
+/**
+ * @brief Command names starting with prefix: executables on PATH,
+ * builtins and shell functions
+ *
+ * @param sh The shell
+ * @param prefix What was typed so far
+ * @param out Receives the candidates, free them with completion_free
+ * @return 0 on success, -1 if memory ran out
+ */
+int complete_command(struct shell *sh, const char *prefix, struct completion *out);
+
+/**
+ * @brief Free the candidates
+ */
+void completion_free(struct completion *out);
+
+/**
+ * @brief Free the trie and close the inotify descriptor
+ *
+ * @param c The completer
+ */
+void completer_destroy(struct completer *c);
+
+/**
+ * @brief Complete command names with Tab in readline, other words are
+ * left to readline's filename completion
+ *
+ * @param sh The shell
+ */
+void complete_install(struct shell *sh);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // COMPLETE_H
@@ -0,0 +1,730 @@
+/**
+ * coreutils.c
+ * echo, printf, test, true, false, pwd and sleep as builtins. They write
+ * into one buffer that goes out through stdout when it fills up and when
+ * the builtin is done, so relayed pipeline stages and redirections work as
+ * they do for every other builtin.
+ */
+
+#define _GNU_SOURCE
+#include "coreutils.h"
+#include "lab.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Output is written in chunks of this size
+#define OUT_SIZE 65536
+
+static char out_buf[OUT_SIZE];
+static size_t out_len;
+static int out_err;     // errno of the first failed write, 0 if none
+
+/** Hand the buffer to stdout. */
+static void out_flush(void) {
+    if (out_len && !out_err && fwrite(out_buf, 1, out_len, stdout) != out_len) out_err = errno;
+    out_len = 0;
+}
+
+/** Append n bytes. */
+static void out_write(const char *s, size_t n) {
+    if (n >= OUT_SIZE) {
+        out_flush();
+        if (!out_err && fwrite(s, 1, n, stdout) != n) out_err = errno;
+        return;
+    }
+    if (out_len + n > OUT_SIZE) out_flush();
+    memcpy(out_buf + out_len, s, n);
+    out_len += n;
+}
+
+/** Append a string. */
+static void out_puts(const char *s) {
+    out_write(s, strlen(s));
+}
+
+/** Append a character. */
+static void out_putc(char c) {
+    if (out_len == OUT_SIZE) out_flush();
+    out_buf[out_len++] = c;
+}
+
+/** Append formatted text, straight into the buffer when it fits. */
+static void out_printf(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(out_buf + out_len, OUT_SIZE - out_len, fmt, ap);
+    va_end(ap);
+    if (n < 0 || (size_t)n < OUT_SIZE - out_len) {
+        if (n > 0) out_len += (size_t)n;
+        return;
+    }
+    char *s;
+    va_start(ap, fmt);
+    n = vasprintf(&s, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        out_err = ENOMEM;
+        return;
+    }
+    out_write(s, (size_t)n);
+    free(s);
+}
+
+/** Write out what is left, 1 and a message if any write failed. */
+static int out_done(const char *who) {
+    out_flush();
+    if (!out_err && fflush(stdout) == EOF) out_err = errno;
+    clearerr(stdout);
+    int err = out_err;
+    out_err = 0;
+    if (!err) return 0;
+    fprintf(stderr, "%s: write error: %s\n", who, strerror(err));
+    return 1;
+}
+
+/** Value of a hex digit. */
+static int hexval(char c) {
+    return isdigit((unsigned char)c) ? c - '0' : tolower((unsigned char)c) - 'a' + 10;
+}
+
+/**
+ * Decode the escape at s, which starts with a backslash, into d. Sets *n
+ * to the bytes written, one or two for an escape that is not one. Returns
+ * how much of s it used, 0 for \c which ends all output. zero_octal selects
+ * the \0nnn form of echo and %b over the \nnn form of printf formats.
+ */
+static size_t escape_at(const char *s, char *d, size_t *n, bool zero_octal) {
+    static const char plain[] = "a\ab\be\033f\fn\nr\rt\tv\v\\\\";
+    char c = s[1];
+    *n = 1;
+    if (c == 'c') return 0;
+    for (size_t i = 0; i < sizeof(plain) - 1; i += 2) {
+        if (plain[i] == c) {
+            *d = plain[i + 1];
+            return 2;
+        }
+    }
+    size_t used = 2;
+    if (c == 'x' && isxdigit((unsigned char)s[2])) {
+        int v = 0;
+        while (used < 4 && isxdigit((unsigned char)s[used])) v = v * 16 + hexval(s[used++]);
+        *d = (char)v;
+    } else if (c >= '0' && c <= '7' && (c == '0' || !zero_octal)) {
+        // \0nnn has up to three digits after the 0, \nnn up to three in all
+        int v = zero_octal ? 0 : c - '0';
+        size_t max = zero_octal ? 5 : 4;
+        while (used < max && s[used] >= '0' && s[used] <= '7') v = v * 8 + (s[used++] - '0');
+        *d = (char)v;
+    } else if (c == '"' && !zero_octal) {
+        *d = '"';
+    } else {
+        d[0] = '\\';
+        d[1] = c;
+        *n = 2;
+    }
+    return used;
+}
+
+/**
+ * Expand the backslash escapes of s into dst, which needs strlen(s) bytes.
+ * Returns the length, *stop is set where \c ended output.
+ */
+static size_t unescape(const char *s, char *dst, bool zero_octal, bool *stop) {
+    char *d = dst;
+    *stop = false;
+    while (*s) {
+        if (*s != '\\' || !s[1]) {
+            *d++ = *s++;
+            continue;
+        }
+        size_t n, used = escape_at(s, d, &n, zero_octal);
+        if (!used) {
+            *stop = true;
+            break;
+        }
+        d += n;
+        s += used;
+    }
+    return (size_t)(d - dst);
+}
+
+/** echo [-neE] [arg ...] */
+int builtin_echo(struct shell *sh, char **argv) {
+    UNUSED(sh)
+    bool newline = true, escapes = false;
+    size_t i = 1;
+    // Options are only taken from words made of nothing but n, e and E
+    for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++) {
+        const char *p = argv[i] + 1;
+        if (p[strspn(p, "neE")]) break;
+        for (; *p; p++) {
+            if (*p == 'n') newline = false;
+            else escapes = *p == 'e';
+        }
+    }
+    for (size_t first = i; argv[i]; i++) {
+        if (i > first) out_putc(' ');
+        if (!escapes) {
+            out_puts(argv[i]);
+            continue;
+        }
+        char *s = malloc(strlen(argv[i]) + 1);
+        if (!s) {
+            perror("echo");
+            return 1;
+        }
+        bool stop;
+        out_write(s, unescape(argv[i], s, true, &stop));
+        free(s);
+        if (stop) {
+            newline = false;
+            break;
+        }
+    }
+    if (newline) out_putc('\n');
+    return out_done("echo");
+}
+
+/** Numeric argument of printf, 'c and "c give the code of c. */
+static long long printf_int(const char *s, bool is_unsigned, int *rc) {
+    if (*s == '\'' || *s == '"') return (unsigned char)s[1];
+    if (!*s) return 0;
+    char *end;
+    long long v;
+    errno = 0;
+    if (is_unsigned && *s != '-') v = (long long)strtoull(s, &end, 0);
+    else v = strtoll(s, &end, 0);
+    if (end == s || *end) {
+        fprintf(stderr, "printf: %s: invalid number\n", s);
+        *rc = 1;
+    } else if (errno == ERANGE) {
+        fprintf(stderr, "printf: %s: %s\n", s, strerror(errno));
+        *rc = 1;
+    }
+    return v;
+}
+
+/** Floating point argument of printf. */
+static long double printf_float(const char *s, int *rc) {
+    if (*s == '\'' || *s == '"') return (unsigned char)s[1];
+    if (!*s) return 0;
+    char *end;
+    errno = 0;
+    long double v = strtold(s, &end);
+    if (end == s || *end) {
+        fprintf(stderr, "printf: %s: invalid number\n", s);
+        *rc = 1;
+    } else if (errno == ERANGE) {
+        fprintf(stderr, "printf: %s: %s\n", s, strerror(errno));
+        *rc = 1;
+    }
+    return v;
+}
+
+/* Arguments of printf, handed out one conversion at a time */
+struct printf_args {
+    char **argv;
+    size_t used;
+};
+
+/** Next argument, or an empty string once they ran out. */
+static const char *next_arg(struct printf_args *a) {
+    return a->argv[a->used] ? a->argv[a->used++] : "";
+}
+
+/**
+ * Run one conversion starting at the % in *fmt. Flags, width and
+ * precision go into a printf spec of our own with the length modifier the
+ * argument type needs. Returns false when output has to stop.
+ */
+static bool printf_conv(const char **fmt, struct printf_args *a, int *rc) {
+    const char *p = *fmt + 1;
+    char spec[48];
+    size_t k = 0;
+    spec[k++] = '%';
+    while (*p && strchr("-+ #0", *p) && k < 8) spec[k++] = *p++;
+    for (int part = 0; part < 2; part++) {
+        if (part == 1) {
+            if (*p != '.') break;
+            spec[k++] = *p++;
+        }
+        if (*p == '*') {
+            k += (size_t)snprintf(spec + k, sizeof(spec) - k, "%d", (int)printf_int(next_arg(a), false, rc));
+            p++;
+        } else {
+            for (int i = 0; isdigit((unsigned char)*p); p++) {
+                if (i++ < 6) spec[k++] = *p;
+            }
+        }
+    }
+    char conv = *p;
+    if (!conv) {
+        fprintf(stderr, "printf: `%s': missing format character\n", *fmt);
+        *rc = 1;
+        *fmt = p;
+        return false;
+    }
+    *fmt = p + 1;
+
+    switch (conv) {
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': {
+        bool is_unsigned = conv != 'd' && conv != 'i';
+        spec[k++] = 'l';
+        spec[k++] = 'l';
+        spec[k++] = conv;
+        spec[k] = '\0';
+        long long v = printf_int(next_arg(a), is_unsigned, rc);
+        if (is_unsigned) out_printf(spec, (unsigned long long)v);
+        else out_printf(spec, v);
+        return true;
+    }
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+        spec[k++] = 'L';
+        spec[k++] = conv;
+        spec[k] = '\0';
+        out_printf(spec, printf_float(next_arg(a), rc));
+        return true;
+    case 'c':
+        spec[k++] = 'c';
+        spec[k] = '\0';
+        {
+            const char *s = next_arg(a);
+            if (*s) out_printf(spec, *s);
+        }
+        return true;
+    case 's':
+        spec[k++] = 's';
+        spec[k] = '\0';
+        out_printf(spec, next_arg(a));
+        return true;
+    case 'b': {
+        const char *s = next_arg(a);
+        char *d = malloc(strlen(s) + 1);
+        if (!d) {
+            perror("printf");
+            *rc = 1;
+            return false;
+        }
+        bool stop;
+        size_t n = unescape(s, d, true, &stop);
+        if (k == 1) {
+            out_write(d, n);
+        } else {
+            d[n] = '\0';
+            spec[k++] = 's';
+            spec[k] = '\0';
+            out_printf(spec, d);
+        }
+        free(d);
+        return !stop;
+    }
+    default:
+        fprintf(stderr, "printf: %c: invalid format character\n", conv);
+        *rc = 1;
+        return false;
+    }
+}
+
+/** printf format [arg ...] */
+int builtin_printf(struct shell *sh, char **argv) {
+    UNUSED(sh)
+    size_t i = 1;
+    if (argv[i] && strcmp(argv[i], "--") == 0) i++;
+    if (!argv[i]) {
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+    const char *format = argv[i];
+    struct printf_args a = {argv + i + 1, 0};
+    int rc = 0;
+    bool go = true;
+
+    // The format is used again as long as it consumes arguments
+    do {
+        size_t before = a.used;
+        for (const char *p = format; go && *p;) {
+            if (*p == '%' && p[1] == '%') {
+                out_putc('%');
+                p += 2;
+            } else if (*p == '%') {
+                go = printf_conv(&p, &a, &rc);
+            } else if (*p == '\\' && p[1]) {
+                char d[2];
+                size_t n, used = escape_at(p, d, &n, false);
+                if (!used) go = false;
+                else out_write(d, n);
+                p += used;
+            } else {
+                const char *q = p;
+                while (*q && *q != '%' && *q != '\\') q++;
+                out_write(p, (size_t)(q - p));
+                p = q;
+            }
+        }
+        if (a.used == before) break;
+    } while (go && a.argv[a.used]);
+
+    int wrc = out_done("printf");
+    return rc ? rc : wrc;
+}
+
+/* Where test is in its arguments, for the general expression parser */
+struct test_state {
+    const char *who;
+    char **argv;
+    int argc;
+    int pos;
+    bool error;
+};
+
+/** Report a test error, only the first one is printed. */
+static void test_error(struct test_state *t, const char *what, const char *arg) {
+    if (t->error) return;
+    t->error = true;
+    if (arg) fprintf(stderr, "%s: %s: %s\n", t->who, arg, what);
+    else fprintf(stderr, "%s: %s\n", t->who, what);
+}
+
+/** True for the file and string tests that take one operand. */
+static bool unary_op(const char *s) {
+    return s[0] == '-' && s[1] && !s[2] && strchr("bcdefghkLprsStuwxOGnz", s[1]);
+}
+
+/** True for the operators between two operands, -a and -o only if logic. */
+static bool binary_op(const char *s, bool logic) {
+    static const char *const ops[] = {
+        "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef",
+    };
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (strcmp(s, ops[i]) == 0) return true;
+    }
+    return logic && (strcmp(s, "-a") == 0 || strcmp(s, "-o") == 0);
+}
+
+/** Integer operand, surrounding blanks allowed. */
+static long long test_int(struct test_state *t, const char *s) {
+    char *end;
+    errno = 0;
+    long long v = strtoll(s, &end, 10);
+    while (*end == ' ' || *end == '\t') end++;
+    if (end == s || *end || errno == ERANGE) test_error(t, "integer expression expected", s);
+    return v;
+}
+
+/** -x file and friends. */
+static bool test_unary(struct test_state *t, char op, const char *arg) {
+    struct stat st;
+    switch (op) {
+    case 'n': return *arg != '\0';
+    case 'z': return *arg == '\0';
+    case 't': return isatty((int)test_int(t, arg));
+    case 'h':
+    case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    case 'r': return faccessat(AT_FDCWD, arg, R_OK, AT_EACCESS) == 0;
+    case 'w': return faccessat(AT_FDCWD, arg, W_OK, AT_EACCESS) == 0;
+    case 'x': return faccessat(AT_FDCWD, arg, X_OK, AT_EACCESS) == 0;
+    }
+    if (stat(arg, &st) == -1) return false;
+    switch (op) {
+    case 'b': return S_ISBLK(st.st_mode);
+    case 'c': return S_ISCHR(st.st_mode);
+    case 'd': return S_ISDIR(st.st_mode);
+    case 'f': return S_ISREG(st.st_mode);
+    case 'p': return S_ISFIFO(st.st_mode);
+    case 'S': return S_ISSOCK(st.st_mode);
+    case 'g': return st.st_mode & S_ISGID;
+    case 'u': return st.st_mode & S_ISUID;
+    case 'k': return st.st_mode & S_ISVTX;
+    case 's': return st.st_size > 0;
+    case 'O': return st.st_uid == geteuid();
+    case 'G': return st.st_gid == getegid();
+    default: return true;   // -e
+    }
+}
+
+/** a op b. */
+static bool test_binary(struct test_state *t, const char *a, const char *op, const char *b) {
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(a, b) == 0;
+    if (strcmp(op, "!=") == 0) return strcmp(a, b) != 0;
+    if (strcmp(op, "<") == 0) return strcmp(a, b) < 0;
+    if (strcmp(op, ">") == 0) return strcmp(a, b) > 0;
+    if (strcmp(op, "-a") == 0) return *a && *b;
+    if (strcmp(op, "-o") == 0) return *a || *b;
+    if (op[1] == 'n' || op[1] == 'o' || (op[1] == 'e' && op[2] == 'f')) {
+        struct stat sa, sb;
+        bool ha = stat(a, &sa) == 0, hb = stat(b, &sb) == 0;
+        if (op[1] == 'e') return ha && hb && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+        // A file that exists is newer than one that does not
+        if (!ha || !hb) return op[1] == 'n' ? ha : hb;
+        long long d = (long long)(sa.st_mtim.tv_sec - sb.st_mtim.tv_sec) * 1000000000 +
+                      (sa.st_mtim.tv_nsec - sb.st_mtim.tv_nsec);
+        return op[1] == 'n' ? d > 0 : d < 0;
+    }
+    long long x = test_int(t, a), y = test_int(t, b);
+    if (strcmp(op, "-eq") == 0) return x == y;
+    if (strcmp(op, "-ne") == 0) return x != y;
+    if (strcmp(op, "-lt") == 0) return x < y;
+    if (strcmp(op, "-le") == 0) return x <= y;
+    if (strcmp(op, "-gt") == 0) return x > y;
+    return x >= y;
+}
+
+static bool test_or(struct test_state *t);
+
+/** A primary: ( expr ), a unary test, a binary test or a string. */
+static bool test_primary(struct test_state *t) {
+    if (t->pos >= t->argc) {
+        test_error(t, "argument expected", NULL);
+        return false;
+    }
+    char **a = t->argv + t->pos;
+    int left = t->argc - t->pos;
+    if (strcmp(a[0], "(") == 0) {
+        t->pos++;
+        bool r = test_or(t);
+        if (t->pos >= t->argc || strcmp(t->argv[t->pos], ")") != 0) test_error(t, "`)' expected", NULL);
+        t->pos++;
+        return r;
+    }
+    if (left >= 3 && binary_op(a[1], false)) {
+        t->pos += 3;
+        return test_binary(t, a[0], a[1], a[2]);
+    }
+    if (left >= 2 && unary_op(a[0])) {
+        t->pos += 2;
+        return test_unary(t, a[0][1], a[1]);
+    }
+    t->pos++;
+    return *a[0] != '\0';
+}
+
+/** ! expr binds tighter than -a. */
+static bool test_not(struct test_state *t) {
+    if (t->pos < t->argc && strcmp(t->argv[t->pos], "!") == 0) {
+        t->pos++;
+        return !test_not(t);
+    }
+    return test_primary(t);
+}
+
+/** expr -a expr binds tighter than -o. */
+static bool test_and(struct test_state *t) {
+    bool r = test_not(t);
+    while (t->pos < t->argc && strcmp(t->argv[t->pos], "-a") == 0) {
+        t->pos++;
+        r = test_not(t) && r;
+    }
+    return r;
+}
+
+/** expr -o expr. */
+static bool test_or(struct test_state *t) {
+    bool r = test_and(t);
+    while (t->pos < t->argc && strcmp(t->argv[t->pos], "-o") == 0) {
+        t->pos++;
+        r = test_and(t) || r;
+    }
+    return r;
+}
+
+/**
+ * Evaluate n arguments. Up to four go by the POSIX rules that decide on
+ * the argument count alone, which keeps test = = = and friends working,
+ * anything else is parsed as an expression.
+ */
+static bool test_eval(struct test_state *t, char **a, int n) {
+    switch (n) {
+    case 0:
+        return false;
+    case 1:
+        return *a[0] != '\0';
+    case 2:
+        if (strcmp(a[0], "!") == 0) return *a[1] == '\0';
+        if (unary_op(a[0])) return test_unary(t, a[0][1], a[1]);
+        break;
+    case 3:
+        if (binary_op(a[1], true)) return test_binary(t, a[0], a[1], a[2]);
+        if (strcmp(a[0], "!") == 0) return !test_eval(t, a + 1, 2);
+        if (strcmp(a[0], "(") == 0 && strcmp(a[2], ")") == 0) return *a[1] != '\0';
+        break;
+    case 4:
+        if (strcmp(a[0], "!") == 0) return !test_eval(t, a + 1, 3);
+        if (strcmp(a[0], "(") == 0 && strcmp(a[3], ")") == 0) return test_eval(t, a + 1, 2);
+        break;
+    }
+    t->argv = a;
+    t->argc = n;
+    t->pos = 0;
+    bool r = test_or(t);
+    if (t->pos < t->argc) test_error(t, "too many arguments", NULL);
+    return r;
+}
+
+/** test expr, [ expr ] */
+int builtin_test(struct shell *sh, char **argv) {
+    UNUSED(sh)
+    int argc = 0;
+    while (argv[argc]) argc++;
+    struct test_state t = {.who = argv[0]};
+    if (strcmp(argv[0], "[") == 0) {
+        if (strcmp(argv[argc - 1], "]") != 0) {
+            fprintf(stderr, "[: missing `]'\n");
+            return 2;
+        }
+        argc--;
+    }
+    bool r = test_eval(&t, argv + 1, argc - 1);
+    return t.error ? 2 : !r;
+}
+
+/** true */
+int builtin_true(struct shell *sh, char **argv) {
+    UNUSED(sh)
+    UNUSED(argv)
+    return 0;
+}
+
+/** false */
+int builtin_false(struct shell *sh, char **argv) {
+    UNUSED(sh)
+    UNUSED(argv)
+    return 1;
+}
+
+/** True when path is absolute, free of . and .. and names the current directory. */
+static bool pwd_valid(const char *path) {
+    if (!path || path[0] != '/') return false;
+    for (const char *p = path; (p = strstr(p, "/.")); p++) {
+        if (p[2] == '/' || p[2] == '\0' || (p[2] == '.' && (p[3] == '/' || p[3] == '\0')))
+            return false;
+    }
+    struct stat a, b;
+    return stat(path, &a) == 0 && stat(".", &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+/** pwd [-L | -P] */
+int builtin_pwd(struct shell *sh, char **argv) {
+    bool physical = false;
+    for (size_t i = 1; argv[i]; i++) {
+        if (strcmp(argv[i], "-P") == 0) {
+            physical = true;
+        } else if (strcmp(argv[i], "-L") == 0) {
+            physical = false;
+        } else {
+            fprintf(stderr, "pwd: %s: invalid option\nusage: pwd [-LP]\n", argv[i]);
+            return 2;
+        }
+    }
+    const char *env = var_get(sh, "PWD");
+    if (!physical && pwd_valid(env)) {
+        out_puts(env);
+    } else {
+        char *cwd = getcwd(NULL, 0);
+        if (!cwd) {
+            perror("pwd");
+            return 1;
+        }
+        out_puts(cwd);
+        free(cwd);
+    }
+    out_putc('\n');
+    return out_done("pwd");
+}
+
+/** Seconds in one sleep operand like 1.5, 2m or 1e-3, -1 if invalid. */
+static double sleep_arg(const char *s) {
+    char *end;
+    double v = strtod(s, &end);
+    if (end == s || v < 0 || isnan(v)) return -1;
+    switch (*end) {
+    case '\0': case 's': break;
+    case 'm': v *= 60; break;
+    case 'h': v *= 3600; break;
+    case 'd': v *= 86400; break;
+    default: return -1;
+    }
+    return *end && end[1] ? -1 : v;
+}
+
+/** Event loop callback of sleep, notes which of its watches fired. */
+static void sleep_wake(struct evloop *l, int fd, unsigned events, void *arg) {
+    UNUSED(l)
+    UNUSED(events)
+    *(int *)arg = fd == -1 ? 0 : 128 + SIGINT;
+}
+
+/**
+ * Wait for a timer of the event loop next to a signalfd for SIGINT. The
+ * interactive shell ignores SIGINT and an ignored signal is never queued,
+ * so for the duration SIGINT is blocked and set to its default action. A
+ * shell that did not ignore it dies from it afterwards, just as it would
+ * have.
+ */
+static int sleep_for(struct shell *sh, double secs) {
+    struct timespec after = {0};
+    if (secs > 1e15) secs = 1e15;
+    after.tv_sec = (time_t)secs;
+    after.tv_nsec = (long)((secs - (double)after.tv_sec) * 1e9);
+    if (after.tv_sec == 0 && after.tv_nsec == 0) return 0;
+
+    int rc = -1;
+    int timer = ev_timer(&sh->loop, &after, sleep_wake, &rc);
+    if (timer == -1) {
+        perror("sleep");
+        return 1;
+    }
+    sigset_t mask, old;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    struct sigaction dfl = {.sa_handler = SIG_DFL}, saved;
+    sigprocmask(SIG_BLOCK, &mask, &old);
+    sigaction(SIGINT, &dfl, &saved);
+    int sfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    int intr = sfd == -1 ? -1 : ev_add(&sh->loop, sfd, EV_READ, sleep_wake, &rc);
+
+    while (rc == -1) {
+        if (ev_run_once(&sh->loop, -1) == -1 && errno != EINTR) {
+            perror("sleep");
+            rc = 1;
+        }
+    }
+    if (rc == 128 + SIGINT) {
+        struct signalfd_siginfo si;
+        (void)!read(sfd, &si, sizeof(si));
+    }
+    ev_del(&sh->loop, intr);
+    ev_del(&sh->loop, timer);
+    if (sfd != -1) close(sfd);
+    sigaction(SIGINT, &saved, NULL);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    if (rc == 128 + SIGINT && saved.sa_handler == SIG_DFL) raise(SIGINT);
+    return rc;
+}
+
+/** sleep number[smhd] ... */
+int builtin_sleep(struct shell *sh, char **argv) {
+    if (!argv[1]) {
+        fprintf(stderr, "sleep: missing operand\n");
+        return 1;
+    }
+    double total = 0;
+    for (size_t i = 1; argv[i]; i++) {
+        double v = sleep_arg(argv[i]);
+        if (v < 0) {
+            fprintf(stderr, "sleep: invalid time interval '%s'\n", argv[i]);
+            return 1;
+        }
+        total += v;
+    }
+    return sleep_for(sh, total);
+}
@@ -0,0 +1,66 @@
+#ifndef COREUTILS_H
+#define COREUTILS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct shell;
+
+/*
+ * The small utilities scripts call on nearly every line, run inside the
+ * shell instead of paying for a fork and exec. Output is collected in a
+ * buffer and written in large chunks, a failed write makes the builtin
+ * return 1. Every function takes the builtin's argv and returns its exit
+ * status.
+ */
+
+/**
+ * @brief echo [-neE] [arg ...], -e expands backslash escapes like bash
+ */
+int builtin_echo(struct shell *sh, char **argv);
+
+/**
+ * @brief printf format [arg ...], the format is reused until every
+ * argument is consumed. Understands %b, %c, %s, the integer and floating
+ * point conversions with flags, width and precision, and the escapes of
+ * POSIX printf.
+ */
+int builtin_printf(struct shell *sh, char **argv);
+
+/**
+ * @brief test expr and [ expr ], with the POSIX rules for up to four
+ * arguments and !, -a, -o and parentheses beyond that
+ *
+ * @return 0 if expr is true, 1 if it is false and 2 on an error
+ */
+int builtin_test(struct shell *sh, char **argv);
+
+/**
+ * @brief true, always 0
+ */
+int builtin_true(struct shell *sh, char **argv);
+
+/**
+ * @brief false, always 1
+ */
+int builtin_false(struct shell *sh, char **argv);
+
+/**
+ * @brief pwd [-L | -P], -L prints $PWD when it still names the current
+ * directory
+ */
+int builtin_pwd(struct shell *sh, char **argv);
+
+/**
+ * @brief sleep number[smhd] ..., sleeps for the sum on a timerfd. SIGINT
+ * ends it early with status 130 even in an interactive shell that
+ * otherwise ignores SIGINT.
+ */
+int builtin_sleep(struct shell *sh, char **argv);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // COREUTILS_H
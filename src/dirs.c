@@ -0,0 +1,570 @@
+/**
+ * dirs.c
+ * Changing directories: cd with CDPATH and cd -, the pushd/popd stack, and
+ * j, which jumps to a directory picked by frecency from a database every
+ * interactive shell shares. The database is a fixed size file mapped into
+ * each shell, so recording a visit and finding the best match are a walk
+ * over memory without a read or a process.
+ */
+
+#define _GNU_SOURCE
+#include "dirs.h"
+#include "lab.h"
+#include "vars.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// First bytes of every database file
+static const char dirdb_magic[8] = {'L', 'A', 'B', 'D', 'I', 'R', 'S', 1};
+
+/** FNV-1a of a path. */
+static uint32_t path_hash(const char *s, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h;
+}
+
+/** Open the file, creating it at its full size when it is new. */
+int dirdb_open(struct dirdb *db, const char *path) {
+    memset(db, 0, sizeof(*db));
+    db->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (db->fd == -1) return -1;
+
+    size_t size = sizeof(struct dirdb_file) + DIRDB_SLOTS * sizeof(struct dirdb_slot);
+    struct stat st;
+    flock(db->fd, LOCK_EX);
+    int rc = fstat(db->fd, &st);
+    if (rc == 0 && st.st_size == 0) {
+        struct dirdb_file head = {.slots = DIRDB_SLOTS};
+        memcpy(head.magic, dirdb_magic, sizeof(head.magic));
+        if (ftruncate(db->fd, (off_t)size) == -1 ||
+            pwrite(db->fd, &head, sizeof(head), 0) != (ssize_t)sizeof(head))
+            rc = -1;
+    } else if (rc == 0 && (size_t)st.st_size != size) {
+        errno = EINVAL;
+        rc = -1;
+    }
+    if (rc == 0) {
+        void *m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, db->fd, 0);
+        if (m == MAP_FAILED) {
+            rc = -1;
+        } else {
+            db->map = m;
+            db->size = size;
+            if (memcmp(db->map->magic, dirdb_magic, sizeof(dirdb_magic)) != 0 ||
+                db->map->slots != DIRDB_SLOTS || db->map->n > DIRDB_SLOTS) {
+                errno = EINVAL;
+                rc = -1;
+            }
+        }
+    }
+    flock(db->fd, LOCK_UN);
+
+    if (rc == -1) {
+        int err = errno;
+        if (!db->map) close(db->fd);
+        dirdb_close(db);
+        errno = err;
+    }
+    return rc;
+}
+
+/** Release the mapping and the descriptor. */
+void dirdb_close(struct dirdb *db) {
+    if (db->map) {
+        munmap(db->map, db->size);
+        close(db->fd);
+    }
+    memset(db, 0, sizeof(*db));
+}
+
+/** Frecency of a slot. */
+double dirdb_score(const struct dirdb_slot *s, int64_t now) {
+    int64_t age = now - s->last;
+    if (age < 3600) return s->rank * 4;
+    if (age < 86400) return s->rank * 2;
+    if (age < 604800) return s->rank / 2;
+    return s->rank / 4;
+}
+
+/** Scale every rank down and forget the directories that fall below one. */
+static void dirdb_age(struct dirdb_file *f) {
+    double total = 0;
+    uint32_t j = 0;
+    for (uint32_t i = 0; i < f->n; i++) {
+        f->slot[i].rank *= 0.9;
+        if (f->slot[i].rank < 1) continue;
+        if (j != i) f->slot[j] = f->slot[i];
+        total += f->slot[j++].rank;
+    }
+    f->n = j;
+    f->total = total;
+}
+
+/** Count a visit. */
+int dirdb_add(struct dirdb *db, const char *path, int64_t now) {
+    if (!db->map) {
+        errno = EBADF;
+        return -1;
+    }
+    size_t len = strlen(path);
+    if (len >= DIRDB_PATH_MAX) return 0;
+    uint32_t hash = path_hash(path, len);
+    struct dirdb_file *f = db->map;
+
+    flock(db->fd, LOCK_EX);
+    struct dirdb_slot *s = NULL;
+    for (uint32_t i = 0; i < f->n && !s; i++) {
+        struct dirdb_slot *c = &f->slot[i];
+        if (c->hash == hash && c->len == len && memcmp(c->path, path, len) == 0) s = c;
+    }
+    if (!s) {
+        if (f->n < f->slots) {
+            s = &f->slot[f->n++];
+        } else {
+            // Full, the least frecent directory makes room
+            s = &f->slot[0];
+            for (uint32_t i = 1; i < f->n; i++)
+                if (dirdb_score(&f->slot[i], now) < dirdb_score(s, now)) s = &f->slot[i];
+            f->total -= s->rank;
+        }
+        s->rank = 0;
+        s->hash = hash;
+        s->len = (uint32_t)len;
+        memcpy(s->path, path, len + 1);
+    }
+    s->rank += 1;
+    s->last = now;
+    f->total += 1;
+    if (f->total > DIRDB_MAX_RANK) dirdb_age(f);
+    flock(db->fd, LOCK_UN);
+    return 0;
+}
+
+/** Words in order, the last one in the last component. */
+bool dirdb_match(const char *path, char *const *words, size_t n) {
+    // Smart case: an upper case letter anywhere makes every word exact
+    bool fold = true;
+    for (size_t i = 0; i < n && fold; i++)
+        for (const char *c = words[i]; *c && fold; c++) fold = !isupper((unsigned char)*c);
+
+    const char *at = path;
+    for (size_t i = 0; i < n; i++) {
+        const char *from = at;
+        if (i == n - 1 && !strchr(words[i], '/')) {
+            const char *last = strrchr(path, '/');
+            if (last && last + 1 > from) from = last + 1;
+        }
+        const char *hit = fold ? strcasestr(from, words[i]) : strstr(from, words[i]);
+        if (!hit) return false;
+        at = hit + strlen(words[i]);
+    }
+    return true;
+}
+
+/** True if path is a directory that still exists. */
+static bool is_dir(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/** The best match. */
+int dirdb_best(struct dirdb *db, char *const *words, size_t n, const char *skip, int64_t now,
+               char *out, size_t size) {
+    if (!db->map) return -1;
+    const struct dirdb_file *f = db->map;
+    const struct dirdb_slot *best = NULL;
+    double best_score = 0;
+
+    flock(db->fd, LOCK_SH);
+    for (uint32_t i = 0; i < f->n; i++) {
+        // The score is cheap, the match less so and the stat least of all
+        const struct dirdb_slot *s = &f->slot[i];
+        double score = dirdb_score(s, now);
+        if (best && score <= best_score) continue;
+        if (!dirdb_match(s->path, words, n) || (skip && strcmp(s->path, skip) == 0) || !is_dir(s->path))
+            continue;
+        best = s;
+        best_score = score;
+    }
+    int rc = best && strlen(best->path) < size ? 0 : -1;
+    if (rc == 0) strcpy(out, best->path);
+    flock(db->fd, LOCK_UN);
+    return rc;
+}
+
+/** Path of the database, $LAB_DIRSFILE or ~/.lab_dirs. */
+static char *dirdb_path(struct shell *sh) {
+    const char *env = var_get(sh, "LAB_DIRSFILE");
+    if (env) return *env ? strdup(env) : NULL;
+    const char *home = var_get(sh, "HOME");
+    if (!home) {
+        struct passwd *pw = getpwuid(getuid());
+        home = pw ? pw->pw_dir : NULL;
+    }
+    char *path;
+    if (!home || asprintf(&path, "%s/.lab_dirs", home) == -1) return NULL;
+    return path;
+}
+
+/** Open the database of an interactive shell. */
+void dirs_init(struct shell *sh) {
+    char *path = dirdb_path(sh);
+    if (!path) return;
+    if (dirdb_open(&sh->dirs.db, path) == -1)
+        fprintf(stderr, "j: %s: %s\n", path, errno == EINVAL ? "not a directory database" : strerror(errno));
+    free(path);
+}
+
+/** True if a relative dir is looked up in CDPATH, as POSIX has it. */
+static bool use_cdpath(const char *dir) {
+    if (dir[0] == '/') return false;
+    if (dir[0] == '.' && (dir[1] == '\0' || dir[1] == '/')) return false;
+    return !(dir[0] == '.' && dir[1] == '.' && (dir[2] == '\0' || dir[2] == '/'));
+}
+
+/** Change directory, returns 1 when CDPATH named a directory other than dir. */
+int dirs_chdir(struct shell *sh, const char *who, const char *dir, bool cdpath) {
+    char *old = getcwd(NULL, 0);
+    const char *list = cdpath && use_cdpath(dir) ? var_get(sh, "CDPATH") : NULL;
+    int rc = -1;
+    for (const char *s = list; s && rc == -1;) {
+        const char *end = strchrnul(s, ':');
+        char path[PATH_MAX];
+        // An empty entry is the current directory
+        int len = end > s ? snprintf(path, sizeof(path), "%.*s/%s", (int)(end - s), s, dir)
+                          : snprintf(path, sizeof(path), "./%s", dir);
+        if (len > 0 && (size_t)len < sizeof(path) && is_dir(path) && chdir(path) == 0) rc = end > s;
+        s = *end ? end + 1 : NULL;
+    }
+    if (rc == -1 && chdir(dir) == -1) {
+        fprintf(stderr, "%s: %s: %s\n", who, dir, strerror(errno));
+        free(old);
+        return -1;
+    }
+    if (rc == -1) rc = 0;
+
+    char *cwd = getcwd(NULL, 0);
+    if (cwd) {
+        var_set(sh, "PWD", cwd);
+        if (sh->dirs.db.map) dirdb_add(&sh->dirs.db, cwd, time(NULL));
+    }
+    if (old) var_set(sh, "OLDPWD", old);
+    free(cwd);
+    free(old);
+    return rc;
+}
+
+/** Print the current directory. */
+static void print_pwd(struct shell *sh) {
+    const char *pwd = var_get(sh, "PWD");
+    if (pwd) printf("%s\n", pwd);
+    fflush(stdout);
+}
+
+/** cd [dir | -] */
+int builtin_cd(struct shell *sh, char **argv) {
+    if (argv[1] && argv[2]) {
+        fprintf(stderr, "cd: too many arguments\n");
+        return 1;
+    }
+    const char *dir = argv[1];
+    bool back = dir && strcmp(dir, "-") == 0;
+    if (back) {
+        dir = var_get(sh, "OLDPWD");
+        if (!dir) {
+            fprintf(stderr, "cd: OLDPWD not set\n");
+            return 1;
+        }
+    } else if (!dir) {
+        // HOME is the shell's variable, which may differ from the environment
+        dir = var_get(sh, "HOME");
+        if (!dir) {
+            struct passwd *pw = getpwuid(getuid());
+            dir = pw ? pw->pw_dir : NULL;
+        }
+        if (!dir) {
+            fprintf(stderr, "cd: HOME not set\n");
+            return 1;
+        }
+    }
+    // dir may be OLDPWD itself, which dirs_chdir replaces
+    char *copy = strdup(dir);
+    if (!copy) {
+        perror("cd");
+        return 1;
+    }
+    int rc = dirs_chdir(sh, "cd", copy, argv[1] && !back);
+    free(copy);
+    if (rc == -1) return 1;
+    if (back || rc == 1) print_pwd(sh);
+    return 0;
+}
+
+/** Add a copy of dir under the current directory. */
+static int stack_push(struct dir_state *d, const char *dir) {
+    if (d->n == d->cap) {
+        size_t cap = d->cap ? d->cap * 2 : 8;
+        char **grown = realloc(d->stack, cap * sizeof(*grown));
+        if (!grown) return -1;
+        d->stack = grown;
+        d->cap = cap;
+    }
+    if (!(d->stack[d->n] = strdup(dir))) return -1;
+    d->n++;
+    return 0;
+}
+
+/** Entry i as dirs numbers them, 0 being the current directory. */
+static const char *stack_entry(const struct dir_state *d, size_t i, const char *cwd) {
+    return i == 0 ? cwd : d->stack[d->n - i];
+}
+
+/**
+ * Parse +N or -N, counting from the left or the right of what dirs
+ * prints. Returns 1 with *i set, 0 if arg is not a number like that and
+ * -1 if it is out of range, which is reported.
+ */
+static int stack_index(const struct dir_state *d, const char *who, const char *arg, size_t *i) {
+    if ((arg[0] != '+' && arg[0] != '-') || !isdigit((unsigned char)arg[1])) return 0;
+    char *end;
+    unsigned long k = strtoul(arg + 1, &end, 10);
+    if (*end) return 0;
+    if (k > d->n) {
+        fprintf(stderr, "%s: %s: directory stack index out of range\n", who, arg);
+        return -1;
+    }
+    *i = arg[0] == '+' ? k : d->n - k;
+    return 1;
+}
+
+/** Print a directory, with $HOME as ~ unless full. */
+static void print_dir(struct shell *sh, const char *dir, bool full) {
+    const char *home = var_get(sh, "HOME");
+    size_t hl = home ? strlen(home) : 0;
+    if (!full && hl > 1 && strncmp(dir, home, hl) == 0 && (dir[hl] == '/' || !dir[hl]))
+        printf("~%s", dir + hl);
+    else
+        printf("%s", dir);
+}
+
+/** Print the stack like dirs does. */
+static void print_stack(struct shell *sh, const char *cwd, bool full, bool lines, bool numbered) {
+    const struct dir_state *d = &sh->dirs;
+    for (size_t i = 0; i <= d->n; i++) {
+        if (numbered) printf("%2zu  ", i);
+        print_dir(sh, stack_entry(d, i, cwd), full);
+        fputc(i == d->n || lines || numbered ? '\n' : ' ', stdout);
+    }
+    fflush(stdout);
+}
+
+/** Print the stack after pushd or popd changed it. */
+static void show_stack(struct shell *sh) {
+    char *cwd = getcwd(NULL, 0);
+    if (cwd) print_stack(sh, cwd, false, false, false);
+    free(cwd);
+}
+
+/** pushd [dir | +N | -N] */
+int builtin_pushd(struct shell *sh, char **argv) {
+    struct dir_state *d = &sh->dirs;
+    if (argv[1] && argv[2]) {
+        fprintf(stderr, "usage: pushd [dir | +N | -N]\n");
+        return 2;
+    }
+    char *cwd = getcwd(NULL, 0);
+    if (!cwd) {
+        perror("pushd");
+        return 1;
+    }
+    size_t k = 1;
+    int kind = argv[1] ? stack_index(d, "pushd", argv[1], &k) : 1;
+    int rc = 1;
+    if (kind == 0) {
+        if (dirs_chdir(sh, "pushd", argv[1], true) != -1) {
+            rc = stack_push(d, cwd) == -1 ? 1 : 0;
+            if (rc) perror("pushd");
+        }
+    } else if (kind == 1 && !d->n) {
+        fprintf(stderr, "pushd: no other directory\n");
+    } else if (kind == 1 && !argv[1]) {
+        // The top two trade places
+        if (dirs_chdir(sh, "pushd", d->stack[d->n - 1], false) != -1) {
+            free(d->stack[d->n - 1]);
+            d->stack[d->n - 1] = cwd;
+            cwd = NULL;
+            rc = 0;
+        }
+    } else if (kind == 1) {
+        // Rotate so entry k is on top
+        size_t m = d->n + 1;
+        char **order = malloc(m * sizeof(*order));
+        if (!order) {
+            perror("pushd");
+        } else if (k == 0 || dirs_chdir(sh, "pushd", stack_entry(d, k, cwd), false) != -1) {
+            for (size_t i = 0; i < m; i++) order[i] = (char *)stack_entry(d, (k + i) % m, cwd);
+            // The new top is the current directory, the rest goes back on the stack
+            for (size_t i = 1; i < m; i++) d->stack[d->n - i] = order[i];
+            free(order[0]);
+            cwd = NULL;
+            rc = 0;
+        }
+        free(order);
+    }
+    free(cwd);
+    if (rc == 0) show_stack(sh);
+    return rc;
+}
+
+/** popd [+N | -N] */
+int builtin_popd(struct shell *sh, char **argv) {
+    struct dir_state *d = &sh->dirs;
+    if (argv[1] && argv[2]) {
+        fprintf(stderr, "usage: popd [+N | -N]\n");
+        return 2;
+    }
+    if (!d->n) {
+        fprintf(stderr, "popd: directory stack empty\n");
+        return 1;
+    }
+    size_t k = 0;
+    int kind = argv[1] ? stack_index(d, "popd", argv[1], &k) : 1;
+    if (kind == 0) {
+        fprintf(stderr, "popd: %s: invalid argument\nusage: popd [+N | -N]\n", argv[1]);
+        return 2;
+    }
+    if (kind == -1) return 1;
+    if (k == 0) {
+        if (dirs_chdir(sh, "popd", d->stack[d->n - 1], false) == -1) return 1;
+        free(d->stack[--d->n]);
+    } else {
+        size_t at = d->n - k;
+        free(d->stack[at]);
+        memmove(&d->stack[at], &d->stack[at + 1], (d->n - at - 1) * sizeof(*d->stack));
+        d->n--;
+    }
+    show_stack(sh);
+    return 0;
+}
+
+/** dirs [-clpv] [+N | -N] */
+int builtin_dirs(struct shell *sh, char **argv) {
+    struct dir_state *d = &sh->dirs;
+    bool full = false, lines = false, numbered = false, cleared = false;
+    const char *pick = NULL;
+    for (size_t i = 1; argv[i]; i++) {
+        const char *a = argv[i];
+        if ((a[0] == '+' || a[0] == '-') && isdigit((unsigned char)a[1])) {
+            pick = a;
+            continue;
+        }
+        if (a[0] != '-' || !a[1] || strspn(a + 1, "clpv") != strlen(a + 1)) {
+            fprintf(stderr, "dirs: %s: invalid option\nusage: dirs [-clpv] [+N | -N]\n", a);
+            return 2;
+        }
+        if (strchr(a, 'c')) {
+            for (size_t j = 0; j < d->n; j++) free(d->stack[j]);
+            d->n = 0;
+            cleared = true;
+        }
+        full |= strchr(a, 'l') != NULL;
+        lines |= strchr(a, 'p') != NULL;
+        numbered |= strchr(a, 'v') != NULL;
+    }
+    char *cwd = getcwd(NULL, 0);
+    if (!cwd) {
+        perror("dirs");
+        return 1;
+    }
+    size_t k;
+    int rc = 0;
+    if (pick && stack_index(d, "dirs", pick, &k) == 1) {
+        print_dir(sh, stack_entry(d, k, cwd), full);
+        putchar('\n');
+        fflush(stdout);
+    } else if (pick) {
+        rc = 1;
+    } else if (!cleared || full || lines || numbered) {
+        // dirs -c alone only clears
+        print_stack(sh, cwd, full, lines, numbered);
+    }
+    free(cwd);
+    return rc;
+}
+
+/* A match listed by j -l */
+struct dir_hit {
+    double score;
+    uint32_t slot;
+};
+
+/** Highest score first. */
+static int cmp_hits(const void *x, const void *y) {
+    const struct dir_hit *a = x, *b = y;
+    return (a->score < b->score) - (a->score > b->score);
+}
+
+/** Print every match with its score. */
+static int list_matches(struct dirdb *db, char *const *words, size_t n, int64_t now) {
+    const struct dirdb_file *f = db->map;
+    struct dir_hit *hits = malloc(DIRDB_SLOTS * sizeof(*hits));
+    if (!hits) {
+        perror("j");
+        return 1;
+    }
+    flock(db->fd, LOCK_SH);
+    size_t nhits = 0;
+    for (uint32_t i = 0; i < f->n; i++)
+        if (dirdb_match(f->slot[i].path, words, n)) hits[nhits++] = (struct dir_hit){dirdb_score(&f->slot[i], now), i};
+    qsort(hits, nhits, sizeof(*hits), cmp_hits);
+    for (size_t i = 0; i < nhits; i++) printf("%10.2f  %s\n", hits[i].score, f->slot[hits[i].slot].path);
+    flock(db->fd, LOCK_UN);
+    fflush(stdout);
+    free(hits);
+    return nhits ? 0 : 1;
+}
+
+/** j [-l] [word ...] */
+int builtin_j(struct shell *sh, char **argv) {
+    struct dirdb *db = &sh->dirs.db;
+    bool list = argv[1] && strcmp(argv[1], "-l") == 0;
+    char **words = argv + 1 + list;
+    size_t n = 0;
+    while (words[n]) n++;
+    if (!db->map) {
+        fprintf(stderr, "j: no directory database\n");
+        return 1;
+    }
+    int64_t now = time(NULL);
+    if (list || !n) return list_matches(db, words, n, now);
+
+    char cwd[PATH_MAX], dir[DIRDB_PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) cwd[0] = '\0';
+    if (dirdb_best(db, words, n, cwd, now, dir, sizeof(dir)) == -1) {
+        fprintf(stderr, "j: no match\n");
+        return 1;
+    }
+    if (dirs_chdir(sh, "j", dir, false) == -1) return 1;
+    print_pwd(sh);
+    return 0;
+}
+
+/** Free the stack and close the database. */
+void dirs_destroy(struct dir_state *d) {
+    for (size_t i = 0; i < d->n; i++) free(d->stack[i]);
+    free(d->stack);
+    dirdb_close(&d->db);
+    memset(d, 0, sizeof(*d));
+}
@@ -0,0 +1,189 @@
+#ifndef DIRS_H
+#define DIRS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct shell;
+
+// Directories the database remembers
+#define DIRDB_SLOTS 1024
+// Longest directory it remembers, NUL included
+#define DIRDB_PATH_MAX 496
+// Sum of the ranks at which every rank is aged
+#define DIRDB_MAX_RANK 10000.0
+
+/* One remembered directory */
+struct dirdb_slot {
+    double rank;        // grows by one per visit, shrinks as the database ages
+    int64_t last;       // seconds since the epoch of the last visit
+    uint32_t hash;      // of the path, compared before the path
+    uint32_t len;
+    char path[DIRDB_PATH_MAX];
+};
+
+/* The database file, mapped as it is on disk */
+struct dirdb_file {
+    char magic[8];
+    uint32_t slots;     // DIRDB_SLOTS
+    uint32_t n;         // slots in use, always the first n
+    double total;       // sum of the ranks
+    struct dirdb_slot slot[];
+};
+
+/**
+ * @brief Directories ranked by frecency, how often and how recently they
+ * were visited. The file has a fixed size and is mapped shared, so every
+ * shell sees the visits of the others without reading anything. Updates
+ * happen under an exclusive flock and lookups under a shared one. When the
+ * ranks add up to DIRDB_MAX_RANK they are all scaled down and the ones
+ * that drop below one are forgotten. All zero is a closed database.
+ */
+struct dirdb {
+    int fd;
+    struct dirdb_file *map;     // NULL when closed
+    size_t size;
+};
+
+/**
+ * @brief The directory stack of pushd and popd and the frecency database.
+ * The current directory is the implied top of the stack and is not kept
+ * in it. All zero is a valid state.
+ */
+struct dir_state {
+    char **stack;       // stack[n - 1] is the entry right under the current directory
+    size_t n;
+    size_t cap;
+    struct dirdb db;
+};
+
+/**
+ * @brief Open or create a database file
+ *
+ * @param db The database
+ * @param path The file
+ * @return 0 on success, -1 with errno set. EINVAL means path is not a
+ * directory database.
+ */
+int dirdb_open(struct dirdb *db, const char *path);
+
+/**
+ * @brief Unmap and close the file
+ */
+void dirdb_close(struct dirdb *db);
+
+/**
+ * @brief Count a visit to a directory. Directories longer than
+ * DIRDB_PATH_MAX are not remembered. When the file is full the directory
+ * with the lowest frecency makes room.
+ *
+ * @param db The database
+ * @param path Absolute path of the directory
+ * @param now Seconds since the epoch
+ * @return 0 on success, -1 with errno set
+ */
+int dirdb_add(struct dirdb *db, const char *path, int64_t now);
+
+/**
+ * @brief Frecency of a slot: its rank weighted by the time since the
+ * last visit, four times within the hour down to a quarter after a week
+ */
+double dirdb_score(const struct dirdb_slot *s, int64_t now);
+
+/**
+ * @brief Check a directory against the words given to j. The words have
+ * to appear in order, the last one in the last component of the path.
+ * Case is ignored unless a word has an upper case letter.
+ *
+ * @param path The directory
+ * @param words The words
+ * @param n Number of words, 0 matches everything
+ * @return True if the directory matches
+ */
+bool dirdb_match(const char *path, char *const *words, size_t n);
+
+/**
+ * @brief The existing directory with the highest frecency that matches
+ * the words
+ *
+ * @param db The database
+ * @param words The words, see dirdb_match
+ * @param n Number of words
+ * @param skip A directory that is never the answer, usually the current
+ * one, or NULL
+ * @param now Seconds since the epoch
+ * @param out Receives the directory
+ * @param size Size of out
+ * @return 0 on success, -1 if nothing matches
+ */
+int dirdb_best(struct dirdb *db, char *const *words, size_t n, const char *skip, int64_t now,
+               char *out, size_t size);
+
+/**
+ * @brief Open the database of an interactive shell, $LAB_DIRSFILE or
+ * ~/.lab_dirs. Errors are reported on stderr and leave it closed.
+ *
+ * @param sh The shell
+ */
+void dirs_init(struct shell *sh);
+
+/**
+ * @brief Change the directory: set PWD and OLDPWD and count the visit in
+ * the database. Errors are reported on stderr prefixed by who.
+ *
+ * @param sh The shell
+ * @param who Name of the builtin for messages
+ * @param dir The directory
+ * @param cdpath Look for a relative dir in the directories of $CDPATH
+ * @return 0 on success, 1 on success in a directory found through a
+ * CDPATH entry other than the current directory, -1 on failure
+ */
+int dirs_chdir(struct shell *sh, const char *who, const char *dir, bool cdpath);
+
+/**
+ * @brief Free the stack and close the database
+ *
+ * @param d The state
+ */
+void dirs_destroy(struct dir_state *d);
+
+/**
+ * @brief cd [dir | -], a relative dir is looked up in $CDPATH, - goes back
+ * to $OLDPWD. The new directory is printed when it was not named exactly.
+ */
+int builtin_cd(struct shell *sh, char **argv);
+
+/**
+ * @brief pushd [dir | +N | -N], push the current directory and change to
+ * dir, or rotate the stack. Without arguments the top two are swapped.
+ */
+int builtin_pushd(struct shell *sh, char **argv);
+
+/**
+ * @brief popd [+N | -N], change to the top of the stack and drop it, or
+ * drop entry N
+ */
+int builtin_popd(struct shell *sh, char **argv);
+
+/**
+ * @brief dirs [-clpv] [+N | -N], print the stack, current directory first
+ */
+int builtin_dirs(struct shell *sh, char **argv);
+
+/**
+ * @brief j [-l] [word ...], change to the directory with the highest
+ * frecency that matches the words, -l lists the matches with their scores
+ */
+int builtin_j(struct shell *sh, char **argv);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // DIRS_H
@@ -0,0 +1,445 @@
+/**
+ * evloop.c
+ * The event core: descriptor readiness, timers and child exits through a
+ * single wait. The io_uring backend is driven with the raw system calls,
+ * there is no liburing here, and only uses poll requests, so everything it
+ * does the epoll backend can do as well.
+ */
+
+#define _GNU_SOURCE
+#include "evloop.h"
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+// user_data of requests whose completions mean nothing to us
+#define EV_UD_IGNORE UINT64_MAX
+
+/** io_uring_setup(2), glibc has no wrapper for it. */
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+/** io_uring_enter(2) with the extended argument for a timeout. */
+static int uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags,
+                       struct io_uring_getevents_arg *arg) {
+    if (arg) flags |= IORING_ENTER_EXT_ARG;
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, arg ? sizeof(*arg) : 0);
+}
+
+/** Unmap the rings. */
+static void uring_unmap(struct ev_uring *r) {
+    if (r->sqes) munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring && r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_size);
+    if (r->sq_ring) munmap(r->sq_ring, r->sq_size);
+    *r = (struct ev_uring){0};
+}
+
+/** Set up the ring, -1 when the kernel has none or lacks what we need. */
+static int uring_open(struct evloop *l) {
+    struct io_uring_params p = {0};
+    int fd = uring_setup(EV_RING_ENTRIES, &p);
+    if (fd == -1) return -1;
+    // Timeouts on the wait itself need the extended argument of 5.11
+    if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)) {
+        close(fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    struct ev_uring *r = &l->ring;
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_size > r->sq_size) r->sq_size = r->cq_size;
+        r->cq_size = r->sq_size;
+    }
+    r->sq_ring = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        r->sq_ring = NULL;
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            r->cq_ring = NULL;
+            goto fail;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto fail;
+    }
+
+    char *sq = r->sq_ring, *cq = r->cq_ring;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_entries = (unsigned *)(sq + p.sq_off.ring_entries);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    l->fd = fd;
+    return 0;
+
+fail:
+    uring_unmap(r);
+    close(fd);
+    return -1;
+}
+
+/** Hand the queued entries to the kernel. */
+static int uring_flush(struct evloop *l) {
+    struct ev_uring *r = &l->ring;
+    while (r->queued) {
+        int n = uring_enter(l->fd, r->queued, 0, 0, NULL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        r->queued -= (unsigned)n < r->queued ? (unsigned)n : r->queued;
+    }
+    return 0;
+}
+
+/** Next free submission entry, flushing the queue when it is full. */
+static struct io_uring_sqe *uring_sqe(struct evloop *l) {
+    struct ev_uring *r = &l->ring;
+    unsigned tail = *r->sq_tail;
+    if (tail - atomic_load_explicit((_Atomic unsigned *)r->sq_head, memory_order_acquire) == *r->sq_entries) {
+        if (uring_flush(l) == -1) return NULL;
+    }
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    return sqe;
+}
+
+/** Publish the entry taken last with uring_sqe. */
+static void uring_push(struct evloop *l) {
+    struct ev_uring *r = &l->ring;
+    atomic_store_explicit((_Atomic unsigned *)r->sq_tail, *r->sq_tail + 1, memory_order_release);
+    r->queued++;
+}
+
+/** Completion tag of a slot, the generation keeps stale ones apart. */
+static uint64_t watch_tag(const struct evloop *l, size_t slot) {
+    return (uint64_t)l->w[slot].gen << 32 | slot;
+}
+
+/** Poll mask for EV_ flags. */
+static unsigned to_poll(unsigned events) {
+    return (events & EV_READ ? POLLIN : 0) | (events & EV_WRITE ? POLLOUT : 0);
+}
+
+/** EV_ flags for a poll mask, the same bits as an epoll mask. */
+static unsigned from_poll(unsigned revents) {
+    return (revents & POLLIN ? EV_READ : 0) | (revents & POLLOUT ? EV_WRITE : 0) |
+           (revents & (POLLHUP | POLLRDHUP) ? EV_HUP : 0) | (revents & (POLLERR | POLLNVAL) ? EV_ERR : 0);
+}
+
+/** Queue a one-shot poll for a slot. */
+static int uring_arm(struct evloop *l, size_t slot) {
+    struct io_uring_sqe *sqe = uring_sqe(l);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = l->w[slot].fd;
+    sqe->poll32_events = to_poll(l->w[slot].events);
+    sqe->user_data = watch_tag(l, slot);
+    uring_push(l);
+    l->w[slot].armed = true;
+    return 0;
+}
+
+/**
+ * Cancel the poll in flight for a slot right away: it holds a reference
+ * to the file, and a pipe end kept open that way would keep the reader
+ * from ever seeing end of file.
+ */
+static void uring_disarm(struct evloop *l, size_t slot) {
+    struct io_uring_sqe *sqe = uring_sqe(l);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = watch_tag(l, slot);
+    sqe->user_data = EV_UD_IGNORE;
+    uring_push(l);
+    uring_flush(l);
+}
+
+/** Forget everything, used for loops inherited across fork as well. */
+static void loop_drop(struct evloop *l) {
+    for (size_t i = 0; i < l->n; i++) {
+        if (l->w[i].kind == EV_TIMER || l->w[i].kind == EV_CHILD) close(l->w[i].fd);
+    }
+    free(l->w);
+    if (l->backend == EV_URING) uring_unmap(&l->ring);
+    if (l->backend != EV_NONE) close(l->fd);
+    *l = (struct evloop){0};
+}
+
+/** Set the loop up for this process if it is not already. */
+static int loop_ready(struct evloop *l) {
+    if (l->backend != EV_NONE && l->owner != getpid()) loop_drop(l);
+    return l->backend != EV_NONE ? 0 : ev_init(l, EV_NONE);
+}
+
+/** Set up a loop. */
+int ev_init(struct evloop *l, enum ev_backend want) {
+    *l = (struct evloop){0};
+    if (want == EV_NONE) {
+        const char *force = getenv("LAB_EVLOOP");
+        want = force && strcmp(force, "epoll") == 0 ? EV_EPOLL : EV_URING;
+        if (want == EV_URING && uring_open(l) == 0) {
+            l->backend = EV_URING;
+        } else {
+            want = EV_EPOLL;
+        }
+    } else if (want == EV_URING) {
+        if (uring_open(l) == -1) return -1;
+        l->backend = EV_URING;
+    }
+    if (want == EV_EPOLL) {
+        if ((l->fd = epoll_create1(EPOLL_CLOEXEC)) == -1) return -1;
+        l->backend = EV_EPOLL;
+    }
+    l->owner = getpid();
+    return 0;
+}
+
+/** Name of the backend in use. */
+const char *ev_backend_name(const struct evloop *l) {
+    switch (l->backend) {
+    case EV_URING: return "io_uring";
+    case EV_EPOLL: return "epoll";
+    default: return "none";
+    }
+}
+
+/** Take a slot and start watching fd in it, returns the id. */
+static int watch_add(struct evloop *l, enum ev_kind kind, int fd, unsigned events, ev_fn fn, void *arg) {
+    if (loop_ready(l) == -1) return -1;
+    size_t slot = 0;
+    while (slot < l->n && l->w[slot].kind != EV_FREE) slot++;
+    if (slot == l->n) {
+        if (l->n == EV_MAX_WATCHES) {
+            errno = ENOSPC;
+            return -1;
+        }
+        if (l->n == l->cap) {
+            size_t cap = l->cap ? l->cap * 2 : 16;
+            struct ev_watch *grown = realloc(l->w, cap * sizeof(*grown));
+            if (!grown) return -1;
+            l->w = grown;
+            l->cap = cap;
+        }
+        l->w[l->n++] = (struct ev_watch){.kind = EV_FREE};
+    }
+    struct ev_watch *w = &l->w[slot];
+    w->fd = fd;
+    w->events = events;
+    w->fn = fn;
+    w->arg = arg;
+    w->armed = false;
+
+    if (l->backend == EV_URING) {
+        if (uring_arm(l, slot) == -1) return -1;
+    } else {
+        struct epoll_event ev = {.events = to_poll(events), .data.u64 = watch_tag(l, slot)};
+        if (epoll_ctl(l->fd, EPOLL_CTL_ADD, fd, &ev) == -1) return -1;
+    }
+    w->kind = kind;
+    l->live++;
+    return (int)((unsigned)(w->gen & 0x7fff) << 16 | (unsigned)slot);
+}
+
+/** Watch a descriptor until the watch is deleted. */
+int ev_add(struct evloop *l, int fd, unsigned events, ev_fn fn, void *arg) {
+    return watch_add(l, EV_FD, fd, events, fn, arg);
+}
+
+/** Call fn once after a delay. */
+int ev_timer(struct evloop *l, const struct timespec *after, ev_fn fn, void *arg) {
+    struct itimerspec its = {.it_value = *after};
+    // A zero it_value would disarm the timer instead of firing it now
+    if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) its.it_value.tv_nsec = 1;
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (tfd == -1) return -1;
+    int id;
+    if (timerfd_settime(tfd, 0, &its, NULL) == -1 || (id = watch_add(l, EV_TIMER, tfd, EV_READ, fn, arg)) == -1) {
+        int err = errno;
+        close(tfd);
+        errno = err;
+        return -1;
+    }
+    return id;
+}
+
+/** Call fn once when a child exits. */
+int ev_child(struct evloop *l, pid_t pid, ev_fn fn, void *arg) {
+    int pfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    if (pfd == -1) return -1;
+    int id = watch_add(l, EV_CHILD, pfd, EV_READ, fn, arg);
+    if (id == -1) {
+        int err = errno;
+        close(pfd);
+        errno = err;
+    }
+    return id;
+}
+
+/** Free a slot, the descriptors the loop opened for it are closed. */
+static void watch_free(struct evloop *l, size_t slot) {
+    struct ev_watch *w = &l->w[slot];
+    if (l->backend == EV_URING) {
+        if (w->armed) uring_disarm(l, slot);
+    } else {
+        epoll_ctl(l->fd, EPOLL_CTL_DEL, w->fd, NULL);
+    }
+    if (w->kind == EV_TIMER || w->kind == EV_CHILD) close(w->fd);
+    w->kind = EV_FREE;
+    w->armed = false;
+    w->gen++;
+    l->live--;
+}
+
+/** Delete a watch. */
+void ev_del(struct evloop *l, int id) {
+    if (id < 0 || l->backend == EV_NONE || l->owner != getpid()) return;
+    size_t slot = (unsigned)id & 0xffff;
+    if (slot >= l->n || l->w[slot].kind == EV_FREE) return;
+    if ((l->w[slot].gen & 0x7fff) != (unsigned)id >> 16) return;
+    watch_free(l, slot);
+}
+
+/** Call the watch a completion or an epoll event is for, false if stale. */
+static bool dispatch(struct evloop *l, uint64_t tag, unsigned events) {
+    size_t slot = (uint32_t)tag;
+    if (tag == EV_UD_IGNORE || slot >= l->n) return false;
+    if (l->w[slot].kind == EV_FREE || l->w[slot].gen != (uint16_t)(tag >> 32)) return false;
+
+    // The callback may add watches and move the array, work on a copy
+    struct ev_watch w = l->w[slot];
+    l->w[slot].armed = false;
+    switch (w.kind) {
+    case EV_TIMER: {
+        uint64_t ticks;
+        (void)!read(w.fd, &ticks, sizeof(ticks));
+        watch_free(l, slot);
+        w.fn(l, -1, events, w.arg);
+        break;
+    }
+    case EV_CHILD:
+        // Free the slot only afterwards, the pidfd stays good for waitid
+        w.fn(l, w.fd, events, w.arg);
+        if (l->w[slot].kind != EV_FREE && l->w[slot].gen == w.gen) watch_free(l, slot);
+        break;
+    default:
+        w.fn(l, w.fd, events, w.arg);
+        if (l->backend == EV_URING && l->w[slot].kind != EV_FREE && l->w[slot].gen == w.gen &&
+            !l->w[slot].armed)
+            uring_arm(l, slot);
+        break;
+    }
+    return true;
+}
+
+/** Wait on the ring and hand out the completions. */
+static int uring_run(struct evloop *l, int timeout_ms) {
+    struct ev_uring *r = &l->ring;
+    if (uring_flush(l) == -1) return -1;
+
+    unsigned head = *r->cq_head;
+    if (head == atomic_load_explicit((_Atomic unsigned *)r->cq_tail, memory_order_acquire)) {
+        struct __kernel_timespec ts = {.tv_sec = timeout_ms / 1000, .tv_nsec = timeout_ms % 1000 * 1000000L};
+        struct io_uring_getevents_arg arg = {.ts = timeout_ms >= 0 ? (uint64_t)(uintptr_t)&ts : 0};
+        if (uring_enter(l->fd, 0, 1, IORING_ENTER_GETEVENTS, &arg) == -1) {
+            if (errno == ETIME) return 0;
+            return -1;
+        }
+    }
+
+    int called = 0;
+    for (;;) {
+        head = *r->cq_head;
+        if (head == atomic_load_explicit((_Atomic unsigned *)r->cq_tail, memory_order_acquire)) break;
+        struct io_uring_cqe cqe = r->cqes[head & *r->cq_mask];
+        // Consume it before the callback, which may run the loop again
+        atomic_store_explicit((_Atomic unsigned *)r->cq_head, head + 1, memory_order_release);
+        if (cqe.res == -ECANCELED) continue;
+        called += dispatch(l, cqe.user_data, cqe.res < 0 ? EV_ERR : from_poll((unsigned)cqe.res));
+    }
+    return called;
+}
+
+/** Wait on the epoll set and hand out the events. */
+static int epoll_run(struct evloop *l, int timeout_ms) {
+    struct epoll_event evs[64];
+    int k = epoll_wait(l->fd, evs, 64, timeout_ms);
+    if (k == -1) return -1;
+    // An earlier callback may have deleted a later one, the tags catch that
+    int called = 0;
+    for (int i = 0; i < k; i++) called += dispatch(l, evs[i].data.u64, from_poll(evs[i].events));
+    return called;
+}
+
+/** Wait for watches to become ready and call them. */
+int ev_run_once(struct evloop *l, int timeout_ms) {
+    if (loop_ready(l) == -1) return -1;
+    return l->backend == EV_URING ? uring_run(l, timeout_ms) : epoll_run(l, timeout_ms);
+}
+
+/** ev_wait's watch, notes that the descriptor is ready. */
+static void wait_ready(struct evloop *l, int fd, unsigned events, void *arg) {
+    (void)l;
+    (void)fd;
+    *(unsigned *)arg = events;
+}
+
+/** Wait for one descriptor while the other watches keep being served. */
+int ev_wait(struct evloop *l, int fd, unsigned events, int timeout_ms) {
+    unsigned got = 0;
+    int id = ev_add(l, fd, events, wait_ready, &got);
+    if (id == -1) return -1;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec += timeout_ms / 1000;
+    end.tv_nsec += timeout_ms % 1000 * 1000000L;
+    int left = timeout_ms, rc = 0;
+    while (!got) {
+        if (ev_run_once(l, left) == -1 && errno != EINTR) {
+            rc = -1;
+            break;
+        }
+        if (timeout_ms < 0 || got) continue;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int64_t ms = (int64_t)(end.tv_sec - now.tv_sec) * 1000 + (end.tv_nsec - now.tv_nsec) / 1000000;
+        if (ms <= 0) break;
+        left = (int)ms;
+    }
+    int err = errno;
+    ev_del(l, id);
+    errno = err;
+    return got ? 1 : rc;
+}
+
+/** Close the loop and the descriptors it owns. */
+void ev_destroy(struct evloop *l) {
+    loop_drop(l);
+}
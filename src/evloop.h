@@ -0,0 +1,198 @@
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// Submission queue entries asked for, completions get twice as many
+#define EV_RING_ENTRIES 64
+// Most watches a loop can hold, ids keep the slot in their low 16 bits
+#define EV_MAX_WATCHES 65536
+
+// Readiness asked for and reported
+#define EV_READ 0x1
+#define EV_WRITE 0x2
+// Reported only, whether asked for or not
+#define EV_HUP 0x4
+#define EV_ERR 0x8
+
+/* Kernel interface a loop runs on, EV_NONE until it is first used */
+enum ev_backend {
+    EV_NONE,
+    EV_URING,
+    EV_EPOLL,
+};
+
+struct evloop;
+
+/**
+ * @brief Called when a watch is ready. It may add and delete watches,
+ * itself included, and run the loop again.
+ *
+ * @param l The loop
+ * @param fd The watched descriptor, the pidfd for children and -1 for
+ * timers
+ * @param events EV_READ, EV_WRITE, EV_HUP and EV_ERR as they apply
+ * @param arg As given when the watch was added
+ */
+typedef void (*ev_fn)(struct evloop *l, int fd, unsigned events, void *arg);
+
+/* What a watch slot holds */
+enum ev_kind {
+    EV_FREE,
+    EV_FD,          // a descriptor of the caller, watched until deleted
+    EV_TIMER,       // a timerfd of the loop, fires once
+    EV_CHILD,       // a pidfd of the loop, fires once when the child exits
+};
+
+struct ev_watch {
+    int fd;
+    unsigned events;    // EV_READ and EV_WRITE
+    enum ev_kind kind;
+    uint16_t gen;       // bumped when the slot is freed, stale completions are dropped
+    bool armed;         // io_uring: a poll is in flight for this generation
+    ev_fn fn;
+    void *arg;
+};
+
+/* The rings shared with the kernel */
+struct ev_uring {
+    void *sq_ring;
+    size_t sq_size;
+    void *cq_ring;      // the same mapping as sq_ring on kernels with a single mmap
+    size_t cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_entries, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned queued;    // entries written but not handed to the kernel yet
+};
+
+/**
+ * @brief The shell's event core. Descriptors, timers and children are all
+ * watched as descriptors, through one-shot polls on an io_uring that are
+ * armed again after every completion, or through an epoll set when the
+ * kernel has no io_uring or it is disabled. Both behave level-triggered.
+ * A loop belongs to the process that set it up; a forked copy drops what
+ * it inherited and sets up its own on first use. All zero is a valid
+ * state.
+ */
+struct evloop {
+    enum ev_backend backend;
+    pid_t owner;
+    int fd;                 // the ring or the epoll set
+    struct ev_watch *w;     // slots, the first n have been used
+    size_t n;
+    size_t cap;
+    size_t live;            // slots in use
+    struct ev_uring ring;
+};
+
+/**
+ * @brief Set up a loop. With EV_NONE io_uring is tried first, unless
+ * $LAB_EVLOOP is "epoll", and epoll is used when it cannot be had. The
+ * other functions call this with EV_NONE when the loop is not set up.
+ *
+ * @param l The loop
+ * @param want The backend, or EV_NONE to pick one
+ * @return 0 on success, -1 with errno set
+ */
+int ev_init(struct evloop *l, enum ev_backend want);
+
+/**
+ * @brief Name of the backend in use, "none" before the loop is set up
+ */
+const char *ev_backend_name(const struct evloop *l);
+
+/**
+ * @brief Watch a descriptor until the watch is deleted. Delete it before
+ * closing the descriptor. A descriptor can have only one watch at a time,
+ * epoll keeps one entry per descriptor.
+ *
+ * @param l The loop
+ * @param fd The descriptor
+ * @param events EV_READ, EV_WRITE or both
+ * @param fn Called every time fd is ready
+ * @param arg Handed to fn
+ * @return The id of the watch, -1 with errno set
+ */
+int ev_add(struct evloop *l, int fd, unsigned events, ev_fn fn, void *arg);
+
+/**
+ * @brief Call fn once after a delay, measured on CLOCK_MONOTONIC
+ *
+ * @param l The loop
+ * @param after The delay, zero fires on the next run
+ * @param fn Called once, the watch is gone by then
+ * @param arg Handed to fn
+ * @return The id of the watch, -1 with errno set
+ */
+int ev_timer(struct evloop *l, const struct timespec *after, ev_fn fn, void *arg);
+
+/**
+ * @brief Call fn once when a child exits, through a pidfd. The child is
+ * not reaped; fn gets the pidfd and is expected to wait for the child.
+ *
+ * @param l The loop
+ * @param pid The child
+ * @param fn Called once, the pidfd is closed when it returns
+ * @param arg Handed to fn
+ * @return The id of the watch, -1 with errno set, ENOSYS on kernels
+ * without pidfds
+ */
+int ev_child(struct evloop *l, pid_t pid, ev_fn fn, void *arg);
+
+/**
+ * @brief Delete a watch. Ids of one-shot watches that fired and ids that
+ * were deleted already are ignored.
+ *
+ * @param l The loop
+ * @param id The watch
+ */
+void ev_del(struct evloop *l, int id);
+
+/**
+ * @brief Wait for watches to become ready and call them
+ *
+ * @param l The loop
+ * @param timeout_ms Longest wait, -1 for no limit
+ * @return Number of callbacks called, 0 on timeout, -1 with errno set,
+ * EINTR when a signal came in
+ */
+int ev_run_once(struct evloop *l, int timeout_ms);
+
+/**
+ * @brief Wait for one descriptor while the other watches keep being served
+ *
+ * @param l The loop
+ * @param fd The descriptor
+ * @param events EV_READ, EV_WRITE or both
+ * @param timeout_ms Longest wait, -1 for no limit
+ * @return 1 when fd is ready, 0 on timeout, -1 with errno set
+ */
+int ev_wait(struct evloop *l, int fd, unsigned events, int timeout_ms);
+
+/**
+ * @brief Close the loop and the descriptors it owns. Callbacks of the
+ * watches left are never called.
+ *
+ * @param l The loop
+ */
+void ev_destroy(struct evloop *l);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // EVLOOP_H
@@ -0,0 +1,297 @@
+/**
+ * expand.c
+ * Word expansion at run time. The parser already split every word into
+ * literal, parameter and substitution parts, here the parameters are
+ * looked up, substitutions are run, unquoted results are split into
+ * fields, fields with wildcards are expanded into pathnames and case
+ * patterns get their quoted characters escaped.
+ */
+
+#define _GNU_SOURCE
+#include "expand.h"
+#include "capture.h"
+#include "glob.h"
+#include "lab.h"
+#include "vars.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum expand_mode {
+    EXP_FIELDS,     // command arguments, unquoted results are split
+    EXP_STRING,     // a single string, nothing is split
+    EXP_PATTERN,    // a single string with quoted glob characters escaped
+};
+
+/*
+ * Fields produced so far and the one being built. While fields are wanted
+ * the current one is kept as a pattern: quoted wildcards and every
+ * backslash are escaped, and the escapes are taken out again unless the
+ * field turns out to be a pattern that matches something.
+ */
+struct fields {
+    struct shell *sh;
+    struct arena *a;
+    int mode;
+    char *buf;      // the current field
+    size_t len;
+    size_t cap;
+    bool open;      // the current field exists, even if it is still empty
+    bool glob;      // the current field has an unquoted wildcard
+    bool escaped;   // the current field has escapes to remove
+    struct glob_result matches;
+    char **v;       // finished fields
+    size_t n;
+    size_t vcap;
+    bool failed;
+};
+
+/** Append bytes to the current field. */
+static void f_append(struct fields *f, const char *s, size_t len) {
+    if (f->len + len + 1 > f->cap) {
+        size_t cap = f->cap ? f->cap : 64;
+        while (cap < f->len + len + 1) cap *= 2;
+        char *grown = realloc(f->buf, cap);
+        if (!grown) {
+            f->failed = true;
+            return;
+        }
+        f->buf = grown;
+        f->cap = cap;
+    }
+    memcpy(f->buf + f->len, s, len);
+    f->len += len;
+}
+
+/** Add a finished field. */
+static void f_push(struct fields *f, char *s) {
+    if (f->n == f->vcap) {
+        size_t cap = f->vcap ? f->vcap * 2 : 16;
+        char **grown = realloc(f->v, cap * sizeof(*grown));
+        if (!grown) {
+            f->failed = true;
+            return;
+        }
+        f->v = grown;
+        f->vcap = cap;
+    }
+    f->v[f->n++] = s;
+}
+
+/** The current field as a string in the arena. */
+static char *f_string(struct fields *f) {
+    char *s = arena_alloc(f->a, f->len + 1);
+    if (!s) {
+        f->failed = true;
+        return NULL;
+    }
+    if (f->len) memcpy(s, f->buf, f->len);
+    s[f->len] = '\0';
+    return s;
+}
+
+/** Append text to a field that may become a pattern, escaping what must stay literal. */
+static void f_text(struct fields *f, const char *s, size_t len, bool quoted) {
+    if (f->mode != EXP_FIELDS) {
+        f_append(f, s, len);
+        return;
+    }
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = s[i];
+        if (c == '\\' || (quoted && (c == '*' || c == '?' || c == '[' || c == ']'))) {
+            f_append(f, s + start, i - start);
+            f_append(f, "\\", 1);
+            start = i;
+            f->escaped = true;
+        } else if (c == '*' || c == '?' || c == '[') {
+            f->glob = true;
+        }
+    }
+    f_append(f, s + start, len - start);
+}
+
+/** Replace the current field by the pathnames it matches, false if there are none. */
+static bool f_glob(struct fields *f) {
+    f_append(f, "", 1);
+    f->len--;
+    if (f->failed || !glob_magic(f->buf, f->len)) return false;
+    struct shell *sh = f->sh;
+    f->matches.n = 0;
+    if (glob_expand(sh->options[SH_OPT_GLOBCACHE] ? &sh->glob : NULL, f->a, f->buf, &f->matches) == -1) {
+        f->failed = true;
+        return false;
+    }
+    for (size_t i = 0; i < f->matches.n; i++) f_push(f, f->matches.v[i]);
+    return f->matches.n > 0;
+}
+
+/** Take the escapes out of the current field. */
+static void f_unescape(struct fields *f) {
+    size_t j = 0;
+    for (size_t i = 0; i < f->len; i++) {
+        if (f->buf[i] == '\\' && i + 1 < f->len) i++;
+        f->buf[j++] = f->buf[i];
+    }
+    f->len = j;
+}
+
+/** Finish the current field if there is one. */
+static void f_end(struct fields *f) {
+    if (!f->open) return;
+    if (!f->glob || !f_glob(f)) {
+        // An unmatched pattern stays as it was written
+        if (f->escaped) f_unescape(f);
+        char *s = f_string(f);
+        if (s) f_push(f, s);
+    }
+    f->len = 0;
+    f->open = false;
+    f->glob = false;
+    f->escaped = false;
+}
+
+/** Add expanded text, splitting it when it is unquoted and fields are wanted. */
+static void f_add(struct fields *f, const char *s, size_t len, bool quoted) {
+    if (f->mode == EXP_PATTERN && quoted) {
+        for (size_t i = 0; i < len; i++) {
+            if (strchr("*?[]\\", s[i])) f_append(f, "\\", 1);
+            f_append(f, &s[i], 1);
+        }
+        f->open = true;
+        return;
+    }
+    if (quoted || f->mode != EXP_FIELDS) {
+        f_text(f, s, len, quoted);
+        f->open = true;
+        return;
+    }
+    size_t start = 0;
+    for (size_t i = 0; i <= len; i++) {
+        if (i < len && s[i] != ' ' && s[i] != '\t' && s[i] != '\n') continue;
+        if (i > start) {
+            f_text(f, s + start, i - start, false);
+            f->open = true;
+        }
+        if (i < len) f_end(f);
+        start = i + 1;
+    }
+}
+
+/** $@ and $*, one field per parameter unless they are joined into one string. */
+static void f_positional(struct shell *sh, struct fields *f, bool quoted, bool at) {
+    const struct vm_state *vm = &sh->vm;
+    bool separate = f->mode == EXP_FIELDS && (at || !quoted);
+    for (size_t i = 0; i < vm->argc; i++) {
+        if (i && separate) f_end(f);
+        else if (i) f_add(f, " ", 1, quoted);
+        f_add(f, vm->argv[i], strlen(vm->argv[i]), quoted);
+    }
+}
+
+/** Value of the parameter in part p, numbers are formatted into num. */
+static const char *param_value(struct shell *sh, const struct word_part *p, char *num, size_t size) {
+    const struct vm_state *vm = &sh->vm;
+    if (p->len == 1) {
+        switch (p->text[0]) {
+        case '?': snprintf(num, size, "%d", sh->last_status); return num;
+        case '#': snprintf(num, size, "%zu", vm->argc); return num;
+        case '$': snprintf(num, size, "%d", (int)(vm->pid ? vm->pid : getpid())); return num;
+        case '0': return vm->arg0 ? vm->arg0 : "lab";
+        }
+    }
+    if (p->text[0] >= '0' && p->text[0] <= '9') {
+        size_t k = 0;
+        for (size_t i = 0; i < p->len && k <= vm->argc; i++) k = k * 10 + (size_t)(p->text[i] - '0');
+        return k >= 1 && k <= vm->argc ? vm->argv[k - 1] : NULL;
+    }
+    char name[p->len + 1];
+    memcpy(name, p->text, p->len);
+    name[p->len] = '\0';
+    return var_get(sh, name);
+}
+
+/** Run every part of w through f. */
+static void expand_into(struct shell *sh, struct fields *f, const struct word *w) {
+    char num[32];
+    // The empty text of the quotes in "$@" must not make a field when
+    // there are no parameters
+    bool at = false;
+    for (size_t i = 0; i < w->nparts; i++)
+        at |= w->parts[i].kind == WP_PARAM && w->parts[i].quoted && w->parts[i].text[0] == '@';
+    for (size_t i = 0; i < w->nparts; i++) {
+        const struct word_part *p = &w->parts[i];
+        if (p->kind == WP_TEXT) {
+            if (!at || p->len) f_add(f, p->text, p->len, p->quoted);
+        } else if (p->kind == WP_SUBST) {
+            struct capture c;
+            if (vm_substitute(sh, p->cmd, &c) == -1) {
+                f->failed = true;
+                continue;
+            }
+            f_add(f, c.data, c.len, p->quoted);
+            capture_release(&sh->capture, &c);
+        } else if (p->len == 1 && (p->text[0] == '@' || p->text[0] == '*')) {
+            f_positional(sh, f, p->quoted, p->text[0] == '@');
+        } else {
+            const char *v = param_value(sh, p, num, sizeof(num));
+            f_add(f, v ? v : "", v ? strlen(v) : 0, p->quoted);
+        }
+    }
+}
+
+/** Expand w as a single string in mode. */
+static char *expand_one(struct shell *sh, struct arena *a, const struct word *w, int mode) {
+    struct fields f = {.sh = sh, .a = a, .mode = mode};
+    expand_into(sh, &f, w);
+    char *s = f.failed ? NULL : f_string(&f);
+    free(f.buf);
+    return s;
+}
+
+/** Expand the words of a command. */
+char **expand_words(struct shell *sh, struct arena *a, const struct word *w, size_t n, size_t *argc) {
+    bool lit = true;
+    for (size_t i = 0; i < n && lit; i++) lit = w[i].lit && !w[i].glob;
+    if (lit) {
+        // The common case, nothing to substitute and nothing to copy
+        char **argv = arena_alloc(a, (n + 1) * sizeof(*argv));
+        if (!argv) return NULL;
+        for (size_t i = 0; i < n; i++) argv[i] = (char *)w[i].lit;
+        argv[n] = NULL;
+        *argc = n;
+        return argv;
+    }
+
+    struct fields f = {.sh = sh, .a = a, .mode = EXP_FIELDS};
+    for (size_t i = 0; i < n; i++) {
+        if (w[i].lit && !w[i].glob) {
+            f_push(&f, (char *)w[i].lit);
+        } else {
+            expand_into(sh, &f, &w[i]);
+            f_end(&f);
+        }
+    }
+    char **argv = f.failed ? NULL : arena_alloc(a, (f.n + 1) * sizeof(*argv));
+    if (argv) {
+        if (f.n) memcpy(argv, f.v, f.n * sizeof(*argv));
+        argv[f.n] = NULL;
+        *argc = f.n;
+    }
+    free(f.buf);
+    free(f.v);
+    free(f.matches.v);
+    return argv;
+}
+
+/** Expand a word into one string. */
+char *expand_word(struct shell *sh, struct arena *a, const struct word *w) {
+    return w->lit ? (char *)w->lit : expand_one(sh, a, w, EXP_STRING);
+}
+
+/** Expand a case pattern. */
+char *expand_pattern(struct shell *sh, struct arena *a, const struct word *w) {
+    bool quoted = false;
+    for (size_t i = 0; i < w->nparts && !quoted; i++) quoted = w->parts[i].quoted;
+    return w->lit && !quoted ? (char *)w->lit : expand_one(sh, a, w, EXP_PATTERN);
+}
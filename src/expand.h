@@ -0,0 +1,50 @@
+#ifndef EXPAND_H
+#define EXPAND_H
+
+#include <stddef.h>
+#include "arena.h"
+#include "parse.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct shell;
+
+/**
+ * @brief Expand words into the arguments of a command. Parameters are
+ * substituted, unquoted results are split into fields on spaces, tabs and
+ * newlines and unquoted words that expand to nothing disappear. "$@"
+ * gives one field per positional parameter. Words without expansions are
+ * used as they are, without copying.
+ *
+ * @param sh The shell
+ * @param a Arena for the argument array and the new strings
+ * @param w The words
+ * @param n Number of words
+ * @param argc Receives the number of fields
+ * @return NULL terminated array, or NULL if memory ran out
+ */
+char **expand_words(struct shell *sh, struct arena *a, const struct word *w, size_t n, size_t *argc);
+
+/**
+ * @brief Expand one word without field splitting, for redirection
+ * targets and the word of a case command.
+ *
+ * @return The string, or NULL if memory ran out
+ */
+char *expand_word(struct shell *sh, struct arena *a, const struct word *w);
+
+/**
+ * @brief Expand a case pattern. Quoted characters are escaped with a
+ * backslash so fnmatch takes them literally.
+ *
+ * @return The pattern, or NULL if memory ran out
+ */
+char *expand_pattern(struct shell *sh, struct arena *a, const struct word *w);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // EXPAND_H
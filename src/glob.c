@@ -0,0 +1,536 @@
+/**
+ * glob.c
+ * Pathname expansion. The pattern is split at slashes and every component
+ * compiled once: components without wildcards are used as they are and
+ * never read a directory, the others keep their literal prefix and suffix
+ * so most names are turned away with a memcmp. Directories are read with
+ * getdents64 straight into a buffer that is matched in place, and with a
+ * cache the same buffer is kept and used again while the directory's
+ * mtime shows it has not changed.
+ */
+
+#define _GNU_SOURCE
+#include "glob.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Bytes asked for per getdents64 call
+#define GLOB_CHUNK (256u << 10)
+
+/* The record getdents64 fills in, glibc has no header for it */
+struct dirent64_raw {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* One component of a compiled pattern */
+struct glob_seg {
+    const char *pat;    // the component, escapes kept
+    const char *rest;   // pat after the literal prefix
+    char *lit;          // literal prefix unescaped, the whole name when not magic
+    size_t litlen;
+    char *suffix;       // literal text after the last *, unescaped
+    size_t suflen;
+    bool magic;
+    bool globstar;      // exactly **
+    bool star_only;     // rest is one * then the suffix, prefix and suffix decide
+    bool dot;           // starts with a literal dot, so hidden names may match
+};
+
+/* State of one expansion */
+struct glob_walk {
+    struct glob_cache *cache;
+    struct arena *a;
+    struct glob_result *r;
+    struct glob_seg *segs;
+    size_t nsegs;
+    bool dirs_only;     // the pattern ends in a slash
+    bool failed;
+    time_t now;         // CLOCK_MONOTONIC seconds
+    time_t wall;        // CLOCK_REALTIME seconds
+    char path[PATH_MAX];
+    size_t plen;
+};
+
+typedef void (*entry_fn)(struct glob_walk *w, size_t seg, const char *name, unsigned char type);
+
+/** The ] closing the bracket expression at p, NULL if it is not closed. */
+static const char *bracket_end(const char *p) {
+    const char *q = p + 1;
+    if (*q == '!' || *q == '^') q++;
+    if (*q == ']') q++;
+    for (; *q && *q != ']'; q++) {
+        if (q[0] == '[' && q[1] == ':') {
+            const char *c = strstr(q + 2, ":]");
+            if (!c) return NULL;
+            q = c + 1;
+        } else if (*q == '\\' && q[1]) {
+            q++;
+        }
+    }
+    return *q ? q : NULL;
+}
+
+/** True if c belongs to the class named by name[0 .. len). */
+static bool in_class(const char *name, size_t len, int c) {
+    static const struct {
+        const char *name;
+        int (*fn)(int);
+    } classes[] = {
+        {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank}, {"cntrl", iscntrl},
+        {"digit", isdigit}, {"graph", isgraph}, {"lower", islower}, {"print", isprint},
+        {"punct", ispunct}, {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+    };
+    for (size_t i = 0; i < sizeof(classes) / sizeof(classes[0]); i++) {
+        if (strlen(classes[i].name) == len && memcmp(classes[i].name, name, len) == 0)
+            return classes[i].fn(c);
+    }
+    return false;
+}
+
+/** Match c against the bracket expression from p to its closing ] at end. */
+static bool bracket_match(const char *p, const char *end, unsigned char c) {
+    const char *q = p + 1;
+    bool negate = *q == '!' || *q == '^';
+    if (negate) q++;
+    bool found = false;
+    for (bool first = true; q < end; first = false) {
+        if (q[0] == '[' && q[1] == ':') {
+            const char *name = q + 2, *close = strstr(name, ":]");
+            found |= in_class(name, (size_t)(close - name), c);
+            q = close + 2;
+            continue;
+        }
+        if (*q == ']' && !first) break;
+        if (*q == '\\' && q + 1 < end) q++;
+        unsigned char lo = (unsigned char)*q++, hi = lo;
+        if (q[0] == '-' && q + 1 < end) {
+            q++;
+            if (*q == '\\' && q + 1 < end) q++;
+            hi = (unsigned char)*q++;
+        }
+        found |= c >= lo && c <= hi;
+    }
+    return found != negate;
+}
+
+/** Match name against a pattern component. */
+bool glob_match(const char *pat, const char *name) {
+    const char *p = pat, *s = name;
+    const char *star = NULL, *resume = NULL;   // where to retry after the last *
+    while (*s) {
+        if (*p == '*') {
+            while (*p == '*') p++;
+            if (!*p) return true;
+            star = p;
+            resume = s;
+            continue;
+        }
+        bool ok;
+        const char *next = p + 1;
+        if (*p == '?') {
+            ok = true;
+        } else if (*p == '[' && (next = bracket_end(p))) {
+            ok = bracket_match(p, next, (unsigned char)*s);
+            next++;
+        } else {
+            if (*p == '\\' && p[1]) p++;
+            ok = *p && *p == *s;
+            next = p + 1;
+        }
+        if (ok) {
+            p = next;
+            s++;
+        } else if (star) {
+            p = star;
+            s = ++resume;
+        } else {
+            return false;
+        }
+    }
+    while (*p == '*') p++;
+    return !*p;
+}
+
+/** Test whether s has a wildcard. */
+bool glob_magic(const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == '\\') i++;
+        else if (s[i] == '*' || s[i] == '?') return true;
+        else if (s[i] == '[' && memchr(s + i, ']', len - i) && bracket_end(s + i)) return true;
+    }
+    return false;
+}
+
+/** Copy the literal run at the start of p, unescaped, into out. Returns where it stops. */
+static const char *literal_run(const char *p, char *out, size_t *len) {
+    size_t n = 0;
+    for (;;) {
+        if (*p == '*' || *p == '?' || (*p == '[' && bracket_end(p)) || !*p) break;
+        if (*p == '\\' && p[1]) p++;
+        out[n++] = *p++;
+    }
+    out[n] = '\0';
+    *len = n;
+    return p;
+}
+
+/** Fill in seg for the component pat, which is modified in place. */
+static bool compile_seg(struct glob_seg *seg, char *pat) {
+    size_t len = strlen(pat);
+    *seg = (struct glob_seg){.pat = pat};
+    seg->globstar = strcmp(pat, "**") == 0;
+    seg->magic = glob_magic(pat, len);
+    seg->dot = pat[0] == '.' || (pat[0] == '\\' && pat[1] == '.');
+    seg->lit = malloc(len + 1);
+    seg->suffix = malloc(len + 1);
+    if (!seg->lit || !seg->suffix) return false;
+    seg->rest = literal_run(pat, seg->lit, &seg->litlen);
+    seg->suffix[0] = '\0';
+
+    // A tail of plain text after the last * must end every match
+    const char *last = NULL;
+    for (const char *p = seg->rest; *p; p++) {
+        if (*p == '\\' && p[1]) p++;
+        else if (*p == '*') last = p;
+        else if (*p == '[' && bracket_end(p)) p = bracket_end(p);
+    }
+    if (last) {
+        const char *end = literal_run(last + 1, seg->suffix, &seg->suflen);
+        if (*end) seg->suflen = 0, seg->suffix[0] = '\0';
+        else seg->star_only = last == seg->rest;
+    }
+    return true;
+}
+
+/** True if name passes the compiled component seg. */
+static bool seg_match(const struct glob_seg *seg, const char *name) {
+    size_t len = strlen(name);
+    if (len < seg->litlen + seg->suflen) return false;
+    if (seg->litlen && memcmp(name, seg->lit, seg->litlen) != 0) return false;
+    if (seg->suflen && memcmp(name + len - seg->suflen, seg->suffix, seg->suflen) != 0) return false;
+    return seg->star_only || glob_match(seg->rest, name + seg->litlen);
+}
+
+/** Add the current path, plus extra, to the matches. */
+static void add_match(struct glob_walk *w, const char *extra) {
+    struct glob_result *r = w->r;
+    if (r->n == r->cap) {
+        size_t cap = r->cap ? r->cap * 2 : 16;
+        char **grown = realloc(r->v, cap * sizeof(*grown));
+        if (!grown) {
+            w->failed = true;
+            return;
+        }
+        r->v = grown;
+        r->cap = cap;
+    }
+    size_t xlen = strlen(extra);
+    char *s = arena_alloc(w->a, w->plen + xlen + 1);
+    if (!s) {
+        w->failed = true;
+        return;
+    }
+    memcpy(s, w->path, w->plen);
+    memcpy(s + w->plen, extra, xlen + 1);
+    r->v[r->n++] = s;
+}
+
+/** Append name to the path, false if it would not fit. */
+static bool path_push(struct glob_walk *w, const char *name, const char *sep) {
+    size_t len = strlen(name), slen = strlen(sep);
+    if (w->plen + len + slen >= sizeof(w->path)) return false;
+    memcpy(w->path + w->plen, name, len);
+    memcpy(w->path + w->plen + len, sep, slen + 1);
+    w->plen += len + slen;
+    return true;
+}
+
+/** Cut the path back to len bytes. */
+static void path_pop(struct glob_walk *w, size_t len) {
+    w->plen = len;
+    w->path[len] = '\0';
+}
+
+/** True if the current path with name added is a directory, following links. */
+static bool is_dir(struct glob_walk *w, const char *name, unsigned char type) {
+    if (type == DT_DIR) return true;
+    if (type != DT_LNK && type != DT_UNKNOWN) return false;
+    size_t at = w->plen;
+    struct stat st;
+    bool dir = path_push(w, name, "") && stat(w->path, &st) == 0 && S_ISDIR(st.st_mode);
+    path_pop(w, at);
+    return dir;
+}
+
+/** Call fn for every entry in the getdents64 records buf[0 .. len). */
+static void visit(struct glob_walk *w, size_t seg, const char *buf, size_t len, entry_fn fn) {
+    for (size_t off = 0; off < len && !w->failed;) {
+        const struct dirent64_raw *d = (const void *)(buf + off);
+        off += d->d_reclen;
+        const char *name = d->d_name;
+        if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) continue;
+        fn(w, seg, name, d->d_type);
+    }
+}
+
+/** Drop a cached listing. */
+static void cache_drop(struct glob_cache *c, struct glob_dir *d) {
+    c->bytes -= d->len;
+    free(d->buf);
+    memset(d, 0, sizeof(*d));
+}
+
+/** The cached listing of the directory st describes, if it is still good. */
+static struct glob_dir *cache_lookup(struct glob_walk *w, const struct stat *st) {
+    struct glob_cache *c = w->cache;
+    for (size_t i = 0; i < GLOB_CACHE_DIRS; i++) {
+        struct glob_dir *d = &c->dirs[i];
+        if (!d->buf || d->dev != st->st_dev || d->ino != st->st_ino) continue;
+        if (d->mtime.tv_sec == st->st_mtim.tv_sec && d->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+            d->ctime.tv_sec == st->st_ctim.tv_sec && d->ctime.tv_nsec == st->st_ctim.tv_nsec &&
+            w->now - d->read_at < GLOB_CACHE_TTL) {
+            d->used = ++c->tick;
+            return d;
+        }
+        if (!d->busy) cache_drop(c, d);
+        return NULL;
+    }
+    return NULL;
+}
+
+/** The least recently used listing that is not being read, NULL if there is none. */
+static struct glob_dir *cache_lru(struct glob_cache *c) {
+    struct glob_dir *v = NULL;
+    for (size_t i = 0; i < GLOB_CACHE_DIRS; i++) {
+        struct glob_dir *d = &c->dirs[i];
+        if (d->buf && !d->busy && (!v || d->used < v->used)) v = d;
+    }
+    return v;
+}
+
+/**
+ * Keep a listing that was just read. A directory changed within the last
+ * second is left out: an entry added in the same timestamp tick would not
+ * move the mtime, so the listing could be stale without anything showing it.
+ */
+static struct glob_dir *cache_store(struct glob_walk *w, const struct stat *st, char *buf, size_t len) {
+    struct glob_cache *c = w->cache;
+    if (len > GLOB_CACHE_BYTES / 2) return NULL;
+    if (st->st_mtim.tv_sec >= w->wall - 1) return NULL;
+
+    struct glob_dir *d = NULL, *v;
+    for (size_t i = 0; i < GLOB_CACHE_DIRS && !d; i++)
+        if (!c->dirs[i].buf) d = &c->dirs[i];
+    if (!d && (d = cache_lru(c))) cache_drop(c, d);
+    while (d && c->bytes + len > GLOB_CACHE_BYTES && (v = cache_lru(c))) cache_drop(c, v);
+    if (!d || c->bytes + len > GLOB_CACHE_BYTES) return NULL;
+    *d = (struct glob_dir){
+        .dev = st->st_dev, .ino = st->st_ino, .mtime = st->st_mtim, .ctime = st->st_ctim,
+        .read_at = w->now, .used = ++c->tick, .buf = buf, .len = len,
+    };
+    c->bytes += len;
+    return d;
+}
+
+/** Read every record of the directory fd into one buffer. */
+static char *read_all(int fd, size_t *out) {
+    size_t cap = GLOB_CHUNK, len = 0;
+    char *buf = malloc(cap);
+    while (buf) {
+        if (cap - len < GLOB_CHUNK / 2) {
+            char *grown = realloc(buf, cap * 2);
+            if (!grown) break;
+            buf = grown;
+            cap *= 2;
+        }
+        long n = syscall(SYS_getdents64, fd, buf + len, cap - len);
+        if (n <= 0) {
+            if (n == 0) {
+                *out = len;
+                return buf;
+            }
+            break;
+        }
+        len += (size_t)n;
+    }
+    free(buf);
+    return NULL;
+}
+
+/** Call fn for every entry of the directory at the current path. */
+static void scan_dir(struct glob_walk *w, size_t seg, entry_fn fn) {
+    int fd = open(w->plen ? w->path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return;
+    struct stat st;
+    if (!w->cache || fstat(fd, &st) == -1) {
+        // Nothing is kept, so one chunk at a time is matched in place
+        char *buf = malloc(GLOB_CHUNK);
+        long n;
+        while (buf && !w->failed && (n = syscall(SYS_getdents64, fd, buf, GLOB_CHUNK)) > 0)
+            visit(w, seg, buf, (size_t)n, fn);
+        w->failed |= !buf;
+        free(buf);
+        close(fd);
+        return;
+    }
+
+    struct glob_dir *d = cache_lookup(w, &st);
+    if (!d) {
+        size_t len;
+        char *buf = read_all(fd, &len);
+        close(fd);
+        if (!buf) {
+            w->failed |= errno == ENOMEM;
+            return;
+        }
+        if (!(d = cache_store(w, &st, buf, len))) {
+            visit(w, seg, buf, len, fn);
+            free(buf);
+            return;
+        }
+    } else {
+        close(fd);
+    }
+    // Deeper directories must not evict the listing being walked
+    d->busy++;
+    visit(w, seg, d->buf, d->len, fn);
+    d->busy--;
+}
+
+static void walk(struct glob_walk *w, size_t seg);
+
+/** An entry of a directory matched against component seg. */
+static void on_entry(struct glob_walk *w, size_t seg, const char *name, unsigned char type) {
+    const struct glob_seg *g = &w->segs[seg];
+    if (name[0] == '.' && !g->dot) return;
+    if (!seg_match(g, name)) return;
+    bool last = seg + 1 == w->nsegs;
+    if (last && !w->dirs_only) {
+        add_match(w, name);
+    } else if (is_dir(w, name, type)) {
+        size_t at = w->plen;
+        if (path_push(w, name, "/")) {
+            if (last) add_match(w, "");
+            else walk(w, seg + 1);
+        }
+        path_pop(w, at);
+    }
+}
+
+/** An entry below a ** component. */
+static void on_globstar(struct glob_walk *w, size_t seg, const char *name, unsigned char type) {
+    if (name[0] == '.') return;
+    bool last = seg + 1 == w->nsegs;
+    if (last && !w->dirs_only) add_match(w, name);
+    // Links are not followed, a loop would never end
+    if (type == DT_UNKNOWN) {
+        size_t at = w->plen;
+        struct stat st;
+        if (path_push(w, name, "") && lstat(w->path, &st) == 0 && S_ISDIR(st.st_mode)) type = DT_DIR;
+        path_pop(w, at);
+    }
+    if (type != DT_DIR) return;
+    size_t at = w->plen;
+    if (path_push(w, name, "/")) {
+        if (last && w->dirs_only) add_match(w, "");
+        if (last) scan_dir(w, seg, on_globstar);
+        else walk(w, seg);
+    }
+    path_pop(w, at);
+}
+
+/** Match the components from seg on below the current path. */
+static void walk(struct glob_walk *w, size_t seg) {
+    const struct glob_seg *g = &w->segs[seg];
+    bool last = seg + 1 == w->nsegs;
+    if (g->globstar) {
+        // ** stands for no directory at all too
+        if (!last) walk(w, seg + 1);
+        else if (seg > 0) add_match(w, "");
+        scan_dir(w, seg, on_globstar);
+        return;
+    }
+    if (g->magic) {
+        scan_dir(w, seg, on_entry);
+        return;
+    }
+
+    // A plain name is only looked up, the directory is not read
+    size_t at = w->plen;
+    if (path_push(w, g->lit, last ? (w->dirs_only ? "/" : "") : "/")) {
+        struct stat st;
+        if (!last) walk(w, seg + 1);
+        else if (w->dirs_only ? stat(w->path, &st) == 0 && S_ISDIR(st.st_mode) : lstat(w->path, &st) == 0)
+            add_match(w, "");
+    }
+    path_pop(w, at);
+}
+
+/** Byte order, as in the C locale. */
+static int cmp_paths(const void *x, const void *y) {
+    return strcmp(*(char *const *)x, *(char *const *)y);
+}
+
+/** Expand a pathname pattern. */
+int glob_expand(struct glob_cache *cache, struct arena *a, const char *pat, struct glob_result *r) {
+    size_t len = strlen(pat), first = r->n;
+    char *copy = malloc(len + 1);
+    struct glob_seg *segs = malloc((len / 2 + 1) * sizeof(*segs));
+    struct glob_walk *w = malloc(sizeof(*w));
+    size_t nsegs = 0;
+    bool ok = copy && segs && w;
+    if (ok) {
+        memcpy(copy, pat, len + 1);
+        *w = (struct glob_walk){.cache = cache, .a = a, .r = r, .segs = segs};
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        w->now = ts.tv_sec;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        w->wall = ts.tv_sec;
+        if (copy[0] == '/') path_push(w, "", "/");
+
+        // Split at slashes, runs of them count as one
+        char *p = copy;
+        while (ok && *p) {
+            while (*p == '/') p++;
+            if (!*p) break;
+            char *start = p;
+            while (*p && *p != '/') p += *p == '\\' && p[1] ? 2 : 1;
+            if (*p) *p++ = '\0';
+            ok = compile_seg(&segs[nsegs++], start);
+        }
+        w->nsegs = nsegs;
+        w->dirs_only = len && pat[len - 1] == '/';
+    }
+    if (ok && nsegs) {
+        walk(w, 0);
+        ok = !w->failed;
+        if (r->n - first > 1) qsort(r->v + first, r->n - first, sizeof(*r->v), cmp_paths);
+    }
+    for (size_t i = 0; i < nsegs; i++) {
+        free(segs[i].lit);
+        free(segs[i].suffix);
+    }
+    free(segs);
+    free(copy);
+    free(w);
+    return ok ? 0 : -1;
+}
+
+/** Free every cached listing. */
+void glob_cache_destroy(struct glob_cache *cache) {
+    for (size_t i = 0; i < GLOB_CACHE_DIRS; i++) free(cache->dirs[i].buf);
+    memset(cache, 0, sizeof(*cache));
+}
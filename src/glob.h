@@ -0,0 +1,101 @@
+#ifndef GLOB_H
+#define GLOB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include "arena.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Directories the cache remembers at most
+#define GLOB_CACHE_DIRS 16
+// Bytes of directory entries the cache holds at most
+#define GLOB_CACHE_BYTES (64u << 20)
+// Seconds a cached listing is used before the directory is read again
+#define GLOB_CACHE_TTL 10
+
+/* The raw getdents64 records of one directory */
+struct glob_dir {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;  // of the directory when it was read
+    struct timespec ctime;
+    time_t read_at;         // CLOCK_MONOTONIC seconds
+    uint64_t used;          // tick of the last lookup, for eviction
+    unsigned busy;          // walks reading it right now, it must stay
+    char *buf;
+    size_t len;
+};
+
+/**
+ * @brief Listings of recently globbed directories. A listing is used
+ * again while the directory's mtime and ctime are unchanged, so a script
+ * that globs the same large directory over and over reads it once. All
+ * zero is a valid empty cache.
+ */
+struct glob_cache {
+    struct glob_dir dirs[GLOB_CACHE_DIRS];
+    size_t bytes;
+    uint64_t tick;
+};
+
+/* Matches of one pattern */
+struct glob_result {
+    char **v;       // sorted, the strings live in the arena
+    size_t n;
+    size_t cap;
+};
+
+/**
+ * @brief Test whether s contains an unescaped *, ? or a [ with a closing ],
+ * the characters that make a word a pattern
+ *
+ * @param s The pattern, quoted characters escaped with a backslash
+ * @param len Length of s
+ * @return true if s is a pattern
+ */
+bool glob_magic(const char *s, size_t len);
+
+/**
+ * @brief Match a name against one pattern component. A leading dot of
+ * the name is not special here.
+ *
+ * @param pat The pattern, quoted characters escaped with a backslash
+ * @param name The name
+ * @return true on a match
+ */
+bool glob_match(const char *pat, const char *name);
+
+/**
+ * @brief Expand a pathname pattern and append the matches to r.
+ * Directories are read with getdents64 and every component is compiled
+ * once, its literal prefix and suffix turn most names away before the
+ * matcher runs. A component of just **
+ * matches any number of directories. Names starting with a dot only
+ * match a pattern that starts with one, . and .. never match.
+ *
+ * @param cache Listings to use and fill, NULL to read every directory
+ * @param a Arena for the matched paths
+ * @param pat The pattern, quoted characters escaped with a backslash
+ * @param r Gets the matches appended in byte order, free r->v when done
+ * @return 0, also when nothing matched, or -1 if memory ran out
+ */
+int glob_expand(struct glob_cache *cache, struct arena *a, const char *pat, struct glob_result *r);
+
+/**
+ * @brief Free every cached listing
+ *
+ * @param cache The cache
+ */
+void glob_cache_destroy(struct glob_cache *cache);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // GLOB_H
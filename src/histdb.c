@@ -0,0 +1,538 @@
+/**
+ * histdb.c
+ * Append-only history file with a slot index and a trigram index beside
+ * it. See histdb.h for the layout.
+ */
+
+#define _GNU_SOURCE
+#include "histdb.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// First bytes of every history file and of its two index files
+static const char hist_file_magic[8] = {'L', 'A', 'B', 'H', 'I', 'S', 'T', 1};
+static const char hist_idx_magic[8] = {'L', 'A', 'B', 'H', 'I', 'D', 'X', 1};
+static const char hist_tri_magic[8] = {'L', 'A', 'B', 'H', 'T', 'R', 'I', 1};
+// Start of every record, not valid UTF-8 so command text cannot fake it
+#define HIST_REC_MAGIC 0xfe4c48f1u
+// Records are padded so headers stay aligned
+#define HIST_ALIGN 8
+// Trigram buckets, each with its own posting list
+#define HIST_BUCKET_BITS 14
+#define HIST_BUCKETS (1u << HIST_BUCKET_BITS)
+// Bytes of the log read at once, also the step index files grow by
+#define HIST_WINDOW (64 * 1024)
+
+struct hist_rec {
+    uint32_t magic;
+    uint32_t len;           // command bytes
+    int64_t start_us;
+    uint64_t duration_us;
+    int32_t status;
+    uint16_t cwd_len;
+    uint16_t flags;         // unused, 0
+};
+
+/* Start of path.idx, the slots follow */
+struct idx_head {
+    char magic[8];
+    uint64_t log_end;       // log offset up to which records are indexed
+    uint64_t n;             // slots
+};
+
+/* One posting: entry has a trigram of the bucket */
+struct tri_node {
+    uint32_t entry;
+    uint32_t next;          // older posting of the same bucket, 0 for none
+};
+
+/* Start of path.tri, the postings follow */
+struct tri_head {
+    char magic[8];
+    uint64_t n;             // entries indexed, equal to the slots when whole
+    uint64_t nodes;
+    struct hist_bucket buckets[HIST_BUCKETS];
+};
+
+/** Bytes a record with these lengths takes up in the file. */
+static size_t rec_size(size_t cwd_len, size_t len) {
+    size_t n = sizeof(struct hist_rec) + cwd_len + len;
+    return (n + HIST_ALIGN - 1) & ~(size_t)(HIST_ALIGN - 1);
+}
+
+/** Offset the next record goes to in a log of size bytes. */
+static uint64_t log_align(uint64_t size) {
+    return (size + HIST_ALIGN - 1) & ~(uint64_t)(HIST_ALIGN - 1);
+}
+
+/** Prefix key of a command, its first four bytes. */
+static uint32_t prefix_key(const char *s, size_t len) {
+    uint32_t key = 0;
+    memcpy(&key, s, len < 4 ? len : 4);
+    return key;
+}
+
+/** Bucket of the trigram at s, the first of a command has its own. */
+static uint32_t trigram_bucket(const char *s, bool first) {
+    const unsigned char *u = (const unsigned char *)s;
+    uint32_t t = u[0] | (uint32_t)u[1] << 8 | (uint32_t)u[2] << 16 | (uint32_t)first << 24;
+    return (t * 0x9e3779b1u) >> (32 - HIST_BUCKET_BITS);
+}
+
+static struct idx_head *idx_head(const struct histdb *db) {
+    return (struct idx_head *)db->idx.map;
+}
+
+static struct hist_slot *idx_slots(const struct histdb *db) {
+    return (struct hist_slot *)(db->idx.map + sizeof(struct idx_head));
+}
+
+static struct tri_head *tri_head(const struct histdb *db) {
+    return (struct tri_head *)db->tri.map;
+}
+
+static struct tri_node *tri_nodes(const struct histdb *db) {
+    return (struct tri_node *)(db->tri.map + sizeof(struct tri_head));
+}
+
+/** Map all of an index file, following it when it grew or shrank. */
+static int map_sync(struct hist_map *m) {
+    struct stat st;
+    if (fstat(m->fd, &st) == -1) return -1;
+    size_t size = (size_t)st.st_size;
+    if (size == m->size) return 0;
+    if (!size) {
+        munmap(m->map, m->size);
+        m->map = NULL;
+        m->size = 0;
+        return 0;
+    }
+    void *p = m->map ? mremap(m->map, m->size, size, MREMAP_MAYMOVE)
+                     : mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+    if (p == MAP_FAILED) return -1;
+    m->map = p;
+    m->size = size;
+    return 0;
+}
+
+/** Make room for size bytes in an index file. */
+static int map_reserve(struct hist_map *m, size_t size) {
+    if (size <= m->size) return 0;
+    size_t grown = m->size + m->size / 2;
+    if (grown < size) grown = size;
+    grown = (grown + HIST_WINDOW - 1) & ~(size_t)(HIST_WINDOW - 1);
+    if (ftruncate(m->fd, (off_t)grown) == -1) return -1;
+    return map_sync(m);
+}
+
+/** Unmap and close an index file, keeping its path. */
+static void map_close(struct hist_map *m) {
+    if (m->map) munmap(m->map, m->size);
+    if (m->fd != -1) close(m->fd);
+    m->fd = -1;
+    m->map = NULL;
+    m->size = 0;
+}
+
+/** True when m is open on the file that is at its path now. */
+static bool map_current(const struct hist_map *m) {
+    struct stat st;
+    return m->fd != -1 && stat(m->path, &st) == 0 && st.st_ino == m->ino;
+}
+
+/** Open the index file at m's path, or the one another shell put there. */
+static int map_open(struct hist_map *m) {
+    if (map_current(m)) return map_sync(m);
+    map_close(m);
+    struct stat st;
+    m->fd = open(m->path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (m->fd == -1 || fstat(m->fd, &st) == -1) return -1;
+    m->ino = st.st_ino;
+    return map_sync(m);
+}
+
+/** Put an empty index file of size bytes in place of m's. */
+static int map_reset(struct hist_map *m, size_t size, const char *magic) {
+    char *tmp;
+    if (asprintf(&tmp, "%s.new", m->path) == -1) return -1;
+    map_close(m);
+    // Written aside and renamed over, shells reading the old one keep it
+    struct stat st;
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1 || ftruncate(fd, (off_t)size) == -1 || pwrite(fd, magic, 8, 0) != 8 ||
+        fstat(fd, &st) == -1 || rename(tmp, m->path) == -1) {
+        int err = errno;
+        if (fd != -1) {
+            close(fd);
+            unlink(tmp);
+        }
+        free(tmp);
+        errno = err;
+        return -1;
+    }
+    free(tmp);
+    m->fd = fd;
+    m->ino = st.st_ino;
+    return map_sync(m);
+}
+
+/**
+ * Bytes [off, off + size) of the log through the read window, NULL when
+ * the log is shorter. Going backwards the window ends at what is asked
+ * for, otherwise it starts there.
+ */
+static const char *log_read(struct histdb *db, uint64_t off, size_t size) {
+    if (off >= db->buf_off && off + size <= db->buf_off + db->buf_len)
+        return db->buf + (off - db->buf_off);
+    uint64_t start = off;
+    if (off < db->buf_off) start = off + size > HIST_WINDOW ? off + size - HIST_WINDOW : 0;
+    start &= ~(uint64_t)(HIST_ALIGN - 1);
+    size_t want = off + size - start;
+    if (want < HIST_WINDOW) want = HIST_WINDOW;
+    if (want > db->buf_cap) {
+        char *buf = realloc(db->buf, want);
+        if (!buf) return NULL;
+        db->buf = buf;
+        db->buf_cap = want;
+    }
+    ssize_t got = pread(db->fd, db->buf, want, (off_t)start);
+    db->buf_off = start;
+    db->buf_len = got > 0 ? (size_t)got : 0;
+    if (off + size > start + db->buf_len) return NULL;
+    return db->buf + (off - start);
+}
+
+/** Header at off if a whole valid record starts there, else NULL. */
+static const struct hist_rec *log_rec(struct histdb *db, uint64_t off, uint64_t size) {
+    if (off + sizeof(struct hist_rec) > size) return NULL;
+    const struct hist_rec *r = (const void *)log_read(db, off, sizeof(*r));
+    if (!r || r->magic != HIST_REC_MAGIC) return NULL;
+    uint64_t end = off + rec_size(r->cwd_len, r->len);
+    if (end > size) return NULL;
+    // A record cut short by a crash runs into the next one, whose magic
+    // then shows up somewhere other than right behind it
+    bool next = end + sizeof(uint32_t) <= size;
+    const char *p = log_read(db, off, end - off + (next ? sizeof(uint32_t) : 0));
+    if (!p || (next && *(const uint32_t *)(p + (end - off)) != HIST_REC_MAGIC)) return NULL;
+    return (const void *)p;
+}
+
+/** True when the index files are whole, agree and match a log of size bytes. */
+static bool index_valid(struct histdb *db, uint64_t size) {
+    if (db->idx.size < sizeof(struct idx_head) || db->tri.size < sizeof(struct tri_head))
+        return false;
+    const struct idx_head *ih = idx_head(db);
+    const struct tri_head *th = tri_head(db);
+    if (memcmp(ih->magic, hist_idx_magic, 8) != 0 || memcmp(th->magic, hist_tri_magic, 8) != 0)
+        return false;
+    if (ih->n != th->n || ih->log_end < sizeof(hist_file_magic) || ih->log_end > log_align(size))
+        return false;
+    if (ih->n > (db->idx.size - sizeof(*ih)) / sizeof(struct hist_slot) ||
+        th->nodes > (db->tri.size - sizeof(*th)) / sizeof(struct tri_node))
+        return false;
+    // The newest record must still be where the index has it, or the log
+    // was rewritten behind its back
+    if (!ih->n) return true;
+    const struct hist_slot *s = &idx_slots(db)[ih->n - 1];
+    struct hist_rec r;
+    return pread(db->fd, &r, sizeof(r), (off_t)s->off) == (ssize_t)sizeof(r) &&
+           r.magic == HIST_REC_MAGIC && r.len == s->len &&
+           s->off + rec_size(r.cwd_len, r.len) <= ih->log_end;
+}
+
+/** Start both index files over, empty. */
+static int index_reset(struct histdb *db) {
+    db->buf_len = 0;
+    if (map_reset(&db->tri, sizeof(struct tri_head), hist_tri_magic) == -1 ||
+        map_reset(&db->idx, sizeof(struct idx_head), hist_idx_magic) == -1)
+        return -1;
+    idx_head(db)->log_end = sizeof(hist_file_magic);
+    return 0;
+}
+
+/** Add entry to the posting list of bucket b unless it is there already. */
+static void post(struct histdb *db, uint64_t *seen, uint32_t b, uint32_t entry) {
+    if (seen[b / 64] >> (b % 64) & 1) return;
+    seen[b / 64] |= UINT64_C(1) << (b % 64);
+    struct tri_head *th = tri_head(db);
+    tri_nodes(db)[th->nodes] = (struct tri_node){entry, th->buckets[b].node};
+    th->buckets[b].node = (uint32_t)++th->nodes;
+    th->buckets[b].count++;
+}
+
+/** Index the record at off as the next entry. */
+static int index_add(struct histdb *db, uint64_t off, const struct hist_rec *r) {
+    const char *line = (const char *)(r + 1) + r->cwd_len;
+    // At most one posting per trigram plus the first one
+    size_t most = r->len >= 3 ? r->len - 1 : 0;
+    if (most > HIST_BUCKETS) most = HIST_BUCKETS;
+    uint64_t n = idx_head(db)->n, nodes = tri_head(db)->nodes;
+    if (n >= UINT32_MAX || nodes + most >= UINT32_MAX) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+    if (map_reserve(&db->tri, sizeof(struct tri_head) + (nodes + most) * sizeof(struct tri_node)) == -1 ||
+        map_reserve(&db->idx, sizeof(struct idx_head) + (n + 1) * sizeof(struct hist_slot)) == -1)
+        return -1;
+
+    // Postings first and the slot last, a crash in between leaves the
+    // counts of the two files apart and gets them rebuilt
+    uint64_t seen[HIST_BUCKETS / 64] = {0};
+    if (r->len >= 3) post(db, seen, trigram_bucket(line, true), (uint32_t)n);
+    for (size_t i = 0; i + 3 <= r->len; i++) post(db, seen, trigram_bucket(line + i, false), (uint32_t)n);
+    tri_head(db)->n = n + 1;
+    idx_slots(db)[n] = (struct hist_slot){off, r->len, prefix_key(line, r->len)};
+    idx_head(db)->n = n + 1;
+    return 0;
+}
+
+/** Index what the log has beyond the index. The caller holds LOCK_EX. */
+static int index_sync(struct histdb *db) {
+    struct stat st;
+    if (fstat(db->fd, &st) == -1 || map_open(&db->idx) == -1 || map_open(&db->tri) == -1)
+        return -1;
+    uint64_t size = (uint64_t)st.st_size;
+    if (!index_valid(db, size) && index_reset(db) == -1) return -1;
+
+    uint64_t off = idx_head(db)->log_end;
+    while (off + sizeof(struct hist_rec) <= size) {
+        const struct hist_rec *r = log_rec(db, off, size);
+        if (!r) {
+            // Garbage from a crash, skip ahead to the next record
+            off += HIST_ALIGN;
+            continue;
+        }
+        if (index_add(db, off, r) == -1) return -1;
+        off += rec_size(r->cwd_len, r->len);
+        idx_head(db)->log_end = off;
+    }
+    // Whatever is left is a torn record, the next append goes after it
+    idx_head(db)->log_end = log_align(size);
+    return 0;
+}
+
+/** True when the index files are the ones in place and cover all of the log. */
+static bool index_current(struct histdb *db, uint64_t size) {
+    if (!map_current(&db->idx) || !map_current(&db->tri) || map_sync(&db->idx) == -1 ||
+        map_sync(&db->tri) == -1)
+        return false;
+    if (db->idx.size < sizeof(struct idx_head) || db->tri.size < sizeof(struct tri_head))
+        return false;
+    return idx_head(db)->log_end == log_align(size) && idx_head(db)->n == tri_head(db)->n;
+}
+
+/** Take the counts and list heads searches go by. The caller holds a lock. */
+static void snapshot(struct histdb *db) {
+    const struct tri_head *th = tri_head(db);
+    db->n = (size_t)idx_head(db)->n;
+    db->nodes = (size_t)th->nodes;
+    memcpy(db->heads, th->buckets, sizeof(th->buckets));
+}
+
+/** Index whatever was appended since the last refresh and snapshot it. */
+int histdb_refresh(struct histdb *db) {
+    if (db->fd == -1) {
+        errno = EBADF;
+        return -1;
+    }
+    struct stat st;
+    bool current = false;
+    flock(db->fd, LOCK_SH);
+    if (fstat(db->fd, &st) == 0 && (current = index_current(db, (uint64_t)st.st_size)))
+        snapshot(db);
+    flock(db->fd, LOCK_UN);
+    if (current) return 0;
+
+    // Behind the log, or the log shrank; only a writer may fix that
+    flock(db->fd, LOCK_EX);
+    int rc = index_sync(db);
+    if (rc == 0) snapshot(db);
+    flock(db->fd, LOCK_UN);
+    return rc;
+}
+
+/** Open the history file, writing the file header if it is new. */
+int histdb_open(struct histdb *db, const char *path) {
+    memset(db, 0, sizeof(*db));
+    db->idx.fd = db->tri.fd = -1;
+    db->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (db->fd == -1) return -1;
+    if (asprintf(&db->idx.path, "%s.idx", path) == -1) db->idx.path = NULL;
+    if (asprintf(&db->tri.path, "%s.tri", path) == -1) db->tri.path = NULL;
+    db->heads = malloc(HIST_BUCKETS * sizeof(*db->heads));
+
+    struct stat st;
+    char magic[sizeof(hist_file_magic)];
+    int rc = db->idx.path && db->tri.path && db->heads ? 0 : -1;
+    flock(db->fd, LOCK_EX);
+    if (rc == 0) rc = fstat(db->fd, &st);
+    if (rc == 0 && st.st_size == 0) {
+        if (write(db->fd, hist_file_magic, sizeof(magic)) != (ssize_t)sizeof(magic)) rc = -1;
+    } else if (rc == 0) {
+        if (pread(db->fd, magic, sizeof(magic), 0) != (ssize_t)sizeof(magic) ||
+            memcmp(magic, hist_file_magic, sizeof(magic)) != 0) {
+            errno = EINVAL;
+            rc = -1;
+        }
+    }
+    if (rc == 0) rc = index_sync(db);
+    if (rc == 0) snapshot(db);
+    flock(db->fd, LOCK_UN);
+
+    if (rc == -1) {
+        int err = errno;
+        histdb_close(db);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/** Release the mappings, the buffers and the descriptors. */
+void histdb_close(struct histdb *db) {
+    // A store that was never opened has no paths and no index descriptors
+    if (db->idx.path) map_close(&db->idx);
+    if (db->tri.path) map_close(&db->tri);
+    if (db->fd != -1) close(db->fd);
+    free(db->idx.path);
+    free(db->tri.path);
+    free(db->heads);
+    free(db->buf);
+    memset(db, 0, sizeof(*db));
+    db->fd = db->idx.fd = db->tri.fd = -1;
+}
+
+/** Write one record with a single write and index it, all under the file lock. */
+int histdb_append(struct histdb *db, const char *line, const char *cwd, int64_t start_us,
+                  uint64_t duration_us, int status) {
+    if (db->fd == -1) {
+        errno = EBADF;
+        return -1;
+    }
+    size_t len = strlen(line);
+    size_t cwd_len = cwd ? strlen(cwd) : 0;
+    if (cwd_len > UINT16_MAX) cwd_len = 0;
+    if (len > UINT32_MAX - 2 * sizeof(struct hist_rec) - UINT16_MAX) {
+        errno = E2BIG;
+        return -1;
+    }
+
+    // Room for padding in front, in case a crash left the file unaligned
+    size_t size = rec_size(cwd_len, len);
+    char *buf = calloc(1, size + HIST_ALIGN);
+    if (!buf) return -1;
+
+    int rc = 0;
+    struct stat st;
+    flock(db->fd, LOCK_EX);
+    if (fstat(db->fd, &st) == -1) {
+        rc = -1;
+    } else {
+        size_t pad = (size_t)-st.st_size & (HIST_ALIGN - 1);
+        struct hist_rec *r = (struct hist_rec *)(buf + pad);
+        *r = (struct hist_rec){
+            .magic = HIST_REC_MAGIC, .len = (uint32_t)len, .start_us = start_us,
+            .duration_us = duration_us, .status = status, .cwd_len = (uint16_t)cwd_len,
+        };
+        memcpy(r + 1, cwd, cwd_len);
+        memcpy((char *)(r + 1) + cwd_len, line, len);
+
+        ssize_t n = write(db->fd, buf, pad + size);
+        if (n != (ssize_t)(pad + size)) {
+            // Leave no partial record behind for the readers
+            if (n > 0 && ftruncate(db->fd, st.st_size) == -1) n = -1;
+            if (n >= 0) errno = ENOSPC;
+            rc = -1;
+        }
+    }
+    if (rc == 0) rc = index_sync(db);
+    if (rc == 0) snapshot(db);
+    flock(db->fd, LOCK_UN);
+    free(buf);
+    return rc;
+}
+
+/** Fill e with entry i, read from the log. */
+int histdb_get(struct histdb *db, size_t i, struct hist_entry *e) {
+    if (i >= db->n) return -1;
+    const struct hist_slot *s = &idx_slots(db)[i];
+    const struct hist_rec *r = (const void *)log_read(db, s->off, sizeof(*r));
+    // A log truncated since the last refresh no longer has it
+    if (!r || r->magic != HIST_REC_MAGIC || r->len != s->len) return -1;
+    r = (const void *)log_read(db, s->off, sizeof(*r) + r->cwd_len + s->len);
+    if (!r) return -1;
+    e->cwd = (const char *)(r + 1);
+    e->cwd_len = r->cwd_len;
+    e->line = e->cwd + r->cwd_len;
+    e->len = r->len;
+    e->start_us = r->start_us;
+    e->duration_us = r->duration_us;
+    e->status = r->status;
+    return 0;
+}
+
+/** Pick the shortest posting list the pattern's trigrams are in. */
+void histdb_search_start(const struct histdb *db, struct hist_search *s, const char *pat,
+                         bool prefix, size_t before) {
+    size_t plen = strlen(pat);
+    *s = (struct hist_search){
+        .pat = pat, .plen = plen, .prefix = prefix, .key = prefix_key(pat, plen),
+        .mask = plen >= 4 ? UINT32_MAX : (uint32_t)((1ull << (plen * 8)) - 1),
+        .before = before < db->n ? before : db->n,
+    };
+    if (plen < 3 || !s->before) return;
+    uint32_t best = trigram_bucket(pat, prefix);
+    for (size_t i = 1; !prefix && i + 3 <= plen; i++) {
+        uint32_t b = trigram_bucket(pat + i, false);
+        if (db->heads[b].count < db->heads[best].count) best = b;
+    }
+    s->indexed = true;
+    s->node = db->heads[best].node;
+}
+
+/** True when entry i matches the search. */
+static bool search_match(struct histdb *db, const struct hist_search *s, size_t i) {
+    // Gone when a refresh since the start found the log rewritten
+    if (i >= db->n) return false;
+    const struct hist_slot *slot = &idx_slots(db)[i];
+    if (slot->len < s->plen) return false;
+    if (s->prefix && (slot->key & s->mask) != s->key) return false;
+    // The key is the whole of a prefix this short
+    if (s->prefix && s->plen <= 4) return true;
+    struct hist_entry e;
+    if (histdb_get(db, i, &e) == -1) return false;
+    return s->prefix ? memcmp(e.line, s->pat, s->plen) == 0 : memmem(e.line, e.len, s->pat, s->plen) != NULL;
+}
+
+/** Walk the posting list, or every entry for patterns without a trigram. */
+ssize_t histdb_search_next(struct histdb *db, struct hist_search *s) {
+    while (s->before > 0) {
+        size_t i = s->before - 1;
+        if (s->indexed) {
+            // Lists only point back, anything else is a damaged file
+            if (!s->node || s->node > db->nodes) return -1;
+            const struct tri_node *nd = &tri_nodes(db)[s->node - 1];
+            s->node = nd->next < s->node ? nd->next : 0;
+            // Entries indexed twice after a crash come up twice
+            if (nd->entry > i) continue;
+            i = nd->entry;
+        }
+        s->before = i;
+        if (search_match(db, s, i)) return (ssize_t)i;
+    }
+    return -1;
+}
+
+/** Newest match below before. */
+ssize_t histdb_search(struct histdb *db, const char *pat, bool prefix, size_t before) {
+    struct hist_search s;
+    histdb_search_start(db, &s, pat, prefix, before);
+    return histdb_search_next(db, &s);
+}
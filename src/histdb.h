@@ -0,0 +1,178 @@
+#ifndef HISTDB_H
+#define HISTDB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief One command as stored in the history file. line and cwd are not
+ * NUL terminated and stay valid until the next call on the store.
+ */
+struct hist_entry {
+    const char *line;
+    size_t len;
+    const char *cwd;
+    size_t cwd_len;
+    int64_t start_us;       // microseconds since the epoch
+    uint64_t duration_us;
+    int status;             // shell exit status of the command
+};
+
+/* Entry of the slot index, where one record sits in the log */
+struct hist_slot {
+    uint64_t off;   // file offset of the record header
+    uint32_t len;   // length of the command
+    uint32_t key;   // first four bytes of the command, zero padded
+};
+
+/* Posting list of one trigram bucket */
+struct hist_bucket {
+    uint32_t node;  // newest posting, 1 based, 0 for an empty list
+    uint32_t count; // postings in the list
+};
+
+/* An index file beside the log, mapped read-write */
+struct hist_map {
+    char *path;
+    int fd;         // -1 when not open
+    char *map;
+    size_t size;    // bytes mapped
+    ino_t ino;      // to notice another shell replacing the file
+};
+
+/**
+ * @brief Persistent command history. The log is an append-only file of
+ * records, each a fixed header (time, duration, status and lengths)
+ * followed by the cwd and the command. Two index files sit beside it:
+ *
+ * - path.idx has one slot per record, so opening the history and fetching
+ *   entry i never walk the log.
+ * - path.tri has a posting list per trigram bucket, newest entry first.
+ *   A search walks the shortest list among the pattern's trigrams and
+ *   only reads the commands on it. The first three bytes of a command
+ *   also go in a bucket of their own for prefix searches.
+ *
+ * Patterns shorter than three bytes have no trigram. They are matched by
+ * going through the slots, which settle prefixes of up to four bytes
+ * without reading the log.
+ *
+ * Any number of shells can share the files. A record goes out in one
+ * write and is indexed under the same exclusive flock on the log. Readers
+ * take a snapshot of the index under a shared one, so nobody sees half a
+ * record. The index files are rebuilt from the log when they are missing
+ * or do not match it, under new names renamed into place so other shells
+ * keep the ones they have mapped. The log itself is only read with
+ * pread: another program truncating it makes entries go away instead of
+ * faulting the shell, and the next refresh rebuilds the index.
+ */
+struct histdb {
+    int fd;             // the log, -1 when closed
+    struct hist_map idx;
+    struct hist_map tri;
+    size_t n;           // entries as of the last refresh
+    size_t nodes;       // postings as of the last refresh
+    struct hist_bucket *heads;  // posting lists as of the last refresh
+    char *buf;          // window of the log read last
+    size_t buf_cap;
+    size_t buf_len;
+    uint64_t buf_off;
+};
+
+/**
+ * @brief A search in progress, see histdb_search_start()
+ */
+struct hist_search {
+    const char *pat;    // not copied, must outlive the search
+    size_t plen;
+    bool prefix;
+    uint32_t key;       // prefix_key of pat and the bytes of it that count
+    uint32_t mask;
+    size_t before;      // matches still to come are below this entry
+    bool indexed;       // walking a posting list rather than every entry
+    uint32_t node;      // next posting to look at
+};
+
+/**
+ * @brief Open or create a history file and bring its index up to date
+ *
+ * @param db The store
+ * @param path The file
+ * @return 0 on success, -1 with errno set. EINVAL means path is not a
+ * history file.
+ */
+int histdb_open(struct histdb *db, const char *path);
+
+/**
+ * @brief Unmap and close the files
+ */
+void histdb_close(struct histdb *db);
+
+/**
+ * @brief Append a command and index it
+ *
+ * @param db The store
+ * @param line The command
+ * @param cwd Directory it ran in
+ * @param start_us Start time in microseconds since the epoch
+ * @param duration_us How long it ran
+ * @param status Its exit status
+ * @return 0 on success, -1 with errno set
+ */
+int histdb_append(struct histdb *db, const char *line, const char *cwd, int64_t start_us,
+                  uint64_t duration_us, int status);
+
+/**
+ * @brief Pick up records other shells appended since the last call
+ *
+ * @return 0 on success, -1 with errno set
+ */
+int histdb_refresh(struct histdb *db);
+
+/**
+ * @brief Fetch entry i, 0 being the oldest
+ *
+ * @return 0 on success, -1 if i is out of range or the log lost it
+ */
+int histdb_get(struct histdb *db, size_t i, struct hist_entry *e);
+
+/**
+ * @brief Start a search among the entries below before
+ *
+ * @param db The store
+ * @param s Receives the search
+ * @param pat Text to look for, kept by reference
+ * @param prefix Match only at the start of the command instead of anywhere
+ * @param before Only look at entries below this index, db->n for all
+ */
+void histdb_search_start(const struct histdb *db, struct hist_search *s, const char *pat,
+                         bool prefix, size_t before);
+
+/**
+ * @brief Next match of a search, newest first
+ *
+ * @return Index of the match or -1 when there are no more
+ */
+ssize_t histdb_search_next(struct histdb *db, struct hist_search *s);
+
+/**
+ * @brief Find the newest entry older than before that matches pat
+ *
+ * @param db The store
+ * @param pat Text to look for
+ * @param prefix Match only at the start of the command instead of anywhere
+ * @param before Only look at entries below this index, db->n for all
+ * @return Index of the match or -1
+ */
+ssize_t histdb_search(struct histdb *db, const char *pat, bool prefix, size_t before);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // HISTDB_H
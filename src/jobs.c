@@ -0,0 +1,640 @@
+/**
+ * jobs.c
+ * Job table and the job control builtins. The shell keeps SIGCHLD blocked
+ * and learns about children through a signalfd, so reaping never happens
+ * inside a signal handler and the main loop can poll for it.
+ */
+
+#define _GNU_SOURCE
+#include "jobs.h"
+#include "lab.h"
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/** Set up an empty table. */
+void jobs_init(struct job_table *jt) {
+    jt->jobs = NULL;
+    jt->n = 0;
+    jt->cap = 0;
+    jt->current = 0;
+    jt->previous = 0;
+    jt->sigfd = -1;
+    memset(&jt->usage, 0, sizeof(jt->usage));
+}
+
+/** Block SIGCHLD and route it to a signalfd. */
+int jobs_open_signalfd(struct job_table *jt) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) return -1;
+    jt->sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    return jt->sigfd == -1 ? -1 : 0;
+}
+
+/** Free one job. */
+static void job_free(struct job *j) {
+    if (!j) return;
+    free(j->pids);
+    free(j->status);
+    free(j->state);
+    free(j->text);
+    free(j);
+}
+
+/** Free every job and close the signalfd. */
+void jobs_destroy(struct job_table *jt) {
+    for (size_t i = 0; i < jt->n; i++) job_free(jt->jobs[i]);
+    free(jt->jobs);
+    if (jt->sigfd != -1) close(jt->sigfd);
+    jobs_init(jt);
+}
+
+/** Create a job for freshly started processes. */
+struct job *job_new(pid_t pgid, const pid_t *pids, const int *status, size_t n, const char *text) {
+    struct job *j = calloc(1, sizeof(*j));
+    if (!j) return NULL;
+    j->pids = malloc(n * sizeof(*j->pids));
+    j->status = malloc(n * sizeof(*j->status));
+    j->state = malloc(n * sizeof(*j->state));
+    j->text = strdup(text ? text : "");
+    if (!j->pids || !j->status || !j->state || !j->text) {
+        job_free(j);
+        return NULL;
+    }
+    j->pgid = pgid;
+    j->n = n;
+    for (size_t i = 0; i < n; i++) {
+        j->pids[i] = pids[i];
+        j->status[i] = status[i];
+        j->state[i] = pids[i] > 0 ? PROC_RUNNING : PROC_DONE;
+    }
+    j->notified = true;
+    return j;
+}
+
+/** Overall state of a job: running if anything runs, else stopped if anything is stopped. */
+static int job_state(const struct job *j) {
+    int st = PROC_DONE;
+    for (size_t i = 0; i < j->n; i++) {
+        if (j->state[i] == PROC_RUNNING) return PROC_RUNNING;
+        if (j->state[i] == PROC_STOPPED) st = PROC_STOPPED;
+    }
+    return st;
+}
+
+/** Wait status that describes the job, the first stop or else the last stage. */
+static int job_status(const struct job *j) {
+    for (size_t i = 0; i < j->n; i++) {
+        if (j->state[i] == PROC_STOPPED) return j->status[i];
+    }
+    return j->status[j->n - 1];
+}
+
+/** Index of job j in the table or -1. */
+static ssize_t job_index(const struct job_table *jt, const struct job *j) {
+    for (size_t i = 0; i < jt->n; i++) {
+        if (jt->jobs[i] == j) return (ssize_t)i;
+    }
+    return -1;
+}
+
+/** Look a job up by id. */
+static struct job *job_by_id(const struct job_table *jt, int id) {
+    for (size_t i = 0; i < jt->n; i++) {
+        if (jt->jobs[i]->id == id) return jt->jobs[i];
+    }
+    return NULL;
+}
+
+/** Make j the current job, the old current one becomes the previous one. */
+static void job_make_current(struct job_table *jt, const struct job *j) {
+    if (jt->current == j->id) return;
+    jt->previous = jt->current;
+    jt->current = j->id;
+}
+
+/** Put a job in the table with the lowest id above every other job. */
+int job_insert(struct job_table *jt, struct job *j) {
+    if (jt->n == jt->cap) {
+        size_t cap = jt->cap ? jt->cap * 2 : 8;
+        struct job **jobs = realloc(jt->jobs, cap * sizeof(*jobs));
+        if (!jobs) return -1;
+        jt->jobs = jobs;
+        jt->cap = cap;
+    }
+    j->id = jt->n ? jt->jobs[jt->n - 1]->id + 1 : 1;
+    jt->jobs[jt->n++] = j;
+    job_make_current(jt, j);
+    return 0;
+}
+
+/** Take j out of the table and pick new current and previous jobs. */
+static void job_remove(struct job_table *jt, struct job *j) {
+    ssize_t at = job_index(jt, j);
+    if (at == -1) return;
+    memmove(&jt->jobs[at], &jt->jobs[at + 1], (jt->n - (size_t)at - 1) * sizeof(*jt->jobs));
+    jt->n--;
+
+    if (jt->current == j->id) {
+        jt->current = jt->previous;
+        jt->previous = 0;
+    } else if (jt->previous == j->id) {
+        jt->previous = 0;
+    }
+    // Fall back to the newest remaining jobs, like bash does
+    for (size_t i = jt->n; i-- > 0;) {
+        int id = jt->jobs[i]->id;
+        if (!jt->current) jt->current = id;
+        else if (!jt->previous && id != jt->current) jt->previous = id;
+    }
+}
+
+/** Sum up a reaped child's resources for time. */
+void jobs_account(struct job_table *jt, const struct rusage *ru) {
+    struct rusage *u = &jt->usage;
+    timeradd(&u->ru_utime, &ru->ru_utime, &u->ru_utime);
+    timeradd(&u->ru_stime, &ru->ru_stime, &u->ru_stime);
+    if (ru->ru_maxrss > u->ru_maxrss) u->ru_maxrss = ru->ru_maxrss;
+    u->ru_minflt += ru->ru_minflt;
+    u->ru_majflt += ru->ru_majflt;
+    u->ru_nvcsw += ru->ru_nvcsw;
+    u->ru_nivcsw += ru->ru_nivcsw;
+}
+
+/** Record a wait status for pid in whichever job owns it. */
+static void job_update(struct job_table *jt, struct job *fg, pid_t pid, int status,
+                       const struct rusage *ru) {
+    if (WIFEXITED(status) || WIFSIGNALED(status)) jobs_account(jt, ru);
+    struct job *j = NULL;
+    size_t k = 0;
+    for (size_t i = 0; !j && i < jt->n + 1; i++) {
+        struct job *c = i < jt->n ? jt->jobs[i] : fg;
+        if (!c) continue;
+        for (k = 0; k < c->n; k++) {
+            if (c->pids[k] == pid) {
+                j = c;
+                break;
+            }
+        }
+    }
+    if (!j) return;
+
+    int before = job_state(j);
+    if (WIFSTOPPED(status)) {
+        j->state[k] = PROC_STOPPED;
+        j->status[k] = status;
+    } else if (WIFCONTINUED(status)) {
+        j->state[k] = PROC_RUNNING;
+    } else {
+        j->state[k] = PROC_DONE;
+        j->status[k] = status;
+    }
+    int after = job_state(j);
+    if (after != before && after != PROC_RUNNING) {
+        j->notified = false;
+        if (after == PROC_STOPPED && job_index(jt, j) != -1) job_make_current(jt, j);
+    }
+}
+
+/** Block until no process of j is running any more. */
+static void job_block(struct job_table *jt, struct job *j) {
+    while (job_state(j) == PROC_RUNNING) {
+        int status;
+        struct rusage ru;
+        pid_t pid = wait4(-j->pgid, &status, WUNTRACED, &ru);
+        if (pid > 0) {
+            job_update(jt, j, pid, status, &ru);
+        } else if (errno == ECHILD) {
+            // Somebody else reaped them, nothing left to wait for
+            for (size_t i = 0; i < j->n; i++) {
+                if (j->state[i] == PROC_RUNNING) j->state[i] = PROC_DONE;
+            }
+        } else if (errno != EINTR) {
+            perror("wait4");
+            return;
+        }
+    }
+}
+
+/** Collect every child state change that is pending. */
+void jobs_reap(struct shell *sh) {
+    struct job_table *jt = &sh->jobs;
+    if (jt->sigfd != -1) {
+        struct signalfd_siginfo si[16];
+        while (read(jt->sigfd, si, sizeof(si)) > 0)
+            ;
+    }
+    int status;
+    struct rusage ru;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru)) > 0)
+        job_update(jt, NULL, pid, status, &ru);
+}
+
+/** Marker for %+ and %- in listings. */
+static char job_marker(const struct job_table *jt, const struct job *j) {
+    if (j->id == jt->current) return '+';
+    if (j->id == jt->previous) return '-';
+    return ' ';
+}
+
+/** Describe the state of a job the way jobs prints it. */
+static void job_describe(const struct job *j, char *buf, size_t size) {
+    int st = job_state(j);
+    int status = job_status(j);
+    if (st == PROC_RUNNING) snprintf(buf, size, "Running");
+    else if (st == PROC_STOPPED) snprintf(buf, size, "Stopped");
+    else if (WIFSIGNALED(status)) snprintf(buf, size, "%s", strsignal(WTERMSIG(status)));
+    else if (WEXITSTATUS(status)) snprintf(buf, size, "Exit %d", WEXITSTATUS(status));
+    else snprintf(buf, size, "Done");
+}
+
+/** Print one line for j, with every pid when verbose. */
+static void job_print(FILE *out, const struct job_table *jt, const struct job *j, bool verbose) {
+    char desc[64];
+    job_describe(j, desc, sizeof(desc));
+    bool amp = j->background && job_state(j) == PROC_RUNNING;
+    if (verbose) {
+        fprintf(out, "[%d]%c %d %-24s%s%s\n", j->id, job_marker(jt, j), (int)j->pgid, desc,
+                j->text, amp ? " &" : "");
+        for (size_t i = 0; i < j->n; i++) {
+            if (j->pids[i] > 0 && j->pids[i] != j->pgid) fprintf(out, "     %d\n", (int)j->pids[i]);
+        }
+    } else {
+        fprintf(out, "[%d]%c  %-24s%s%s\n", j->id, job_marker(jt, j), desc, j->text, amp ? " &" : "");
+    }
+}
+
+/** Report jobs that finished or stopped and forget the finished ones. */
+void jobs_notify(struct shell *sh) {
+    struct job_table *jt = &sh->jobs;
+    for (size_t i = 0; i < jt->n;) {
+        struct job *j = jt->jobs[i];
+        // Scripts do not talk about their jobs, like bash
+        if (!j->notified && sh->shell_is_interactive) job_print(stderr, jt, j, false);
+        j->notified = true;
+        if (job_state(j) == PROC_DONE) {
+            job_remove(jt, j);
+            job_free(j);
+            continue;
+        }
+        i++;
+    }
+}
+
+/** Count jobs waiting to be reported. */
+size_t jobs_pending(const struct job_table *jt) {
+    size_t n = 0;
+    for (size_t i = 0; i < jt->n; i++) {
+        if (!jt->jobs[i]->notified) n++;
+    }
+    return n;
+}
+
+/** Hand the terminal to j and wait for it to finish or stop. */
+int job_foreground(struct shell *sh, struct job *j, bool cont) {
+    struct job_table *jt = &sh->jobs;
+    j->background = false;
+    if (sh->shell_is_interactive) {
+        tcsetpgrp(sh->shell_terminal, j->pgid);
+        if (cont && j->have_tmodes) tcsetattr(sh->shell_terminal, TCSADRAIN, &j->tmodes);
+    }
+    if (cont) {
+        for (size_t i = 0; i < j->n; i++) {
+            if (j->state[i] == PROC_STOPPED) j->state[i] = PROC_RUNNING;
+        }
+        if (kill(-j->pgid, SIGCONT) == -1) perror("kill (SIGCONT)");
+    }
+
+    job_block(jt, j);
+
+    bool stopped = job_state(j) == PROC_STOPPED;
+    if (sh->shell_is_interactive) {
+        tcsetpgrp(sh->shell_terminal, sh->shell_pgid);
+        if (stopped) j->have_tmodes = tcgetattr(sh->shell_terminal, &j->tmodes) == 0;
+        tcsetattr(sh->shell_terminal, TCSADRAIN, &sh->shell_tmodes);
+    }
+
+    int status = job_status(j);
+    if (stopped) {
+        if (job_index(jt, j) == -1 && job_insert(jt, j) == -1) {
+            // No room to remember it, let it run rather than lose it
+            kill(-j->pgid, SIGCONT);
+            job_free(j);
+            return status;
+        }
+        job_make_current(jt, j);
+        fputc('\n', stderr);
+        job_print(stderr, jt, j, false);
+        j->notified = true;
+    } else {
+        job_remove(jt, j);
+        job_free(j);
+    }
+    return status;
+}
+
+/** Shell exit status for a wait status. */
+static int status_code(int status) {
+    if (WIFSTOPPED(status)) return 128 + WSTOPSIG(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return WEXITSTATUS(status);
+}
+
+/** True when s is a non-empty string of digits. */
+static bool all_digits(const char *s) {
+    if (!*s) return false;
+    for (; *s; s++) {
+        if (!isdigit((unsigned char)*s)) return false;
+    }
+    return true;
+}
+
+/**
+ * Resolve a job spec: %n, %%, %+, %-, %prefix, or NULL for the current
+ * job. Plain digits name a job id when digits_are_ids is set. Errors are
+ * reported with who as prefix.
+ */
+static struct job *job_find(struct job_table *jt, const char *spec, bool digits_are_ids,
+                            const char *who) {
+    struct job *j = NULL;
+    const char *s = spec;
+    if (!s || strcmp(s, "%") == 0 || strcmp(s, "%%") == 0 || strcmp(s, "%+") == 0) {
+        j = job_by_id(jt, jt->current);
+        if (!j) fprintf(stderr, "%s: %s: no such job\n", who, s ? s : "current");
+        return j;
+    }
+    if (strcmp(s, "%-") == 0) {
+        j = job_by_id(jt, jt->previous);
+    } else if (s[0] == '%' && all_digits(s + 1)) {
+        j = job_by_id(jt, atoi(s + 1));
+    } else if (s[0] != '%' && digits_are_ids && all_digits(s)) {
+        j = job_by_id(jt, atoi(s));
+    } else if (s[0] == '%') {
+        size_t len = strlen(s + 1);
+        for (size_t i = 0; i < jt->n; i++) {
+            if (strncmp(jt->jobs[i]->text, s + 1, len) != 0) continue;
+            if (j) {
+                fprintf(stderr, "%s: %s: ambiguous job spec\n", who, s);
+                return NULL;
+            }
+            j = jt->jobs[i];
+        }
+    }
+    if (!j) fprintf(stderr, "%s: %s: no such job\n", who, s);
+    return j;
+}
+
+/** Job owning pid, with its stage index in k. */
+static struct job *job_by_pid(const struct job_table *jt, pid_t pid, size_t *k) {
+    for (size_t i = 0; i < jt->n; i++) {
+        for (size_t s = 0; s < jt->jobs[i]->n; s++) {
+            if (jt->jobs[i]->pids[s] != pid) continue;
+            *k = s;
+            return jt->jobs[i];
+        }
+    }
+    return NULL;
+}
+
+/** jobs [-lp] [jobspec ...] */
+int builtin_jobs(struct shell *sh, char **argv) {
+    struct job_table *jt = &sh->jobs;
+    bool verbose = false, pids = false;
+    int i = 1;
+    for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++) {
+        for (const char *o = argv[i] + 1; *o; o++) {
+            if (*o == 'l') verbose = true;
+            else if (*o == 'p') pids = true;
+            else {
+                fprintf(stderr, "jobs: usage: jobs [-lp] [jobspec ...]\n");
+                return 2;
+            }
+        }
+    }
+
+    jobs_reap(sh);
+    int rc = 0;
+    size_t n = argv[i] ? 0 : jt->n;
+    for (int a = i; argv[a]; a++) n++;
+    for (size_t k = 0; k < n; k++) {
+        struct job *j = argv[i] ? job_find(jt, argv[i + k], true, "jobs") : jt->jobs[k];
+        if (!j) {
+            rc = 1;
+            continue;
+        }
+        if (pids) printf("%d\n", (int)j->pgid);
+        else job_print(stdout, jt, j, verbose);
+        j->notified = true;
+    }
+    fflush(stdout);
+    // Finished jobs have been reported now
+    for (size_t k = 0; k < jt->n;) {
+        struct job *j = jt->jobs[k];
+        if (job_state(j) == PROC_DONE && j->notified) {
+            job_remove(jt, j);
+            job_free(j);
+        } else {
+            k++;
+        }
+    }
+    return rc;
+}
+
+/** fg [jobspec] */
+int builtin_fg(struct shell *sh, char **argv) {
+    jobs_reap(sh);
+    struct job *j = job_find(&sh->jobs, argv[1], true, "fg");
+    if (!j) return 1;
+    printf("%s\n", j->text);
+    fflush(stdout);
+    return status_code(job_foreground(sh, j, true));
+}
+
+/** bg [jobspec ...] */
+int builtin_bg(struct shell *sh, char **argv) {
+    struct job_table *jt = &sh->jobs;
+    int rc = 0;
+    jobs_reap(sh);
+    for (int i = 1; i == 1 || argv[i]; i++) {
+        struct job *j = job_find(jt, argv[i], true, "bg");
+        if (!j) {
+            rc = 1;
+        } else if (job_state(j) != PROC_STOPPED) {
+            fprintf(stderr, "bg: job %d already in background\n", j->id);
+        } else {
+            for (size_t k = 0; k < j->n; k++) {
+                if (j->state[k] == PROC_STOPPED) j->state[k] = PROC_RUNNING;
+            }
+            j->background = true;
+            if (kill(-j->pgid, SIGCONT) == -1) perror("kill (SIGCONT)");
+            printf("[%d]%c %s &\n", j->id, job_marker(jt, j), j->text);
+        }
+        if (!argv[i]) break;
+    }
+    fflush(stdout);
+    return rc;
+}
+
+/** wait [jobspec or pid ...] */
+int builtin_wait(struct shell *sh, char **argv) {
+    struct job_table *jt = &sh->jobs;
+    int rc = 0;
+    jobs_reap(sh);
+
+    if (!argv[1]) {
+        // Stopped jobs would never finish, skip them like bash does
+        for (size_t i = 0; i < jt->n;) {
+            struct job *j = jt->jobs[i];
+            if (job_state(j) == PROC_STOPPED) {
+                i++;
+                continue;
+            }
+            job_block(jt, j);
+            if (job_state(j) != PROC_DONE) {
+                i++;
+                continue;
+            }
+            job_remove(jt, j);
+            job_free(j);
+        }
+        return 0;
+    }
+
+    for (int i = 1; argv[i]; i++) {
+        const char *a = argv[i];
+        if (a[0] == '%') {
+            struct job *j = job_find(jt, a, false, "wait");
+            if (!j) {
+                rc = 127;
+                continue;
+            }
+            job_block(jt, j);
+            rc = status_code(job_status(j));
+            if (job_state(j) == PROC_DONE) {
+                job_remove(jt, j);
+                job_free(j);
+            }
+        } else if (all_digits(a)) {
+            size_t k;
+            struct job *j = job_by_pid(jt, (pid_t)atoi(a), &k);
+            if (!j) {
+                fprintf(stderr, "wait: pid %s is not a child of this shell\n", a);
+                rc = 127;
+                continue;
+            }
+            while (j->state[k] == PROC_RUNNING) {
+                int status;
+                struct rusage ru;
+                pid_t pid = wait4(j->pids[k], &status, WUNTRACED, &ru);
+                if (pid > 0) job_update(jt, NULL, pid, status, &ru);
+                else if (errno != EINTR) break;
+            }
+            rc = status_code(j->status[k]);
+            if (job_state(j) == PROC_DONE) {
+                job_remove(jt, j);
+                job_free(j);
+            }
+        } else {
+            fprintf(stderr, "wait: `%s': not a pid or valid job spec\n", a);
+            rc = 2;
+        }
+    }
+    return rc;
+}
+
+/** Signal number for a name like TERM, SIGTERM or 15, -1 if unknown. */
+static int signal_number(const char *name) {
+    if (all_digits(name)) {
+        int sig = atoi(name);
+        return sig < NSIG ? sig : -1;
+    }
+    if (strncasecmp(name, "SIG", 3) == 0) name += 3;
+    for (int sig = 1; sig < NSIG; sig++) {
+        const char *abbrev = sigabbrev_np(sig);
+        if (abbrev && strcasecmp(abbrev, name) == 0) return sig;
+    }
+    return -1;
+}
+
+/** kill [-s sig | -sig] pid | jobspec ... and kill -l [sig] */
+int builtin_kill(struct shell *sh, char **argv) {
+    struct job_table *jt = &sh->jobs;
+    int sig = SIGTERM;
+    int i = 1;
+
+    if (argv[1] && strcmp(argv[1], "-l") == 0) {
+        if (argv[2]) {
+            // Exit statuses of signaled processes map back to the signal
+            int n = atoi(argv[2]);
+            const char *abbrev = sigabbrev_np(n > 128 ? n - 128 : n);
+            if (!abbrev) {
+                fprintf(stderr, "kill: %s: invalid signal specification\n", argv[2]);
+                return 1;
+            }
+            printf("%s\n", abbrev);
+            return 0;
+        }
+        for (int s = 1; s < NSIG; s++) {
+            const char *abbrev = sigabbrev_np(s);
+            if (abbrev) printf("%2d) SIG%-8s%s", s, abbrev, s % 5 == 0 ? "\n" : "\t");
+        }
+        printf("\n");
+        return 0;
+    }
+
+    if (argv[i] && strcmp(argv[i], "-s") == 0) {
+        if (!argv[i + 1] || (sig = signal_number(argv[i + 1])) == -1) {
+            fprintf(stderr, "kill: %s: invalid signal specification\n", argv[i + 1] ? argv[i + 1] : "");
+            return 1;
+        }
+        i += 2;
+    } else if (argv[i] && argv[i][0] == '-' && argv[i][1]) {
+        if ((sig = signal_number(argv[i] + 1)) == -1) {
+            fprintf(stderr, "kill: %s: invalid signal specification\n", argv[i] + 1);
+            return 1;
+        }
+        i++;
+    }
+    if (!argv[i]) {
+        fprintf(stderr, "kill: usage: kill [-s sigspec | -sigspec] pid | jobspec ... or kill -l [sigspec]\n");
+        return 2;
+    }
+
+    jobs_reap(sh);
+    int rc = 0;
+    for (; argv[i]; i++) {
+        const char *a = argv[i];
+        if (a[0] == '%') {
+            struct job *j = job_find(jt, a, false, "kill");
+            if (!j) {
+                rc = 1;
+                continue;
+            }
+            if (kill(-j->pgid, sig) == -1) {
+                fprintf(stderr, "kill: (%d) - %s\n", (int)j->pgid, strerror(errno));
+                rc = 1;
+            } else if (job_state(j) == PROC_STOPPED && (sig == SIGTERM || sig == SIGHUP)) {
+                // A stopped job only sees the signal once it runs again
+                kill(-j->pgid, SIGCONT);
+            }
+        } else if (all_digits(a) || (a[0] == '-' && all_digits(a + 1))) {
+            if (kill((pid_t)atoi(a), sig) == -1) {
+                fprintf(stderr, "kill: (%s) - %s\n", a, strerror(errno));
+                rc = 1;
+            }
+        } else {
+            fprintf(stderr, "kill: %s: arguments must be process or job IDs\n", a);
+            rc = 1;
+        }
+    }
+    return rc;
+}
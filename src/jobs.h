@@ -0,0 +1,136 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <termios.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct shell;
+
+enum proc_state {
+    PROC_RUNNING,
+    PROC_STOPPED,
+    PROC_DONE,
+};
+
+/**
+ * @brief A pipeline started by the shell. Foreground jobs only enter the
+ * job table when they are stopped, background jobs right away.
+ */
+struct job {
+    int id;             // the n in %n
+    pid_t pgid;
+    size_t n;           // number of stages
+    pid_t *pids;        // -1 for stages that never started
+    int *status;        // last wait status per stage
+    int *state;         // enum proc_state per stage
+    char *text;         // the command line for jobs and notifications
+    bool background;
+    bool notified;      // the last state change was reported
+    bool have_tmodes;   // tmodes holds the terminal modes of a stopped job
+    struct termios tmodes;
+};
+
+/**
+ * @brief All background and stopped jobs. Child state changes arrive on a
+ * signalfd for SIGCHLD which the main loop polls next to the terminal.
+ */
+struct job_table {
+    struct job **jobs;  // ordered by id
+    size_t n;
+    size_t cap;
+    int current;        // id of %+, 0 if none
+    int previous;       // id of %-, 0 if none
+    int sigfd;          // SIGCHLD signalfd, -1 when not in use
+    struct rusage usage;    // summed over every child reaped, maxrss is the largest
+};
+
+/**
+ * @brief Set up an empty table without a signalfd
+ */
+void jobs_init(struct job_table *jt);
+
+/**
+ * @brief Block SIGCHLD and open the signalfd used to learn about children
+ *
+ * @return 0 on success, -1 if the signalfd could not be created
+ */
+int jobs_open_signalfd(struct job_table *jt);
+
+/**
+ * @brief Free every job and close the signalfd
+ */
+void jobs_destroy(struct job_table *jt);
+
+/**
+ * @brief Add the resources of a child that was reaped to jt->usage
+ */
+void jobs_account(struct job_table *jt, const struct rusage *ru);
+
+/**
+ * @brief Create a job for processes that were just started. Stages that
+ * did not start have pid -1 and their wait status in status.
+ *
+ * @param pgid Process group of the job
+ * @param pids One pid per stage
+ * @param status One wait status per stage, used for stages that did not start
+ * @param n Number of stages
+ * @param text Command line, copied
+ * @return The job or NULL if memory ran out
+ */
+struct job *job_new(pid_t pgid, const pid_t *pids, const int *status, size_t n, const char *text);
+
+/**
+ * @brief Put a job in the table and give it the next free id
+ *
+ * @return 0 on success, -1 if memory ran out
+ */
+int job_insert(struct job_table *jt, struct job *j);
+
+/**
+ * @brief Run a job in the foreground: give it the terminal and wait until
+ * every process finished or the job stopped. A stopped job is kept in the
+ * table, a finished one is removed and freed.
+ *
+ * @param sh The shell
+ * @param j The job, may or may not be in the table yet
+ * @param cont Send SIGCONT first, used by fg
+ * @return Wait status of the last stage
+ */
+int job_foreground(struct shell *sh, struct job *j, bool cont);
+
+/**
+ * @brief Collect every pending child state change without blocking.
+ * Drains the signalfd if there is one.
+ */
+void jobs_reap(struct shell *sh);
+
+/**
+ * @brief Print Done and Stopped messages for jobs whose state changed since
+ * the last call and drop finished jobs from the table. Non-interactive
+ * shells only drop them.
+ */
+void jobs_notify(struct shell *sh);
+
+/**
+ * @brief Number of jobs with a state change jobs_notify has not reported yet
+ */
+size_t jobs_pending(const struct job_table *jt);
+
+int builtin_jobs(struct shell *sh, char **argv);
+int builtin_fg(struct shell *sh, char **argv);
+int builtin_bg(struct shell *sh, char **argv);
+int builtin_wait(struct shell *sh, char **argv);
+int builtin_kill(struct shell *sh, char **argv);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // JOBS_H
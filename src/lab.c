@@ -3,8 +3,15 @@
  * Simple shell with command parsing, built-in commands, and execution.
  */
 
+#define _GNU_SOURCE
 #include "lab.h"
+#include "coreutils.h"
+#include "builtins.h"
+#include "histdb.h"
+#include "parallel.h"
+#include "tokenize.h"
 #include <stdio.h>
+#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -15,18 +22,94 @@
 #include <pwd.h>
 #include <errno.h>
 #include <signal.h>
+#include <stddef.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
 
-#define ARG_MAX sysconf(_SC_ARG_MAX)
+// Chunk size of the per-line arena, big enough for any interactive line
+#define LINE_ARENA_SIZE 4096
+// Lines of the history file handed to readline when HISTSIZE is not set
+#define HISTORY_LOAD_SIZE 1000
+
+/* Names used by set -o, indexed by enum sh_option */
+static const char *const option_names[SH_OPT_COUNT] = {
+    [SH_OPT_SPAWN] = "spawn",
+    [SH_OPT_RELAY] = "relay",
+    [SH_OPT_DIRECT] = "direct",
+    [SH_OPT_NOATIME] = "noatime",
+    [SH_OPT_NOTIFY] = "notify",
+    [SH_OPT_GLOBCACHE] = "globcache",
+    [SH_OPT_ZYGOTE] = "zygote",
+    [SH_OPT_SPREAD] = "spread",
+};
+
+/** Parse a byte count with an optional K, M or G suffix. */
+static int parse_size(const char *s, off_t *out) {
+    char *end;
+    errno = 0;
+    long long v = strtoll(s, &end, 10);
+    if (errno || end == s || v < 0) return -1;
+    int shift = 0;
+    switch (*end) {
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+    }
+    if (*end || v > (LLONG_MAX >> shift)) return -1;
+    *out = (off_t)(v << shift);
+    return 0;
+}
+
+/** Turn a named shell option on or off. */
+int sh_set_option(struct shell *sh, const char *name, bool on) {
+    if (strncmp(name, "prealloc", 8) == 0 && (name[8] == '=' || name[8] == '\0')) {
+        off_t size = 0;
+        if (on && (name[8] != '=' || parse_size(name + 9, &size) == -1)) return -1;
+        sh->redir_prealloc = size;
+        return 0;
+    }
+    for (int i = 0; i < SH_OPT_COUNT; i++) {
+        if (strcmp(option_names[i], name) == 0) {
+            sh->options[i] = on;
+            if (i == SH_OPT_GLOBCACHE && !on) glob_cache_destroy(&sh->glob);
+            if (i == SH_OPT_ZYGOTE && !on) zygote_stop(&sh->zygote);
+            return 0;
+        }
+    }
+    return -1;
+}
 
 /** Parse command-line arguments. */
-void parse_args(int argc, char **argv) {
+void parse_args(struct shell *sh, int argc, char **argv) {
     int opt;
-    while ((opt = getopt(argc, argv, "v")) != -1) {
-        if (opt == 'v') {
+    while ((opt = getopt(argc, argv, "+vo:c:")) != -1) {
+        if (opt == 'c') {
+            sh->command = optarg;
+        } else if (opt == 'v') {
             printf("Shell Version: %d.%d\n", lab_VERSION_MAJOR, lab_VERSION_MINOR);
             exit(0);
+        } else if (opt == 'o') {
+            if (sh_set_option(sh, optarg, true) == -1) {
+                fprintf(stderr, "%s: %s: invalid option name\n", argv[0], optarg);
+                exit(2);
+            }
+        } else {
+            fprintf(stderr, "usage: %s [-v] [-o option] [-c command | script]\n", argv[0]);
+            exit(2);
         }
     }
+    if (!sh->command && optind < argc) sh->script = argv[optind++];
+
+    // $0 is the script, or the first argument after -c, the rest become
+    // the positional parameters
+    sh->vm.arg0 = argv[0];
+    if (sh->command || sh->script) {
+        if (sh->script) sh->vm.arg0 = sh->script;
+        else if (optind < argc) sh->vm.arg0 = argv[optind++];
+        sh->vm.argv = argv + optind;
+        sh->vm.argc = (size_t)(argc - optind);
+    }
 }
 
 /** Get shell prompt from an environment variable. */
@@ -35,33 +118,60 @@ char *get_prompt(const char *env) {
     return strdup(prompt ? prompt : "shell>"); // Bug FIXED (Code Review)
 }
 
-/** Parse a command line into arguments. */
-char **cmd_parse(const char *line) {
-    char **cmd = malloc(ARG_MAX * sizeof(char *));
-    if (!cmd) return NULL;
+/** Copy n tokens of line into one argv block from a, or from malloc when a is NULL. */
+char **cmd_build(struct arena *a, const char *line, const struct token *tok, size_t n) {
+    size_t bytes = 0;
+    for (size_t i = 0; i < n; i++) bytes += tok[i].out + 1;
 
-    char *token, *line_copy = strdup(line);
-    int i = 0;
+    size_t size = offsetof(struct cmd, argv) + (n + 1) * sizeof(char *) + bytes;
+    struct cmd *c = a ? arena_alloc(a, size) : malloc(size);
+    if (!c) return NULL;
+    c->owner = a;
+    c->argc = n;
 
-    // Tokenize the input line by spaces
-    token = strtok(line_copy, " ");
-    while (token && i < ARG_MAX - 1) {
-        cmd[i++] = strdup(token);
-        token = strtok(NULL, " ");
+    char *out = (char *)&c->argv[n + 1];
+    for (size_t i = 0; i < n; i++) {
+        tok_copy(line, &tok[i], out);
+        out[tok[i].out] = '\0';
+        c->argv[i] = out;
+        out += tok[i].out + 1;
     }
-    cmd[i] = NULL;
+    c->argv[n] = NULL;
+    return c->argv;
+}
+
+/** Parse line into a block from the arena a, or from malloc when a is NULL. */
+static char **cmd_parse_into(struct arena *a, const char *line) {
+    struct tok_index idx;
+    tok_index_init(&idx);
+    char **argv = NULL;
+    if (tokenize(line, strlen(line), &idx) == 0)
+        argv = cmd_build(a, line, idx.tok, idx.n);
+    tok_index_free(&idx);
+    return argv;
+}
+
+/** Parse a command line into arguments. */
+char **cmd_parse(const char *line) {
+    return cmd_parse_into(NULL, line);
+}
 
-    free(line_copy);
-    return cmd;
+/** Parse a command line into arguments that live until the arena is reset. */
+char **cmd_parse_arena(struct arena *a, const char *line) {
+    return cmd_parse_into(a, line);
+}
+
+/** Recover the block header from the argv pointer handed out by cmd_parse. */
+struct cmd *cmd_header(char **cmd) {
+    return (struct cmd *)((char *)cmd - offsetof(struct cmd, argv));
 }
 
 /** Free parsed command memory. */
 void cmd_free(char **cmd) {
     if (!cmd) return;
-    for (int i = 0; cmd[i] != NULL; i++) {
-        free(cmd[i]);
-    }
-    free(cmd);
+    struct cmd *c = cmd_header(cmd);
+    // Arena backed lines are released all at once by arena_reset
+    if (!c->owner) free(c);
 }
 
 /** Trim leading/trailing whitespace from a string. */
@@ -76,10 +186,10 @@ char *trim_white(char *line) {
 }
 
 /** Change the working directory. */
-int change_dir(char **args) {
+int change_dir(struct shell *sh, char **args) {
     if (args[1] == NULL) {
         // No argument, change to home directory
-        const char *home = getenv("HOME");
+        const char *home = var_get(sh, "HOME");
         if (!home) {
             struct passwd *pw = getpwuid(getuid());
             home = pw ? pw->pw_dir : NULL;
@@ -96,30 +206,370 @@ int change_dir(char **args) {
     return 0;
 }
 
-/** Handle built-in commands. */
-bool do_builtin(struct shell *sh, char **argv) {
-    if (!argv[0]) return false;
-    if (strcmp(argv[0], "exit") == 0) {
-        sh_destroy(sh);
-        exit(0);
-    } else if (strcmp(argv[0], "cd") == 0) {
-        return change_dir(argv) == 0;
-    } else if (strcmp(argv[0], "history") == 0) {
+/** hash [-lr] [-p path] [-dt] [name ...] */
+static int builtin_hash(struct shell *sh, char **argv) {
+    int opt, list = 0, del = 0, show = 0, reset = 0;
+    const char *path = NULL;
+    int argc = 0;
+    while (argv[argc]) argc++;
+
+    optind = 0;
+    while ((opt = getopt(argc, argv, "+lrdtp:")) != -1) {
+        switch (opt) {
+        case 'r': cmd_hash_clear(&sh->cmd_hash); reset = 1; break;
+        case 'l': list = 1; break;
+        case 'd': del = 1; break;
+        case 't': show = 1; break;
+        case 'p': path = optarg; break;
+        default:
+            fprintf(stderr, "usage: hash [-lr] [-p pathname] [-dt] [name ...]\n");
+            return 1;
+        }
+    }
+
+    struct cmd_hash *h = &sh->cmd_hash;
+    if (optind == argc) {
+        // Entries resolved against an older PATH are gone by now
+        cmd_hash_refresh(h);
+        if (h->n == 0) {
+            if (!list && !reset) printf("hash: hash table empty\n");
+            return 0;
+        }
+        if (!list) printf("hits\tcommand\n");
+        for (size_t i = 0; i < h->cap; i++) {
+            const struct cmd_hash_entry *e = &h->slots[i];
+            if (!e->name) continue;
+            if (list) printf("builtin hash -p %s %s\n", e->path, e->name);
+            else printf("%4u\t%s\n", e->hits, e->path);
+        }
+        return 0;
+    }
+
+    int rc = 0;
+    for (int i = optind; i < argc; i++) {
+        const char *name = argv[i];
+        if (path) {
+            if (cmd_hash_set(h, name, path) == -1) rc = 1;
+        } else if (del) {
+            if (cmd_hash_forget(h, name) == -1) {
+                fprintf(stderr, "hash: %s: not found\n", name);
+                rc = 1;
+            }
+        } else if (!strchr(name, '/')) {
+            const char *found = cmd_hash_find(h, name);
+            if (!found) {
+                fprintf(stderr, "hash: %s: not found\n", name);
+                rc = 1;
+            } else if (show) {
+                printf(argc - optind > 1 ? "%s\t%s\n" : "%.0s%s\n", name, found);
+            } else if (list) {
+                printf("builtin hash -p %s %s\n", found, name);
+            }
+        }
+    }
+    return rc;
+}
+
+/** Print history entry i, with time, status, duration and cwd when verbose. */
+static void print_history(struct histdb *db, size_t i, bool verbose) {
+    struct hist_entry e;
+    if (histdb_get(db, i, &e) == -1) return;
+    if (!verbose) {
+        printf("%5zu  %.*s\n", i + 1, (int)e.len, e.line);
+        return;
+    }
+    char when[32];
+    time_t t = (time_t)(e.start_us / 1000000);
+    struct tm tm;
+    strftime(when, sizeof(when), "%F %T", localtime_r(&t, &tm));
+    printf("%5zu  %s %3d %9.3fs  %-20.*s  %.*s\n", i + 1, when, e.status,
+           (double)e.duration_us / 1e6, (int)e.cwd_len, e.cwd, (int)e.len, e.line);
+}
+
+/** history [-v] [-s text | -p prefix] [n] */
+static int builtin_history(struct shell *sh, char **argv) {
+    int opt, argc = 0;
+    bool verbose = false, prefix = false;
+    const char *pat = NULL;
+    while (argv[argc]) argc++;
+
+    optind = 0;
+    while ((opt = getopt(argc, argv, "+vs:p:")) != -1) {
+        switch (opt) {
+        case 'v': verbose = true; break;
+        case 's': pat = optarg; prefix = false; break;
+        case 'p': pat = optarg; prefix = true; break;
+        default:
+            fprintf(stderr, "usage: history [-v] [-s text | -p prefix] [n]\n");
+            return 2;
+        }
+    }
+    size_t limit = SIZE_MAX;
+    if (optind < argc) {
+        char *end;
+        limit = strtoul(argv[optind], &end, 10);
+        if (*end || !*argv[optind]) {
+            fprintf(stderr, "history: %s: numeric argument required\n", argv[optind]);
+            return 2;
+        }
+    }
+
+    struct histdb *db = &sh->history;
+    if (db->fd == -1) {
+        // No history file, only this session's lines are known
         HIST_ENTRY **hist = history_list();
-        if (hist) {
-            for (int i = 0; hist[i]; i++) {
+        for (int i = 0; hist && hist[i]; i++) {
+            if (!pat || (prefix ? strncmp(hist[i]->line, pat, strlen(pat)) == 0 : strstr(hist[i]->line, pat) != NULL))
                 printf("%d  %s\n", i + history_base, hist[i]->line);
-            }
         }
-        return true;
+        return 0;
+    }
+
+    histdb_refresh(db);
+    if (!pat) {
+        size_t first = limit < db->n ? db->n - limit : 0;
+        for (size_t i = first; i < db->n; i++) print_history(db, i, verbose);
+        return 0;
     }
-    return false;
+    // Matches come newest first, print them oldest first like grep would
+    size_t cap = 64, n = 0;
+    size_t *hits = malloc(cap * sizeof(*hits));
+    struct hist_search search;
+    ssize_t at;
+    histdb_search_start(db, &search, pat, prefix, db->n);
+    while (hits && n < limit && (at = histdb_search_next(db, &search)) != -1) {
+        if (n == cap) {
+            size_t *grown = realloc(hits, (cap *= 2) * sizeof(*hits));
+            if (!grown) break;
+            hits = grown;
+        }
+        hits[n++] = (size_t)at;
+    }
+    if (!hits) {
+        perror("history");
+        return 1;
+    }
+    int rc = n ? 0 : 1;
+    while (n) print_history(db, hits[--n], verbose);
+    free(hits);
+    return rc;
+}
+
+/** set [-+]o [option] */
+static int builtin_set(struct shell *sh, char **argv) {
+    if (!argv[1] || (!argv[2] && (strcmp(argv[1], "-o") == 0 || strcmp(argv[1], "+o") == 0))) {
+        for (int i = 0; i < SH_OPT_COUNT; i++) {
+            if (argv[1] && argv[1][0] == '+')
+                printf("set %co %s\n", sh->options[i] ? '-' : '+', option_names[i]);
+            else
+                printf("%-15s\t%s\n", option_names[i], sh->options[i] ? "on" : "off");
+        }
+        if (argv[1] && argv[1][0] == '+') {
+            if (sh->redir_prealloc) printf("set -o prealloc=%lld\n", (long long)sh->redir_prealloc);
+            else printf("set +o prealloc\n");
+        } else {
+            printf("%-15s\t%lld\n", "prealloc", (long long)sh->redir_prealloc);
+        }
+        return 0;
+    }
+
+    int rc = 0;
+    for (int i = 1; argv[i]; i++) {
+        const char *a = argv[i];
+        if ((a[0] != '-' && a[0] != '+') || a[1] != 'o' || a[2] || !argv[i + 1]) {
+            fprintf(stderr, "set: usage: set [-+]o option\n");
+            return 2;
+        }
+        if (sh_set_option(sh, argv[i + 1], a[0] == '-') == -1) {
+            fprintf(stderr, "set: %s: invalid option name\n", argv[i + 1]);
+            rc = 1;
+        }
+        i++;
+    }
+    return rc;
+}
+
+/** exit [n], scripts end with the status of the last command */
+static int builtin_exit(struct shell *sh, char **argv) {
+    int code = argv[1] ? atoi(argv[1]) & 0xff : sh->last_status;
+    sh_destroy(sh);
+    exit(code);
+}
+
+// builtin_table, BUILTIN_SEED and BUILTIN_MASK, generated from builtins.def
+#include "builtins.gen.h"
+
+/** Slot of name in the registry, or the empty slot where it would go. */
+static struct builtin_entry *registry_slot(const struct builtin_registry *r, const char *name) {
+    size_t mask = r->cap - 1;
+    for (size_t i = builtin_name_hash(name, 0) & mask;; i = (i + 1) & mask) {
+        struct builtin_entry *e = &r->slots[i];
+        if (!e->name || strcmp(e->name, name) == 0) return e;
+    }
+}
+
+/** Registered builtins first, then the generated table. */
+builtin_fn builtin_lookup(const struct shell *sh, const char *name) {
+    if (!name) return NULL;
+    if (sh->builtins.n) {
+        const struct builtin_entry *e = registry_slot(&sh->builtins, name);
+        if (e->name) return e->fn;
+    }
+    const struct builtin_entry *e = &builtin_table[builtin_name_hash(name, BUILTIN_SEED) & BUILTIN_MASK];
+    return e->name && strcmp(e->name, name) == 0 ? e->fn : NULL;
+}
+
+/** Relay-safe compiled builtins, unless a registered one shadows them. */
+bool builtin_relays(const struct shell *sh, const char *name) {
+    if (!name) return false;
+    if (sh->builtins.n && registry_slot(&sh->builtins, name)->name) return false;
+    const struct builtin_entry *e = &builtin_table[builtin_name_hash(name, BUILTIN_SEED) & BUILTIN_MASK];
+    return e->name && strcmp(e->name, name) == 0 && e->relay;
+}
+
+/** Every builtin name. */
+void builtin_each(const struct shell *sh, void (*fn)(const char *name, void *arg), void *arg) {
+    for (size_t i = 0; i < sh->builtins.cap; i++)
+        if (sh->builtins.slots[i].name) fn(sh->builtins.slots[i].name, arg);
+    for (size_t i = 0; i <= BUILTIN_MASK; i++)
+        if (builtin_table[i].name) fn(builtin_table[i].name, arg);
+}
+
+/** Check for a builtin name. */
+bool is_builtin(const struct shell *sh, const char *name) {
+    return builtin_lookup(sh, name) != NULL;
+}
+
+/** Add or replace a run time builtin, the registry stays at most half full. */
+int sh_register_builtin(struct shell *sh, const char *name, builtin_fn fn) {
+    if (!name || !*name || strchr(name, '/') || !fn) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct builtin_registry *r = &sh->builtins;
+    if (2 * (r->n + 1) > r->cap) {
+        struct builtin_registry grown = {.cap = r->cap ? r->cap * 2 : 16};
+        grown.slots = calloc(grown.cap, sizeof(*grown.slots));
+        if (!grown.slots) return -1;
+        for (size_t i = 0; i < r->cap; i++) {
+            if (r->slots[i].name) *registry_slot(&grown, r->slots[i].name) = r->slots[i];
+        }
+        grown.n = r->n;
+        free(r->slots);
+        *r = grown;
+    }
+    struct builtin_entry *e = registry_slot(r, name);
+    if (!e->name) {
+        if (!(e->name = strdup(name))) return -1;
+        r->n++;
+    }
+    e->fn = fn;
+    return 0;
+}
+
+/** Free the names and slots of the registry. */
+static void registry_destroy(struct builtin_registry *r) {
+    for (size_t i = 0; i < r->cap; i++) free((char *)r->slots[i].name);
+    free(r->slots);
+    memset(r, 0, sizeof(*r));
+}
+
+/** Handle built-in commands. */
+bool do_builtin(struct shell *sh, char **argv) {
+    builtin_fn fn = builtin_lookup(sh, argv[0]);
+    if (!fn) return false;
+    sh->last_status = fn(sh, argv);
+    return true;
+}
+
+/* State of the Ctrl-R search, readline key handlers get no context */
+static struct shell *search_shell;
+static char *search_pat;
+static struct hist_search search;
+
+/**
+ * Ctrl-R: replace the line with the newest older command containing what
+ * was typed before the first press. Pressing it again goes further back.
+ * Runs on the history file's trigram index, so it stays fast with
+ * millions of entries.
+ */
+static int history_search_key(int count, int key) {
+    UNUSED(count)
+    UNUSED(key)
+    struct histdb *db = &search_shell->history;
+    if (rl_last_func != history_search_key) {
+        free(search_pat);
+        search_pat = strdup(rl_line_buffer);
+        if (!search_pat) return 1;
+        histdb_refresh(db);
+        histdb_search_start(db, &search, search_pat, false, db->n);
+    }
+    if (!search_pat) return 1;
+
+    struct hist_entry e;
+    ssize_t i;
+    do {
+        i = histdb_search_next(db, &search);
+        if (i == -1) {
+            rl_ding();
+            return 0;
+        }
+        // Skip repeats of what is already on the line
+    } while (histdb_get(db, (size_t)i, &e) == -1 ||
+             (e.len == (size_t)rl_end && memcmp(e.line, rl_line_buffer, e.len) == 0));
+
+    char *line = strndup(e.line, e.len);
+    if (!line) return 1;
+    rl_replace_line(line, 0);
+    rl_point = rl_end;
+    free(line);
+    return 0;
+}
+
+/** Path of the history file, $LAB_HISTFILE or ~/.lab_history. */
+static char *history_path(struct shell *sh) {
+    const char *env = var_get(sh, "LAB_HISTFILE");
+    if (env) return *env ? strdup(env) : NULL;
+    const char *home = var_get(sh, "HOME");
+    if (!home) {
+        struct passwd *pw = getpwuid(getuid());
+        home = pw ? pw->pw_dir : NULL;
+    }
+    char *path;
+    if (!home || asprintf(&path, "%s/.lab_history", home) == -1) return NULL;
+    return path;
+}
+
+/** Open the history file and feed its newest $HISTSIZE lines to readline. */
+static void history_load(struct shell *sh) {
+    char *path = history_path(sh);
+    if (!path) return;
+    if (histdb_open(&sh->history, path) == -1) {
+        fprintf(stderr, "history: %s: %s\n", path, errno == EINVAL ? "not a history file" : strerror(errno));
+        free(path);
+        return;
+    }
+    free(path);
+
+    const char *env = var_get(sh, "HISTSIZE");
+    size_t keep = env && *env ? strtoul(env, NULL, 10) : HISTORY_LOAD_SIZE;
+    struct histdb *db = &sh->history;
+    for (size_t i = keep < db->n ? db->n - keep : 0; i < db->n; i++) {
+        struct hist_entry e;
+        if (histdb_get(db, i, &e) == -1) continue;
+        char *line = strndup(e.line, e.len);
+        if (line) add_history(line);
+        free(line);
+    }
+
+    search_shell = sh;
+    rl_bind_keyseq("\\C-r", history_search_key);
 }
 
 /** Initialize shell process and set up signals. */
 void sh_init(struct shell *sh) {
     sh->shell_terminal = STDIN_FILENO;
-    sh->shell_is_interactive = isatty(sh->shell_terminal);
+    sh->shell_is_interactive = !sh->command && !sh->script && isatty(sh->shell_terminal);
 
     if (sh->shell_is_interactive) {
         // Loop until we are in the foreground
@@ -143,34 +593,46 @@ void sh_init(struct shell *sh) {
     }
 
     sh->prompt = get_prompt("MY_PROMPT");
+    arena_init(&sh->line_arena, LINE_ARENA_SIZE);
+    cmd_hash_init(&sh->cmd_hash);
+    sh->last_status = 0;
+    sh->vm.pid = getpid();
+    if (vars_import(sh, environ) == -1) perror("environment");
+
+    // Children are reaped from the main loop through a signalfd
+    jobs_init(&sh->jobs);
+    if (jobs_open_signalfd(&sh->jobs) == -1) perror("signalfd");
+
+    // The helper is forked while the shell is still small
+    if (sh->options[SH_OPT_ZYGOTE] && zygote_start(sh) == -1) perror("zygote");
+
+    // Only interactive shells keep a history
+    sh->history.fd = -1;
+    if (sh->shell_is_interactive) {
+        history_load(sh);
+        dirs_init(sh);
+        complete_install(sh);
+    }
 }
 
 /** Free shell resources. */
 void sh_destroy(struct shell *sh) {
     free(sh->prompt);
+    arena_destroy(&sh->line_arena);
+    cmd_hash_destroy(&sh->cmd_hash);
+    jobs_destroy(&sh->jobs);
+    histdb_close(&sh->history);
+    registry_destroy(&sh->builtins);
+    vm_destroy(&sh->vm);
+    vars_destroy(&sh->vars);
+    glob_cache_destroy(&sh->glob);
+    completer_destroy(&sh->complete);
+    prompt_destroy(&sh->prompt_state);
+    dirs_destroy(&sh->dirs);
+    zygote_stop(&sh->zygote);
+    ev_destroy(&sh->loop);
+    capture_pool_destroy(&sh->capture);
+    affinity_destroy(&sh->affinity);
+    free(search_pat);
+    search_pat = NULL;
 }
-
-/** Execute a command using fork and execvp. */
-void execute_command(char **cmd) {
-    if (!cmd || !cmd[0]) return;
-
-    pid_t pid = fork();
-    if (pid == 0) {
-        // Child process
-        signal(SIGINT, SIG_DFL);
-        signal(SIGQUIT, SIG_DFL);
-        signal(SIGTSTP, SIG_DFL);
-        signal(SIGTTIN, SIG_DFL);
-        signal(SIGTTOU, SIG_DFL);
-
-        execvp(cmd[0], cmd);
-        perror("execvp");
-        exit(EXIT_FAILURE);
-    } else if (pid > 0) {
-        // Parent process
-        int status;
-        waitpid(pid, &status, 0);
-    } else {
-        perror("fork");
-    }
-}
\ No newline at end of file
@@ -6,6 +6,21 @@
 #include <sys/types.h>
 #include <termios.h>
 #include <unistd.h>
+#include "affinity.h"
+#include "arena.h"
+#include "capture.h"
+#include "cmdhash.h"
+#include "complete.h"
+#include "dirs.h"
+#include "evloop.h"
+#include "glob.h"
+#include "histdb.h"
+#include "jobs.h"
+#include "prompt.h"
+#include "tokenize.h"
+#include "vars.h"
+#include "vm.h"
+#include "zygote.h"
 
 #define lab_VERSION_MAJOR 1
 #define lab_VERSION_MINOR 0
@@ -15,12 +30,82 @@
 extern "C" {
 #endif
 
+/**
+ * @brief Boolean options changed with set -o NAME / set +o NAME or the -o
+ * command line flag.
+ */
+enum sh_option {
+    SH_OPT_SPAWN,   // start commands with posix_spawn instead of fork
+    SH_OPT_RELAY,   // run output-only builtins in pipelines inside the shell
+    SH_OPT_DIRECT,  // open output redirections with O_DIRECT
+    SH_OPT_NOATIME, // open redirections with O_NOATIME
+    SH_OPT_NOTIFY,  // report finished background jobs right away
+    SH_OPT_GLOBCACHE,   // keep directory listings for pathname expansion
+    SH_OPT_ZYGOTE,  // start programs from a helper forked at startup
+    SH_OPT_SPREAD,  // deal background and parallel jobs out over nodes or CPUs
+    SH_OPT_COUNT,
+};
+
+struct shell;
+
+/**
+ * @brief A builtin command, called with the shell and the command's argv
+ * and returning its exit status
+ */
+typedef int (*builtin_fn)(struct shell *sh, char **argv);
+
+/* Name and function of one builtin */
+struct builtin_entry {
+    const char *name;
+    builtin_fn fn;
+    bool relay;     // only writes output, may run inside the shell as a pipeline stage
+};
+
+/* Builtins added with sh_register_builtin, open addressing on the name */
+struct builtin_registry {
+    struct builtin_entry *slots;
+    size_t n;
+    size_t cap;     // power of two, 0 until the first registration
+};
+
 struct shell {
     int shell_is_interactive;
     pid_t shell_pgid;
     struct termios shell_tmodes;
     int shell_terminal;
     char *prompt;
+    struct arena line_arena;
+    struct cmd_hash cmd_hash;
+    int last_status;
+    bool options[SH_OPT_COUNT];
+    off_t redir_prealloc;   // set -o prealloc=SIZE, 0 when off
+    struct job_table jobs;
+    struct histdb history;  // fd is -1 when there is no history file
+    const char *command;    // -c string, NULL otherwise
+    const char *script;     // script file given on the command line, NULL otherwise
+    struct builtin_registry builtins;
+    struct vm_state vm;
+    struct var_table vars;
+    struct glob_cache glob;     // used while set -o globcache is on
+    struct completer complete;  // command names for Tab
+    struct prompt_state prompt_state;
+    struct dir_state dirs;      // pushd stack and the j database
+    struct zygote zygote;       // used while set -o zygote is on
+    struct evloop loop;         // input, children, timers and relays wait here
+    struct capture_pool capture;    // buffers for command substitution output
+    struct affinity affinity;   // CPUs and memory node of launched programs
+    bool subshell;          // a forked copy running part of a pipeline
+};
+
+/**
+ * @brief Result of cmd_parse. The argv pointers and the token bytes they
+ * point at live in the same allocation directly after this header, so a
+ * parsed line is always exactly one block of memory.
+ */
+struct cmd {
+    struct arena *owner;
+    size_t argc;
+    char *argv[];
 };
 
 /**
@@ -36,26 +121,61 @@ char *get_prompt(const char *env);
 
 /**
  * Changes the current working directory of the shell. Uses the linux system
- * call chdir. With no arguments the users home directory is used as the
- * directory to change to.
+ * call chdir. With no arguments the shell's HOME is used as the directory to
+ * change to, or the user's home directory when HOME is unset.
  *
+ * @param sh The shell
  * @param dir The directory to change to
  * @return On success, zero is returned. On error, -1 is returned, and
  * errno is set to indicate the error.
  */
-int change_dir(char **dir);
+int change_dir(struct shell *sh, char **dir);
 
 /**
  * @brief Convert line read from the user into to format that will work with
- * execvp. We limit the number of arguments to ARG_MAX loaded from sysconf.
- * This function allocates memory that must be reclaimed with the cmd_free
- * function.
+ * execvp. Words are separated by whitespace or metacharacters, single
+ * quotes, double quotes and backslashes are removed as in sh. The argument
+ * array and the strings are sized to the line and packed into a single
+ * allocation. This function allocates memory that must be reclaimed with
+ * the cmd_free function.
  *
  * @param line The line to process
- * @return The line read in a format suitable for exec
+ * @return The line read in a format suitable for exec, NULL if the line has
+ * an unterminated quote (errno is EINVAL) or memory ran out
  */
 char **cmd_parse(char const *line);
 
+/**
+ * @brief Same as cmd_parse but the result is carved out of an arena. The
+ * memory is released when the arena is reset, calling cmd_free on the
+ * result is allowed and does nothing.
+ *
+ * @param a The arena to allocate from
+ * @param line The line to process
+ * @return The line read in a format suitable for exec
+ */
+char **cmd_parse_arena(struct arena *a, char const *line);
+
+/**
+ * @brief Build an argv block like cmd_parse does from tokens that were
+ * already found by tokenize.
+ *
+ * @param a The arena to allocate from, NULL to use malloc
+ * @param line The line the tokens point into
+ * @param tok First token
+ * @param n Number of tokens
+ * @return The NULL terminated argument array or NULL if memory ran out
+ */
+char **cmd_build(struct arena *a, const char *line, const struct token *tok, size_t n);
+
+/**
+ * @brief Get the header of a line returned by cmd_parse or cmd_parse_arena
+ *
+ * @param line The parsed line
+ * @return The header holding the argument count
+ */
+struct cmd *cmd_header(char **line);
+
 /**
  * @brief Free the line that was constructed with parse_cmd
  *
@@ -87,6 +207,75 @@ char *trim_white(char *line);
  */
 bool do_builtin(struct shell *sh, char **argv);
 
+/**
+ * @brief Check if name is handled by do_builtin without running it
+ *
+ * @param sh The shell, for builtins registered at run time
+ * @param name The command name
+ * @return True if name is a built in command
+ */
+bool is_builtin(const struct shell *sh, const char *name);
+
+/**
+ * @brief Check if name is a builtin that only writes output and changes
+ * no shell state, marked relay in src/builtins.def. With set -o relay
+ * such a builtin runs inside the shell as a pipeline stage; every other
+ * builtin gets a forked subshell there. Registered builtins never relay.
+ *
+ * @param sh The shell
+ * @param name The command name, may be NULL
+ * @return True if name may be relayed
+ */
+bool builtin_relays(const struct shell *sh, const char *name);
+
+/**
+ * @brief Find the function do_builtin would run for name. Builtins
+ * registered with sh_register_builtin come first, then the ones compiled
+ * into the shell, which are found through a perfect hash generated from
+ * src/builtins.def.
+ *
+ * @param sh The shell
+ * @param name The command name, may be NULL
+ * @return The builtin or NULL
+ */
+builtin_fn builtin_lookup(const struct shell *sh, const char *name);
+
+/**
+ * @brief Call fn with the name of every builtin, registered ones first.
+ * A name shadowed by a registered builtin may come twice.
+ *
+ * @param sh The shell
+ * @param fn Called once per name
+ * @param arg Passed on to fn
+ */
+void builtin_each(const struct shell *sh, void (*fn)(const char *name, void *arg), void *arg);
+
+/**
+ * @brief Add a builtin to the shell, or replace one of the same name. It
+ * can shadow a builtin compiled into the shell. Like every other builtin
+ * it runs in the shell process when it is a command of its own and in a
+ * subshell inside a pipeline, with its output going to stdout.
+ *
+ * @param sh The shell
+ * @param name The command name, copied. Must not be empty or contain a /
+ * @param fn The function to run
+ * @return 0 on success, -1 with errno set to EINVAL or ENOMEM
+ */
+int sh_register_builtin(struct shell *sh, const char *name, builtin_fn fn);
+
+/**
+ * @brief Run an external command in the foreground and wait for it. The
+ * program is found through the shell's command hash so PATH is only walked
+ * the first time a name is used. A hashed path that no longer exists is
+ * dropped and looked up again.
+ *
+ * @param sh The shell
+ * @param cmd The command, as returned by cmd_parse
+ * @return The wait status of the child. A command that could not be found
+ * or executed reports exit status 127 or 126, -1 means waitpid failed.
+ */
+int execute_command(struct shell *sh, char **cmd);
+
 /**
  * @brief Initialize the shell for use. Allocate all data structures
  * Grab control of the terminal and put the shell in its own
@@ -108,12 +297,27 @@ void sh_init(struct shell *sh);
 void sh_destroy(struct shell *sh);
 
 /**
- * @brief Parse command line args from the user when the shell was launched
+ * @brief Parse command line args from the user when the shell was launched:
+ * [-v] [-o option] [-c command | script]. This is called before sh_init,
+ * which leaves the options alone, so the shell must start out zeroed. A
+ * command or script makes the shell non-interactive.
  *
+ * @param sh The shell receiving the options
  * @param argc Number of args
  * @param argv The arg array
  */
-void parse_args(int argc, char **argv);
+void parse_args(struct shell *sh, int argc, char **argv);
+
+/**
+ * @brief Turn a shell option on or off by name. Options that take a value
+ * are given as name=value, prealloc=SIZE accepts K, M and G suffixes.
+ *
+ * @param sh The shell
+ * @param name Option name as used by set -o
+ * @param on New value
+ * @return 0 on success, -1 if there is no such option
+ */
+int sh_set_option(struct shell *sh, const char *name, bool on);
 
 #ifdef __cplusplus
 } // extern "C"
@@ -0,0 +1,334 @@
+/**
+ * launch.c
+ * Process creation backends. The fork backend copies the shell and sets
+ * the child up by hand, the spawn backend uses posix_spawn which glibc
+ * implements with clone(CLONE_VM|CLONE_VFORK) so no page tables are
+ * copied no matter how large the shell has grown.
+ */
+
+#define _GNU_SOURCE
+#include "launch.h"
+#include "lab.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <paths.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* glibc 2.35 can hand the terminal to the child as a spawn file action */
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+#define LAUNCH_SPAWN_TCSETPGRP 1
+#endif
+
+/* Signals the shell ignores or handles that children get back at default */
+static const int child_default_signals[] = {
+    SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGCHLD, SIGPIPE,
+};
+
+#define NELEMS(a) (sizeof(a) / sizeof((a)[0]))
+
+/** Restore default signal handling in a freshly forked child. */
+void launch_child_signals(void) {
+    for (size_t i = 0; i < NELEMS(child_default_signals); i++)
+        signal(child_default_signals[i], SIG_DFL);
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+}
+
+/** Build the argv used to run a file without a #! line through sh. */
+static void sh_argv(const char *path, char **argv, char **out) {
+    out[0] = "sh";
+    out[1] = (char *)path;
+    int i = 1;
+    for (; argv[i]; i++) out[i + 1] = argv[i];
+    out[i + 1] = NULL;
+}
+
+/** exec path, running it with /bin/sh the way execvp does if it has no #! line. */
+void launch_exec(const char *path, char **argv, char **envp) {
+    execve(path, argv, envp);
+    if (errno != ENOEXEC) return;
+
+    int argc = 0;
+    while (argv[argc]) argc++;
+    char *shargv[argc + 2];
+    sh_argv(path, argv, shargv);
+    execve(_PATH_BSHELL, shargv, envp);
+}
+
+/** Open a redirection target, reserving space for output files. */
+static int open_target(const struct launch_action *a) {
+    int fd = open(a->path, a->flags, 0666);
+    // O_NOATIME is only allowed on files we own, it is a hint so drop it
+    if (fd == -1 && errno == EPERM && (a->flags & O_NOATIME))
+        fd = open(a->path, a->flags & ~O_NOATIME, 0666);
+    if (fd == -1) return -1;
+
+    if (a->prealloc > 0) {
+        off_t at = (a->flags & O_APPEND) ? lseek(fd, 0, SEEK_END) : 0;
+        // Space is reserved without changing the size, a filesystem that
+        // cannot do this just gets the file written normally
+        if (at != -1 && fallocate(fd, FALLOC_FL_KEEP_SIZE, at, a->prealloc) == -1 &&
+            errno != EOPNOTSUPP && errno != ENOSYS) {
+            int e = errno;
+            close(fd);
+            errno = e;
+            return -1;
+        }
+    }
+    return fd;
+}
+
+/** Perform one descriptor action. */
+int launch_apply(const struct launch_action *a) {
+    switch (a->op) {
+    case LAUNCH_DUP2:
+        if (a->src == a->fd) {
+            // dup2 onto itself keeps close-on-exec, clear it by hand
+            int fl = fcntl(a->fd, F_GETFD);
+            if (fl == -1) return -1;
+            return fcntl(a->fd, F_SETFD, fl & ~FD_CLOEXEC);
+        }
+        return dup2(a->src, a->fd) == -1 ? -1 : 0;
+    case LAUNCH_OPEN: {
+        int fd = open_target(a);
+        if (fd == -1) return -1;
+        if (fd != a->fd) {
+            if (dup2(fd, a->fd) == -1) {
+                int e = errno;
+                close(fd);
+                errno = e;
+                return -1;
+            }
+            close(fd);
+        }
+        return 0;
+    }
+    case LAUNCH_CLOSE:
+        // Closing something that is not open is not an error in sh
+        if (close(a->fd) == -1 && errno != EBADF) return -1;
+        return 0;
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+/* What a forked child reports back when it could not exec */
+struct child_error {
+    int err;
+    int action;     // index into req->actions, -1 for exec
+};
+
+/**
+ * Fork a child that execs the request. If exec fails the child sends errno
+ * back over a close-on-exec pipe, the child is reaped here and the failure
+ * reported like a failed posix_spawn.
+ */
+static pid_t launch_fork(struct shell *sh, const struct launch_req *req, struct launch_error *e) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        e->err = errno;
+        return -1;
+    }
+    // Brought up to date in the parent, so the work is not redone next time
+    char **envp = req->fn || req->body ? NULL : vars_environ(sh);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        pid_t child = getpid();
+        pid_t pgid = req->pgid ? req->pgid : child;
+        setpgid(child, pgid);
+        if (req->foreground && sh->shell_is_interactive) tcsetpgrp(sh->shell_terminal, pgid);
+        launch_child_signals();
+        const struct placement *place = affinity_current(sh);
+        if (place) placement_apply(place);
+
+        struct child_error ce = {0, -1};
+        for (size_t i = 0; i < req->nactions; i++) {
+            if (launch_apply(&req->actions[i]) == -1) {
+                ce.action = (int)i;
+                break;
+            }
+        }
+        if (ce.action == -1) {
+            if (req->fn) {
+                close(fds[1]);
+                _exit(req->fn(sh, req->argv));
+            }
+            if (req->body) {
+                close(fds[1]);
+                _exit(req->body(sh, req->arg));
+            }
+            launch_exec(req->path, req->argv, envp);
+        }
+        ce.err = errno;
+        ssize_t rc = write(fds[1], &ce, sizeof(ce));
+        UNUSED(rc);
+        _exit(127);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        e->err = errno;
+        close(fds[0]);
+        return -1;
+    }
+
+    // Set the group from both sides to avoid racing the child
+    pid_t pgid = req->pgid ? req->pgid : pid;
+    setpgid(pid, pgid);
+    if (req->foreground && sh->shell_is_interactive) tcsetpgrp(sh->shell_terminal, pgid);
+
+    struct child_error ce;
+    ssize_t n;
+    while ((n = read(fds[0], &ce, sizeof(ce))) == -1 && errno == EINTR)
+        ;
+    close(fds[0]);
+    if (n != sizeof(ce)) return pid;
+
+    while (waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+        ;
+    e->err = ce.err;
+    e->action = ce.action >= 0 ? &req->actions[ce.action] : NULL;
+    return -1;
+}
+
+/** True when posix_spawn attributes can express everything req asks for. */
+static bool spawn_can_express(struct shell *sh, const struct launch_req *req) {
+    // There are no spawn attributes for CPU affinity or memory policy
+    if (req->fn || req->body || affinity_current(sh)) return false;
+    for (size_t i = 0; i < req->nactions; i++) {
+        if (req->actions[i].op == LAUNCH_OPEN && req->actions[i].prealloc > 0) return false;
+    }
+#ifdef LAUNCH_SPAWN_TCSETPGRP
+    UNUSED(sh);
+    return true;
+#else
+    // Without the tcsetpgrp file action the child could touch the terminal
+    // before the parent hands it over
+    return !(req->foreground && sh->shell_is_interactive);
+#endif
+}
+
+/**
+ * posix_spawn does not say which step failed. Check the files the child
+ * would have opened so a missing input file is not blamed on the program.
+ */
+static const struct launch_action *spawn_blame(const struct launch_req *req) {
+    for (size_t i = 0; i < req->nactions; i++) {
+        const struct launch_action *a = &req->actions[i];
+        if (a->op != LAUNCH_OPEN) continue;
+        if ((a->flags & O_ACCMODE) == O_RDONLY) {
+            if (access(a->path, R_OK) == -1) return a;
+        } else if (access(a->path, F_OK) == 0) {
+            if (access(a->path, W_OK) == -1) return a;
+        } else {
+            char dir[PATH_MAX];
+            snprintf(dir, sizeof(dir), "%s", a->path);
+            if (access(dirname(dir), W_OK | X_OK) == -1) return a;
+        }
+    }
+    return NULL;
+}
+
+/** Start the request with posix_spawn. */
+static pid_t launch_spawn(struct shell *sh, const struct launch_req *req, struct launch_error *e,
+                          bool noatime) {
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    sigset_t defaults, none;
+    short flags = POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+#ifdef POSIX_SPAWN_USEVFORK
+    flags |= POSIX_SPAWN_USEVFORK;
+#endif
+
+    sigemptyset(&defaults);
+    for (size_t i = 0; i < NELEMS(child_default_signals); i++)
+        sigaddset(&defaults, child_default_signals[i]);
+    sigemptyset(&none);
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setpgroup(&attr, req->pgid);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setflags(&attr, flags);
+
+    posix_spawn_file_actions_init(&actions);
+#ifdef LAUNCH_SPAWN_TCSETPGRP
+    // Runs after the child joined its group, with all signals blocked and
+    // before the descriptor actions can replace the terminal on fd 0
+    if (req->foreground && sh->shell_is_interactive)
+        posix_spawn_file_actions_addtcsetpgrp_np(&actions, sh->shell_terminal);
+#else
+    UNUSED(sh);
+#endif
+    for (size_t i = 0; i < req->nactions; i++) {
+        const struct launch_action *a = &req->actions[i];
+        switch (a->op) {
+        case LAUNCH_DUP2:
+            posix_spawn_file_actions_adddup2(&actions, a->src, a->fd);
+            break;
+        case LAUNCH_OPEN:
+            posix_spawn_file_actions_addopen(&actions, a->fd, a->path,
+                                             noatime ? a->flags : a->flags & ~O_NOATIME, 0666);
+            break;
+        case LAUNCH_CLOSE:
+            posix_spawn_file_actions_addclose(&actions, a->fd);
+            break;
+        }
+    }
+
+    pid_t pid;
+    char **envp = vars_environ(sh);
+    int rc = posix_spawn(&pid, req->path, &actions, &attr, req->argv, envp);
+    if (rc == ENOEXEC) {
+        int argc = 0;
+        while (req->argv[argc]) argc++;
+        char *shargv[argc + 2];
+        sh_argv(req->path, req->argv, shargv);
+        rc = posix_spawn(&pid, _PATH_BSHELL, &actions, &attr, shargv, envp);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    // The group and terminal were set up by the child before exec
+    if (rc == 0) return pid;
+    e->err = rc;
+    e->action = spawn_blame(req);
+    return -1;
+}
+
+/** True if any open action asks for O_NOATIME. */
+static bool wants_noatime(const struct launch_req *req) {
+    for (size_t i = 0; i < req->nactions; i++) {
+        if (req->actions[i].op == LAUNCH_OPEN && (req->actions[i].flags & O_NOATIME)) return true;
+    }
+    return false;
+}
+
+/** Start a program with the configured backend. */
+pid_t launch(struct shell *sh, const struct launch_req *req, struct launch_error *e) {
+    e->err = 0;
+    e->action = NULL;
+    if (sh->options[SH_OPT_ZYGOTE] && !req->fn && !req->body) {
+        pid_t pid = zygote_launch(sh, req, e);
+        // Without an error the helper could not take it, start it here
+        if (pid != -1 || e->err) return pid;
+    }
+    if (!sh->options[SH_OPT_SPAWN] || !spawn_can_express(sh, req))
+        return launch_fork(sh, req, e);
+
+    pid_t pid = launch_spawn(sh, req, e, true);
+    // Spawn cannot retry an open without O_NOATIME by itself
+    if (pid == -1 && e->err == EPERM && wants_noatime(req))
+        pid = launch_spawn(sh, req, e, false);
+    return pid;
+}
@@ -0,0 +1,97 @@
+#ifndef LAUNCH_H
+#define LAUNCH_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct shell;
+
+enum launch_op {
+    LAUNCH_DUP2,    // make fd a copy of src
+    LAUNCH_OPEN,    // open path with flags as fd
+    LAUNCH_CLOSE,   // close fd
+};
+
+/**
+ * @brief File descriptor setup done in the child before exec. Actions run
+ * in order, either by hand after fork or as posix_spawn file actions.
+ */
+struct launch_action {
+    int op;
+    int fd;
+    int src;            // LAUNCH_DUP2
+    const char *path;   // LAUNCH_OPEN
+    int flags;          // LAUNCH_OPEN, O_NOATIME is dropped if not permitted
+    off_t prealloc;     // LAUNCH_OPEN, bytes to reserve with fallocate
+};
+
+/**
+ * @brief Everything needed to start one external program.
+ */
+struct launch_req {
+    const char *path;   // file to exec, already resolved
+    char **argv;
+    pid_t pgid;         // group to join, 0 to lead a new one
+    bool foreground;    // hand the terminal to the group
+    const struct launch_action *actions;
+    size_t nactions;
+    // Run this in a forked copy of the shell instead of exec, used for
+    // builtins that are part of a pipeline
+    int (*fn)(struct shell *sh, char **argv);
+    // The same for shell functions and compound commands, run as body(arg)
+    int (*body)(struct shell *sh, const void *arg);
+    const void *arg;
+};
+
+/**
+ * @brief Why a launch failed
+ */
+struct launch_error {
+    int err;                            // errno value
+    const struct launch_action *action; // the action that failed, NULL for exec
+};
+
+/**
+ * @brief Start a program with the backend selected by the zygote and
+ * spawn options. The zygote helper takes every external program it can.
+ * Otherwise posix_spawn is used when the request can be expressed with
+ * spawn attributes, fork and exec otherwise. Requests with fn or body set
+ * or with preallocated output files always fork.
+ *
+ * @param sh The shell
+ * @param req What to start
+ * @param e Receives the reason if the program could not be started
+ * @return The pid of the running child or -1 if it could not be started
+ */
+pid_t launch(struct shell *sh, const struct launch_req *req, struct launch_error *e);
+
+/**
+ * @brief Perform one descriptor action in the calling process. Used by
+ * forked children and for builtins that run inside the shell.
+ *
+ * @param a The action
+ * @return 0 on success, -1 with errno set on failure
+ */
+int launch_apply(const struct launch_action *a);
+
+/**
+ * @brief exec a resolved path, running a file without a #! line with
+ * /bin/sh the way execvp does. Returns only on failure, with errno set.
+ */
+void launch_exec(const char *path, char **argv, char **envp);
+
+/**
+ * @brief Reset signal dispositions and the signal mask to what a new
+ * program expects. Called in children before exec.
+ */
+void launch_child_signals(void);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // LAUNCH_H
@@ -0,0 +1,292 @@
+/**
+ * parallel.c
+ * The parallel builtin, an xargs -P that lives inside the shell. Every
+ * child is watched through a pidfd in the shell's event loop, so the shell
+ * sleeps until any one of them exits no matter how many are running.
+ */
+
+#define _GNU_SOURCE
+#include "parallel.h"
+#include "lab.h"
+#include "pipeline.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Failed job count is reported as exit status, capped like GNU parallel
+#define PARALLEL_MAX_FAILED 101
+
+/* State of one run the child watches update */
+struct par_run {
+    struct shell *sh;
+    size_t running;
+    bool stop;      // a job was interrupted, start no more
+};
+
+struct par_job {
+    char **argv;
+    pid_t pid;
+    int watch;      // in the event loop while running, -1 otherwise
+    int status;     // wait status, -1 while not finished or never run
+    struct timespec start;
+    double wall;
+    struct par_run *run;
+};
+
+/** Seconds from a to b. */
+static double elapsed(const struct timespec *a, const struct timespec *b) {
+    return (double)(b->tv_sec - a->tv_sec) + (double)(b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+/** Free an argv built by build_argv. */
+static void argv_free(char **argv) {
+    if (!argv) return;
+    for (size_t i = 0; argv[i]; i++) free(argv[i]);
+    free(argv);
+}
+
+/** Copy w with every {} replaced by arg. */
+static char *substitute(const char *w, const char *arg) {
+    size_t alen = strlen(arg), len = 0;
+    for (const char *p = w; *p;) {
+        if (p[0] == '{' && p[1] == '}') {
+            len += alen;
+            p += 2;
+        } else {
+            len++;
+            p++;
+        }
+    }
+    char *out = malloc(len + 1);
+    if (!out) return NULL;
+    char *o = out;
+    for (const char *p = w; *p;) {
+        if (p[0] == '{' && p[1] == '}') {
+            memcpy(o, arg, alen);
+            o += alen;
+            p += 2;
+        } else {
+            *o++ = *p++;
+        }
+    }
+    *o = '\0';
+    return out;
+}
+
+/** Fill the template with arg, appending it when there is no {}. */
+static char **build_argv(char **tmpl, const char *arg) {
+    size_t n = 0;
+    bool placeholder = false;
+    for (; tmpl[n]; n++) {
+        if (strstr(tmpl[n], "{}")) placeholder = true;
+    }
+    size_t argc = n + !placeholder;
+    char **argv = calloc(argc + 1, sizeof(*argv));
+    if (!argv) return NULL;
+    for (size_t i = 0; i < argc; i++) {
+        argv[i] = i < n ? substitute(tmpl[i], arg) : strdup(arg);
+        if (!argv[i]) {
+            argv_free(argv);
+            return NULL;
+        }
+    }
+    return argv;
+}
+
+/** Read one argument per line, skipping empty lines. */
+static int read_jobs(FILE *in, char **tmpl, struct par_job **out, size_t *n) {
+    struct par_job *jobs = NULL;
+    size_t cap = 0;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    *n = 0;
+    while ((len = getline(&line, &size, in)) != -1) {
+        if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+        if (len == 0) continue;
+        if (*n == cap) {
+            cap = cap ? cap * 2 : 64;
+            struct par_job *grown = realloc(jobs, cap * sizeof(*jobs));
+            if (!grown) goto fail;
+            jobs = grown;
+        }
+        struct par_job *j = &jobs[*n];
+        *j = (struct par_job){.pid = -1, .watch = -1, .status = -1};
+        if (!(j->argv = build_argv(tmpl, line))) goto fail;
+        (*n)++;
+    }
+    free(line);
+    *out = jobs;
+    return 0;
+
+fail:
+    perror("parallel");
+    free(line);
+    for (size_t i = 0; i < *n; i++) argv_free(jobs[i].argv);
+    free(jobs);
+    *n = 0;
+    return -1;
+}
+
+/** Reap a job that exited and note its wall time. */
+static void job_finish(struct shell *sh, struct par_job *j) {
+    int status;
+    struct rusage ru;
+    struct timespec now;
+    pid_t pid;
+    while ((pid = wait4(j->pid, &status, 0, &ru)) == -1) {
+        if (errno != EINTR) {
+            status = W_EXITCODE(1, 0);
+            break;
+        }
+    }
+    if (pid > 0) jobs_account(&sh->jobs, &ru);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    j->status = status;
+    j->wall = elapsed(&j->start, &now);
+    ev_del(&sh->loop, j->watch);
+    j->watch = -1;
+}
+
+/** True when a job was killed by ^C. */
+static bool interrupted(const struct par_job *j) {
+    return j->status != -1 && WIFSIGNALED(j->status) && WTERMSIG(j->status) == SIGINT;
+}
+
+/** Event loop callback for a job whose child exited. */
+static void job_exited(struct evloop *l, int fd, unsigned events, void *arg) {
+    struct par_job *j = arg;
+    UNUSED(l)
+    UNUSED(fd)
+    UNUSED(events)
+    job_finish(j->run->sh, j);
+    j->run->running--;
+    if (interrupted(j)) j->run->stop = true;
+}
+
+/** Start a job, returns true while it is running and watched. */
+static bool job_start(struct shell *sh, struct par_job *j, pid_t pgid) {
+    int code;
+    const struct placement *outer = sh->affinity.scope;
+    struct placement spread;
+    if (affinity_spread(sh, &spread)) sh->affinity.scope = &spread;
+    clock_gettime(CLOCK_MONOTONIC, &j->start);
+    j->pid = start_command(sh, j->argv, pgid, &code);
+    sh->affinity.scope = outer;
+    if (j->pid == -1) {
+        j->status = W_EXITCODE(code, 0);
+        return false;
+    }
+    j->watch = ev_child(&sh->loop, j->pid, job_exited, j);
+    if (j->watch == -1) {
+        // Kernel without pidfds, this job at least still gets waited for
+        job_finish(sh, j);
+        return false;
+    }
+    return true;
+}
+
+/** Print the per-job table and the totals, returns the failure count. */
+static size_t report(const struct par_job *jobs, size_t n, double wall) {
+    size_t failed = 0;
+    double busy = 0;
+    fprintf(stderr, "%6s %8s %10s  %s\n", "job", "status", "wall", "command");
+    for (size_t i = 0; i < n; i++) {
+        const struct par_job *j = &jobs[i];
+        char status[32];
+        if (j->status == -1) snprintf(status, sizeof(status), "-");
+        else if (WIFSIGNALED(j->status)) snprintf(status, sizeof(status), "SIG%s", sigabbrev_np(WTERMSIG(j->status)));
+        else snprintf(status, sizeof(status), "%d", WEXITSTATUS(j->status));
+        if (j->status == -1 || !WIFEXITED(j->status) || WEXITSTATUS(j->status)) failed++;
+        busy += j->wall;
+
+        fprintf(stderr, "%6zu %8s %9.3fs ", i + 1, status, j->wall);
+        for (size_t k = 0; j->argv[k]; k++) fprintf(stderr, " %s", j->argv[k]);
+        fputc('\n', stderr);
+    }
+    fprintf(stderr, "%zu jobs, %zu failed, %.3fs wall, %.3fs total\n", n, failed, wall, busy);
+    return failed;
+}
+
+/** parallel [-j jobs] [-a file] command [arg ...] */
+int builtin_parallel(struct shell *sh, char **argv) {
+    int opt, argc = 0;
+    long max = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *file = NULL;
+    while (argv[argc]) argc++;
+
+    optind = 0;
+    while ((opt = getopt(argc, argv, "+j:a:")) != -1) {
+        char *end;
+        switch (opt) {
+        case 'j':
+            max = strtol(optarg, &end, 10);
+            if (*end || max < 1) {
+                fprintf(stderr, "parallel: %s: invalid job count\n", optarg);
+                return 2;
+            }
+            break;
+        case 'a': file = optarg; break;
+        default: goto usage;
+        }
+    }
+    if (optind == argc) goto usage;
+    if (max < 1) max = 1;
+
+    FILE *in = stdin;
+    if (file && !(in = fopen(file, "r"))) {
+        fprintf(stderr, "parallel: %s: %s\n", file, strerror(errno));
+        return 1;
+    }
+    struct par_job *jobs;
+    size_t n;
+    int rc = read_jobs(in, &argv[optind], &jobs, &n);
+    if (in != stdin) fclose(in);
+    else clearerr(stdin);
+    if (rc == -1) return 1;
+    if (n == 0) return 0;
+
+    // Children join our group so ^C reaches them like any foreground job
+    pid_t pgid = getpgrp();
+    struct par_run run = {.sh = sh};
+    size_t next = 0;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    fflush(stdout);
+    fflush(stderr);
+
+    while (run.running || (next < n && !run.stop)) {
+        while (!run.stop && next < n && run.running < (size_t)max) {
+            struct par_job *j = &jobs[next++];
+            j->run = &run;
+            if (job_start(sh, j, pgid)) run.running++;
+            else run.stop = interrupted(j);
+        }
+        if (!run.running) continue;
+
+        if (ev_run_once(&sh->loop, -1) == -1 && errno != EINTR) {
+            // Cannot watch them any more, wait in order instead
+            perror("parallel");
+            for (size_t i = 0; i < next; i++) {
+                if (jobs[i].watch != -1) job_finish(sh, &jobs[i]);
+            }
+            run.running = 0;
+            run.stop = true;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    size_t failed = report(jobs, n, elapsed(&t0, &t1));
+    for (size_t i = 0; i < n; i++) argv_free(jobs[i].argv);
+    free(jobs);
+    return failed > PARALLEL_MAX_FAILED ? PARALLEL_MAX_FAILED : (int)failed;
+
+usage:
+    fprintf(stderr, "usage: parallel [-j jobs] [-a file] command [arg ...]\n");
+    return 2;
+}
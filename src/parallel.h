@@ -0,0 +1,32 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct shell;
+
+/**
+ * @brief parallel [-j jobs] [-a file] command [arg ...]
+ *
+ * Run command once for every line of stdin, or of file with -a, with at
+ * most jobs copies running at the same time (default: one per online CPU).
+ * Every {} in the template is replaced by the line, without any {} the line
+ * is appended as the last argument. Children are waited for through pidfds
+ * on the shell's event loop, with set -o spread they are dealt out over
+ * the NUMA nodes or CPUs. When all are done the exit status and wall time of
+ * every job is printed on stderr. A job killed by SIGINT stops the
+ * remaining ones from starting.
+ *
+ * @param sh The shell
+ * @param argv The builtin's arguments
+ * @return The number of failed jobs capped at 101, or 2 on a usage error
+ */
+int builtin_parallel(struct shell *sh, char **argv);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // PARALLEL_H
@@ -0,0 +1,1035 @@
+/**
+ * parse.c
+ * Recursive descent parser for the shell grammar. The source is tokenized
+ * once, newlines between tokens become separator tokens of their own and
+ * every word is split into literal and parameter parts, so nothing is
+ * scanned again when a loop body runs for the thousandth time.
+ * Here-document bodies are cut out of the source before tokenizing and
+ * handed to their << operators in order.
+ */
+
+#define _GNU_SOURCE
+#include "parse.h"
+#include "pipeline.h"
+#include "tokenize.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// One or more newlines between two tokens, only the parser knows this kind
+#define TOK_NEWLINE (TOK_IONUM + 1)
+
+/* A here-document, its body is cut out of the source before tokenizing */
+struct heredoc {
+    const char *delim;  // without its quotes
+    size_t dlen;
+    bool strip;         // <<-, leading tabs are dropped
+    bool quoted;        // some of the delimiter was quoted, the body stays literal
+    char *body;         // NULL until its lines were read
+    size_t len;
+};
+
+struct parser {
+    struct arena *a;
+    const char *src;    // the source without comments, owned by a
+    struct token *tok;
+    size_t n;
+    size_t i;           // next token
+    int status;         // first error or PARSE_MORE code, 0 while all is well
+    int depth;          // compound commands open at the current token
+    struct heredoc *docs;   // in the order their operators appear
+    size_t ndocs;
+    size_t docs_cap;
+    size_t nbodies;     // docs whose body was read
+    size_t next_doc;    // the one the next << takes
+};
+
+static struct node *parse_list(struct parser *p);
+static struct node *parse_command(struct parser *p);
+
+/** Check for a valid name. */
+bool is_name(const char *s, size_t len) {
+    if (len == 0 || isdigit((unsigned char)s[0])) return false;
+    for (size_t i = 0; i < len; i++) {
+        if (!isalnum((unsigned char)s[i]) && s[i] != '_') return false;
+    }
+    return true;
+}
+
+/** Bytes after which # starts a comment. */
+static bool ends_word(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == ';' || c == '&' || c == '|' ||
+           c == '(' || c == ')' || c == '<' || c == '>';
+}
+
+/** Copy the tokens into p, adding a newline token wherever a gap has one. */
+static int add_newlines(struct parser *p, const struct tok_index *idx) {
+    p->tok = malloc((2 * idx->n + 1) * sizeof(*p->tok));
+    if (!p->tok) return -1;
+    size_t prev = 0;
+    for (size_t i = 0; i < idx->n; i++) {
+        const struct token *t = &idx->tok[i];
+        const char *nl = memchr(p->src + prev, '\n', t->off - prev);
+        if (nl && i > 0)
+            p->tok[p->n++] = (struct token){.off = (uint32_t)(nl - p->src), .len = 1, .kind = TOK_NEWLINE};
+        p->tok[p->n++] = *t;
+        prev = t->off + t->len;
+    }
+    return 0;
+}
+
+/** The next token, NULL at the end. */
+static const struct token *peek(const struct parser *p) {
+    return p->i < p->n ? &p->tok[p->i] : NULL;
+}
+
+/** True when t is the operator or unquoted word s. */
+static bool is_tok(const struct parser *p, const struct token *t, const char *s) {
+    size_t len = strlen(s);
+    return t && t->kind != TOK_NEWLINE && !(t->flags & TOKF_QUOTED) && t->len == len &&
+           memcmp(p->src + t->off, s, len) == 0;
+}
+
+/** True when the next token is s. */
+static bool at(const struct parser *p, const char *s) {
+    return is_tok(p, peek(p), s);
+}
+
+/** True at a newline token. */
+static bool at_newline(const struct parser *p) {
+    const struct token *t = peek(p);
+    return t && t->kind == TOK_NEWLINE;
+}
+
+/** Skip any newline tokens. */
+static void skip_newlines(struct parser *p) {
+    while (at_newline(p)) p->i++;
+}
+
+/** Note that the program goes on past the end of the text. */
+static void *need_more(struct parser *p) {
+    if (!p->status) p->status = p->depth ? PARSE_MORE_CLOSE : PARSE_MORE;
+    return NULL;
+}
+
+/** Report a syntax error at the next token. */
+static void *fail(struct parser *p) {
+    if (p->status) return NULL;
+    const struct token *t = peek(p);
+    if (!t && p->depth) return need_more(p);
+    if (!t || t->kind == TOK_NEWLINE)
+        fprintf(stderr, "syntax error near unexpected token `newline'\n");
+    else
+        fprintf(stderr, "syntax error near unexpected token `%.*s'\n", (int)t->len, p->src + t->off);
+    p->status = PARSE_ERROR;
+    return NULL;
+}
+
+/** Report running out of memory. */
+static void *oom(struct parser *p) {
+    if (!p->status) perror("parse");
+    p->status = PARSE_ERROR;
+    return NULL;
+}
+
+/** Consume s or fail. */
+static bool expect(struct parser *p, const char *s) {
+    if (!at(p, s)) return fail(p) != NULL;
+    p->i++;
+    return true;
+}
+
+/** Zeroed memory from the parser's arena. */
+static void *zalloc(struct parser *p, size_t size) {
+    void *m = arena_alloc(p->a, size);
+    if (!m) return oom(p);
+    return memset(m, 0, size);
+}
+
+/** A new node of kind. */
+static struct node *new_node(struct parser *p, int kind) {
+    struct node *n = zalloc(p, sizeof(*n));
+    if (n) {
+        n->kind = kind;
+        n->unit = -1;
+    }
+    return n;
+}
+
+/** Room for one more element in an arena array, doubling when it is full. */
+static void *grow(struct parser *p, void *v, size_t n, size_t *cap, size_t size) {
+    if (n < *cap) return v;
+    size_t ncap = *cap ? *cap * 2 : 4;
+    void *m = arena_alloc(p->a, ncap * size);
+    if (!m) return oom(p);
+    if (n) memcpy(m, v, n * size);
+    *cap = ncap;
+    return m;
+}
+
+/** Copy the source text from token first through token last. */
+static const char *span_text(struct parser *p, size_t first, size_t last) {
+    size_t off = p->tok[first].off, end = p->tok[last].off + p->tok[last].len;
+    char *s = arena_alloc(p->a, end - off + 1);
+    if (!s) return oom(p);
+    memcpy(s, p->src + off, end - off);
+    s[end - off] = '\0';
+    return s;
+}
+
+/**
+ * Length of the parameter expansion at s, which points at a $. Returns 0
+ * when the $ is just a character and -1 for a malformed ${...}.
+ */
+static long param_at(const char *s, const char *end, const char **name, size_t *len) {
+    const char *n = s + 1;
+    if (n >= end) return 0;
+    if (*n == '{') {
+        const char *close = memchr(n, '}', (size_t)(end - n));
+        if (!close) return -1;
+        size_t l = (size_t)(close - n - 1);
+        bool digits = l > 0;
+        for (size_t i = 0; i < l; i++) digits = digits && isdigit((unsigned char)n[1 + i]);
+        if (!is_name(n + 1, l) && !digits && !(l == 1 && strchr("?#$@*", n[1]))) return -1;
+        *name = n + 1;
+        *len = l;
+        return close + 1 - s;
+    }
+    size_t l = 0;
+    if (isalpha((unsigned char)*n) || *n == '_') {
+        while (n + l < end && (isalnum((unsigned char)n[l]) || n[l] == '_')) l++;
+    } else if (isdigit((unsigned char)*n) || strchr("?#$@*", *n)) {
+        l = 1;
+    } else {
+        return 0;
+    }
+    *name = n;
+    *len = l;
+    return (long)(l + 1);
+}
+
+/* Parts of a word being split up */
+struct word_builder {
+    struct word_part *parts;
+    size_t n;
+    char *o;    // where the next literal byte goes
+};
+
+/** Make sure the last part is literal text with the given quoting that ends at o. */
+static void wb_text(struct word_builder *b, bool quoted) {
+    struct word_part *l = b->n ? &b->parts[b->n - 1] : NULL;
+    if (!l || l->kind != WP_TEXT || l->quoted != quoted || l->text + l->len != b->o)
+        b->parts[b->n++] = (struct word_part){WP_TEXT, quoted, b->o, 0, NULL};
+}
+
+/** Append one literal byte. */
+static void wb_byte(struct word_builder *b, char c, bool quoted) {
+    wb_text(b, quoted);
+    *b->o++ = c;
+    b->parts[b->n - 1].len++;
+}
+
+/** Append a parameter, returns the bytes of s it used or -1. */
+static long wb_param(struct word_builder *b, const char *s, const char *end, bool quoted) {
+    const char *name;
+    size_t len;
+    long used = param_at(s, end, &name, &len);
+    if (used == 0) wb_byte(b, '$', quoted);
+    else if (used > 0) b->parts[b->n++] = (struct word_part){WP_PARAM, quoted, name, len, NULL};
+    return used ? used : 1;
+}
+
+/**
+ * Append a command substitution, s points at its $( or backquote. The
+ * command is parsed right away. Returns the bytes of s it used, or -1
+ * after reporting an error.
+ */
+static long wb_subst(struct parser *p, struct word_builder *b, const char *s, const char *end, bool quoted) {
+    bool bq = *s == '`';
+    size_t from = bq ? 1 : 2;
+    // Would otherwise run as a substitution of a subshell
+    if (!bq && s + 2 < end && s[2] == '(') {
+        fprintf(stderr, "syntax error: arithmetic expansion $(( )) is not supported\n");
+        p->status = PARSE_ERROR;
+        return -1;
+    }
+    size_t close = tok_subst_end(s, (size_t)(end - s), from, bq ? '`' : '(');
+    if (close == SIZE_MAX) {
+        fprintf(stderr, "syntax error: unterminated command substitution\n");
+        p->status = PARSE_ERROR;
+        return -1;
+    }
+    char *body = (char *)s + from;
+    size_t len = close - from - 1;
+    if (bq) {
+        // Inside backquotes a backslash only escapes \, ` and $
+        char *copy = arena_alloc(p->a, len + 1);
+        if (!copy) {
+            oom(p);
+            return -1;
+        }
+        size_t k = 0;
+        for (size_t i = 0; i < len; i++) {
+            if (body[i] == '\\' && i + 1 < len && strchr("\\`$", body[i + 1])) i++;
+            copy[k++] = body[i];
+        }
+        copy[k] = '\0';
+        body = copy;
+        len = k;
+    }
+    struct node *cmd;
+    int rc = parse_program(p->a, body, len, &cmd);
+    if (rc != 0) {
+        if (rc != PARSE_ERROR) fprintf(stderr, "syntax error: unexpected end of command substitution\n");
+        p->status = PARSE_ERROR;
+        return -1;
+    }
+    b->parts[b->n++] = (struct word_part){WP_SUBST, quoted, body, len, cmd};
+    return (long)close;
+}
+
+/** True when s starts a command substitution. */
+static bool subst_at(const char *s, const char *end) {
+    return *s == '`' || (*s == '$' && s + 1 < end && s[1] == '(');
+}
+
+/** Split the word token t into parts, cooking it right away when it has no expansions. */
+static bool parse_word(struct parser *p, const struct token *t, struct word *w) {
+    const char *s = p->src + t->off, *end = s + t->len;
+    size_t special = 0;
+    for (const char *c = s; c < end; c++)
+        special += *c == '$' || *c == '\'' || *c == '"' || *c == '\\' || *c == '`';
+
+    char *buf = arena_alloc(p->a, t->out + 1);
+    struct word_builder b = {arena_alloc(p->a, (2 * special + 2) * sizeof(*b.parts)), 0, buf};
+    if (!buf || !b.parts) return oom(p) != NULL;
+
+    bool params = false, glob = false;
+    while (s < end) {
+        char c = *s;
+        if (c == '\'') {
+            wb_text(&b, true);
+            for (s++; *s != '\''; s++) wb_byte(&b, *s, true);
+            s++;
+        } else if (c == '"') {
+            wb_text(&b, true);
+            for (s++; *s != '"';) {
+                if (*s == '\\' && (s[1] == '"' || s[1] == '\\' || s[1] == '$' || s[1] == '`')) {
+                    wb_byte(&b, s[1], true);
+                    s += 2;
+                } else if (subst_at(s, end)) {
+                    long used = wb_subst(p, &b, s, end, true);
+                    if (used < 0) return false;
+                    params = true;
+                    s += used;
+                } else if (*s == '$') {
+                    long used = wb_param(&b, s, end, true);
+                    if (used < 0) goto bad;
+                    params |= b.parts[b.n - 1].kind == WP_PARAM;
+                    s += used;
+                } else {
+                    wb_byte(&b, *s++, true);
+                }
+            }
+            s++;
+        } else if (c == '\\') {
+            if (s + 1 < end) wb_byte(&b, s[1], true);
+            s += 2;
+        } else if (subst_at(s, end)) {
+            long used = wb_subst(p, &b, s, end, false);
+            if (used < 0) return false;
+            params = true;
+            s += used;
+        } else if (c == '$') {
+            long used = wb_param(&b, s, end, false);
+            if (used < 0) goto bad;
+            params |= b.parts[b.n - 1].kind == WP_PARAM;
+            s += used;
+        } else {
+            glob |= c == '*' || c == '?' || (c == '[' && memchr(s, ']', (size_t)(end - s)));
+            wb_byte(&b, c, false);
+            s++;
+        }
+    }
+    *b.o = '\0';
+    *w = (struct word){params ? NULL : buf, b.parts, b.n, glob};
+    return true;
+
+bad:
+    fprintf(stderr, "%.*s: bad substitution\n", (int)t->len, p->src + t->off);
+    p->status = PARSE_ERROR;
+    return false;
+}
+
+/** Split the body of here-document d into parts, like a word in double quotes. */
+static bool heredoc_word(struct parser *p, const struct heredoc *d, struct word *w) {
+    const char *s = d->body, *end = s + d->len;
+    if (d->quoted) {
+        struct word_part *part = arena_alloc(p->a, sizeof(*part));
+        if (!part) return oom(p) != NULL;
+        *part = (struct word_part){WP_TEXT, true, d->body, d->len, NULL};
+        *w = (struct word){d->body, part, 1, false};
+        return true;
+    }
+    size_t special = 0;
+    for (const char *c = s; c < end; c++) special += *c == '$' || *c == '\\' || *c == '`';
+
+    char *buf = arena_alloc(p->a, d->len + 1);
+    struct word_builder b = {arena_alloc(p->a, (2 * special + 2) * sizeof(*b.parts)), 0, buf};
+    if (!buf || !b.parts) return oom(p) != NULL;
+
+    bool params = false;
+    while (s < end) {
+        if (*s == '\\' && s + 1 < end && (s[1] == '\\' || s[1] == '$' || s[1] == '`')) {
+            wb_byte(&b, s[1], true);
+            s += 2;
+        } else if (*s == '\\' && s + 1 < end && s[1] == '\n') {
+            s += 2;
+        } else if (subst_at(s, end)) {
+            long used = wb_subst(p, &b, s, end, true);
+            if (used < 0) return false;
+            params = true;
+            s += used;
+        } else if (*s == '$') {
+            long used = wb_param(&b, s, end, true);
+            if (used < 0) {
+                fprintf(stderr, "%.*s: bad substitution\n", (int)d->dlen, d->delim);
+                p->status = PARSE_ERROR;
+                return false;
+            }
+            params |= b.parts[b.n - 1].kind == WP_PARAM;
+            s += used;
+        } else {
+            wb_byte(&b, *s++, true);
+        }
+    }
+    *b.o = '\0';
+    *w = (struct word){params ? NULL : buf, b.parts, b.n, false};
+    return true;
+}
+
+/** Length of the name of an unquoted name=... word t, 0 if it is not one. */
+static size_t assignment_at(const struct parser *p, const struct token *t) {
+    const char *s = p->src + t->off;
+    size_t len = 0;
+    while (len < t->len && s[len] != '=') len++;
+    return len < t->len && is_name(s, len) ? len : 0;
+}
+
+/** Split name=value into an assignment, the value is a word of its own. */
+static bool parse_assign(struct parser *p, const struct token *t, struct assign *as) {
+    size_t len = assignment_at(p, t);
+    char *name = arena_alloc(p->a, len + 1);
+    if (!name) return oom(p) != NULL;
+    memcpy(name, p->src + t->off, len);
+    name[len] = '\0';
+    as->name = name;
+    // The name and = are plain bytes, the rest is cooked like any word
+    struct token v = *t;
+    v.off += len + 1;
+    v.len -= len + 1;
+    v.out -= len + 1;
+    return parse_word(p, &v, &as->value);
+}
+
+/** Redirection type of operator t, -1 if it is not one. */
+static int redir_type(const struct parser *p, const struct token *t) {
+    if (t->kind != TOK_OP) return -1;
+    if (is_tok(p, t, "<")) return REDIR_IN;
+    if (is_tok(p, t, ">")) return REDIR_OUT;
+    if (is_tok(p, t, ">>")) return REDIR_APPEND;
+    if (is_tok(p, t, "<&") || is_tok(p, t, ">&")) return REDIR_DUP;
+    if (is_tok(p, t, "<<<")) return REDIR_HERESTR;
+    if (is_tok(p, t, "<<") || is_tok(p, t, "<<-")) return REDIR_HEREDOC;
+    return -1;
+}
+
+/** True when the next token starts a redirection. */
+static bool at_redir(const struct parser *p) {
+    const struct token *t = peek(p);
+    return t && (t->kind == TOK_IONUM || redir_type(p, t) != -1);
+}
+
+/** Parse one redirection with its target word. */
+static bool parse_redir(struct parser *p, struct ast_redir *r) {
+    const struct token *t = &p->tok[p->i];
+    int fd = -1;
+    if (t->kind == TOK_IONUM) {
+        fd = 0;
+        for (size_t k = 0; k < t->len && fd <= 9999; k++) fd = fd * 10 + (p->src[t->off + k] - '0');
+        if (fd > 9999) {
+            fprintf(stderr, "%.*s: bad file descriptor\n", (int)t->len, p->src + t->off);
+            p->status = PARSE_ERROR;
+            return false;
+        }
+        t = &p->tok[++p->i];  // the tokenizer only marks digits right before < or >
+    }
+    bool input = p->src[t->off] == '<';
+    int type = redir_type(p, t);
+    p->i++;
+    const struct token *w = peek(p);
+    if (!w || w->kind != TOK_WORD) return fail(p) != NULL;
+    r->type = type;
+    r->fd = fd != -1 ? fd : (input ? 0 : 1);
+    r->to_file = type == REDIR_DUP && fd == -1 && !input;
+    p->i++;
+    if (type != REDIR_HEREDOC) return parse_word(p, w, &r->target);
+    // The delimiter word is spent, the body read with it is the target
+    if (p->next_doc == p->ndocs) return fail(p) != NULL;
+    return heredoc_word(p, &p->docs[p->next_doc++], &r->target);
+}
+
+/** Redirections following a compound command. */
+static bool parse_redirs(struct parser *p, struct node *n) {
+    size_t cap = 0;
+    while (at_redir(p)) {
+        if (!(n->redirs = grow(p, n->redirs, n->nredirs, &cap, sizeof(*n->redirs)))) return false;
+        if (!parse_redir(p, &n->redirs[n->nredirs++])) return false;
+    }
+    return true;
+}
+
+/** Words and redirections up to the next operator. */
+static struct node *parse_simple(struct parser *p) {
+    size_t max = 0;
+    for (size_t k = p->i; k < p->n && (p->tok[k].kind == TOK_WORD || p->tok[k].kind == TOK_IONUM ||
+                                       redir_type(p, &p->tok[k]) != -1); k++)
+        max++;
+    struct node *n = new_node(p, N_SIMPLE);
+    if (!n) return NULL;
+    n->simple.words = arena_alloc(p->a, (max ? max : 1) * sizeof(*n->simple.words));
+    n->simple.assigns = arena_alloc(p->a, (max ? max : 1) * sizeof(*n->simple.assigns));
+    n->redirs = arena_alloc(p->a, (max ? max : 1) * sizeof(*n->redirs));
+    if (!n->simple.words || !n->simple.assigns || !n->redirs) return oom(p);
+
+    for (;;) {
+        const struct token *t = peek(p);
+        if (t && t->kind == TOK_WORD && n->simple.n == 0 && assignment_at(p, t)) {
+            if (!parse_assign(p, t, &n->simple.assigns[n->simple.nassigns++])) return NULL;
+            p->i++;
+        } else if (t && t->kind == TOK_WORD) {
+            if (!parse_word(p, t, &n->simple.words[n->simple.n++])) return NULL;
+            p->i++;
+        } else if (at_redir(p)) {
+            if (!parse_redir(p, &n->redirs[n->nredirs++])) return NULL;
+        } else {
+            break;
+        }
+    }
+    if (n->simple.n == 0 && n->simple.nassigns == 0 && n->nredirs == 0) return fail(p);
+    return n;
+}
+
+/** A list that must not be empty, as in the parts of if or while. */
+static struct node *parse_body(struct parser *p) {
+    struct node *n = parse_list(p);
+    if (!n && !p->status) fail(p);
+    return n;
+}
+
+/** { list } or ( list ). */
+static struct node *parse_group(struct parser *p, int kind, const char *close) {
+    struct node *n = new_node(p, kind);
+    if (!n) return NULL;
+    p->i++;
+    if (!(n->group.body = parse_body(p)) || !expect(p, close)) return NULL;
+    return n;
+}
+
+/** if or elif up to but not including the fi. */
+static struct node *parse_if(struct parser *p) {
+    struct node *n = new_node(p, N_IF);
+    if (!n) return NULL;
+    p->i++;
+    if (!(n->cond.cond = parse_body(p)) || !expect(p, "then") || !(n->cond.then = parse_body(p)))
+        return NULL;
+    if (at(p, "elif")) {
+        if (!(n->cond.otherwise = parse_if(p))) return NULL;
+    } else if (at(p, "else")) {
+        p->i++;
+        if (!(n->cond.otherwise = parse_body(p))) return NULL;
+    }
+    return n;
+}
+
+/** do list done. */
+static struct node *parse_do(struct parser *p) {
+    if (!expect(p, "do")) return NULL;
+    struct node *body = parse_body(p);
+    if (!body || !expect(p, "done")) return NULL;
+    return body;
+}
+
+/** while or until. */
+static struct node *parse_while(struct parser *p, int kind) {
+    struct node *n = new_node(p, kind);
+    if (!n) return NULL;
+    p->i++;
+    if (!(n->cond.cond = parse_body(p)) || !(n->cond.then = parse_do(p))) return NULL;
+    return n;
+}
+
+/** for name [in word ...]; do list done. */
+static struct node *parse_for(struct parser *p) {
+    struct node *n = new_node(p, N_FOR);
+    if (!n) return NULL;
+    p->i++;
+    const struct token *t = peek(p);
+    if (!t || t->kind != TOK_WORD || !is_name(p->src + t->off, t->len)) return fail(p);
+    if (!(n->loop.var = span_text(p, p->i, p->i))) return NULL;
+    p->i++;
+    skip_newlines(p);
+
+    if (at(p, "in")) {
+        size_t cap = 0;
+        n->loop.in = true;
+        for (p->i++; (t = peek(p)) && t->kind == TOK_WORD; p->i++) {
+            if (!(n->loop.words = grow(p, n->loop.words, n->loop.n, &cap, sizeof(*n->loop.words))) ||
+                !parse_word(p, t, &n->loop.words[n->loop.n++]))
+                return NULL;
+        }
+        if (!at(p, ";") && !at_newline(p)) return fail(p);
+        p->i++;
+    } else if (at(p, ";")) {
+        p->i++;
+    }
+    skip_newlines(p);
+    return (n->loop.body = parse_do(p)) ? n : NULL;
+}
+
+/** case word in [(]pattern[|pattern]...) list;; ... esac. */
+static struct node *parse_case(struct parser *p) {
+    struct node *n = new_node(p, N_CASE);
+    if (!n) return NULL;
+    p->i++;
+    const struct token *t = peek(p);
+    if (!t || t->kind != TOK_WORD) return fail(p);
+    if (!parse_word(p, t, &n->cases.subject)) return NULL;
+    p->i++;
+    skip_newlines(p);
+    if (!expect(p, "in")) return NULL;
+    skip_newlines(p);
+
+    size_t cap = 0;
+    while (!at(p, "esac")) {
+        if (!(n->cases.items = grow(p, n->cases.items, n->cases.n, &cap, sizeof(*n->cases.items))))
+            return NULL;
+        struct case_item *it = &n->cases.items[n->cases.n++];
+        memset(it, 0, sizeof(*it));
+        if (at(p, "(")) p->i++;
+        size_t pcap = 0;
+        for (;;) {
+            if (!(t = peek(p)) || t->kind != TOK_WORD) return fail(p);
+            if (!(it->patterns = grow(p, it->patterns, it->npatterns, &pcap, sizeof(*it->patterns))) ||
+                !parse_word(p, t, &it->patterns[it->npatterns++]))
+                return NULL;
+            p->i++;
+            if (!at(p, "|")) break;
+            p->i++;
+        }
+        if (!expect(p, ")")) return NULL;
+        it->body = parse_list(p);
+        if (p->status) return NULL;
+        if (at(p, ";;")) {
+            p->i++;
+            skip_newlines(p);
+        } else if (!at(p, "esac")) {
+            return fail(p);
+        }
+    }
+    p->i++;
+    return n;
+}
+
+/** True when the next token starts a compound command. */
+static bool at_compound(const struct parser *p) {
+    static const char *const words[] = {"{", "(", "if", "while", "until", "for", "case"};
+    for (size_t k = 0; k < sizeof(words) / sizeof(words[0]); k++) {
+        if (at(p, words[k])) return true;
+    }
+    return false;
+}
+
+/** name() compound or function name [()] compound. */
+static struct node *parse_function(struct parser *p, bool keyword) {
+    if (keyword) p->i++;
+    const struct token *t = peek(p);
+    if (!t || t->kind != TOK_WORD || (t->flags & TOKF_QUOTED) ||
+        memchr(p->src + t->off, '$', t->len) || memchr(p->src + t->off, '/', t->len))
+        return fail(p);
+    struct node *n = new_node(p, N_FUNCTION);
+    if (!n || !(n->func.name = span_text(p, p->i, p->i))) return NULL;
+    p->i++;
+    if (!keyword || at(p, "(")) {
+        if (!expect(p, "(") || !expect(p, ")")) return NULL;
+    }
+    skip_newlines(p);
+    if (!peek(p)) return need_more(p);
+    if (!at_compound(p)) return fail(p);
+    return (n->func.body = parse_command(p)) ? n : NULL;
+}
+
+/** A simple command, a compound command with its redirections or a function definition. */
+static struct node *parse_command(struct parser *p) {
+    const struct token *t = peek(p);
+    if (!t) return fail(p);
+    if (at(p, "function")) return parse_function(p, true);
+    if (t->kind == TOK_WORD && !(t->flags & TOKF_QUOTED) && p->i + 1 < p->n && is_tok(p, &p->tok[p->i + 1], "("))
+        return parse_function(p, false);
+    if (!at_compound(p)) return parse_simple(p);
+
+    struct node *n;
+    p->depth++;
+    if (at(p, "(")) {
+        n = parse_group(p, N_SUBSHELL, ")");
+    } else if (at(p, "{")) {
+        n = parse_group(p, N_GROUP, "}");
+    } else if (at(p, "if")) {
+        n = parse_if(p);
+        if (n && !expect(p, "fi")) n = NULL;
+    } else if (at(p, "while")) {
+        n = parse_while(p, N_WHILE);
+    } else if (at(p, "until")) {
+        n = parse_while(p, N_UNTIL);
+    } else if (at(p, "for")) {
+        n = parse_for(p);
+    } else {
+        n = parse_case(p);
+    }
+    if (!n) return NULL;
+    p->depth--;
+    return parse_redirs(p, n) ? n : NULL;
+}
+
+/** Flags for an option word of time like -p or -pe, 0 if it is not one. */
+static int time_option(const struct parser *p, const struct token *t) {
+    if (!t || t->kind != TOK_WORD || t->len < 2 || p->src[t->off] != '-') return 0;
+    int flags = 0;
+    for (size_t i = 1; i < t->len; i++) {
+        if (p->src[t->off + i] == 'p') flags |= PL_TIME_POSIX;
+        else if (p->src[t->off + i] == 'e') flags |= PL_TIME_COUNTERS;
+        else return 0;
+    }
+    return flags;
+}
+
+/** True where a command list may end. */
+static bool at_separator(const struct parser *p) {
+    return !peek(p) || at_newline(p) || at(p, ";") || at(p, "&") || at(p, ")") || at(p, ";;") ||
+           at(p, "&&") || at(p, "||");
+}
+
+/** [time [-p] [-e]] [!] command [| command]... */
+static struct node *parse_pipeline(struct parser *p) {
+    struct node *n = new_node(p, N_PIPELINE);
+    if (!n) return NULL;
+    size_t first = p->i, cap = 0;
+    if (at(p, "time")) {
+        n->pipe.time = PL_TIME;
+        for (p->i++; time_option(p, peek(p)); p->i++) n->pipe.time |= time_option(p, peek(p));
+        if (at(p, "--")) p->i++;
+        // A bare time times nothing, like in bash
+        if (at_separator(p)) {
+            n->pipe.text = span_text(p, first, p->i - 1);
+            return n->pipe.text ? n : NULL;
+        }
+    }
+    if (at(p, "!")) {
+        n->pipe.negate = true;
+        p->i++;
+    }
+    for (;;) {
+        if (!(n->pipe.cmds = grow(p, n->pipe.cmds, n->pipe.n, &cap, sizeof(*n->pipe.cmds)))) return NULL;
+        if (!(n->pipe.cmds[n->pipe.n++] = parse_command(p))) return NULL;
+        if (!at(p, "|")) break;
+        p->i++;
+        skip_newlines(p);
+        if (!peek(p)) return need_more(p);
+    }
+    n->pipe.text = span_text(p, first, p->i - 1);
+    return n->pipe.text ? n : NULL;
+}
+
+/** Pipelines joined with && and ||. */
+static struct node *parse_and_or(struct parser *p) {
+    struct node *left = parse_pipeline(p);
+    while (left) {
+        int kind;
+        if (at(p, "&&")) kind = N_AND;
+        else if (at(p, "||")) kind = N_OR;
+        else break;
+        p->i++;
+        skip_newlines(p);
+        if (!peek(p)) return need_more(p);
+        struct node *n = new_node(p, kind);
+        if (!n || !(n->pair.right = parse_pipeline(p))) return NULL;
+        n->pair.left = left;
+        left = n;
+    }
+    return left;
+}
+
+/** Send cmd, the tokens first to last, to the background. */
+static struct node *background(struct parser *p, struct node *cmd, size_t first, size_t last) {
+    if (cmd->kind == N_PIPELINE) {
+        cmd->pipe.background = true;
+        return cmd;
+    }
+    struct node *n = new_node(p, N_PIPELINE);
+    if (!n || !(n->pipe.cmds = arena_alloc(p->a, sizeof(*n->pipe.cmds)))) return oom(p);
+    n->pipe.cmds[0] = cmd;
+    n->pipe.n = 1;
+    n->pipe.background = true;
+    n->pipe.text = span_text(p, first, last);
+    return n->pipe.text ? n : NULL;
+}
+
+/** True at a word or operator that ends the list of a compound command. */
+static bool at_terminator(const struct parser *p) {
+    static const char *const words[] = {"then", "else", "elif", "fi", "do", "done", "esac", "}", ")", ";;"};
+    if (!peek(p)) return true;
+    for (size_t k = 0; k < sizeof(words) / sizeof(words[0]); k++) {
+        if (at(p, words[k])) return true;
+    }
+    return false;
+}
+
+/** and-or lists separated by ; & or newlines, NULL if there are none. */
+static struct node *parse_list(struct parser *p) {
+    struct node **items = NULL;
+    size_t n = 0, cap = 0;
+    skip_newlines(p);
+    while (!at_terminator(p)) {
+        size_t first = p->i;
+        struct node *cmd = parse_and_or(p);
+        if (!cmd) return NULL;
+        if (at(p, "&")) {
+            if (!(cmd = background(p, cmd, first, p->i - 1))) return NULL;
+            p->i++;
+        } else if (at(p, ";") || at_newline(p)) {
+            p->i++;
+        } else if (!at_terminator(p)) {
+            return fail(p);
+        }
+        if (!(items = grow(p, items, n, &cap, sizeof(*items)))) return NULL;
+        items[n++] = cmd;
+        skip_newlines(p);
+    }
+    if (n < 2) return n ? items[0] : NULL;
+    struct node *list = new_node(p, N_LIST);
+    if (!list) return NULL;
+    list->list.items = items;
+    list->list.n = n;
+    return list;
+}
+
+/**
+ * Offset just past the substitution that starts at src[i], 0 when none
+ * starts there and SIZE_MAX when it is not closed.
+ */
+static size_t subst_skip(const char *src, size_t len, size_t i) {
+    if (src[i] == '`') return tok_subst_end(src, len, i + 1, '`');
+    if (src[i] == '$' && i + 1 < len && src[i + 1] == '(') return tok_subst_end(src, len, i + 2, '(');
+    return 0;
+}
+
+/**
+ * Note the here-document whose << starts at src[i] and copy the operator
+ * and the delimiter word to out. Returns the bytes used, 0 when out of
+ * memory and SIZE_MAX when a quote in the delimiter is not closed.
+ */
+static size_t heredoc_open(struct parser *p, const char *src, size_t len, size_t i, char *out) {
+    size_t j = i + 2;
+    bool strip = j < len && src[j] == '-';
+    if (strip) j++;
+    while (j < len && (src[j] == ' ' || src[j] == '\t')) j++;
+    char *delim = arena_alloc(p->a, len - j + 1);
+    if (!delim) {
+        oom(p);
+        return 0;
+    }
+    size_t dlen = 0;
+    bool quoted = false;
+    while (j < len && !ends_word(src[j])) {
+        char c = src[j++];
+        if (c == '\'' || c == '"') {
+            quoted = true;
+            while (j < len && src[j] != c) delim[dlen++] = src[j++];
+            if (j++ == len) return SIZE_MAX;
+        } else if (c == '\\' && j < len) {
+            quoted = true;
+            delim[dlen++] = src[j++];
+        } else {
+            delim[dlen++] = c;
+        }
+    }
+    // Without a delimiter the parser reports the missing word
+    if (dlen || quoted) {
+        if (!(p->docs = grow(p, p->docs, p->ndocs, &p->docs_cap, sizeof(*p->docs)))) return 0;
+        p->docs[p->ndocs++] = (struct heredoc){delim, dlen, strip, quoted, NULL, 0};
+    }
+    memcpy(out, src + i, j - i);
+    return j - i;
+}
+
+/**
+ * Cut the bodies of the here-documents still waiting out of src, pos is
+ * just past the newline ending the line they were opened on. Returns
+ * where the source goes on, 0 when out of memory and SIZE_MAX when a
+ * delimiter line is missing.
+ */
+static size_t heredoc_bodies(struct parser *p, const char *src, size_t len, size_t pos) {
+    for (; p->nbodies < p->ndocs; p->nbodies++) {
+        struct heredoc *d = &p->docs[p->nbodies];
+        // Find the delimiter line first so the body is copied only once
+        size_t size = 0, at = pos, next;
+        for (;;) {
+            if (at == len) return SIZE_MAX;
+            const char *nl = memchr(src + at, '\n', len - at);
+            size_t end = nl ? (size_t)(nl - src) : len, from = at;
+            while (d->strip && from < end && src[from] == '\t') from++;
+            if (end - from == d->dlen && memcmp(src + from, d->delim, d->dlen) == 0) {
+                next = nl ? end + 1 : len;
+                break;
+            }
+            if (!nl) return SIZE_MAX;
+            size += end + 1 - from;
+            at = end + 1;
+        }
+        if (!(d->body = arena_alloc(p->a, size + 1))) {
+            oom(p);
+            return 0;
+        }
+        while (pos < at) {
+            size_t end = (size_t)((const char *)memchr(src + pos, '\n', at - pos) - src);
+            while (d->strip && src[pos] == '\t') pos++;
+            memcpy(d->body + d->len, src + pos, end + 1 - pos);
+            d->len += end + 1 - pos;
+            pos = end + 1;
+        }
+        d->body[d->len] = '\0';
+        pos = next;
+    }
+    return pos;
+}
+
+/**
+ * Copy src to out without comments, backslash newlines and here-document
+ * bodies, which are kept in p->docs. Substitutions are copied as they
+ * are, their own parse cleans them. Returns 0, PARSE_ERROR, or a
+ * PARSE_MORE code when src stops inside a quote, after a backslash or
+ * before a here-document ended.
+ */
+static int clean_source(struct parser *p, const char *src, size_t len, char *out, size_t *outlen) {
+    size_t o = 0;
+    char q = 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = src[i];
+        if (q == '\'') {
+            out[o++] = c;
+            if (c == '\'') q = 0;
+            continue;
+        }
+        if (c == '\\') {
+            if (i + 1 == len) return q ? PARSE_MORE_QUOTE : PARSE_MORE;
+            if (src[i + 1] == '\n') {
+                i++;
+                continue;
+            }
+            out[o++] = c;
+            out[o++] = src[++i];
+            continue;
+        }
+        if (!q && c == '#' && (o == 0 || ends_word(out[o - 1]))) {
+            while (i + 1 < len && src[i + 1] != '\n') i++;
+            continue;
+        }
+        // Quotes inside a substitution do not close this one
+        size_t end = subst_skip(src, len, i);
+        if (end == SIZE_MAX) return PARSE_MORE;
+        if (end) {
+            memcpy(out + o, src + i, end - i);
+            o += end - i;
+            i = end - 1;
+            continue;
+        }
+        if (q == '"') {
+            out[o++] = c;
+            if (c == '"') q = 0;
+            continue;
+        }
+        if (c == '\'' || c == '"') {
+            q = c;
+        } else if (c == '<' && i + 2 < len && src[i + 1] == '<' && src[i + 2] == '<') {
+            memcpy(out + o, "<<<", 3);
+            o += 3;
+            i += 2;
+            continue;
+        } else if (c == '<' && i + 1 < len && src[i + 1] == '<') {
+            size_t used = heredoc_open(p, src, len, i, out + o);
+            if (used == 0) return PARSE_ERROR;
+            if (used == SIZE_MAX) return PARSE_MORE_QUOTE;
+            o += used;
+            i += used - 1;
+            continue;
+        } else if (c == '\n' && p->nbodies < p->ndocs) {
+            out[o++] = c;
+            size_t next = heredoc_bodies(p, src, len, i + 1);
+            if (next == 0) return PARSE_ERROR;
+            if (next == SIZE_MAX) return PARSE_MORE;
+            i = next - 1;
+            continue;
+        }
+        out[o++] = c;
+    }
+    *outlen = o;
+    if (q) return PARSE_MORE_QUOTE;
+    return p->nbodies < p->ndocs ? PARSE_MORE : 0;
+}
+
+/** Parse a whole program. */
+int parse_program(struct arena *a, const char *src, size_t len, struct node **root) {
+    *root = NULL;
+    char *clean = arena_alloc(a, len + 1);
+    if (!clean) {
+        perror("parse");
+        return PARSE_ERROR;
+    }
+    struct parser p = {.a = a, .src = clean};
+    size_t clen = 0;
+    int rc = clean_source(&p, src, len, clean, &clen);
+    if (rc) return rc;
+    clean[clen] = '\0';
+
+    struct tok_index idx;
+    tok_index_init(&idx);
+    if (tokenize(clean, clen, &idx) == -1 || add_newlines(&p, &idx) == -1) {
+        // Quotes were checked already, so EINVAL is a substitution still open
+        int err = errno;
+        if (err != EINVAL) perror("parse");
+        tok_index_free(&idx);
+        free(p.tok);
+        return err == EINVAL ? PARSE_MORE : PARSE_ERROR;
+    }
+    tok_index_free(&idx);
+
+    struct node *n = parse_list(&p);
+    if (!p.status && p.i < p.n) fail(&p);
+    free(p.tok);
+    if (p.status) return p.status;
+    *root = n;
+    return 0;
+}
+
+/** Cheap test whether line could close what is open. */
+bool parse_may_complete(int status, const char *line) {
+    static const char *const closers[] = {"fi", "done", "esac", "}", ")"};
+    if (status == PARSE_MORE_QUOTE) return strpbrk(line, "'\"") != NULL;
+    if (status != PARSE_MORE_CLOSE) return true;
+    for (size_t k = 0; k < sizeof(closers) / sizeof(closers[0]); k++) {
+        if (strstr(line, closers[k])) return true;
+    }
+    return false;
+}
@@ -0,0 +1,189 @@
+#ifndef PARSE_H
+#define PARSE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "arena.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Results of parse_program besides 0 for a complete program */
+enum parse_status {
+    PARSE_ERROR = -1,       // syntax error, already reported on stderr
+    PARSE_MORE = 1,         // ends in an operator or backslash, any line may finish it
+    PARSE_MORE_QUOTE = 2,   // inside a quote
+    PARSE_MORE_CLOSE = 3,   // inside a compound command waiting for its closing word
+};
+
+enum word_part_kind {
+    WP_TEXT,    // literal bytes, quotes already removed
+    WP_PARAM,   // $name, ${name} or a special parameter like $? or $@
+    WP_SUBST,   // $(command) or `command`
+};
+
+struct node;
+
+/**
+ * @brief A piece of a word. Quoted pieces are neither split into fields
+ * nor treated as patterns.
+ */
+struct word_part {
+    int kind;
+    bool quoted;
+    const char *text;   // the bytes, the parameter name or the command's source
+    size_t len;
+    struct node *cmd;   // WP_SUBST: the command parsed, NULL when it is empty
+};
+
+/**
+ * @brief One word of a command, split up once at parse time so running it
+ * again never looks at quotes.
+ */
+struct word {
+    const char *lit;    // the finished word when it has no expansions, else NULL
+    struct word_part *parts;
+    size_t nparts;
+    bool glob;          // has an unquoted *, ? or [...], a pathname pattern
+};
+
+/**
+ * @brief Redirection of a command. The target is expanded every time the
+ * command runs, so n>&m and n>&- are told apart only then.
+ */
+struct ast_redir {
+    int type;           // enum redir_type, never REDIR_CLOSE
+    int fd;
+    bool to_file;       // a bare >& that may name a file for stdout and stderr
+    struct word target;
+};
+
+/* name=value in front of a command, or on its own */
+struct assign {
+    const char *name;
+    struct word value;
+};
+
+enum node_kind {
+    N_SIMPLE,
+    N_PIPELINE,
+    N_AND,
+    N_OR,
+    N_LIST,
+    N_IF,
+    N_WHILE,
+    N_UNTIL,
+    N_FOR,
+    N_CASE,
+    N_GROUP,
+    N_SUBSHELL,
+    N_FUNCTION,
+};
+
+/* One pattern list of a case command and what runs when it matches */
+struct case_item {
+    struct word *patterns;
+    size_t npatterns;
+    struct node *body;  // NULL for an empty body
+};
+
+/**
+ * @brief A node of the syntax tree. Every command may carry redirections,
+ * they apply to the whole compound command.
+ */
+struct node {
+    int kind;
+    struct ast_redir *redirs;
+    size_t nredirs;
+    int32_t unit;   // set by the compiler when the node runs as a code chunk of its own
+    union {
+        struct {
+            struct word *words;
+            size_t n;
+            struct assign *assigns;
+            size_t nassigns;
+        } simple;
+        struct {
+            struct node **cmds;     // N_SIMPLE or compound commands
+            size_t n;
+            bool negate;            // started with !
+            bool background;        // ended with &
+            int time;               // enum pipeline_time flags
+            const char *text;       // source text, for the job table
+        } pipe;
+        struct {
+            struct node *left, *right;
+        } pair;                     // N_AND, N_OR
+        struct {
+            struct node **items;
+            size_t n;
+        } list;                     // N_LIST
+        struct {
+            struct node *cond, *then, *otherwise;
+        } cond;                     // N_IF, N_WHILE and N_UNTIL use cond and then
+        struct {
+            const char *var;
+            struct word *words;
+            size_t n;
+            bool in;                // false loops over "$@"
+            struct node *body;
+        } loop;                     // N_FOR
+        struct {
+            struct word subject;
+            struct case_item *items;
+            size_t n;
+        } cases;                    // N_CASE
+        struct {
+            struct node *body;
+        } group;                    // N_GROUP, N_SUBSHELL
+        struct {
+            const char *name;
+            struct node *body;
+        } func;                     // N_FUNCTION
+    };
+};
+
+/**
+ * @brief Parse shell source into a syntax tree. Comments and backslash
+ * newlines are dropped and the text is tokenized in one pass, the tree
+ * and every string it points to are allocated from a. Supported are
+ * pipelines, lists with ; & && || and newlines, if, while, until, for,
+ * case, { }, ( ) and function definitions. The commands of $(...) and
+ * backquote substitutions are parsed along with the words they are in.
+ *
+ * @param a Arena that owns the tree
+ * @param src The source text
+ * @param len Length of src
+ * @param root Receives the tree, NULL for a program without commands
+ * @return 0, PARSE_ERROR, or one of the PARSE_MORE codes when src is the
+ * beginning of a longer program
+ */
+int parse_program(struct arena *a, const char *src, size_t len, struct node **root);
+
+/**
+ * @brief Check whether appending line to a program that returned one of
+ * the PARSE_MORE codes can finish it. Saves parsing a long loop body
+ * again for every line that cannot end it.
+ *
+ * @param status What parse_program returned
+ * @param line The line about to be appended
+ * @return False when the program is certainly still incomplete
+ */
+bool parse_may_complete(int status, const char *line);
+
+/**
+ * @brief Check for a name usable as a variable or function name
+ *
+ * @param s The name
+ * @param len Its length
+ * @return True for letters, digits and underscores not starting with a digit
+ */
+bool is_name(const char *s, size_t len);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // PARSE_H
@@ -0,0 +1,833 @@
+/**
+ * pipeline.c
+ * Parsing and execution of pipelines. Every stage is started with launch()
+ * into a single process group so the whole pipeline is one job.
+ */
+
+#define _GNU_SOURCE
+#include "pipeline.h"
+#include "lab.h"
+#include "jobs.h"
+#include "launch.h"
+#include "timing.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Size requested for relay pipes, the kernel caps it at pipe-max-size
+#define RELAY_PIPE_SIZE (1 << 20)
+
+/** Report a syntax error at token t. */
+static void syntax_error(const char *line, const struct token *t) {
+    if (t)
+        fprintf(stderr, "syntax error near unexpected token `%.*s'\n", (int)t->len, line + t->off);
+    else
+        fprintf(stderr, "syntax error near unexpected end of line\n");
+}
+
+/** True when t is the operator op. */
+static bool is_op(const char *line, const struct token *t, const char *op) {
+    size_t len = strlen(op);
+    return t->kind == TOK_OP && t->len == len && memcmp(line + t->off, op, len) == 0;
+}
+
+/** True when t is the unquoted word w. */
+static bool is_word(const char *line, const struct token *t, const char *w) {
+    size_t len = strlen(w);
+    return t->kind == TOK_WORD && t->len == len && memcmp(line + t->off, w, len) == 0;
+}
+
+/** Flags for an option word of time like -p or -pe, 0 if it is not one. */
+static int time_option(const char *line, const struct token *t) {
+    if (t->kind != TOK_WORD || t->len < 2 || line[t->off] != '-') return 0;
+    int flags = 0;
+    for (size_t i = 1; i < t->len; i++) {
+        if (line[t->off + i] == 'p') flags |= PL_TIME_POSIX;
+        else if (line[t->off + i] == 'e') flags |= PL_TIME_COUNTERS;
+        else return 0;
+    }
+    return flags;
+}
+
+/** Redirection type for operator t, or -1 if t is not a redirection. */
+static int redir_type(const char *line, const struct token *t) {
+    if (is_op(line, t, "<")) return REDIR_IN;
+    if (is_op(line, t, ">")) return REDIR_OUT;
+    if (is_op(line, t, ">>")) return REDIR_APPEND;
+    if (is_op(line, t, "<&") || is_op(line, t, ">&")) return REDIR_DUP;
+    if (is_op(line, t, "<<<")) return REDIR_HERESTR;
+    return -1;
+}
+
+/** Copy the unquoted text of t into a. */
+static char *tok_strdup(struct arena *a, const char *line, const struct token *t) {
+    char *s = arena_alloc(a, t->out + 1);
+    if (!s) return NULL;
+    tok_copy(line, t, s);
+    s[t->out] = '\0';
+    return s;
+}
+
+/** Parse a non-negative decimal descriptor number, -1 if s is not one. */
+static int parse_fd(const char *s) {
+    if (!*s) return -1;
+    long v = 0;
+    for (; *s; s++) {
+        if (*s < '0' || *s > '9' || v > 9999) return -1;
+        v = v * 10 + (*s - '0');
+    }
+    return (int)v;
+}
+
+/**
+ * Parse the tokens of one stage, words become argv and redirection
+ * operators with their targets become struct redir entries.
+ */
+static int parse_stage(struct arena *a, const char *line, const struct token *tok, size_t n,
+                       struct stage *st) {
+    *st = (struct stage){0};
+    struct token *words = arena_alloc(a, (n ? n : 1) * sizeof(*words));
+    // Every redirection needs at least two tokens, >&file turns into two
+    st->redirs = arena_alloc(a, (n ? n : 1) * sizeof(*st->redirs));
+    if (!words || !st->redirs) return -1;
+    st->nredirs = 0;
+    size_t nwords = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        const struct token *t = &tok[i];
+        if (t->kind == TOK_WORD) {
+            words[nwords++] = *t;
+            continue;
+        }
+
+        int fd = -1;
+        if (t->kind == TOK_IONUM) {
+            char num[16];
+            snprintf(num, sizeof(num), "%.*s", (int)t->len, line + t->off);
+            fd = parse_fd(num);
+            t = &tok[++i];  // the tokenizer only marks digits right before < or >
+        }
+        int type = redir_type(line, t);
+        if (type == -1 || i + 1 >= n || tok[i + 1].kind == TOK_OP) {
+            if (is_op(line, t, "<<") || is_op(line, t, "<<-"))
+                fprintf(stderr, "syntax error: here-documents are not supported\n");
+            else
+                syntax_error(line, type == -1 ? t : (i + 1 < n ? &tok[i + 1] : NULL));
+            errno = EINVAL;
+            return -1;
+        }
+
+        bool input = line[t->off] == '<';
+        struct redir *r = &st->redirs[st->nredirs++];
+        r->type = type;
+        r->fd = fd != -1 ? fd : (input ? STDIN_FILENO : STDOUT_FILENO);
+        r->word = tok_strdup(a, line, &tok[++i]);
+        if (!r->word) return -1;
+
+        if (type == REDIR_DUP) {
+            if (strcmp(r->word, "-") == 0) {
+                r->type = REDIR_CLOSE;
+            } else if ((r->src = parse_fd(r->word)) == -1) {
+                if (input || fd != -1) {
+                    fprintf(stderr, "%s: ambiguous redirect\n", r->word);
+                    errno = EINVAL;
+                    return -1;
+                }
+                // >&file sends both stdout and stderr to file
+                r->type = REDIR_OUT;
+                st->redirs[st->nredirs++] = (struct redir){REDIR_DUP, STDERR_FILENO, STDOUT_FILENO, NULL};
+            }
+        }
+    }
+
+    st->argc = nwords;
+    st->argv = cmd_build(a, line, words, nwords);
+    return st->argv ? 0 : -1;
+}
+
+/**
+ * Split the tokens of line on | into stages, a trailing & makes it a
+ * background job and a leading time keyword a timed one.
+ */
+int pipeline_parse(struct arena *a, const char *line, struct pipeline *pl) {
+    struct tok_index idx;
+    tok_index_init(&idx);
+    pl->stages = NULL;
+    pl->n = 0;
+    pl->background = false;
+    pl->text = NULL;
+    pl->time = 0;
+
+    if (tokenize(line, strlen(line), &idx) == -1) {
+        if (errno == EINVAL) fprintf(stderr, "syntax error: unterminated quote\n");
+        else perror("tokenize");
+        tok_index_free(&idx);
+        return -1;
+    }
+    if (idx.n == 0) {
+        tok_index_free(&idx);
+        return 0;
+    }
+
+    // time is a keyword only as the first word, like in bash, and takes
+    // its options before the command starts
+    const struct token *tok = idx.tok;
+    size_t ntok = idx.n;
+    if (is_word(line, &tok[0], "time")) {
+        pl->time = PL_TIME;
+        for (tok++, ntok--; ntok && time_option(line, tok); tok++, ntok--)
+            pl->time |= time_option(line, tok);
+        if (ntok && is_word(line, tok, "--")) {
+            tok++;
+            ntok--;
+        }
+    }
+
+    // Only a trailing & is understood, it sends the whole pipeline to the
+    // background. Anywhere else parse_stage rejects it.
+    if (ntok && is_op(line, &tok[ntok - 1], "&")) {
+        pl->background = true;
+        if (--ntok == 0) {
+            syntax_error(line, &tok[0]);
+            tok_index_free(&idx);
+            return -1;
+        }
+    }
+    if (ntok == 0) {
+        // A bare time, it times nothing
+        tok_index_free(&idx);
+        return 0;
+    }
+
+    size_t n = 1;
+    for (size_t i = 0; i < ntok; i++) {
+        if (!is_op(line, &tok[i], "|")) continue;
+        if (i == 0 || is_op(line, &tok[i - 1], "|")) {
+            syntax_error(line, &tok[i]);
+            tok_index_free(&idx);
+            return -1;
+        }
+        n++;
+    }
+    if (is_op(line, &tok[ntok - 1], "|")) {
+        syntax_error(line, NULL);
+        tok_index_free(&idx);
+        return -1;
+    }
+
+    pl->stages = arena_alloc(a, n * sizeof(*pl->stages));
+    if (!pl->stages) goto fail;
+    size_t start = 0;
+    for (size_t i = 0; i <= ntok; i++) {
+        if (i < ntok && !is_op(line, &tok[i], "|")) continue;
+        struct stage *st = &pl->stages[pl->n++];
+        if (parse_stage(a, line, &tok[start], i - start, st) == -1) goto fail;
+        if (st->argc == 0 && (n > 1 || st->nredirs == 0)) {
+            syntax_error(line, i < ntok ? &tok[i] : NULL);
+            errno = EINVAL;
+            goto fail;
+        }
+        start = i + 1;
+    }
+
+    size_t end = pl->background ? tok[ntok].off : strlen(line);
+    while (end > 0 && (line[end - 1] == ' ' || line[end - 1] == '\t')) end--;
+    char *text = arena_alloc(a, end + 1);
+    if (!text) goto fail;
+    memcpy(text, line, end);
+    text[end] = '\0';
+    pl->text = text;
+    tok_index_free(&idx);
+    return 0;
+
+fail:
+    if (errno != EINVAL) perror("pipeline_parse");
+    tok_index_free(&idx);
+    pl->n = 0;
+    return -1;
+}
+
+/** Wait status for a stage that never started or ran inside the shell. */
+static int exit_status(int code) {
+    return W_EXITCODE(code, 0);
+}
+
+/** Remember the status of the last stage in the shell. */
+static void set_last_status(struct shell *sh, int status) {
+    if (status == -1) return;
+    if (WIFEXITED(status)) sh->last_status = WEXITSTATUS(status);
+    else if (WIFSTOPPED(status)) sh->last_status = 128 + WSTOPSIG(status);
+    else sh->last_status = 128 + WTERMSIG(status);
+}
+
+/** Body of a forked subshell running a builtin. */
+static int run_builtin(struct shell *sh, char **argv) {
+    do_builtin(sh, argv);
+    fflush(stdout);
+    return sh->last_status;
+}
+
+/** Tell the user why a stage could not be started. */
+static void report_launch_error(char **argv, const struct launch_error *e) {
+    if (e->action && e->action->op == LAUNCH_OPEN)
+        fprintf(stderr, "%s: %s\n", e->action->path, strerror(e->err));
+    else if (e->action)
+        fprintf(stderr, "%d: %s\n", e->action->src, strerror(e->err));
+    else
+        fprintf(stderr, "%s: %s\n", argv && argv[0] ? argv[0] : "fork", strerror(e->err));
+}
+
+/**
+ * Start an external command through the command hash. A hashed path that
+ * turned out to be gone is forgotten and the lookup is done again.
+ */
+static pid_t start_external(struct shell *sh, struct launch_req *req, int *code) {
+    char **argv = req->argv;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int cached;
+        struct launch_error e;
+        req->path = cmd_hash_lookup(&sh->cmd_hash, argv[0], &cached);
+        if (!req->path) {
+            fprintf(stderr, "%s: command not found\n", argv[0]);
+            *code = 127;
+            return -1;
+        }
+        pid_t pid = launch(sh, req, &e);
+        if (pid != -1) return pid;
+        if (e.err == ENOENT && cached && !e.action) {
+            cmd_hash_forget(&sh->cmd_hash, argv[0]);
+            continue;
+        }
+        report_launch_error(argv, &e);
+        if (e.action) *code = 1;
+        else *code = e.err == ENOENT ? 127 : 126;
+        return -1;
+    }
+    *code = 127;
+    return -1;
+}
+
+/** Body of a forked subshell running a function or compound command. */
+static int run_stage_body(struct shell *sh, const void *arg) {
+    const struct stage *st = arg;
+    // The copy has no terminal and no jobs of its own, what it starts
+    // joins the pipeline's group
+    sh->shell_is_interactive = 0;
+    sh->subshell = true;
+    jobs_destroy(&sh->jobs);
+    int rc = st->body(sh, st);
+    fflush(stdout);
+    return rc;
+}
+
+/** Start a builtin or body in a subshell or an external command. */
+static pid_t start_stage(struct shell *sh, struct launch_req *req, int *code) {
+    if (!req->body && !is_builtin(sh, req->argv[0])) return start_external(sh, req, code);
+    struct launch_error e;
+    if (!req->body) req->fn = run_builtin;
+    pid_t pid = launch(sh, req, &e);
+    if (pid == -1) report_launch_error(req->argv, &e);
+    return pid;
+}
+
+/** Start one command in the background of pgid, without waiting. */
+pid_t start_command(struct shell *sh, char **argv, pid_t pgid, int *code) {
+    struct launch_req req = {.argv = argv, .pgid = pgid};
+    *code = 1;
+    return start_stage(sh, &req, code);
+}
+
+/** Wait for pid, retrying on signals. */
+static int wait_child(pid_t pid) {
+    int status;
+    pid_t rval;
+    while ((rval = waitpid(pid, &status, 0)) == -1 && errno == EINTR)
+        ;
+    return rval == -1 ? -1 : status;
+}
+
+/** Take the terminal back after a foreground job. */
+static void reclaim_terminal(struct shell *sh) {
+    if (sh->shell_is_interactive) tcsetpgrp(sh->shell_terminal, sh->shell_pgid);
+}
+
+/**
+ * Descriptor to read a here-document or here-string body from, plus a
+ * newline for here-strings. A body that fits the pipe buffer is written
+ * into a pipe. A bigger one goes into a memfd that is sealed against
+ * changes, so nothing ever lands on disk and the write never blocks.
+ */
+static int here_fd(const char *body, bool newline) {
+    size_t len = strlen(body);
+    struct iovec iov[2] = {{(void *)body, len}, {"\n", 1}};
+    int n = newline ? 2 : 1;
+    size_t total = len + (newline ? 1 : 0);
+    int p[2];
+    if (pipe2(p, O_CLOEXEC) == -1) return -1;
+    int cap = fcntl(p[1], F_GETPIPE_SZ);
+    if (cap > 0 && total <= (size_t)cap) {
+        ssize_t w = writev(p[1], iov, n);
+        close(p[1]);
+        if (w == (ssize_t)total) return p[0];
+        close(p[0]);
+        errno = EIO;
+        return -1;
+    }
+    close(p[0]);
+    close(p[1]);
+
+    int fd = memfd_create("lab-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) return -1;
+    for (int i = 0; i < n; i++) {
+        const char *b = iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while (left) {
+            ssize_t w = write(fd, b, left);
+            if (w == -1 && errno == EINTR) continue;
+            if (w == -1) goto fail;
+            b += w;
+            left -= (size_t)w;
+        }
+    }
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1 ||
+        lseek(fd, 0, SEEK_SET) == -1)
+        goto fail;
+    return fd;
+
+fail:;
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+}
+
+/* Descriptor setup for one stage: pipe ends first, then its redirections */
+struct stage_io {
+    struct launch_action *acts;
+    size_t n;
+    int *here;      // here-document descriptors to close once the stage started
+    size_t nhere;
+};
+
+/** Translate the pipe ends and redirections of st into launch actions. */
+static int stage_io_build(struct shell *sh, const struct stage *st, int in, int out,
+                          struct stage_io *io) {
+    io->acts = arena_alloc(&sh->line_arena, (st->nredirs + 2) * sizeof(*io->acts));
+    io->here = arena_alloc(&sh->line_arena, (st->nredirs + 1) * sizeof(*io->here));
+    io->n = 0;
+    io->nhere = 0;
+    if (!io->acts || !io->here) {
+        perror("redirect");
+        return -1;
+    }
+    if (in != -1) io->acts[io->n++] = (struct launch_action){.op = LAUNCH_DUP2, .fd = 0, .src = in};
+    if (out != -1) io->acts[io->n++] = (struct launch_action){.op = LAUNCH_DUP2, .fd = 1, .src = out};
+
+    int extra = 0;
+    if (sh->options[SH_OPT_NOATIME]) extra |= O_NOATIME;
+    for (size_t i = 0; i < st->nredirs; i++) {
+        const struct redir *r = &st->redirs[i];
+        struct launch_action *a = &io->acts[io->n++];
+        *a = (struct launch_action){.op = LAUNCH_OPEN, .fd = r->fd, .path = r->word};
+        switch (r->type) {
+        case REDIR_IN:
+            a->flags = O_RDONLY | extra;
+            break;
+        case REDIR_OUT:
+        case REDIR_APPEND:
+            a->flags = O_WRONLY | O_CREAT | extra;
+            a->flags |= r->type == REDIR_OUT ? O_TRUNC : O_APPEND;
+            if (sh->options[SH_OPT_DIRECT]) a->flags |= O_DIRECT;
+            a->prealloc = sh->redir_prealloc;
+            break;
+        case REDIR_DUP:
+            a->op = LAUNCH_DUP2;
+            a->src = r->src;
+            break;
+        case REDIR_CLOSE:
+            a->op = LAUNCH_CLOSE;
+            break;
+        case REDIR_HERESTR:
+        case REDIR_HEREDOC: {
+            int fd = here_fd(r->word, r->type == REDIR_HERESTR);
+            if (fd == -1) {
+                perror(r->type == REDIR_HERESTR ? "here-string" : "here-document");
+                for (size_t k = 0; k < io->nhere; k++) close(io->here[k]);
+                return -1;
+            }
+            io->here[io->nhere++] = fd;
+            a->op = LAUNCH_DUP2;
+            a->src = fd;
+            break;
+        }
+        }
+    }
+    return 0;
+}
+
+/** Close the here-document descriptors once the child has its own copies. */
+static void stage_io_done(struct stage_io *io) {
+    for (size_t i = 0; i < io->nhere; i++) close(io->here[i]);
+    io->nhere = 0;
+}
+
+/** Put back everything shell_redirect changed, newest first. */
+static void shell_restore(struct saved_fds *sv) {
+    fflush(stdout);
+    fflush(stderr);
+    while (sv->n) {
+        sv->n--;
+        if (sv->copy[sv->n] == -1) {
+            close(sv->fd[sv->n]);
+        } else {
+            dup2(sv->copy[sv->n], sv->fd[sv->n]);
+            close(sv->copy[sv->n]);
+        }
+    }
+}
+
+/** Apply actions to the shell itself, remembering how to undo them. */
+static int shell_redirect(const struct stage_io *io, struct saved_fds *sv) {
+    sv->n = 0;
+    fflush(stdout);
+    fflush(stderr);
+    for (size_t i = 0; i < io->n; i++) {
+        const struct launch_action *a = &io->acts[i];
+        if (sv->n == sizeof(sv->fd) / sizeof(sv->fd[0])) {
+            errno = EMFILE;
+        } else {
+            sv->fd[sv->n] = a->fd;
+            sv->copy[sv->n] = fcntl(a->fd, F_DUPFD_CLOEXEC, 10);
+            if (sv->copy[sv->n] != -1 || errno == EBADF) {
+                sv->n++;
+                if (launch_apply(a) == 0) continue;
+            }
+        }
+        struct launch_error e = {errno, a};
+        report_launch_error(NULL, &e);
+        shell_restore(sv);
+        return -1;
+    }
+    return 0;
+}
+
+/** Redirect the shell for a compound command. */
+int redirect_push(struct shell *sh, const struct redir *redirs, size_t n, struct saved_fds *sv) {
+    struct stage st = {.redirs = (struct redir *)redirs, .nredirs = n};
+    struct stage_io io;
+    sv->n = 0;
+    if (stage_io_build(sh, &st, -1, -1, &io) == -1) return -1;
+    int rc = shell_redirect(&io, sv);
+    stage_io_done(&io);
+    return rc;
+}
+
+/** Undo redirect_push. */
+void redirect_pop(struct saved_fds *sv) {
+    shell_restore(sv);
+}
+
+/**
+ * Run the stages of a pipeline, every one of them in the same group. The
+ * group becomes a job called text, in the background if asked to.
+ */
+static int run_stages(struct shell *sh, const struct stage *stages, size_t n, const char *text,
+                      bool background);
+
+/** Execute a command found through the command hash. */
+int execute_command(struct shell *sh, char **cmd) {
+    if (!cmd || !cmd[0]) return 0;
+    size_t argc = 0;
+    while (cmd[argc]) argc++;
+    struct stage st = {.argv = cmd, .argc = argc};
+    return run_stages(sh, &st, 1, cmd[0], false);
+}
+
+/*
+ * Relay for builtins run inside the shell. The builtin prints into a
+ * relay pipe through a stdio cookie stream and the shell moves the bytes
+ * on to the next stage with splice, so they are never copied back through
+ * user space and the builtin can run ahead of a slow reader by up to the
+ * relay pipe size. When the reader falls behind the shell waits for out in
+ * its event loop rather than in a blocking splice.
+ */
+struct relay {
+    int r, w;       // relay pipe, both non-blocking
+    int out;        // the stage's real stdout
+    bool broken;    // the reader went away, drop everything
+    struct evloop *loop;
+};
+
+/** Move whatever sits in the relay into out, waiting for out as needed. */
+static void relay_pump(struct relay *rl) {
+    while (!rl->broken) {
+        ssize_t n = splice(rl->r, NULL, rl->out, NULL, RELAY_PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) continue;
+        if (n == -1 && errno == EINTR) continue;
+        int pending = 0;
+        if (n == -1 && errno == EAGAIN && ioctl(rl->r, FIONREAD, &pending) == 0 && pending > 0) {
+            // The relay has bytes, so it is out that is full
+            if (ev_wait(rl->loop, rl->out, EV_WRITE, -1) == -1) rl->broken = true;
+            continue;
+        }
+        if (n == -1 && errno == EINVAL) {
+            // out cannot be spliced into, fall back to a copy
+            char buf[4096];
+            while ((n = read(rl->r, buf, sizeof(buf))) > 0) {
+                if (write(rl->out, buf, (size_t)n) != n) {
+                    rl->broken = true;
+                    break;
+                }
+            }
+            return;
+        }
+        if (n == -1 && errno != EAGAIN) rl->broken = true;
+        return;
+    }
+}
+
+/** stdio write hook, pumps the relay whenever it fills up. */
+static ssize_t relay_write(void *cookie, const char *buf, size_t size) {
+    struct relay *rl = cookie;
+    size_t done = 0;
+    while (done < size && !rl->broken) {
+        ssize_t n = write(rl->w, buf + done, size - done);
+        if (n > 0) {
+            done += (size_t)n;
+        } else if (n == -1 && errno == EAGAIN) {
+            relay_pump(rl);
+        } else if (n == -1 && errno != EINTR) {
+            rl->broken = true;
+        }
+    }
+    // Pretend everything was written once the reader is gone, like a
+    // subshell that was killed by SIGPIPE
+    return (ssize_t)size;
+}
+
+/** Run a builtin inside the shell with its output relayed into out. */
+static void relay_builtin(struct shell *sh, char **argv, int out) {
+    int p[2];
+    if (pipe2(p, O_CLOEXEC | O_NONBLOCK) == -1) {
+        perror("pipe");
+        sh->last_status = 1;
+        return;
+    }
+    fcntl(p[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+
+    struct relay rl = {.r = p[0], .w = p[1], .out = out, .broken = false, .loop = &sh->loop};
+    cookie_io_functions_t io = {.write = relay_write};
+    FILE *f = fopencookie(&rl, "w", io);
+    if (!f) {
+        perror("fopencookie");
+        close(p[0]);
+        close(p[1]);
+        sh->last_status = 1;
+        return;
+    }
+
+    struct sigaction ign = {.sa_handler = SIG_IGN}, saved;
+    sigaction(SIGPIPE, &ign, &saved);
+    fflush(stdout);
+    FILE *real = stdout;
+    stdout = f;
+    do_builtin(sh, argv);
+    fclose(f);
+    stdout = real;
+    relay_pump(&rl);
+    sigaction(SIGPIPE, &saved, NULL);
+
+    close(p[0]);
+    close(p[1]);
+}
+
+/**
+ * Make the cpus= prefix of st the placement of what starts next, *saved
+ * gets the placement to put back. An invalid list is reported.
+ */
+static int place_stage(struct shell *sh, const struct stage *st, struct placement *p,
+                       const struct placement **saved) {
+    *saved = sh->affinity.scope;
+    if (!st->cpus) return 0;
+    if (placement_parse(sh, st->cpus, p) == -1) {
+        fprintf(stderr, "cpus=%s: %s\n", st->cpus, strerror(errno));
+        return -1;
+    }
+    sh->affinity.scope = p;
+    return 0;
+}
+
+/**
+ * Run a builtin, a body, or just the redirections of an empty command,
+ * inside the shell. out, if not -1, becomes stdout before the stage's redirections.
+ * With relay set the output goes through relay_builtin.
+ */
+static int run_in_shell(struct shell *sh, const struct stage *st, int out, bool relay) {
+    struct stage_io io;
+    struct saved_fds sv;
+    if (stage_io_build(sh, st, -1, out, &io) == -1) return 1;
+    int rc = shell_redirect(&io, &sv);
+    stage_io_done(&io);
+    if (rc == -1) return 1;
+
+    struct placement place;
+    const struct placement *saved;
+    struct var_scope scope;
+    if (place_stage(sh, st, &place, &saved) == -1 || vars_push(sh, st->assigns, st->nassigns, &scope) == -1) {
+        sh->affinity.scope = saved;
+        shell_restore(&sv);
+        return 1;
+    }
+    // stdout is the pipe or whatever the stage redirected it to by now
+    if (st->body) sh->last_status = st->body(sh, st);
+    else if (st->argc == 0) sh->last_status = 0;
+    else if (relay) relay_builtin(sh, st->argv, STDOUT_FILENO);
+    else do_builtin(sh, st->argv);
+    vars_pop(sh, &scope);
+    sh->affinity.scope = saved;
+    shell_restore(&sv);
+    return sh->last_status;
+}
+
+static int run_stages(struct shell *sh, const struct stage *stages, size_t n, const char *text,
+                      bool background) {
+    pid_t pids[n];
+    int codes[n];
+    int relay_out[n];   // pipe kept open for in-shell builtins, else -1
+    // The shell cannot wait for a background job, its builtins get subshells
+    bool relay = sh->options[SH_OPT_RELAY] && !background;
+    // A subshell keeps what it starts in the group it already belongs to
+    pid_t pgid = sh->subshell ? getpgrp() : 0;
+    int in = -1;
+    // Every stage of a background job gets the same spread slot
+    const struct placement *outer = sh->affinity.scope;
+    struct placement spread;
+    if (background && affinity_spread(sh, &spread)) sh->affinity.scope = &spread;
+
+    // Subshells for builtins must not inherit unflushed output
+    fflush(stdout);
+    fflush(stderr);
+
+    for (size_t i = 0; i < n; i++) {
+        const struct stage *st = &stages[i];
+        int p[2] = {-1, -1};
+        pids[i] = -1;
+        codes[i] = 1;
+        relay_out[i] = -1;
+
+        if (i + 1 < n && pipe2(p, O_CLOEXEC) == -1) {
+            perror("pipe");
+            for (size_t k = i; k < n; k++) {
+                pids[k] = -1;
+                codes[k] = 1;
+                relay_out[k] = -1;
+            }
+            break;
+        }
+
+        struct stage_io io;
+        if (!st->body && relay && p[1] != -1 && builtin_relays(sh, st->argv[0])) {
+            // Runs once every external stage is up, its stdin is unused. Only
+            // output builtins, the others would change the shell's own state
+            relay_out[i] = p[1];
+            p[1] = -1;
+        } else if (stage_io_build(sh, st, in, p[1], &io) == 0) {
+            struct launch_req req = {
+                .argv = st->argv, .pgid = pgid, .foreground = !background,
+                .actions = io.acts, .nactions = io.n,
+                .body = st->body ? run_stage_body : NULL, .arg = st,
+            };
+            // Assignments in front of the command reach only its environment
+            struct placement place;
+            const struct placement *saved;
+            struct var_scope scope;
+            if (place_stage(sh, st, &place, &saved) == 0 &&
+                vars_push(sh, st->assigns, st->nassigns, &scope) == 0) {
+                pids[i] = start_stage(sh, &req, &codes[i]);
+                vars_pop(sh, &scope);
+            }
+            sh->affinity.scope = saved;
+            if (pids[i] > 0 && !pgid) pgid = pids[i];
+            stage_io_done(&io);
+        }
+
+        if (in != -1) close(in);
+        if (p[1] != -1) close(p[1]);
+        in = p[0];
+    }
+    if (in != -1) close(in);
+    sh->affinity.scope = outer;
+
+    for (size_t i = 0; i < n; i++) {
+        if (relay_out[i] == -1) continue;
+        codes[i] = run_in_shell(sh, &stages[i], relay_out[i], true);
+        close(relay_out[i]);
+    }
+
+    int status = -1;
+    int statuses[n];
+    for (size_t i = 0; i < n; i++) statuses[i] = exit_status(codes[i]);
+    struct job *j = pgid ? job_new(pgid, pids, statuses, n, text) : NULL;
+    if (j && background) {
+        j->background = true;
+        if (job_insert(&sh->jobs, j) == 0) {
+            pid_t last = pgid;
+            for (size_t i = 0; i < n; i++) if (pids[i] > 0) last = pids[i];
+            if (sh->shell_is_interactive) fprintf(stderr, "[%d] %d\n", j->id, (int)last);
+            sh->last_status = 0;
+            return 0;
+        }
+        // Without a table entry nobody could wait for it, so wait right away
+        perror("job");
+    }
+    if (j) {
+        status = job_foreground(sh, j, false);
+    } else {
+        // Nothing started or no memory for a job, wait the plain way
+        for (size_t i = 0; i < n; i++)
+            status = pids[i] > 0 ? wait_child(pids[i]) : statuses[i];
+        reclaim_terminal(sh);
+    }
+    set_last_status(sh, status);
+    return status;
+}
+
+/**
+ * Run a pipeline, a lone builtin, body or redirection runs in the shell
+ * itself.
+ */
+static int run_pipeline(struct shell *sh, const struct pipeline *pl) {
+    if (pl->n == 0) return 0;
+    const struct stage *st = &pl->stages[0];
+    bool in_shell = st->body ? !st->subshell : st->argc == 0 || is_builtin(sh, st->argv[0]);
+    if (pl->n == 1 && !pl->background && in_shell) {
+        sh->last_status = run_in_shell(sh, st, -1, false);
+        return exit_status(sh->last_status);
+    }
+    return run_stages(sh, pl->stages, pl->n, pl->text, pl->background);
+}
+
+/** Run a pipeline, timing it if it started with the time keyword. */
+int execute_pipeline(struct shell *sh, const struct pipeline *pl) {
+    // The shell does not wait for a background job, so there is nothing to time
+    if (!(pl->time & PL_TIME) || pl->background) return run_pipeline(sh, pl);
+
+    const char *fmt = var_get(sh, "TIMEFORMAT");
+    bool posix = pl->time & PL_TIME_POSIX;
+    if (posix || !fmt) fmt = time_default_format(posix, pl->time & PL_TIME_COUNTERS);
+    struct time_probe tp;
+    struct time_report tr;
+    time_start(sh, &tp, (pl->time & PL_TIME_COUNTERS) || time_format_counters(fmt));
+    int status = run_pipeline(sh, pl);
+    time_stop(sh, &tp, &tr);
+    time_print(stderr, fmt, &tr);
+    return status;
+}
@@ -0,0 +1,146 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "arena.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct shell;
+
+enum redir_type {
+    REDIR_IN,       // n<file
+    REDIR_OUT,      // n>file
+    REDIR_APPEND,   // n>>file
+    REDIR_DUP,      // n>&m or n<&m
+    REDIR_CLOSE,    // n>&- or n<&-
+    REDIR_HERESTR,  // n<<<word
+    REDIR_HEREDOC,  // n<<word and n<<-word, the word is the body
+};
+
+/**
+ * @brief One redirection, applied left to right after the pipe setup.
+ */
+struct redir {
+    int type;
+    int fd;             // descriptor being redirected
+    int src;            // REDIR_DUP
+    const char *word;   // file name, here-string or here-document body
+};
+
+/**
+ * @brief One command of a pipeline. A stage with a body runs it instead
+ * of argv, for shell functions and compound commands.
+ */
+struct stage {
+    char **argv;
+    size_t argc;
+    struct redir *redirs;
+    size_t nredirs;
+    char **assigns;     // name=value exported to the command only
+    size_t nassigns;
+    const char *cpus;   // placement from a cpus= prefix, NULL for none
+    int (*body)(struct shell *sh, const struct stage *st);
+    const void *arg;    // for body
+    bool subshell;      // ( list ), runs forked even on its own
+};
+
+/* Set in struct pipeline's time field by a leading time keyword */
+enum pipeline_time {
+    PL_TIME = 1,            // time in front of the pipeline
+    PL_TIME_POSIX = 2,      // time -p
+    PL_TIME_COUNTERS = 4,   // time -e, hardware counters too
+};
+
+/**
+ * @brief Commands connected with |, stdout of each stage feeds stdin of the
+ * next. All stages run in one process group.
+ */
+struct pipeline {
+    struct stage *stages;
+    size_t n;
+    bool background;    // ended with &
+    const char *text;   // the line without a trailing &, for the job table
+    int time;           // enum pipeline_time flags
+};
+
+/**
+ * @brief Parse a line into a pipeline. Redirections (<, >, >>, n>&m, n>&-
+ * and <<<) are collected per stage. A trailing & marks a background job
+ * and a leading time keyword, optionally with -p and -e, times the whole
+ * pipeline. Everything is allocated from a and lives until the arena is
+ * reset. Syntax errors are reported on stderr.
+ *
+ * @param a Arena for the stages and their argv blocks
+ * @param line The line to parse
+ * @param pl Receives the pipeline, n is 0 for an empty line
+ * @return 0 on success, -1 on a syntax error or allocation failure
+ */
+int pipeline_parse(struct arena *a, const char *line, struct pipeline *pl);
+
+/**
+ * @brief Run a pipeline in the foreground and wait until every stage
+ * finished or the job was stopped, or start it as a background job. A
+ * single foreground builtin or body stage runs directly in the shell,
+ * unless it is a ( ) subshell. Builtins that are part of a longer
+ * pipeline run in a forked subshell. With the relay option on, builtins
+ * that only write output run inside the shell instead. Bodies always run
+ * in a forked subshell. A timed foreground pipeline reports its cost on
+ * stderr in the format of $TIMEFORMAT.
+ *
+ * @param sh The shell
+ * @param pl The pipeline
+ * @return The wait status of the last stage, a stop status if the job was
+ * stopped, 0 for a background job, or -1 if it could not be started
+ */
+int execute_pipeline(struct shell *sh, const struct pipeline *pl);
+
+/* Descriptors the shell moved out of the way while redirecting itself */
+struct saved_fds {
+    int fd[64];
+    int copy[64];   // -1 if fd was closed before
+    size_t n;
+};
+
+/**
+ * @brief Apply redirections to the shell itself, for a compound command
+ * that runs inside the shell. Errors are reported on stderr.
+ *
+ * @param sh The shell
+ * @param redirs The redirections
+ * @param n Number of redirections
+ * @param sv Receives what redirect_pop needs to undo them
+ * @return 0 on success, -1 if one failed, nothing is left applied then
+ */
+int redirect_push(struct shell *sh, const struct redir *redirs, size_t n, struct saved_fds *sv);
+
+/**
+ * @brief Undo redirect_push, output buffered so far goes to the
+ * redirected descriptors first
+ *
+ * @param sv What redirect_push saved
+ */
+void redirect_pop(struct saved_fds *sv);
+
+/**
+ * @brief Start one command without waiting for it and without handing it
+ * the terminal. Builtins run in a forked subshell, everything else is
+ * found through the command hash. Errors are reported on stderr.
+ *
+ * @param sh The shell
+ * @param argv The command
+ * @param pgid Process group to join, 0 to lead a new one
+ * @param code Receives the exit code to record when nothing was started
+ * @return The pid of the child or -1
+ */
+pid_t start_command(struct shell *sh, char **argv, pid_t pgid, int *code);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // PIPELINE_H
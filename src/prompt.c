@@ -0,0 +1,509 @@
+/**
+ * prompt.c
+ * Prompt expansion. Cheap escapes are expanded every time the prompt is
+ * drawn. Slow segments, like the git branch, come from a cache keyed by
+ * segment and directory; a thread revalidates the cached value against
+ * the mtimes it depended on and recomputes it when they moved, so Enter
+ * never waits on a repository.
+ */
+
+#define _GNU_SOURCE
+#include "prompt.h"
+#include "lab.h"
+#include "vars.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <readline/readline.h>
+
+/* Segments every shell has, ahead of the ones added at run time */
+static const struct {
+    const char *name;
+    prompt_segment_fn fn;
+} builtin_segments[] = {
+    {"git", prompt_segment_git},
+};
+
+#define NBUILTIN_SEGMENTS (sizeof(builtin_segments) / sizeof(builtin_segments[0]))
+
+/* The prompt being built */
+struct pbuf {
+    char *s;
+    size_t len;
+    size_t cap;
+    bool failed;
+};
+
+/** Append len bytes of s. */
+static void pb_add(struct pbuf *b, const char *s, size_t len) {
+    if (b->len + len + 1 > b->cap) {
+        size_t cap = b->cap ? b->cap : 128;
+        while (cap < b->len + len + 1) cap *= 2;
+        char *grown = realloc(b->s, cap);
+        if (!grown) {
+            b->failed = true;
+            return;
+        }
+        b->s = grown;
+        b->cap = cap;
+    }
+    memcpy(b->s + b->len, s, len);
+    b->len += len;
+    b->s[b->len] = '\0';
+}
+
+/** Append a string. */
+static void pb_str(struct pbuf *b, const char *s) {
+    pb_add(b, s, strlen(s));
+}
+
+/** True when the thread runs in this process, a forked copy only has its memory. */
+static bool ps_threaded(const struct prompt_state *ps) {
+    return ps->started && ps->owner == getpid();
+}
+
+/** Lock the shared state, which only exists once the thread runs. */
+static void ps_lock(struct prompt_state *ps) {
+    if (ps_threaded(ps)) pthread_mutex_lock(&ps->lock);
+}
+
+static void ps_unlock(struct prompt_state *ps) {
+    if (ps_threaded(ps)) pthread_mutex_unlock(&ps->lock);
+}
+
+/** Index of the segment called name[0 .. len), -1 if there is none. */
+static ssize_t segment_index(const struct prompt_state *ps, const char *name, size_t len) {
+    for (size_t i = 0; i < ps->nsegs; i++) {
+        if (strlen(ps->segs[i].name) == len && memcmp(ps->segs[i].name, name, len) == 0)
+            return (ssize_t)(NBUILTIN_SEGMENTS + i);
+    }
+    for (size_t i = 0; i < NBUILTIN_SEGMENTS; i++) {
+        if (strlen(builtin_segments[i].name) == len && memcmp(builtin_segments[i].name, name, len) == 0)
+            return (ssize_t)i;
+    }
+    return -1;
+}
+
+/** The function of segment seg, call with the lock held. */
+static prompt_segment_fn segment_fn(const struct prompt_state *ps, size_t seg) {
+    return seg < NBUILTIN_SEGMENTS ? builtin_segments[seg].fn : ps->segs[seg - NBUILTIN_SEGMENTS].fn;
+}
+
+/** The cache entry of seg in cwd, call with the lock held. */
+static struct prompt_cached *cache_find(struct prompt_state *ps, size_t seg, const char *cwd) {
+    for (size_t i = 0; i < PROMPT_CACHE_SIZE; i++) {
+        struct prompt_cached *c = &ps->cache[i];
+        if (c->cwd && c->seg == seg && strcmp(c->cwd, cwd) == 0) return c;
+    }
+    return NULL;
+}
+
+/** Empty a cache entry. */
+static void cache_free(struct prompt_cached *c) {
+    free(c->cwd);
+    free(c->value);
+    free(c->dep);
+    memset(c, 0, sizeof(*c));
+}
+
+/** mtime of path, zero if it cannot be looked at. */
+static struct timespec mtime_of(const char *path) {
+    struct stat st;
+    if (!*path || stat(path, &st) == -1) return (struct timespec){0};
+    return st.st_mtim;
+}
+
+static bool same_time(struct timespec a, struct timespec b) {
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+/**
+ * Bring segment seg for cwd up to date. Called on the thread without the
+ * lock, which is only taken to look at and change the cache. Returns true
+ * if the value changed.
+ */
+static bool refresh_segment(struct prompt_state *ps, size_t seg, const char *cwd) {
+    struct timespec cwd_mtime = mtime_of(cwd);
+    char dep[PATH_MAX] = "";
+
+    pthread_mutex_lock(&ps->lock);
+    struct prompt_cached *c = cache_find(ps, seg, cwd);
+    if (c) snprintf(dep, sizeof(dep), "%s", c->dep);
+    struct timespec old_cwd = c ? c->cwd_mtime : (struct timespec){0};
+    struct timespec old_dep = c ? c->dep_mtime : (struct timespec){0};
+    prompt_segment_fn fn = segment_fn(ps, seg);
+    pthread_mutex_unlock(&ps->lock);
+
+    if (c && same_time(old_cwd, cwd_mtime) && same_time(old_dep, mtime_of(dep))) return false;
+
+    char value[PROMPT_SEGMENT_MAX];
+    dep[0] = '\0';
+    if (fn(cwd, value, sizeof(value), dep, sizeof(dep)) == -1) value[0] = '\0';
+    struct timespec dep_mtime = mtime_of(dep);
+
+    pthread_mutex_lock(&ps->lock);
+    bool changed = true;
+    // The entry may have been evicted while the lock was not held
+    if ((c = cache_find(ps, seg, cwd))) {
+        changed = strcmp(c->value, value) != 0;
+    } else {
+        c = &ps->cache[0];
+        for (size_t i = 1; i < PROMPT_CACHE_SIZE && c->cwd; i++)
+            if (!ps->cache[i].cwd || ps->cache[i].used < c->used) c = &ps->cache[i];
+        cache_free(c);
+        c->seg = seg;
+        c->cwd = strdup(cwd);
+    }
+    free(c->value);
+    free(c->dep);
+    c->value = strdup(value);
+    c->dep = strdup(dep);
+    c->cwd_mtime = cwd_mtime;
+    c->dep_mtime = dep_mtime;
+    c->used = ++ps->tick;
+    if (!c->cwd || !c->value || !c->dep) cache_free(c);
+    pthread_mutex_unlock(&ps->lock);
+    return changed;
+}
+
+/** The prompt thread, takes one request at a time. */
+static void *prompt_thread(void *arg) {
+    struct prompt_state *ps = arg;
+    pthread_mutex_lock(&ps->lock);
+    while (!ps->quit) {
+        if (!ps->want_cwd) {
+            pthread_cond_wait(&ps->wake, &ps->lock);
+            continue;
+        }
+        char *cwd = ps->want_cwd;
+        uint64_t segs = ps->want_segs;
+        ps->want_cwd = NULL;
+        pthread_mutex_unlock(&ps->lock);
+
+        bool changed = false;
+        for (size_t seg = 0; seg < 64; seg++)
+            if (segs & (1ull << seg)) changed |= refresh_segment(ps, seg, cwd);
+        free(cwd);
+        if (changed) {
+            uint64_t one = 1;
+            ssize_t rc = write(ps->efd, &one, sizeof(one));
+            UNUSED(rc);
+        }
+        pthread_mutex_lock(&ps->lock);
+    }
+    pthread_mutex_unlock(&ps->lock);
+    return NULL;
+}
+
+/** Start the thread, with every signal blocked so they stay with the shell. */
+static int prompt_start(struct prompt_state *ps) {
+    if (ps->started) return ps->owner == getpid() ? 0 : -1;
+    ps->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ps->efd == -1) return -1;
+    pthread_mutex_init(&ps->lock, NULL);
+    pthread_cond_init(&ps->wake, NULL);
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int rc = pthread_create(&ps->thread, NULL, prompt_thread, ps);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0) {
+        close(ps->efd);
+        pthread_mutex_destroy(&ps->lock);
+        pthread_cond_destroy(&ps->wake);
+        errno = rc;
+        return -1;
+    }
+    ps->started = true;
+    ps->owner = getpid();
+    return 0;
+}
+
+/** Ask the thread to look at segs in cwd, replacing a request it did not take yet. */
+static void prompt_request(struct prompt_state *ps, const char *cwd, uint64_t segs) {
+    if (prompt_start(ps) == -1) return;
+    char *copy = strdup(cwd);
+    if (!copy) return;
+    pthread_mutex_lock(&ps->lock);
+    free(ps->want_cwd);
+    ps->want_cwd = copy;
+    ps->want_segs = segs;
+    pthread_cond_signal(&ps->wake);
+    pthread_mutex_unlock(&ps->lock);
+}
+
+/** Look up the user and host names the first time they are needed. */
+static void prompt_identity(struct prompt_state *ps) {
+    if (!ps->user) {
+        struct passwd *pw = getpwuid(geteuid());
+        ps->user = strdup(pw ? pw->pw_name : "");
+    }
+    if (!ps->host) {
+        char host[HOST_NAME_MAX + 1];
+        if (gethostname(host, sizeof(host)) == -1) host[0] = '\0';
+        host[HOST_NAME_MAX] = '\0';
+        ps->host = strdup(host);
+    }
+}
+
+/** Append a duration the way people read them. */
+static void pb_duration(struct pbuf *b, int64_t us) {
+    char buf[32];
+    int64_t s = us / 1000000;
+    if (s < 60) snprintf(buf, sizeof(buf), "%.2fs", (double)us / 1e6);
+    else if (s < 3600) snprintf(buf, sizeof(buf), "%dm%02ds", (int)(s / 60), (int)(s % 60));
+    else snprintf(buf, sizeof(buf), "%dh%02dm", (int)(s / 3600), (int)(s / 60 % 60));
+    pb_str(b, buf);
+}
+
+/** Expand a prompt format. */
+char *prompt_expand(struct shell *sh, const char *fmt) {
+    struct prompt_state *ps = &sh->prompt_state;
+    struct pbuf b = {0};
+    char cwd[PATH_MAX], num[32];
+    if (!getcwd(cwd, sizeof(cwd))) cwd[0] = '\0';
+    uint64_t segs = 0;
+    pb_add(&b, "", 0);
+
+    for (const char *p = fmt; *p; p++) {
+        if (*p != '\\' || !p[1]) {
+            // Plain text up to the next escape
+            size_t n = 1 + strcspn(p + 1, "\\");
+            pb_add(&b, p, n);
+            p += n - 1;
+            continue;
+        }
+        switch (*++p) {
+        case 'w': {
+            const char *home = var_get(sh, "HOME");
+            size_t hl = home ? strlen(home) : 0;
+            if (hl > 1 && strncmp(cwd, home, hl) == 0 && (cwd[hl] == '/' || !cwd[hl])) {
+                pb_str(&b, "~");
+                pb_str(&b, cwd + hl);
+            } else {
+                pb_str(&b, cwd);
+            }
+            break;
+        }
+        case 'W': {
+            const char *slash = strrchr(cwd, '/');
+            pb_str(&b, slash && slash[1] ? slash + 1 : cwd);
+            break;
+        }
+        case 'u':
+            prompt_identity(ps);
+            pb_str(&b, ps->user ? ps->user : "");
+            break;
+        case 'h':
+        case 'H':
+            prompt_identity(ps);
+            if (ps->host) pb_add(&b, ps->host, *p == 'H' ? strlen(ps->host) : strcspn(ps->host, "."));
+            break;
+        case '?':
+            snprintf(num, sizeof(num), "%d", sh->last_status);
+            pb_str(&b, num);
+            break;
+        case 'j':
+            snprintf(num, sizeof(num), "%zu", sh->jobs.n);
+            pb_str(&b, num);
+            break;
+        case 'E':
+            pb_duration(&b, ps->elapsed_us);
+            break;
+        case '$': pb_str(&b, geteuid() == 0 ? "#" : "$"); break;
+        case 'n': pb_str(&b, "\n"); break;
+        case 'e': pb_str(&b, "\033"); break;
+        case 'a': pb_str(&b, "\a"); break;
+        case '\\': pb_str(&b, "\\"); break;
+        case '[': pb_add(&b, (char[]){RL_PROMPT_START_IGNORE}, 1); break;
+        case ']': pb_add(&b, (char[]){RL_PROMPT_END_IGNORE}, 1); break;
+        case '{': {
+            const char *close = strchr(p, '}');
+            ssize_t seg = close ? segment_index(ps, p + 1, (size_t)(close - p - 1)) : -1;
+            if (seg < 0 || seg >= 64) {
+                pb_add(&b, p - 1, 2);
+                break;
+            }
+            segs |= 1ull << seg;
+            ps_lock(ps);
+            struct prompt_cached *c = cache_find(ps, (size_t)seg, cwd);
+            if (c) {
+                c->used = ++ps->tick;
+                pb_str(&b, c->value);
+            }
+            ps_unlock(ps);
+            p = close;
+            break;
+        }
+        default:
+            pb_add(&b, p - 1, 2);
+            break;
+        }
+    }
+    // Shown right away with what the cache had, the thread checks it
+    if (segs && *cwd) prompt_request(ps, cwd, segs);
+    if (b.failed) {
+        free(b.s);
+        return NULL;
+    }
+    return b.s;
+}
+
+/** The main prompt. */
+char *prompt_render(struct shell *sh) {
+    const char *fmt = var_get(sh, "MY_PROMPT");
+    char *s = prompt_expand(sh, fmt ? fmt : sh->prompt ? sh->prompt : "shell>");
+    free(sh->prompt_state.shown);
+    sh->prompt_state.shown = s ? strdup(s) : NULL;
+    return s;
+}
+
+/** The eventfd of the thread. */
+int prompt_fd(const struct shell *sh) {
+    return sh->prompt_state.started ? sh->prompt_state.efd : -1;
+}
+
+/** Render again after the thread changed a segment. */
+char *prompt_update(struct shell *sh) {
+    struct prompt_state *ps = &sh->prompt_state;
+    uint64_t n;
+    if (!ps->started || read(ps->efd, &n, sizeof(n)) != sizeof(n)) return NULL;
+    char *old = ps->shown;
+    ps->shown = NULL;
+    char *s = prompt_render(sh);
+    if (s && old && strcmp(s, old) == 0) {
+        free(s);
+        s = NULL;
+    }
+    free(old);
+    return s;
+}
+
+/** Add a slow segment. */
+int prompt_add_segment(struct shell *sh, const char *name, prompt_segment_fn fn) {
+    struct prompt_state *ps = &sh->prompt_state;
+    if (!name || !*name || strchr(name, '}') || !fn) {
+        errno = EINVAL;
+        return -1;
+    }
+    ssize_t at = segment_index(ps, name, strlen(name));
+    if (at < 0 && NBUILTIN_SEGMENTS + ps->nsegs >= 64) {
+        errno = ENOSPC;
+        return -1;
+    }
+    ps_lock(ps);
+    int rc = 0;
+    if (at >= (ssize_t)NBUILTIN_SEGMENTS) {
+        ps->segs[at - (ssize_t)NBUILTIN_SEGMENTS].fn = fn;
+    } else {
+        // A built in name is shadowed, the new one is found first
+        struct prompt_segment *grown = realloc(ps->segs, (ps->nsegs + 1) * sizeof(*grown));
+        char *copy = strdup(name);
+        if (grown) ps->segs = grown;
+        if (!grown || !copy) {
+            free(copy);
+            rc = -1;
+        } else {
+            ps->segs[ps->nsegs++] = (struct prompt_segment){copy, fn};
+        }
+    }
+    // Values computed by the function that was replaced are not used again
+    for (size_t i = 0; i < PROMPT_CACHE_SIZE && at >= (ssize_t)NBUILTIN_SEGMENTS; i++)
+        if (ps->cache[i].cwd && ps->cache[i].seg == (size_t)at) cache_free(&ps->cache[i]);
+    ps_unlock(ps);
+    return rc;
+}
+
+/** Read a small file into buf, without the trailing newline. */
+static int read_small(const char *path, char *buf, size_t size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0) return -1;
+    buf[n] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+/** Format into out, false when the result does not fit. */
+__attribute__((format(printf, 3, 4)))
+static bool fits(char *out, size_t size, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(out, size, fmt, ap);
+    va_end(ap);
+    return n >= 0 && (size_t)n < size;
+}
+
+/** The git branch of cwd. */
+int prompt_segment_git(const char *cwd, char *out, size_t size, char *dep, size_t dep_size) {
+    char dir[PATH_MAX], path[PATH_MAX], head[PATH_MAX];
+    // A path too long to build gives no segment rather than a wrong one
+    if (!fits(dir, sizeof(dir), "%s", cwd)) return -1;
+    for (;;) {
+        struct stat st;
+        if (!fits(path, sizeof(path), "%s/.git", strcmp(dir, "/") == 0 ? "" : dir)) return -1;
+        if (stat(path, &st) == 0) {
+            if (!S_ISDIR(st.st_mode)) {
+                // A worktree or submodule: .git names the real directory
+                if (read_small(path, head, sizeof(head)) == -1 || strncmp(head, "gitdir: ", 8) != 0) return -1;
+                bool ok = head[8] == '/' ? fits(path, sizeof(path), "%s", head + 8)
+                                         : fits(path, sizeof(path), "%s/%s", dir, head + 8);
+                if (!ok) return -1;
+            }
+            break;
+        }
+        char *slash = strrchr(dir, '/');
+        if (!slash || slash == dir) {
+            if (strcmp(dir, "/") == 0 || !slash) return -1;
+            dir[1] = '\0';
+        } else {
+            *slash = '\0';
+        }
+    }
+    size_t len = strlen(path);
+    if (len + 6 > sizeof(path)) return -1;
+    memcpy(path + len, "/HEAD", 6);
+    if (!fits(dep, dep_size, "%s", path)) return -1;
+    if (read_small(path, head, sizeof(head)) == -1) return -1;
+    if (strncmp(head, "ref: refs/heads/", 16) == 0) snprintf(out, size, "%s", head + 16);
+    else if (strncmp(head, "ref: ", 5) == 0) snprintf(out, size, "%s", head + 5);
+    else snprintf(out, size, "%.7s", head);
+    return 0;
+}
+
+/** Stop the thread and free everything. */
+void prompt_destroy(struct prompt_state *ps) {
+    // A forked copy has no thread to stop, and the lock may have been
+    // held by it at the fork, so only the memory is freed
+    if (ps->started && ps->owner != getpid()) {
+        close(ps->efd);
+    } else if (ps->started) {
+        pthread_mutex_lock(&ps->lock);
+        ps->quit = true;
+        pthread_cond_signal(&ps->wake);
+        pthread_mutex_unlock(&ps->lock);
+        pthread_join(ps->thread, NULL);
+        pthread_mutex_destroy(&ps->lock);
+        pthread_cond_destroy(&ps->wake);
+        close(ps->efd);
+    }
+    for (size_t i = 0; i < PROMPT_CACHE_SIZE; i++) cache_free(&ps->cache[i]);
+    for (size_t i = 0; i < ps->nsegs; i++) free(ps->segs[i].name);
+    free(ps->segs);
+    free(ps->want_cwd);
+    free(ps->user);
+    free(ps->host);
+    free(ps->shown);
+    memset(ps, 0, sizeof(*ps));
+}
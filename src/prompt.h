@@ -0,0 +1,144 @@
+#ifndef PROMPT_H
+#define PROMPT_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct shell;
+
+// Segment values remembered, by segment and directory
+#define PROMPT_CACHE_SIZE 32
+// Longest segment value
+#define PROMPT_SEGMENT_MAX 256
+
+/**
+ * @brief Compute a slow prompt segment. Runs on the prompt thread, so it
+ * must not touch the shell or start processes, the shell reaps every child.
+ *
+ * @param cwd The directory the prompt is for
+ * @param out Receives the text, NUL terminated
+ * @param size Size of out
+ * @param dep Receives a file whose mtime tells when out is stale, or ""
+ * when only a change of cwd itself matters
+ * @param dep_size Size of dep
+ * @return 0 on success, -1 to show nothing
+ */
+typedef int (*prompt_segment_fn)(const char *cwd, char *out, size_t size, char *dep, size_t dep_size);
+
+/* A segment that can be named in a prompt with \{name} */
+struct prompt_segment {
+    char *name;
+    prompt_segment_fn fn;
+};
+
+/* One computed segment value */
+struct prompt_cached {
+    size_t seg;             // index into the segments, built in ones first
+    char *cwd;              // NULL marks a free entry
+    char *value;
+    char *dep;
+    struct timespec cwd_mtime;
+    struct timespec dep_mtime;
+    uint64_t used;          // for eviction
+};
+
+/**
+ * @brief Prompt state. Slow segments never hold up the prompt: it is
+ * drawn with the value cached for the directory, or nothing, while a
+ * thread checks whether that value is still good and computes it again if
+ * not. The thread reports a changed value through an eventfd, the shell
+ * then draws the prompt again. All zero is a valid state, the thread is
+ * started by the first prompt that uses a slow segment.
+ */
+struct prompt_state {
+    struct prompt_segment *segs;    // added with prompt_add_segment
+    size_t nsegs;
+    struct prompt_cached cache[PROMPT_CACHE_SIZE];
+    uint64_t tick;
+    pthread_t thread;
+    pthread_mutex_t lock;   // the cache, segs and the request
+    pthread_cond_t wake;
+    int efd;                // eventfd, valid once started
+    bool started;
+    pid_t owner;            // process running the thread, a forked copy has none
+    bool quit;
+    char *want_cwd;         // the request for the thread, NULL when there is none
+    uint64_t want_segs;     // bit per segment index
+    char *user;             // looked up once, the password database may be remote
+    char *host;
+    char *shown;            // the prompt last handed out by prompt_render
+    int64_t elapsed_us;     // duration of the last command
+};
+
+/**
+ * @brief Expand a prompt format. Besides plain text it understands
+ * \w (cwd, $HOME as ~), \W (its last component), \u (user), \h (host up
+ * to the first dot), \H (host), \? (exit status), \j (jobs), \E (time the
+ * last command took), \$ (# for root, $ otherwise), \n, \e, \a, \\, \[ and
+ * \] around escape sequences that take no room, and \{name} for the
+ * segment called name. A slow segment shows its cached value.
+ *
+ * @param sh The shell
+ * @param fmt The format
+ * @return The prompt, free it when done, or NULL if memory ran out
+ */
+char *prompt_expand(struct shell *sh, const char *fmt);
+
+/**
+ * @brief The main prompt, from the shell variable MY_PROMPT or the one
+ * the shell started with. Slow segments it uses are handed to the thread.
+ *
+ * @param sh The shell
+ * @return The prompt, free it when done, or NULL if memory ran out
+ */
+char *prompt_render(struct shell *sh);
+
+/**
+ * @brief The descriptor that becomes readable when a slow segment changed
+ *
+ * @return The eventfd, -1 while there is no thread
+ */
+int prompt_fd(const struct shell *sh);
+
+/**
+ * @brief Take the news from the thread and render the prompt again
+ *
+ * @param sh The shell
+ * @return The new prompt if it differs from the last one, else NULL
+ */
+char *prompt_update(struct shell *sh);
+
+/**
+ * @brief Make a slow segment available as \{name}, replacing one of the
+ * same name
+ *
+ * @return 0 on success, -1 with errno set
+ */
+int prompt_add_segment(struct shell *sh, const char *name, prompt_segment_fn fn);
+
+/**
+ * @brief The git segment: the branch checked out in the repository
+ * holding cwd, or the start of the commit id when HEAD is detached. Read
+ * from the files in .git, git itself is not run.
+ */
+int prompt_segment_git(const char *cwd, char *out, size_t size, char *dep, size_t dep_size);
+
+/**
+ * @brief Stop the thread and free everything
+ *
+ * @param ps The state
+ */
+void prompt_destroy(struct prompt_state *ps);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // PROMPT_H
@@ -0,0 +1,135 @@
+/**
+ * script.c
+ * Reading scripts, -c strings and non-interactive stdin line by line.
+ */
+
+#define _GNU_SOURCE
+#include "script.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read size for pipes, doubled while a single line does not fit
+#define SCRIPT_BUF_SIZE (64 * 1024)
+
+/** Map fd if it is a non-empty regular file, else prepare to stream it. */
+static int script_setup(struct script *s, int fd) {
+    memset(s, 0, sizeof(*s));
+    s->fd = fd;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) return -1;
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        // Start where the descriptor is, stdin might be half read already
+        off_t at = lseek(fd, 0, SEEK_CUR);
+        void *m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m != MAP_FAILED) {
+            madvise(m, (size_t)st.st_size, MADV_SEQUENTIAL);
+            s->mapped = true;
+            s->data = m;
+            s->len = (size_t)st.st_size;
+            if (at > 0) s->pos = (size_t)at < s->len ? (size_t)at : s->len;
+            return 0;
+        }
+    }
+    s->cap = SCRIPT_BUF_SIZE;
+    s->buf = malloc(s->cap);
+    if (!s->buf) return -1;
+    s->data = s->buf;
+    return 0;
+}
+
+/** Open and map a script file. */
+int script_open_file(struct script *s, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    if (script_setup(s, fd) == -1) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    s->own_fd = true;
+    return 0;
+}
+
+/** Read from an inherited descriptor. */
+int script_open_fd(struct script *s, int fd) {
+    if (script_setup(s, fd) == -1) return -1;
+    s->sync_offset = s->mapped;
+    return 0;
+}
+
+/** Read from a string. */
+void script_open_string(struct script *s, const char *str) {
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+    s->data = str;
+    s->len = strlen(str);
+}
+
+/** Pull more input into the buffer, keeping the unread part. */
+static int script_fill(struct script *s) {
+    size_t left = s->len - s->pos;
+    if (left == s->cap) {
+        char *grown = realloc(s->buf, s->cap * 2);
+        if (!grown) return -1;
+        s->buf = grown;
+        s->cap *= 2;
+    } else if (s->pos) {
+        memmove(s->buf, s->buf + s->pos, left);
+    }
+    s->data = s->buf;
+    s->pos = 0;
+    s->len = left;
+
+    ssize_t n;
+    while ((n = read(s->fd, s->buf + s->len, s->cap - s->len)) == -1 && errno == EINTR)
+        ;
+    if (n == -1) return -1;
+    if (n == 0) s->eof = true;
+    s->len += (size_t)n;
+    return 0;
+}
+
+/** Next non-empty, non-comment line. */
+char *script_next(struct script *s, struct arena *a) {
+    for (;;) {
+        const char *start = s->data + s->pos;
+        const char *nl = memchr(start, '\n', s->len - s->pos);
+        if (!nl && s->buf && !s->eof) {
+            if (script_fill(s) == -1) return NULL;
+            continue;
+        }
+        if (s->pos == s->len) return NULL;
+
+        size_t len = nl ? (size_t)(nl - start) : s->len - s->pos;
+        s->pos += len + (nl ? 1 : 0);
+        s->line_no++;
+        if (s->sync_offset) lseek(s->fd, (off_t)s->pos, SEEK_SET);
+
+        // Leading blanks and comments never reach the parser
+        size_t skip = 0;
+        while (skip < len && (start[skip] == ' ' || start[skip] == '\t')) skip++;
+        if (skip == len || start[skip] == '#') continue;
+
+        char *line = arena_alloc(a, len - skip + 1);
+        if (!line) return NULL;
+        memcpy(line, start + skip, len - skip);
+        line[len - skip] = '\0';
+        return line;
+    }
+}
+
+/** Release everything the reader holds. */
+void script_close(struct script *s) {
+    if (s->mapped) munmap((void *)s->data, s->len);
+    free(s->buf);
+    if (s->own_fd) close(s->fd);
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+}
@@ -0,0 +1,70 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "arena.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Line reader for non-interactive input. Regular files are mapped
+ * and read in place, pipes and terminals go through one large buffer, and
+ * -c strings are read straight from memory. No readline, no history.
+ */
+struct script {
+    int fd;             // descriptor read from, -1 for strings
+    bool mapped;        // data is an mmap of the whole file
+    bool own_fd;        // close fd when done
+    bool sync_offset;   // keep the fd offset at the next line for children
+    const char *data;   // mapping, string, or buffer contents
+    size_t len;
+    size_t pos;         // start of the next line in data
+    char *buf;          // read buffer when streaming
+    size_t cap;
+    bool eof;           // no more data to read into buf
+    size_t line_no;     // number of the line returned last
+};
+
+/**
+ * @brief Read the script at path
+ *
+ * @return 0 on success, -1 with errno set
+ */
+int script_open_file(struct script *s, const char *path);
+
+/**
+ * @brief Read the script from fd, usually stdin. When fd is a regular file
+ * its offset is kept right after the current line so commands reading
+ * from the same descriptor continue where the shell stopped.
+ *
+ * @return 0 on success, -1 with errno set
+ */
+int script_open_fd(struct script *s, int fd);
+
+/**
+ * @brief Read the script from a string, as passed to -c
+ */
+void script_open_string(struct script *s, const char *str);
+
+/**
+ * @brief Next line without its newline, copied into a. Lines that are
+ * empty or comments are skipped.
+ *
+ * @return The line, or NULL at the end of input or on a read error
+ */
+char *script_next(struct script *s, struct arena *a);
+
+/**
+ * @brief Release the mapping or buffer and close the file
+ */
+void script_close(struct script *s);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // SCRIPT_H
@@ -0,0 +1,197 @@
+/**
+ * timing.c
+ * Measurements for the time keyword. Children are accounted for through
+ * the rusage that wait4 hands back when the job table reaps them, the
+ * shell's own rusage covers builtins, and perf_event_open adds hardware
+ * counters on request.
+ */
+
+#define _GNU_SOURCE
+#include "timing.h"
+#include "lab.h"
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+static const uint64_t perf_config[TIME_COUNTERS] = {
+    [TIME_CYCLES] = PERF_COUNT_HW_CPU_CYCLES,
+    [TIME_INSTRUCTIONS] = PERF_COUNT_HW_INSTRUCTIONS,
+    [TIME_CACHE_MISSES] = PERF_COUNT_HW_CACHE_MISSES,
+};
+
+/** Seconds in a timeval. */
+static double tv_secs(const struct timeval *tv) {
+    return (double)tv->tv_sec + (double)tv->tv_usec / 1e6;
+}
+
+/** Close every counter of tp. */
+static void perf_close(struct time_probe *tp) {
+    for (int i = 0; i < TIME_COUNTERS; i++) {
+        if (tp->perf[i] != -1) close(tp->perf[i]);
+        tp->perf[i] = -1;
+    }
+}
+
+/**
+ * Open one disabled counter per event on the shell. inherit makes every
+ * process started afterwards count too, user space only so a
+ * perf_event_paranoid of 2 still allows it.
+ */
+static int perf_open(struct time_probe *tp) {
+    for (int i = 0; i < TIME_COUNTERS; i++) {
+        struct perf_event_attr attr = {
+            .type = PERF_TYPE_HARDWARE, .size = sizeof(attr), .config = perf_config[i],
+            .disabled = 1, .inherit = 1, .exclude_kernel = 1, .exclude_hv = 1,
+        };
+        tp->perf[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (tp->perf[i] == -1) {
+            int err = errno;
+            perf_close(tp);
+            errno = err;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/** Snapshot the clocks and usage, counters start last so setup is not counted. */
+void time_start(struct shell *sh, struct time_probe *tp, bool counters) {
+    for (int i = 0; i < TIME_COUNTERS; i++) tp->perf[i] = -1;
+    if (counters && perf_open(tp) == -1)
+        fprintf(stderr, "time: hardware counters unavailable: %s\n", strerror(errno));
+    // The largest child from here on, not since the shell started
+    sh->jobs.usage.ru_maxrss = 0;
+    tp->children = sh->jobs.usage;
+    getrusage(RUSAGE_SELF, &tp->self);
+    clock_gettime(CLOCK_MONOTONIC, &tp->start);
+    for (int i = 0; i < TIME_COUNTERS; i++) {
+        if (tp->perf[i] == -1) continue;
+        ioctl(tp->perf[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(tp->perf[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+/** Stop the counters and work out what happened since time_start. */
+void time_stop(struct shell *sh, struct time_probe *tp, struct time_report *tr) {
+    memset(tr, 0, sizeof(*tr));
+    tr->have_counters = tp->perf[0] != -1;
+    for (int i = 0; i < TIME_COUNTERS; i++) {
+        if (tp->perf[i] == -1) continue;
+        ioctl(tp->perf[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(tp->perf[i], &tr->counters[i], sizeof(uint64_t)) != sizeof(uint64_t))
+            tr->have_counters = false;
+    }
+    perf_close(tp);
+
+    struct timespec now;
+    struct rusage self;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    getrusage(RUSAGE_SELF, &self);
+    const struct rusage *c = &sh->jobs.usage, *c0 = &tp->children, *s0 = &tp->self;
+
+    struct timeval d, e;
+    tr->real = (double)(now.tv_sec - tp->start.tv_sec) + (double)(now.tv_nsec - tp->start.tv_nsec) / 1e9;
+    timersub(&self.ru_utime, &s0->ru_utime, &d);
+    timersub(&c->ru_utime, &c0->ru_utime, &e);
+    tr->user = tv_secs(&d) + tv_secs(&e);
+    timersub(&self.ru_stime, &s0->ru_stime, &d);
+    timersub(&c->ru_stime, &c0->ru_stime, &e);
+    tr->sys = tv_secs(&d) + tv_secs(&e);
+    // Without children the builtin ran in the shell, whose peak is all there is
+    tr->maxrss = c->ru_maxrss ? c->ru_maxrss : self.ru_maxrss;
+    tr->majflt = self.ru_majflt - s0->ru_majflt + c->ru_majflt - c0->ru_majflt;
+    tr->minflt = self.ru_minflt - s0->ru_minflt + c->ru_minflt - c0->ru_minflt;
+    tr->nvcsw = self.ru_nvcsw - s0->ru_nvcsw + c->ru_nvcsw - c0->ru_nvcsw;
+    tr->nivcsw = self.ru_nivcsw - s0->ru_nivcsw + c->ru_nivcsw - c0->ru_nivcsw;
+}
+
+/** Print t seconds with prec decimals, as 1m2.345s in the long form. */
+static void print_secs(FILE *out, double t, int prec, bool lng) {
+    if (lng) {
+        long m = (long)(t / 60);
+        fprintf(out, "%ldm%.*fs", m, prec, t - (double)m * 60);
+    } else {
+        fprintf(out, "%.*f", prec, t);
+    }
+}
+
+/** Counter i, or - when it was not counted. */
+static void print_counter(FILE *out, const struct time_report *tr, int i) {
+    if (tr->have_counters) fprintf(out, "%llu", (unsigned long long)tr->counters[i]);
+    else fputc('-', out);
+}
+
+/** Walk fmt, expanding escapes. */
+void time_print(FILE *out, const char *fmt, const struct time_report *tr) {
+    for (const char *p = fmt; *p; p++) {
+        if (*p == '\\' && (p[1] == 'n' || p[1] == 't' || p[1] == '\\')) {
+            p++;
+            fputc(*p == 'n' ? '\n' : *p == 't' ? '\t' : '\\', out);
+            continue;
+        }
+        if (*p != '%') {
+            fputc(*p, out);
+            continue;
+        }
+        const char *esc = p++;
+        int prec = 3;
+        bool lng = false;
+        if (*p >= '0' && *p <= '9') prec = *p++ - '0';
+        if (prec > 6) prec = 6;
+        if (*p == 'l') {
+            lng = true;
+            p++;
+        }
+        switch (*p) {
+        case 'R': print_secs(out, tr->real, prec, lng); break;
+        case 'U': print_secs(out, tr->user, prec, lng); break;
+        case 'S': print_secs(out, tr->sys, prec, lng); break;
+        case 'P': fprintf(out, "%.2f", tr->real > 0 ? (tr->user + tr->sys) * 100 / tr->real : 0.0); break;
+        case 'M': fprintf(out, "%ld", tr->maxrss); break;
+        case 'F': fprintf(out, "%ld", tr->majflt); break;
+        case 'f': fprintf(out, "%ld", tr->minflt); break;
+        case 'w': fprintf(out, "%ld", tr->nvcsw); break;
+        case 'c': fprintf(out, "%ld", tr->nivcsw); break;
+        case 'y': print_counter(out, tr, TIME_CYCLES); break;
+        case 'i': print_counter(out, tr, TIME_INSTRUCTIONS); break;
+        case 'x': print_counter(out, tr, TIME_CACHE_MISSES); break;
+        case '%': fputc('%', out); break;
+        default:
+            // Not an escape, print it as it is
+            fprintf(out, "%.*s", (int)(p - esc) + (*p != '\0'), esc);
+            if (!*p) p--;
+            break;
+        }
+    }
+    fputc('\n', out);
+}
+
+/** Look for %y, %i or %x, with or without precision and l. */
+bool time_format_counters(const char *fmt) {
+    for (const char *p = fmt; (p = strchr(p, '%')); ) {
+        p++;
+        if (*p == '%') {
+            p++;
+            continue;
+        }
+        if (*p >= '0' && *p <= '9') p++;
+        if (*p == 'l') p++;
+        if (*p == 'y' || *p == 'i' || *p == 'x') return true;
+    }
+    return false;
+}
+
+/** The formats of time and time -p, plus the rusage and counter lines. */
+const char *time_default_format(bool posix, bool counters) {
+    if (posix) return "real %2R\nuser %2U\nsys %2S";
+    if (counters)
+        return "\nreal\t%3lR\nuser\t%3lU\nsys\t%3lS\nrss\t%MK\n"
+               "faults\t%F major, %f minor\nctxsw\t%w voluntary, %c involuntary\n"
+               "cycles\t%y\ninstr\t%i\ncmiss\t%x";
+    return "\nreal\t%3lR\nuser\t%3lU\nsys\t%3lS\nrss\t%MK\n"
+           "faults\t%F major, %f minor\nctxsw\t%w voluntary, %c involuntary";
+}
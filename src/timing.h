@@ -0,0 +1,97 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct shell;
+
+enum time_counter {
+    TIME_CYCLES,
+    TIME_INSTRUCTIONS,
+    TIME_CACHE_MISSES,
+    TIME_COUNTERS,
+};
+
+/**
+ * @brief What a timed command cost. Times are in seconds, the rest comes
+ * from the rusage of the children reaped while it ran, or of the shell
+ * itself for builtins.
+ */
+struct time_report {
+    double real;
+    double user;
+    double sys;
+    long maxrss;    // kilobytes
+    long majflt;
+    long minflt;
+    long nvcsw;
+    long nivcsw;
+    bool have_counters;
+    uint64_t counters[TIME_COUNTERS];
+};
+
+/**
+ * @brief Measurement in progress. Hardware counters are opened on the
+ * shell with inherit set, so every process it starts until time_stop is
+ * counted, and the kernel folds their counts back in as they are reaped.
+ */
+struct time_probe {
+    struct timespec start;
+    struct rusage self;
+    struct rusage children;
+    int perf[TIME_COUNTERS];    // -1 when not counting
+};
+
+/**
+ * @brief Start timing
+ *
+ * @param sh The shell, its job table accounts for reaped children
+ * @param tp Receives the starting point
+ * @param counters Also count cycles, instructions and cache misses
+ */
+void time_start(struct shell *sh, struct time_probe *tp, bool counters);
+
+/**
+ * @brief Stop timing and close the counters
+ */
+void time_stop(struct shell *sh, struct time_probe *tp, struct time_report *tr);
+
+/**
+ * @brief Format a report. Besides bash's TIMEFORMAT escapes (%[p][l]R,
+ * %[p][l]U, %[p][l]S, %P and %%) this knows %M (max RSS in KB), %F and %f
+ * (major and minor faults), %w and %c (voluntary and involuntary context
+ * switches) and %y, %i and %x (cycles, instructions and cache misses).
+ * \n and \t in fmt stand for newline and tab. A newline is added at the end.
+ *
+ * @param out Where to print
+ * @param fmt The format
+ * @param tr The report
+ */
+void time_print(FILE *out, const char *fmt, const struct time_report *tr);
+
+/**
+ * @brief True when fmt uses any hardware counter
+ */
+bool time_format_counters(const char *fmt);
+
+/**
+ * @brief Format used when TIMEFORMAT is not set
+ *
+ * @param posix The POSIX format of time -p
+ * @param counters Add lines for the hardware counters
+ */
+const char *time_default_format(bool posix, bool counters);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // TIMING_H
@@ -0,0 +1,490 @@
+/**
+ * tokenize.c
+ * Single pass tokenizer. Bytes are classified 64 at a time into a
+ * whitespace mask and a special character mask, the scanner then jumps
+ * between interesting bytes with count-trailing-zeros instead of looking
+ * at every byte.
+ */
+
+#include "tokenize.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TOK_HAVE_X86 1
+#endif
+
+typedef void (*classify_fn)(const char *p, uint64_t *ws, uint64_t *sp);
+
+/*
+ * Byte classes. Whitespace is the isspace set so tokens agree with
+ * trim_white. Specials are the quoting characters, backquotes included,
+ * plus the metacharacters that end a word.
+ */
+#define CLS_WS 0x1
+#define CLS_SP 0x2
+
+static const uint8_t byte_class[256] = {
+    ['\t'] = CLS_WS, ['\n'] = CLS_WS, ['\v'] = CLS_WS,
+    ['\f'] = CLS_WS, ['\r'] = CLS_WS, [' '] = CLS_WS,
+    ['\''] = CLS_SP, ['"'] = CLS_SP, ['\\'] = CLS_SP,
+    ['|'] = CLS_SP, ['&'] = CLS_SP, [';'] = CLS_SP,
+    ['<'] = CLS_SP, ['>'] = CLS_SP, ['('] = CLS_SP, [')'] = CLS_SP,
+    ['`'] = CLS_SP,
+};
+
+#define IS_META(c) (byte_class[(uint8_t)(c)] & CLS_SP && (c) != '\'' && (c) != '"' && (c) != '\\' && (c) != '`')
+
+/** Portable classifier, one table lookup per byte. */
+static void classify_scalar(const char *p, uint64_t *ws, uint64_t *sp) {
+    uint64_t w = 0, s = 0;
+    for (int i = 0; i < 64; i++) {
+        uint8_t c = byte_class[(uint8_t)p[i]];
+        w |= (uint64_t)(c & CLS_WS) << i;
+        s |= (uint64_t)((c & CLS_SP) >> 1) << i;
+    }
+    *ws = w;
+    *sp = s;
+}
+
+#ifdef TOK_HAVE_X86
+/*
+ * The specials are grouped into ranges to save compares:
+ * & ' ( ) are 0x26-0x29 and ; < are 0x3b-0x3c, the rest one by one. Whitespace is ' ' or
+ * 0x09-0x0d. A range test is x - lo <= n - 1 using an unsigned min.
+ */
+__attribute__((target("sse2")))
+static void classify_sse2(const char *p, uint64_t *ws, uint64_t *sp) {
+    const __m128i sp_c = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8(0x09), four = _mm_set1_epi8(4);
+    const __m128i amp = _mm_set1_epi8(0x26), three = _mm_set1_epi8(3);
+    const __m128i semi = _mm_set1_epi8(0x3b), one = _mm_set1_epi8(1);
+    const __m128i gt = _mm_set1_epi8('>'), dq = _mm_set1_epi8('"');
+    const __m128i bs = _mm_set1_epi8('\\'), bar = _mm_set1_epi8('|');
+    const __m128i bq = _mm_set1_epi8('`');
+    uint64_t w = 0, s = 0;
+
+    for (int i = 0; i < 4; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i * 16));
+        __m128i t = _mm_sub_epi8(v, tab);
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, sp_c),
+                                 _mm_cmpeq_epi8(_mm_min_epu8(t, four), t));
+        w |= (uint64_t)(uint16_t)_mm_movemask_epi8(m) << (i * 16);
+
+        t = _mm_sub_epi8(v, amp);
+        m = _mm_cmpeq_epi8(_mm_min_epu8(t, three), t);
+        t = _mm_sub_epi8(v, semi);
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(t, one), t));
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, gt), _mm_cmpeq_epi8(v, dq)));
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, bs), _mm_cmpeq_epi8(v, bar)));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, bq));
+        s |= (uint64_t)(uint16_t)_mm_movemask_epi8(m) << (i * 16);
+    }
+    *ws = w;
+    *sp = s;
+}
+
+/** Same as classify_sse2 with 32 byte vectors. */
+__attribute__((target("avx2")))
+static void classify_avx2(const char *p, uint64_t *ws, uint64_t *sp) {
+    const __m256i sp_c = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8(0x09), four = _mm256_set1_epi8(4);
+    const __m256i amp = _mm256_set1_epi8(0x26), three = _mm256_set1_epi8(3);
+    const __m256i semi = _mm256_set1_epi8(0x3b), one = _mm256_set1_epi8(1);
+    const __m256i gt = _mm256_set1_epi8('>'), dq = _mm256_set1_epi8('"');
+    const __m256i bs = _mm256_set1_epi8('\\'), bar = _mm256_set1_epi8('|');
+    const __m256i bq = _mm256_set1_epi8('`');
+    uint64_t w = 0, s = 0;
+
+    for (int i = 0; i < 2; i++) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i * 32));
+        __m256i t = _mm256_sub_epi8(v, tab);
+        __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, sp_c),
+                                    _mm256_cmpeq_epi8(_mm256_min_epu8(t, four), t));
+        w |= (uint64_t)(uint32_t)_mm256_movemask_epi8(m) << (i * 32);
+
+        t = _mm256_sub_epi8(v, amp);
+        m = _mm256_cmpeq_epi8(_mm256_min_epu8(t, three), t);
+        t = _mm256_sub_epi8(v, semi);
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(_mm256_min_epu8(t, one), t));
+        m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(v, gt), _mm256_cmpeq_epi8(v, dq)));
+        m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(v, bs), _mm256_cmpeq_epi8(v, bar)));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, bq));
+        s |= (uint64_t)(uint32_t)_mm256_movemask_epi8(m) << (i * 32);
+    }
+    *ws = w;
+    *sp = s;
+}
+#endif
+
+static classify_fn classify;
+static const char *classify_name;
+
+/** Pick the widest classifier the CPU supports. */
+static void tok_auto(void) {
+    classify = classify_scalar;
+    classify_name = "scalar";
+#ifdef TOK_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        classify = classify_avx2;
+        classify_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        classify = classify_sse2;
+        classify_name = "sse2";
+    }
+#endif
+}
+
+/** Force a classifier by name. */
+int tok_select(const char *name) {
+    if (strcmp(name, "auto") == 0) {
+        tok_auto();
+        return 0;
+    }
+    if (strcmp(name, "scalar") == 0) {
+        classify = classify_scalar;
+        classify_name = "scalar";
+        return 0;
+    }
+#ifdef TOK_HAVE_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+        classify = classify_sse2;
+        classify_name = "sse2";
+        return 0;
+    }
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        classify = classify_avx2;
+        classify_name = "avx2";
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+/** Name of the active classifier. */
+const char *tok_impl_name(void) {
+    if (!classify) tok_auto();
+    return classify_name;
+}
+
+/** Prepare an empty index. */
+void tok_index_init(struct tok_index *idx) {
+    idx->tok = idx->inline_tok;
+    idx->n = 0;
+    idx->cap = TOK_INLINE;
+    idx->bytes = 0;
+}
+
+/** Release heap storage of an index. */
+void tok_index_free(struct tok_index *idx) {
+    if (idx->tok != idx->inline_tok) free(idx->tok);
+    tok_index_init(idx);
+}
+
+/** Append a token, moving off the inline array when it fills up. */
+static int tok_push(struct tok_index *idx, size_t off, size_t len, size_t out,
+                    uint8_t kind, uint8_t flags) {
+    if (idx->n == idx->cap) {
+        size_t cap = idx->cap * 2;
+        struct token *t;
+        if (idx->tok == idx->inline_tok) {
+            t = malloc(cap * sizeof(*t));
+            if (t) memcpy(t, idx->tok, idx->n * sizeof(*t));
+        } else {
+            t = realloc(idx->tok, cap * sizeof(*t));
+        }
+        if (!t) {
+            errno = ENOMEM;
+            return -1;
+        }
+        idx->tok = t;
+        idx->cap = cap;
+    }
+    idx->tok[idx->n++] = (struct token){
+        .off = (uint32_t)off, .len = (uint32_t)len, .out = (uint32_t)out,
+        .kind = kind, .flags = flags,
+    };
+    idx->bytes += out;
+    return 0;
+}
+
+/* Scanner state, the masks of the 64 byte block starting at base. */
+struct scan {
+    const char *s;
+    size_t len;
+    size_t base;
+    uint64_t ws;
+    uint64_t sp;
+};
+
+enum { FIND_NONWS, FIND_DELIM, FIND_SPECIAL };
+
+/** Classify the block at base. Bytes past the end count as whitespace. */
+static void scan_load(struct scan *sc, size_t base) {
+    size_t left = sc->len - base;
+    sc->base = base;
+    if (left >= 64) {
+        classify(sc->s + base, &sc->ws, &sc->sp);
+        return;
+    }
+    char pad[64] = {0};
+    memcpy(pad, sc->s + base, left);
+    classify(pad, &sc->ws, &sc->sp);
+    uint64_t valid = (1ULL << left) - 1;
+    sc->ws |= ~valid;
+    sc->sp &= valid;
+}
+
+/** Position of the next byte at or after pos of the requested class. */
+static size_t scan_next(struct scan *sc, size_t pos, int what) {
+    while (pos < sc->len) {
+        size_t base = pos & ~(size_t)63;
+        if (base != sc->base) scan_load(sc, base);
+        uint64_t m;
+        if (what == FIND_NONWS) m = ~sc->ws;
+        else if (what == FIND_DELIM) m = sc->ws | sc->sp;
+        else m = sc->sp;
+        m &= ~0ULL << (pos - base);
+        if (m) {
+            size_t r = base + (size_t)__builtin_ctzll(m);
+            return r < sc->len ? r : sc->len;
+        }
+        pos = base + 64;
+    }
+    return sc->len;
+}
+
+/** Length of the operator starting at p, longest match wins. */
+static size_t op_length(const char *p, size_t left) {
+    static const char *const ops3[] = {"<<<", "<<-"};
+    static const char *const ops2[] = {"||", "&&", ";;", "<<", ">>", "<&", ">&"};
+    if (left >= 3) {
+        for (size_t i = 0; i < sizeof(ops3) / sizeof(ops3[0]); i++)
+            if (memcmp(p, ops3[i], 3) == 0) return 3;
+    }
+    if (left >= 2) {
+        for (size_t i = 0; i < sizeof(ops2) / sizeof(ops2[0]); i++)
+            if (memcmp(p, ops2[i], 2) == 0) return 2;
+    }
+    return 1;
+}
+
+/** Characters a backslash escapes inside double quotes. */
+static int dq_escapable(char c) {
+    return c == '"' || c == '\\' || c == '$' || c == '`';
+}
+
+static size_t dq_end(const char *s, size_t len, size_t pos);
+
+/** End of a command substitution. */
+size_t tok_subst_end(const char *s, size_t len, size_t pos, char open) {
+    int depth = 0;
+    while (pos < len) {
+        char c = s[pos];
+        if (c == '\\') {
+            pos += 2;
+        } else if (open == '`') {
+            if (c == '`') return pos + 1;
+            pos++;
+        } else if (c == '\'') {
+            const char *q = memchr(s + pos + 1, '\'', len - pos - 1);
+            if (!q) return SIZE_MAX;
+            pos = (size_t)(q - s) + 1;
+        } else if (c == '"') {
+            pos = dq_end(s, len, pos + 1);
+        } else if (c == '`') {
+            pos = tok_subst_end(s, len, pos + 1, '`');
+        } else if (c == '$' && pos + 1 < len && s[pos + 1] == '(') {
+            pos = tok_subst_end(s, len, pos + 2, '(');
+        } else {
+            // Parentheses of subshells inside have to balance
+            if (c == ')' && depth-- == 0) return pos + 1;
+            if (c == '(') depth++;
+            pos++;
+        }
+    }
+    return SIZE_MAX;
+}
+
+/** Just past the double quote closing the string that starts at pos, SIZE_MAX if none does. */
+static size_t dq_end(const char *s, size_t len, size_t pos) {
+    while (pos < len) {
+        char c = s[pos];
+        if (c == '"') return pos + 1;
+        if (c == '\\') pos += 2;
+        else if (c == '`') pos = tok_subst_end(s, len, pos + 1, '`');
+        else if (c == '$' && pos + 1 < len && s[pos + 1] == '(') pos = tok_subst_end(s, len, pos + 2, '(');
+        else pos++;
+    }
+    return SIZE_MAX;
+}
+
+/** True when c at pos opens a substitution, a backquote or the ( of an unescaped $(. */
+static int opens_subst(const char *line, size_t pos, size_t from, size_t esc) {
+    char c = line[pos];
+    return c == '`' || (c == '(' && pos > from && line[pos - 1] == '$' && pos - 1 != esc);
+}
+
+/** Tokenize line into idx. */
+int tokenize(const char *line, size_t len, struct tok_index *idx) {
+    if (!classify) tok_auto();
+    idx->n = 0;
+    idx->bytes = 0;
+    if (len > UINT32_MAX) {
+        errno = E2BIG;
+        return -1;
+    }
+
+    struct scan sc = {.s = line, .len = len, .base = SIZE_MAX};
+    size_t pos = 0;
+    for (;;) {
+        pos = scan_next(&sc, pos, FIND_NONWS);
+        if (pos >= len) break;
+
+        if (IS_META(line[pos])) {
+            size_t n = op_length(line + pos, len - pos);
+            if (tok_push(idx, pos, n, n, TOK_OP, 0) == -1) return -1;
+            pos += n;
+            continue;
+        }
+
+        size_t start = pos, out = 0, esc = SIZE_MAX;
+        uint8_t flags = 0;
+        for (;;) {
+            size_t d = scan_next(&sc, pos, FIND_DELIM);
+            out += d - pos;
+            pos = d;
+            if (pos >= len) break;
+
+            char c = line[pos];
+            if (c == '\'') {
+                flags |= TOKF_QUOTED;
+                size_t q = pos + 1;
+                for (;;) {
+                    q = scan_next(&sc, q, FIND_SPECIAL);
+                    if (q >= len) {
+                        errno = EINVAL;
+                        return -1;
+                    }
+                    if (line[q] == '\'') break;
+                    q++;
+                }
+                out += q - (pos + 1);
+                pos = q + 1;
+            } else if (c == '"') {
+                flags |= TOKF_QUOTED;
+                pos++;
+                for (;;) {
+                    size_t q = scan_next(&sc, pos, FIND_SPECIAL);
+                    if (q >= len) {
+                        errno = EINVAL;
+                        return -1;
+                    }
+                    out += q - pos;
+                    if (line[q] == '"') {
+                        pos = q + 1;
+                        break;
+                    }
+                    if (opens_subst(line, q, start, esc)) {
+                        // Kept as written, the parser takes it apart
+                        size_t e = tok_subst_end(line, len, q + 1, line[q]);
+                        if (e == SIZE_MAX) {
+                            errno = EINVAL;
+                            return -1;
+                        }
+                        out += e - q;
+                        pos = e;
+                    } else if (line[q] == '\\' && q + 1 < len && dq_escapable(line[q + 1])) {
+                        esc = q + 1;
+                        out += 1;
+                        pos = q + 2;
+                    } else {
+                        out += 1;
+                        pos = q + 1;
+                    }
+                }
+            } else if (c == '\\') {
+                // A trailing backslash is dropped
+                flags |= TOKF_QUOTED;
+                if (pos + 1 < len) {
+                    esc = pos + 1;
+                    out += 1;
+                    pos += 2;
+                } else {
+                    pos += 1;
+                }
+            } else if (opens_subst(line, pos, start, esc)) {
+                size_t e = tok_subst_end(line, len, pos + 1, c);
+                if (e == SIZE_MAX) {
+                    errno = EINVAL;
+                    return -1;
+                }
+                out += e - pos;
+                pos = e;
+            } else {
+                break; // whitespace or a metacharacter ends the word
+            }
+        }
+
+        uint8_t kind = TOK_WORD;
+        if (!flags && pos < len && (line[pos] == '<' || line[pos] == '>')) {
+            kind = TOK_IONUM;
+            for (size_t i = start; i < pos; i++) {
+                if (line[i] < '0' || line[i] > '9') {
+                    kind = TOK_WORD;
+                    break;
+                }
+            }
+        }
+        if (tok_push(idx, start, pos - start, out, kind, flags) == -1) return -1;
+    }
+    return 0;
+}
+
+/** Copy a token applying the same quoting rules as tokenize. */
+void tok_copy(const char *line, const struct token *t, char *dst) {
+    const char *p = line + t->off;
+    if (!(t->flags & TOKF_QUOTED)) {
+        memcpy(dst, p, t->len);
+        return;
+    }
+
+    const char *end = p + t->len;
+    size_t len = t->off + t->len;
+    while (p < end) {
+        char c = *p++;
+        if (c == '`' || (c == '$' && p < end && *p == '(')) {
+            // Substitutions are copied as written
+            size_t from = (size_t)(p - line) - 1;
+            size_t e = tok_subst_end(line, len, from + (c == '$' ? 2 : 1), c == '$' ? '(' : '`');
+            memcpy(dst, line + from, e - from);
+            dst += e - from;
+            p = line + e;
+        } else if (c == '\'') {
+            while (*p != '\'') *dst++ = *p++;
+            p++;
+        } else if (c == '"') {
+            while (*p != '"') {
+                if (*p == '`' || (*p == '$' && p[1] == '(')) {
+                    size_t from = (size_t)(p - line);
+                    size_t e = tok_subst_end(line, len, from + (*p == '$' ? 2 : 1), *p == '$' ? '(' : '`');
+                    memcpy(dst, p, e - from);
+                    dst += e - from;
+                    p = line + e;
+                    continue;
+                }
+                if (*p == '\\' && dq_escapable(p[1])) p++;
+                *dst++ = *p++;
+            }
+            p++;
+        } else if (c == '\\') {
+            if (p < end) *dst++ = *p++;
+        } else {
+            *dst++ = c;
+        }
+    }
+}
@@ -0,0 +1,106 @@
+#ifndef TOKENIZE_H
+#define TOKENIZE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum tok_kind {
+    TOK_WORD,   // ordinary word, possibly quoted
+    TOK_OP,     // control or redirection operator such as | or >>
+    TOK_IONUM,  // digits directly in front of a redirection, the 2 in 2>
+};
+
+// The word contained quotes or backslashes and must be unquoted when copied
+#define TOKF_QUOTED 0x1
+
+/**
+ * @brief One token as a span of the source line. Tokens never own memory,
+ * the bytes are copied out with tok_copy once the whole line is indexed.
+ */
+struct token {
+    uint32_t off;   // offset of the first byte in the line
+    uint32_t len;   // length of the span including quote characters
+    uint32_t out;   // length of the word once quotes are removed
+    uint8_t kind;
+    uint8_t flags;
+};
+
+#define TOK_INLINE 32
+
+/**
+ * @brief Flat index of the tokens found in a line. Short lines fit in the
+ * inline array and never touch the heap.
+ */
+struct tok_index {
+    struct token *tok;
+    size_t n;
+    size_t cap;
+    size_t bytes;   // sum of out over all tokens
+    struct token inline_tok[TOK_INLINE];
+};
+
+void tok_index_init(struct tok_index *idx);
+void tok_index_free(struct tok_index *idx);
+
+/**
+ * @brief Split line into tokens in a single pass. Bytes are classified as
+ * whitespace (the same set trim_white removes), quotes or metacharacters
+ * 16 or 32 at a time when the CPU supports it. Command substitutions,
+ * $(...) and backquotes, stay inside the word they appear in whatever
+ * they contain.
+ *
+ * @param line The line to scan
+ * @param len Length of line in bytes
+ * @param idx Index to fill, any previous content is discarded
+ * @return 0 on success, -1 on an unterminated quote or substitution or on
+ * allocation failure with errno set to EINVAL or ENOMEM
+ */
+int tokenize(const char *line, size_t len, struct tok_index *idx);
+
+/**
+ * @brief Copy a token out of line with quotes and escapes removed,
+ * command substitutions are copied as written. Exactly t->out bytes are
+ * written, no terminator is added.
+ *
+ * @param line The line the token was found in
+ * @param t The token
+ * @param dst Destination with room for t->out bytes
+ */
+void tok_copy(const char *line, const struct token *t, char *dst);
+
+/**
+ * @brief Find the end of a command substitution, skipping quotes, nested
+ * substitutions and balanced parentheses inside it
+ *
+ * @param s The text
+ * @param len Length of s
+ * @param pos Offset just past the opening $( or backquote
+ * @param open '(' or '`', which one opened it
+ * @return Offset just past the closing ) or backquote, SIZE_MAX when it is
+ * not closed within len
+ */
+size_t tok_subst_end(const char *s, size_t len, size_t pos, char open);
+
+/**
+ * @brief Choose the byte classifier. Useful for benchmarks and tests, the
+ * best supported implementation is picked automatically otherwise.
+ *
+ * @param name One of "scalar", "sse2", "avx2" or "auto"
+ * @return 0 on success, -1 if the implementation is not available here
+ */
+int tok_select(const char *name);
+
+/**
+ * @brief Name of the classifier currently in use
+ */
+const char *tok_impl_name(void);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // TOKENIZE_H
@@ -0,0 +1,417 @@
+/**
+ * vars.c
+ * Shell variables. Names are interned in an open-addressing table whose
+ * slots are never freed, so setting and unsetting the same variable in a
+ * loop allocates nothing but the value. The envp array for exec is
+ * patched entry by entry as exported variables change instead of being
+ * rebuilt for every command.
+ */
+
+#define _GNU_SOURCE
+#include "vars.h"
+#include "lab.h"
+#include "builtins.h"
+#include "parse.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern char **environ;
+
+/** Slot holding name, or the empty slot where it would go. */
+static struct var *var_slot(const struct var_table *t, const char *name, uint32_t hash) {
+    size_t mask = t->cap - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        struct var *v = &t->slots[i];
+        if (!v->name || (v->hash == hash && strcmp(v->name, name) == 0)) return v;
+    }
+}
+
+/** The variable called name, NULL if the name was never used. */
+static struct var *var_lookup(const struct var_table *t, const char *name) {
+    if (!t->cap) return NULL;
+    struct var *v = var_slot(t, name, builtin_name_hash(name, 0));
+    return v->name ? v : NULL;
+}
+
+/** Make room for one more name, keeping the table at most half full. */
+static int vars_grow(struct var_table *t) {
+    if (2 * (t->n + 1) <= t->cap) return 0;
+    size_t cap = t->cap ? t->cap * 2 : 256;
+    struct var *old = t->slots;
+    size_t old_cap = t->cap;
+    t->slots = calloc(cap, sizeof(*t->slots));
+    if (!t->slots) {
+        t->slots = old;
+        return -1;
+    }
+    t->cap = cap;
+    for (size_t i = 0; i < old_cap; i++)
+        if (old[i].name) *var_slot(t, old[i].name, old[i].hash) = old[i];
+    free(old);
+    return 0;
+}
+
+/** The variable called name, created unset if it does not exist yet. */
+static struct var *var_intern(struct var_table *t, const char *name) {
+    uint32_t hash = builtin_name_hash(name, 0);
+    if (t->cap) {
+        struct var *v = var_slot(t, name, hash);
+        if (v->name) return v;
+    }
+    if (vars_grow(t) == -1) return NULL;
+    if (!t->names.chunk_size) arena_init(&t->names, 0);
+    size_t len = strlen(name);
+    char *copy = arena_alloc(&t->names, len + 1);
+    if (!copy) return NULL;
+    memcpy(copy, name, len + 1);
+    struct var *v = var_slot(t, name, hash);
+    *v = (struct var){.name = copy, .hash = hash, .env = -1};
+    t->n++;
+    return v;
+}
+
+/** Queue v for the next vars_environ if its envp entry is affected. */
+static int mark_dirty(struct var_table *t, struct var *v) {
+    if (v->dirty || (!(v->flags & VAR_EXPORT) && v->env == -1)) return 0;
+    if (t->ndirty == t->dirty_cap) {
+        size_t cap = t->dirty_cap ? t->dirty_cap * 2 : 64;
+        const char **grown = realloc(t->dirty, cap * sizeof(*grown));
+        if (!grown) return -1;
+        t->dirty = grown;
+        t->dirty_cap = cap;
+    }
+    t->dirty[t->ndirty++] = v->name;
+    v->dirty = true;
+    return 0;
+}
+
+/** Bookkeeping after the value or flags of v changed. */
+static int var_changed(struct shell *sh, struct var *v) {
+    if (strcmp(v->name, "PATH") == 0) cmd_hash_use_path(&sh->cmd_hash, v->value);
+    if (mark_dirty(&sh->vars, v) == -1) {
+        perror(v->name);
+        return -1;
+    }
+    return 0;
+}
+
+/** Load the inherited environment. */
+int vars_import(struct shell *sh, char **env) {
+    for (; env && *env; env++) {
+        const char *eq = strchr(*env, '=');
+        if (!eq || eq == *env) continue;
+        size_t len = (size_t)(eq - *env);
+        char name[len + 1];
+        memcpy(name, *env, len);
+        name[len] = '\0';
+        struct var *v = var_intern(&sh->vars, name);
+        char *value = v ? strdup(eq + 1) : NULL;
+        if (!value) return -1;
+        free(v->value);
+        v->value = value;
+        v->flags |= VAR_EXPORT;
+        if (var_changed(sh, v) == -1) return -1;
+    }
+    return 0;
+}
+
+/** Free everything. */
+void vars_destroy(struct var_table *t) {
+    for (size_t i = 0; i < t->cap; i++) free(t->slots[i].value);
+    for (size_t i = 0; i < t->nenv; i++) free(t->envp[i]);
+    free(t->slots);
+    free(t->envp);
+    free(t->env_names);
+    free(t->dirty);
+    arena_destroy(&t->names);
+    memset(t, 0, sizeof(*t));
+}
+
+/** Look up a value. */
+const char *var_get(struct shell *sh, const char *name) {
+    const struct var *v = var_lookup(&sh->vars, name);
+    return v ? v->value : NULL;
+}
+
+/** Look up a variable. */
+const struct var *var_find(const struct shell *sh, const char *name) {
+    return var_lookup(&sh->vars, name);
+}
+
+/** Assign a value. */
+int var_set(struct shell *sh, const char *name, const char *value) {
+    struct var *v = var_intern(&sh->vars, name);
+    if (!v) {
+        perror(name);
+        return -1;
+    }
+    if (v->flags & VAR_READONLY) {
+        fprintf(stderr, "%s: readonly variable\n", name);
+        errno = EPERM;
+        return -1;
+    }
+    char *copy = strdup(value);
+    if (!copy) {
+        perror(name);
+        return -1;
+    }
+    free(v->value);
+    v->value = copy;
+    return var_changed(sh, v);
+}
+
+/** Change the flags of a variable. */
+int var_flag(struct shell *sh, const char *name, unsigned set, unsigned clear) {
+    struct var *v = var_intern(&sh->vars, name);
+    if (!v) {
+        perror(name);
+        return -1;
+    }
+    v->flags = (v->flags | set) & ~clear;
+    return var_changed(sh, v);
+}
+
+/** Forget the value and flags of a variable, its slot stays. */
+int var_unset(struct shell *sh, const char *name) {
+    struct var *v = var_lookup(&sh->vars, name);
+    if (!v) return 0;
+    if (v->flags & VAR_READONLY) {
+        fprintf(stderr, "unset: %s: cannot unset: readonly variable\n", name);
+        errno = EPERM;
+        return -1;
+    }
+    free(v->value);
+    v->value = NULL;
+    v->flags = 0;
+    return var_changed(sh, v);
+}
+
+/** Make sure envp can take one more entry and its terminator. */
+static int env_reserve(struct var_table *t) {
+    if (t->nenv + 2 <= t->env_cap) return 0;
+    size_t cap = t->env_cap ? t->env_cap * 2 : 64;
+    char **envp = realloc(t->envp, cap * sizeof(*envp));
+    if (!envp) return -1;
+    t->envp = envp;
+    const char **names = realloc(t->env_names, cap * sizeof(*names));
+    if (!names) return -1;
+    t->env_names = names;
+    t->env_cap = cap;
+    return 0;
+}
+
+/** Write the envp entry of v, appending one if it has none. */
+static int env_put(struct var_table *t, struct var *v) {
+    char *entry;
+    if (asprintf(&entry, "%s=%s", v->name, v->value) == -1) return -1;
+    if (v->env == -1) {
+        if (env_reserve(t) == -1) {
+            free(entry);
+            return -1;
+        }
+        v->env = (ssize_t)t->nenv;
+        t->env_names[t->nenv++] = v->name;
+        t->envp[t->nenv] = NULL;
+    } else {
+        free(t->envp[v->env]);
+    }
+    t->envp[v->env] = entry;
+    return 0;
+}
+
+/** Remove the envp entry of v, the last entry moves into its place. */
+static void env_drop(struct var_table *t, struct var *v) {
+    if (v->env == -1) return;
+    size_t k = (size_t)v->env;
+    free(t->envp[k]);
+    if (k != --t->nenv) {
+        t->envp[k] = t->envp[t->nenv];
+        t->env_names[k] = t->env_names[t->nenv];
+        var_lookup(t, t->env_names[k])->env = (ssize_t)k;
+    }
+    t->envp[t->nenv] = NULL;
+    v->env = -1;
+}
+
+/** Patch envp for the variables that changed since the last call. */
+char **vars_environ(struct shell *sh) {
+    struct var_table *t = &sh->vars;
+    for (size_t i = 0; i < t->ndirty; i++) {
+        struct var *v = var_lookup(t, t->dirty[i]);
+        v->dirty = false;
+        if (!(v->flags & VAR_EXPORT) || !v->value) env_drop(t, v);
+        else if (env_put(t, v) == -1) perror("environment");
+    }
+    t->ndirty = 0;
+    return t->envp ? t->envp : environ;
+}
+
+/** Apply temporary assignments. */
+int vars_push(struct shell *sh, char *const *assigns, size_t n, struct var_scope *scope) {
+    scope->undo = NULL;
+    scope->n = 0;
+    if (!n) return 0;
+    if (!(scope->undo = malloc(n * sizeof(*scope->undo)))) {
+        perror("assign");
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        const char *eq = strchr(assigns[i], '=');
+        size_t len = (size_t)(eq - assigns[i]);
+        char name[len + 1];
+        memcpy(name, assigns[i], len);
+        name[len] = '\0';
+        struct var *v = var_intern(&sh->vars, name);
+        char *value = v ? strdup(eq + 1) : NULL;
+        if (!value) {
+            perror(name);
+            goto fail;
+        }
+        if (v->flags & VAR_READONLY) {
+            fprintf(stderr, "%s: readonly variable\n", name);
+            free(value);
+            goto fail;
+        }
+        scope->undo[scope->n++] = (struct var_undo){v->name, v->value, v->flags};
+        v->value = value;
+        v->flags |= VAR_EXPORT;
+        if (var_changed(sh, v) == -1) goto fail;
+    }
+    return 0;
+
+fail:
+    vars_pop(sh, scope);
+    return -1;
+}
+
+/** Put back what vars_push changed, newest first. */
+void vars_pop(struct shell *sh, struct var_scope *scope) {
+    while (scope->n) {
+        struct var_undo *u = &scope->undo[--scope->n];
+        struct var *v = var_lookup(&sh->vars, u->name);
+        free(v->value);
+        v->value = u->value;
+        v->flags = u->flags;
+        var_changed(sh, v);
+    }
+    free(scope->undo);
+    scope->undo = NULL;
+}
+
+/** qsort comparison of variables by name. */
+static int var_cmp(const void *a, const void *b) {
+    return strcmp((*(const struct var *const *)a)->name, (*(const struct var *const *)b)->name);
+}
+
+/** Print every variable with flag as a command that would recreate it. */
+static int list_vars(struct shell *sh, const char *cmd, unsigned flag) {
+    struct var_table *t = &sh->vars;
+    struct var **v = malloc((t->n ? t->n : 1) * sizeof(*v));
+    if (!v) {
+        perror(cmd);
+        return 1;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < t->cap; i++)
+        if (t->slots[i].name && (t->slots[i].flags & flag)) v[n++] = &t->slots[i];
+    qsort(v, n, sizeof(*v), var_cmp);
+    for (size_t i = 0; i < n; i++) {
+        printf("%s %s", cmd, v[i]->name);
+        if (v[i]->value) {
+            putchar('=');
+            putchar('"');
+            for (const char *s = v[i]->value; *s; s++) {
+                if (strchr("\"\\$`", *s)) putchar('\\');
+                putchar(*s);
+            }
+            putchar('"');
+        }
+        putchar('\n');
+    }
+    free(v);
+    return 0;
+}
+
+/** export and readonly: optionally assign, then set or clear flag. */
+static int declare(struct shell *sh, char **argv, unsigned flag) {
+    const char *cmd = argv[0];
+    bool clear = false;
+    size_t i = 1;
+    for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (const char *o = argv[i] + 1; *o; o++) {
+            if (*o == 'n' && flag == VAR_EXPORT) {
+                clear = true;
+            } else if (*o != 'p') {
+                fprintf(stderr, "%s: -%c: invalid option\nusage: %s [-%sp] [name[=value] ...]\n", cmd,
+                        *o, cmd, flag == VAR_EXPORT ? "n" : "");
+                return 2;
+            }
+        }
+    }
+    if (!argv[i]) return list_vars(sh, cmd, flag);
+
+    int rc = 0;
+    for (; argv[i]; i++) {
+        const char *eq = strchr(argv[i], '=');
+        size_t len = eq ? (size_t)(eq - argv[i]) : strlen(argv[i]);
+        if (!is_name(argv[i], len)) {
+            fprintf(stderr, "%s: `%s': not a valid identifier\n", cmd, argv[i]);
+            rc = 1;
+            continue;
+        }
+        char name[len + 1];
+        memcpy(name, argv[i], len);
+        name[len] = '\0';
+        if (eq && var_set(sh, name, eq + 1) == -1) rc = 1;
+        else if (var_flag(sh, name, clear ? 0 : flag, clear ? flag : 0) == -1) rc = 1;
+    }
+    return rc;
+}
+
+/** Export variables to the environment of commands. */
+int builtin_export(struct shell *sh, char **argv) {
+    return declare(sh, argv, VAR_EXPORT);
+}
+
+/** Make variables readonly. */
+int builtin_readonly(struct shell *sh, char **argv) {
+    return declare(sh, argv, VAR_READONLY);
+}
+
+/** Unset variables, or functions with -f. */
+int builtin_unset(struct shell *sh, char **argv) {
+    bool funcs = false, vars = false;
+    size_t i = 1;
+    for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (const char *o = argv[i] + 1; *o; o++) {
+            if (*o == 'f') {
+                funcs = true;
+            } else if (*o == 'v') {
+                vars = true;
+            } else {
+                fprintf(stderr, "unset: -%c: invalid option\nusage: unset [-f] [-v] [name ...]\n", *o);
+                return 2;
+            }
+        }
+    }
+    int rc = 0;
+    for (; argv[i]; i++) {
+        // Without an option a variable goes first, a function only if there is none
+        if (!funcs && (vars || var_get(sh, argv[i]) || !vm_function(sh, argv[i]))) {
+            if (var_unset(sh, argv[i]) == -1) rc = 1;
+        } else {
+            vm_undefine(sh, argv[i]);
+        }
+    }
+    return rc;
+}
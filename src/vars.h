@@ -0,0 +1,171 @@
+#ifndef VARS_H
+#define VARS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "arena.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct shell;
+
+enum var_flags {
+    VAR_EXPORT = 1,     // goes into the environment of commands
+    VAR_READONLY = 2,
+};
+
+/**
+ * @brief One variable. Slots are never removed: unset clears the value
+ * and flags, so a name is interned once and its slot reused.
+ */
+struct var {
+    const char *name;   // interned, NULL marks an empty slot
+    char *value;        // NULL while unset or only declared by export or readonly
+    uint32_t hash;
+    unsigned flags;     // enum var_flags
+    ssize_t env;        // index into envp, -1 when not there
+    bool dirty;         // on the dirty list, envp is out of date for it
+};
+
+/**
+ * @brief Shell variables in an open-addressing table, plus the envp array
+ * handed to exec. envp is kept up to date incrementally: a change to an
+ * exported variable only queues its name, and the next vars_environ
+ * rewrites just the queued entries.
+ */
+struct var_table {
+    struct var *slots;
+    size_t n;           // slots in use, set or not
+    size_t cap;         // power of two, 0 until the first variable
+    struct arena names; // interned names
+    char **envp;        // "NAME=value" of exported variables, NULL terminated
+    const char **env_names;     // owner of every envp entry
+    size_t nenv;
+    size_t env_cap;
+    const char **dirty; // names whose envp entry needs work
+    size_t ndirty;
+    size_t dirty_cap;
+};
+
+/* What vars_push changed, for vars_pop */
+struct var_undo {
+    const char *name;
+    char *value;
+    unsigned flags;
+};
+
+/* Assignments in front of one command */
+struct var_scope {
+    struct var_undo *undo;
+    size_t n;
+};
+
+/**
+ * @brief Load the environment the shell was started with, every entry
+ * becomes an exported variable
+ *
+ * @param sh The shell
+ * @param env NULL terminated "NAME=value" strings
+ * @return 0 on success, -1 if memory ran out
+ */
+int vars_import(struct shell *sh, char **env);
+
+/**
+ * @brief Free every variable and the envp array
+ *
+ * @param t The table
+ */
+void vars_destroy(struct var_table *t);
+
+/**
+ * @brief Value of a shell variable
+ *
+ * @param sh The shell
+ * @param name The variable name
+ * @return The value, valid until the variable changes, or NULL when unset
+ */
+const char *var_get(struct shell *sh, const char *name);
+
+/**
+ * @brief Look up a variable, set or not
+ *
+ * @return The variable or NULL if the name was never used
+ */
+const struct var *var_find(const struct shell *sh, const char *name);
+
+/**
+ * @brief Set a shell variable. Errors, like assigning to a readonly
+ * variable, are reported on stderr.
+ *
+ * @param sh The shell
+ * @param name The variable name
+ * @param value The new value, copied
+ * @return 0 on success, -1 with errno set
+ */
+int var_set(struct shell *sh, const char *name, const char *value);
+
+/**
+ * @brief Add and remove flags of a variable, creating it unset if needed
+ *
+ * @return 0 on success, -1 with errno set
+ */
+int var_flag(struct shell *sh, const char *name, unsigned set, unsigned clear);
+
+/**
+ * @brief Unset a variable, readonly ones are refused with a message
+ *
+ * @return 0 on success, -1 with errno set
+ */
+int var_unset(struct shell *sh, const char *name);
+
+/**
+ * @brief The environment for a command about to be started. Only
+ * entries of variables that changed since the last call are rebuilt.
+ *
+ * @param sh The shell
+ * @return NULL terminated envp owned by the table, the process
+ * environment if the table never held an exported variable
+ */
+char **vars_environ(struct shell *sh);
+
+/**
+ * @brief Apply the assignments in front of a command, exported, until
+ * vars_pop
+ *
+ * @param sh The shell
+ * @param assigns "NAME=value" strings
+ * @param n Number of assignments
+ * @param scope Receives what to undo
+ * @return 0 on success, -1 after reporting an error, nothing is applied then
+ */
+int vars_push(struct shell *sh, char *const *assigns, size_t n, struct var_scope *scope);
+
+/**
+ * @brief Undo vars_push
+ */
+void vars_pop(struct shell *sh, struct var_scope *scope);
+
+/**
+ * @brief export [-n] [-p] [name[=value] ...]
+ */
+int builtin_export(struct shell *sh, char **argv);
+
+/**
+ * @brief readonly [-p] [name[=value] ...]
+ */
+int builtin_readonly(struct shell *sh, char **argv);
+
+/**
+ * @brief unset [-f | -v] name ...
+ */
+int builtin_unset(struct shell *sh, char **argv);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // VARS_H
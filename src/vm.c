@@ -0,0 +1,1033 @@
+/**
+ * vm.c
+ * Compiler from the syntax tree to a flat instruction array and the loop
+ * that runs it. Only pipelines touch the outside world, everything else
+ * is jumps, so a loop body is expanded from its tree on every pass but
+ * never tokenized or parsed again.
+ */
+
+#define _GNU_SOURCE
+#include "vm.h"
+#include "lab.h"
+#include "builtins.h"
+#include "capture.h"
+#include "expand.h"
+#include "launch.h"
+#include "parse.h"
+#include "pipeline.h"
+#include "vars.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+// Function calls nested deeper than this fail instead of overflowing the stack
+#define VM_MAX_DEPTH 1000
+
+enum op {
+    OP_PIPELINE,    // run the N_PIPELINE node arg
+    OP_NOT,         // negate the status
+    OP_JUMP,        // go to a
+    OP_JUMP_IF_OK,  // go to a when the status is 0
+    OP_JUMP_IF_FAIL,
+    OP_STATUS,      // set the status to a
+    OP_LOOP,        // push a loop frame
+    OP_FOR,         // push a loop frame holding the expanded words of the N_FOR arg
+    OP_NEXT,        // assign the next word of the for loop, go to a when none is left
+    OP_SAVE,        // remember the status of the loop body
+    OP_LEAVE,       // pop the loop frame, the saved status becomes the status
+    OP_BREAK,       // pop n frames, status 0 for the loop, go to a
+    OP_CONTINUE,    // pop n frames, go to a
+    OP_REDIR,       // push the redirections of node arg, go to a if they fail
+    OP_UNREDIR,     // pop them
+    OP_CASE,        // skip as many instructions as the index of the item of arg that matches
+    OP_DEFINE,      // define the N_FUNCTION arg with its code at a
+    OP_RETURN,      // leave the function, arg is the return command if it has a status
+    OP_END,
+};
+
+enum frame_kind {
+    FRAME_LOOP,
+    FRAME_REDIR,
+};
+
+/* A loop or redirection in progress */
+struct vm_frame {
+    int kind;
+    struct arena_mark mark;     // line arena position to return to when popped
+    int status;                 // FRAME_LOOP: status of the last pass of the body
+    char **words;               // FRAME_LOOP of a for: the words to assign
+    size_t nwords;
+    size_t next;
+    struct saved_fds *saved;    // FRAME_REDIR
+};
+
+/* Code chunk of a compound command that runs as a stage of its own */
+struct vm_unit {
+    struct program *prog;
+    int32_t pc;
+};
+
+/* ---- compiler ---------------------------------------------------------- */
+
+/* A loop being compiled, for break and continue */
+struct loop_ctx {
+    struct loop_ctx *outer;
+    size_t frame;       // frames open outside of the loop's own
+    int32_t top;        // where continue goes
+    int32_t breaks;     // OP_BREAK instructions chained through a, -1 ends
+};
+
+struct compiler {
+    struct program *p;
+    struct loop_ctx *loop;
+    size_t frames;      // frames the code being compiled runs under
+    bool in_function;
+    bool failed;
+};
+
+/** Append an instruction, returning its index. */
+static int32_t emit(struct compiler *c, int op, int32_t a, const void *arg) {
+    struct program *p = c->p;
+    if (p->ncode == p->cap) {
+        size_t cap = p->cap ? p->cap * 2 : 64;
+        struct insn *grown = realloc(p->code, cap * sizeof(*grown));
+        if (!grown) {
+            c->failed = true;
+            return 0;
+        }
+        p->code = grown;
+        p->cap = cap;
+    }
+    p->code[p->ncode] = (struct insn){.op = (uint16_t)op, .a = a, .arg = arg};
+    return (int32_t)p->ncode++;
+}
+
+/** Index of the next instruction. */
+static int32_t here(const struct compiler *c) {
+    return (int32_t)c->p->ncode;
+}
+
+/** Point the jump at to target. */
+static void patch(struct compiler *c, int32_t at, int32_t target) {
+    if (!c->failed) c->p->code[at].a = target;
+}
+
+/** Point every jump of a chain linked through a to target. */
+static void patch_chain(struct compiler *c, int32_t chain, int32_t target) {
+    while (chain != -1 && !c->failed) {
+        int32_t next = c->p->code[chain].a;
+        c->p->code[chain].a = target;
+        chain = next;
+    }
+}
+
+static void compile(struct compiler *c, const struct node *n);
+
+/** A compound command with its redirections around it. */
+static void compile_redirected(struct compiler *c, const struct node *n) {
+    if (!n->nredirs) {
+        compile(c, n);
+        return;
+    }
+    int32_t r = emit(c, OP_REDIR, -1, n);
+    c->frames++;
+    compile(c, n);
+    c->frames--;
+    emit(c, OP_UNREDIR, 0, NULL);
+    patch(c, r, here(c));
+}
+
+/**
+ * A compound command that runs as a stage of a pipeline, in the
+ * background or in a subshell: a chunk of its own that ends with OP_END.
+ * Its redirections are applied by the stage.
+ */
+static void compile_unit(struct compiler *c, struct node *n) {
+    int32_t skip = emit(c, OP_JUMP, -1, NULL);
+    struct compiler u = {.p = c->p, .in_function = c->in_function};
+    n->unit = here(c);
+    compile(&u, n);
+    emit(&u, OP_END, 0, NULL);
+    c->failed |= u.failed;
+    patch(c, skip, here(c));
+}
+
+/** The commands substituted into words, each a unit run by vm_substitute. */
+static void compile_words(struct compiler *c, const struct word *w, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        for (size_t k = 0; k < w[i].nparts; k++) {
+            struct node *cmd = w[i].parts[k].cmd;
+            if (w[i].parts[k].kind == WP_SUBST && cmd) compile_unit(c, cmd);
+        }
+    }
+}
+
+/** Substitutions in the words and redirections of command n. */
+static void compile_substs(struct compiler *c, const struct node *n) {
+    for (size_t i = 0; i < n->nredirs; i++) compile_words(c, &n->redirs[i].target, 1);
+    if (n->kind != N_SIMPLE) return;
+    compile_words(c, n->simple.words, n->simple.n);
+    for (size_t i = 0; i < n->simple.nassigns; i++) compile_words(c, &n->simple.assigns[i].value, 1);
+}
+
+/** Number in a literal word, -1 if it is not a positive one. */
+static long literal_count(const struct word *w) {
+    if (!w->lit || !*w->lit) return -1;
+    long v = 0;
+    for (const char *s = w->lit; *s; s++) {
+        if (*s < '0' || *s > '9' || v > 100000) return -1;
+        v = v * 10 + (*s - '0');
+    }
+    return v > 0 ? v : -1;
+}
+
+/**
+ * break, continue and return on their own become jumps. Anything the
+ * compiler cannot resolve is left to the builtins of the same names.
+ */
+static bool compile_control(struct compiler *c, const struct node *pn) {
+    if (pn->pipe.n != 1 || pn->pipe.negate || pn->pipe.time || pn->pipe.background) return false;
+    const struct node *cmd = pn->pipe.cmds[0];
+    if (cmd->kind != N_SIMPLE || cmd->nredirs || cmd->simple.nassigns || cmd->simple.n == 0
+        || cmd->simple.n > 2)
+        return false;
+    const char *name = cmd->simple.words[0].lit;
+    if (!name) return false;
+
+    if (strcmp(name, "return") == 0) {
+        if (!c->in_function) return false;
+        emit(c, OP_RETURN, 0, cmd->simple.n == 2 ? cmd : NULL);
+        return true;
+    }
+    bool brk = strcmp(name, "break") == 0;
+    if ((!brk && strcmp(name, "continue") != 0) || !c->loop) return false;
+    long levels = cmd->simple.n == 2 ? literal_count(&cmd->simple.words[1]) : 1;
+    if (levels == -1) return false;
+    // Like bash, a count beyond the outermost loop means the outermost loop
+    struct loop_ctx *l = c->loop;
+    for (; levels > 1 && l->outer; levels--) l = l->outer;
+
+    // break pops everything above the loop frame and ends at OP_LEAVE,
+    // continue keeps the loop frame
+    int32_t at = emit(c, brk ? OP_BREAK : OP_CONTINUE, brk ? l->breaks : l->top, NULL);
+    if (c->failed) return true;
+    c->p->code[at].n = (uint16_t)(c->frames - l->frame - 1);
+    if (brk) l->breaks = at;
+    return true;
+}
+
+/** One pipeline, compound commands inside it are compiled first. */
+static void compile_pipeline(struct compiler *c, const struct node *n) {
+    for (size_t i = 0; i < n->pipe.n; i++) compile_substs(c, n->pipe.cmds[i]);
+    if (compile_control(c, n)) return;
+    // A lone compound command in the foreground runs inline, so break,
+    // continue and return inside it reach the loops and functions around it
+    struct node *first = n->pipe.n == 1 ? n->pipe.cmds[0] : NULL;
+    if (first && first->kind != N_SIMPLE && first->kind != N_SUBSHELL && !n->pipe.background
+        && !n->pipe.time) {
+        compile_redirected(c, first);
+    } else {
+        for (size_t i = 0; i < n->pipe.n; i++)
+            if (n->pipe.cmds[i]->kind != N_SIMPLE) compile_unit(c, n->pipe.cmds[i]);
+        emit(c, OP_PIPELINE, 0, n);
+    }
+    if (n->pipe.negate) emit(c, OP_NOT, 0, NULL);
+}
+
+/** if, elif chains are nested N_IF nodes in otherwise. */
+static void compile_if(struct compiler *c, const struct node *n) {
+    compile(c, n->cond.cond);
+    int32_t skip = emit(c, OP_JUMP_IF_FAIL, -1, NULL);
+    compile(c, n->cond.then);
+    int32_t end = emit(c, OP_JUMP, -1, NULL);
+    patch(c, skip, here(c));
+    // Without a branch that ran the status is 0
+    if (n->cond.otherwise) compile(c, n->cond.otherwise);
+    else emit(c, OP_STATUS, 0, NULL);
+    patch(c, end, here(c));
+}
+
+/** Start a loop, the frame pushed by its first instruction is counted. */
+static void loop_begin(struct compiler *c, struct loop_ctx *l) {
+    *l = (struct loop_ctx){.outer = c->loop, .frame = c->frames, .breaks = -1};
+    c->loop = l;
+    c->frames++;
+}
+
+/** Close a loop whose OP_LEAVE goes next. */
+static void loop_end(struct compiler *c, struct loop_ctx *l) {
+    patch_chain(c, l->breaks, here(c));
+    c->loop = l->outer;
+    c->frames--;
+    emit(c, OP_LEAVE, 0, NULL);
+}
+
+/** while and until. */
+static void compile_while(struct compiler *c, const struct node *n) {
+    struct loop_ctx l;
+    emit(c, OP_LOOP, 0, NULL);
+    loop_begin(c, &l);
+    l.top = here(c);
+    compile(c, n->cond.cond);
+    int32_t done = emit(c, n->kind == N_WHILE ? OP_JUMP_IF_FAIL : OP_JUMP_IF_OK, -1, NULL);
+    compile(c, n->cond.then);
+    emit(c, OP_SAVE, 0, NULL);
+    emit(c, OP_JUMP, l.top, NULL);
+    patch(c, done, here(c));
+    loop_end(c, &l);
+}
+
+/** for name [in words]. */
+static void compile_for(struct compiler *c, const struct node *n) {
+    struct loop_ctx l;
+    compile_words(c, n->loop.words, n->loop.n);
+    emit(c, OP_FOR, 0, n);
+    loop_begin(c, &l);
+    l.top = emit(c, OP_NEXT, -1, n);
+    compile(c, n->loop.body);
+    emit(c, OP_SAVE, 0, NULL);
+    emit(c, OP_JUMP, l.top, NULL);
+    patch(c, l.top, here(c));
+    loop_end(c, &l);
+}
+
+/**
+ * case, OP_CASE is followed by one jump per item and one for no match,
+ * it skips ahead to the jump it picked.
+ */
+static void compile_case(struct compiler *c, const struct node *n) {
+    compile_words(c, &n->cases.subject, 1);
+    for (size_t i = 0; i < n->cases.n; i++)
+        compile_words(c, n->cases.items[i].patterns, n->cases.items[i].npatterns);
+    emit(c, OP_CASE, 0, n);
+    int32_t table = here(c);
+    for (size_t i = 0; i <= n->cases.n; i++) emit(c, OP_JUMP, -1, NULL);
+    int32_t ends = -1;
+    for (size_t i = 0; i < n->cases.n; i++) {
+        patch(c, table + (int32_t)i, here(c));
+        if (n->cases.items[i].body) compile(c, n->cases.items[i].body);
+        ends = emit(c, OP_JUMP, ends, NULL);
+    }
+    patch(c, table + (int32_t)n->cases.n, here(c));
+    patch_chain(c, ends, here(c));
+}
+
+/** A function definition, its body is compiled in place and jumped over. */
+static void compile_function(struct compiler *c, const struct node *n) {
+    compile_substs(c, n->func.body);
+    int32_t skip = emit(c, OP_JUMP, -1, NULL);
+    int32_t entry = here(c);
+    struct compiler f = {.p = c->p, .in_function = true};
+    compile_redirected(&f, n->func.body);
+    emit(&f, OP_RETURN, 0, NULL);
+    c->failed |= f.failed;
+    patch(c, skip, here(c));
+    emit(c, OP_DEFINE, entry, n);
+}
+
+/** Compile any node, the redirections of compound commands are handled by the callers. */
+static void compile(struct compiler *c, const struct node *n) {
+    switch (n->kind) {
+    case N_PIPELINE:
+        compile_pipeline(c, n);
+        break;
+    case N_AND:
+    case N_OR: {
+        compile(c, n->pair.left);
+        int32_t skip = emit(c, n->kind == N_AND ? OP_JUMP_IF_FAIL : OP_JUMP_IF_OK, -1, NULL);
+        compile(c, n->pair.right);
+        patch(c, skip, here(c));
+        break;
+    }
+    case N_LIST:
+        for (size_t i = 0; i < n->list.n; i++) compile(c, n->list.items[i]);
+        break;
+    case N_IF:
+        compile_if(c, n);
+        break;
+    case N_WHILE:
+    case N_UNTIL:
+        compile_while(c, n);
+        break;
+    case N_FOR:
+        compile_for(c, n);
+        break;
+    case N_CASE:
+        compile_case(c, n);
+        break;
+    case N_GROUP:
+    case N_SUBSHELL:
+        compile(c, n->group.body);
+        break;
+    case N_FUNCTION:
+        compile_function(c, n);
+        break;
+    case N_SIMPLE:
+        // Simple commands only appear inside pipelines
+        break;
+    }
+}
+
+/** Parse and compile src. */
+int program_parse(const char *src, size_t len, struct program **out) {
+    *out = NULL;
+    struct program *p = calloc(1, sizeof(*p));
+    if (!p) {
+        perror("program");
+        return PARSE_ERROR;
+    }
+    arena_init(&p->arena, 0);
+    struct node *root;
+    int rc = parse_program(&p->arena, src, len, &root);
+    if (rc == 0) {
+        struct compiler c = {.p = p};
+        if (root) compile(&c, root);
+        emit(&c, OP_END, 0, NULL);
+        if (c.failed) {
+            perror("program");
+            rc = PARSE_ERROR;
+        }
+    }
+    if (rc != 0) {
+        arena_destroy(&p->arena);
+        free(p->code);
+        free(p);
+        return rc;
+    }
+    p->refs = 1;
+    *out = p;
+    return 0;
+}
+
+/** Drop a reference. */
+void program_unref(struct program *prog) {
+    if (!prog || --prog->refs) return;
+    arena_destroy(&prog->arena);
+    free(prog->code);
+    free(prog);
+}
+
+/* ---- functions --------------------------------------------------------- */
+
+/** Slot holding name, or the empty slot where it would go. */
+static struct vm_func *func_slot(const struct vm_state *vm, const char *name) {
+    size_t mask = vm->funcs_cap - 1;
+    for (size_t i = builtin_name_hash(name, 0) & mask;; i = (i + 1) & mask) {
+        struct vm_func *f = &vm->funcs[i];
+        if (!f->name || strcmp(f->name, name) == 0) return f;
+    }
+}
+
+/** Find a function. */
+const struct vm_func *vm_function(const struct shell *sh, const char *name) {
+    const struct vm_state *vm = &sh->vm;
+    if (!vm->nfuncs) return NULL;
+    const struct vm_func *f = func_slot(vm, name);
+    return f->name ? f : NULL;
+}
+
+/** Make room for one more function, keeping the table at most half full. */
+static int funcs_grow(struct vm_state *vm) {
+    if (2 * (vm->nfuncs + 1) <= vm->funcs_cap) return 0;
+    size_t cap = vm->funcs_cap ? vm->funcs_cap * 2 : 16;
+    struct vm_func *old = vm->funcs;
+    size_t old_cap = vm->funcs_cap;
+    vm->funcs = calloc(cap, sizeof(*vm->funcs));
+    if (!vm->funcs) {
+        vm->funcs = old;
+        return -1;
+    }
+    vm->funcs_cap = cap;
+    for (size_t i = 0; i < old_cap; i++)
+        if (old[i].name) *func_slot(vm, old[i].name) = old[i];
+    free(old);
+    return 0;
+}
+
+/** Define or replace the function of node n, its code starts at entry. */
+static int vm_define(struct shell *sh, struct program *p, const struct node *n, int32_t entry) {
+    struct vm_state *vm = &sh->vm;
+    if (funcs_grow(vm) == -1) return -1;
+    struct vm_func *f = func_slot(vm, n->func.name);
+    if (!f->name) {
+        if (!(f->name = strdup(n->func.name))) return -1;
+        vm->nfuncs++;
+    } else {
+        program_unref(f->prog);
+    }
+    p->refs++;
+    f->prog = p;
+    f->entry = entry;
+    return 0;
+}
+
+/** Remove a function, closing the gap in its probe sequence. */
+int vm_undefine(struct shell *sh, const char *name) {
+    struct vm_state *vm = &sh->vm;
+    if (!vm->nfuncs) return -1;
+    struct vm_func *f = func_slot(vm, name);
+    if (!f->name) return -1;
+    free(f->name);
+    program_unref(f->prog);
+    // Move later entries back unless that would put them before their home slot
+    size_t mask = vm->funcs_cap - 1, hole = (size_t)(f - vm->funcs);
+    for (size_t i = (hole + 1) & mask; vm->funcs[i].name; i = (i + 1) & mask) {
+        size_t home = builtin_name_hash(vm->funcs[i].name, 0) & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            vm->funcs[hole] = vm->funcs[i];
+            hole = i;
+        }
+    }
+    vm->funcs[hole] = (struct vm_func){0};
+    vm->nfuncs--;
+    return 0;
+}
+
+/** Free functions and frames. */
+void vm_destroy(struct vm_state *vm) {
+    for (size_t i = 0; i < vm->funcs_cap; i++) {
+        if (!vm->funcs[i].name) continue;
+        free(vm->funcs[i].name);
+        program_unref(vm->funcs[i].prog);
+    }
+    free(vm->funcs);
+    free(vm->frames);
+    vm->funcs = NULL;
+    vm->nfuncs = vm->funcs_cap = 0;
+    vm->frames = NULL;
+    vm->nframes = vm->frames_cap = 0;
+}
+
+/* ---- frames ------------------------------------------------------------ */
+
+/** Push a frame, NULL if memory ran out. */
+static struct vm_frame *frame_push(struct shell *sh, int kind) {
+    struct vm_state *vm = &sh->vm;
+    if (vm->nframes == vm->frames_cap) {
+        size_t cap = vm->frames_cap ? vm->frames_cap * 2 : 16;
+        struct vm_frame *grown = realloc(vm->frames, cap * sizeof(*grown));
+        if (!grown) return NULL;
+        vm->frames = grown;
+        vm->frames_cap = cap;
+    }
+    struct vm_frame *f = &vm->frames[vm->nframes++];
+    *f = (struct vm_frame){.kind = kind, .mark = arena_mark(&sh->line_arena)};
+    return f;
+}
+
+/** Pop frames down to depth, undoing redirections and freeing loop words. */
+static void frames_drop(struct shell *sh, size_t depth) {
+    struct vm_state *vm = &sh->vm;
+    while (vm->nframes > depth) {
+        struct vm_frame *f = &vm->frames[--vm->nframes];
+        if (f->kind == FRAME_REDIR) redirect_pop(f->saved);
+        arena_rewind(&sh->line_arena, f->mark);
+    }
+}
+
+/** Push the frame of a for loop with its words expanded. */
+static int for_begin(struct shell *sh, const struct node *n) {
+    struct vm_frame *f = frame_push(sh, FRAME_LOOP);
+    if (!f) return -1;
+    if (!n->loop.in) {
+        // for name without in walks "$@"
+        f->words = sh->vm.argv;
+        f->nwords = sh->vm.argc;
+        return 0;
+    }
+    f->words = expand_words(sh, &sh->line_arena, n->loop.words, n->loop.n, &f->nwords);
+    return f->words ? 0 : -1;
+}
+
+/* ---- running ----------------------------------------------------------- */
+
+static volatile sig_atomic_t vm_sigint;
+
+/** ^C while an interactive shell runs builtins or loops of its own. */
+static void vm_on_sigint(int sig) {
+    UNUSED(sig)
+    vm_sigint = 1;
+}
+
+/** Parse a non-negative descriptor number, -1 if s is not one. */
+static int fd_number(const char *s) {
+    if (!*s) return -1;
+    long v = 0;
+    for (; *s; s++) {
+        if (*s < '0' || *s > '9' || v > 9999) return -1;
+        v = v * 10 + (*s - '0');
+    }
+    return (int)v;
+}
+
+/**
+ * Expand the redirections of n. n>&word is only told apart from a
+ * descriptor copy once word is known.
+ */
+static int redirs_expand(struct shell *sh, const struct node *n, struct redir **out, size_t *count) {
+    *out = NULL;
+    *count = 0;
+    if (!n->nredirs) return 0;
+    struct arena *a = &sh->line_arena;
+    // >&file turns into two
+    struct redir *r = arena_alloc(a, 2 * n->nredirs * sizeof(*r));
+    if (!r) {
+        perror("redirect");
+        return -1;
+    }
+    size_t k = 0;
+    for (size_t i = 0; i < n->nredirs; i++) {
+        const struct ast_redir *ar = &n->redirs[i];
+        const char *w = expand_word(sh, a, &ar->target);
+        if (!w) {
+            perror("redirect");
+            return -1;
+        }
+        struct redir *d = &r[k++];
+        *d = (struct redir){ar->type, ar->fd, -1, w};
+        if (ar->type != REDIR_DUP) continue;
+        if (strcmp(w, "-") == 0) {
+            d->type = REDIR_CLOSE;
+        } else if ((d->src = fd_number(w)) == -1) {
+            if (!ar->to_file) {
+                fprintf(stderr, "%s: ambiguous redirect\n", w);
+                return -1;
+            }
+            // >&file sends both stdout and stderr to file
+            d->type = REDIR_OUT;
+            r[k++] = (struct redir){REDIR_DUP, STDERR_FILENO, STDOUT_FILENO, NULL};
+        }
+    }
+    *out = r;
+    *count = k;
+    return 0;
+}
+
+/** Push a frame with the redirections of compound command n applied. */
+static int redir_begin(struct shell *sh, const struct node *n) {
+    struct vm_state *vm = &sh->vm;
+    struct vm_frame *f = frame_push(sh, FRAME_REDIR);
+    if (!f) return -1;
+    struct arena_mark m = f->mark;
+    struct redir *r;
+    size_t nr;
+    // The expanded words and the saved descriptors go with the frame
+    if (redirs_expand(sh, n, &r, &nr) == 0 && (f->saved = arena_alloc(&sh->line_arena, sizeof(*f->saved)))
+        && redirect_push(sh, r, nr, f->saved) == 0)
+        return 0;
+    vm->nframes--;
+    arena_rewind(&sh->line_arena, m);
+    return -1;
+}
+
+static void vm_exec(struct shell *sh, struct program *p, int32_t pc);
+
+/** Call a function with argv as its name and positional parameters. */
+static int vm_call(struct shell *sh, const struct vm_func *f, char **argv) {
+    struct vm_state *vm = &sh->vm;
+    if (vm->depth >= VM_MAX_DEPTH) {
+        fprintf(stderr, "%s: maximum function nesting level exceeded (%d)\n", argv[0], VM_MAX_DEPTH);
+        return 1;
+    }
+    // The function may be redefined while it runs, hold on to its code
+    struct program *p = f->prog;
+    int32_t entry = f->entry;
+    p->refs++;
+    char **saved_argv = vm->argv;
+    size_t saved_argc = vm->argc;
+    vm->argv = argv + 1;
+    for (vm->argc = 0; vm->argv[vm->argc]; vm->argc++)
+        ;
+    vm->depth++;
+    vm_exec(sh, p, entry);
+    vm->depth--;
+    vm->argv = saved_argv;
+    vm->argc = saved_argc;
+    program_unref(p);
+    return sh->last_status;
+}
+
+/** Stage body of a function call. */
+static int run_function(struct shell *sh, const struct stage *st) {
+    return vm_call(sh, st->arg, st->argv);
+}
+
+/** Stage body of a compound command. */
+static int run_unit(struct shell *sh, const struct stage *st) {
+    const struct vm_unit *u = st->arg;
+    vm_exec(sh, u->prog, u->pc);
+    return sh->last_status;
+}
+
+/** Body of the subshell of a command substitution. */
+static int run_subst(struct shell *sh, const void *arg) {
+    const struct vm_unit *u = arg;
+    sh->shell_is_interactive = 0;
+    sh->subshell = true;
+    jobs_destroy(&sh->jobs);
+    vm_exec(sh, u->prog, u->pc);
+    fflush(stdout);
+    return sh->last_status;
+}
+
+/** Run a substitution and capture its output. */
+int vm_substitute(struct shell *sh, const struct node *cmd, struct capture *out) {
+    struct vm_state *vm = &sh->vm;
+    *out = (struct capture){0};
+    if (!cmd) {
+        sh->last_status = vm->subst_status = 0;
+        return 0;
+    }
+    int p[2];
+    if (pipe2(p, O_CLOEXEC) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    static char *no_args[] = {NULL};
+    struct vm_unit u = {vm->prog, cmd->unit};
+    struct launch_action act = {.op = LAUNCH_DUP2, .fd = STDOUT_FILENO, .src = p[1]};
+    struct launch_req req = {
+        .argv = no_args, .pgid = getpgrp(), .actions = &act, .nactions = 1, .body = run_subst, .arg = &u,
+    };
+    struct launch_error e;
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = launch(sh, &req, &e);
+    close(p[1]);
+    if (pid == -1) {
+        fprintf(stderr, "fork: %s\n", strerror(e.err));
+        close(p[0]);
+        return -1;
+    }
+    int rc = capture_read(&sh->capture, p[0], out);
+    if (rc == -1) perror("command substitution");
+    close(p[0]);
+
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            status = W_EXITCODE(1, 0);
+            break;
+        }
+    }
+    vm->subst_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    sh->last_status = vm->subst_status;
+    return rc;
+}
+
+/** Stage body of a command that expanded to nothing, its assignments stay. */
+static int run_assigns(struct shell *sh, const struct stage *st) {
+    char *const *assigns = st->arg;
+    int rc = 0;
+    for (size_t i = 0; assigns && assigns[i]; i++) {
+        char *eq = strchr(assigns[i], '=');
+        *eq = '\0';
+        if (var_set(sh, assigns[i], eq + 1) == -1) rc = 1;
+        *eq = '=';
+    }
+    // x=$(cmd) on its own reports how cmd did
+    return rc ? rc : sh->vm.subst_status;
+}
+
+/** name=value strings for the assignments of n, NULL terminated. */
+static char **assigns_expand(struct shell *sh, const struct node *n) {
+    struct arena *a = &sh->line_arena;
+    char **v = arena_alloc(a, (n->simple.nassigns + 1) * sizeof(*v));
+    if (!v) return NULL;
+    for (size_t i = 0; i < n->simple.nassigns; i++) {
+        const struct assign *as = &n->simple.assigns[i];
+        const char *value = expand_word(sh, a, &as->value);
+        size_t nlen = strlen(as->name), vlen = value ? strlen(value) : 0;
+        if (!value || !(v[i] = arena_alloc(a, nlen + vlen + 2))) return NULL;
+        memcpy(v[i], as->name, nlen);
+        v[i][nlen] = '=';
+        memcpy(v[i] + nlen + 1, value, vlen + 1);
+    }
+    v[n->simple.nassigns] = NULL;
+    return v;
+}
+
+/** Expand command n of a pipeline into a stage. */
+static int stage_build(struct shell *sh, struct program *p, const struct node *n, struct stage *st) {
+    struct arena *a = &sh->line_arena;
+    static char *no_args[] = {NULL};
+    *st = (struct stage){.argv = no_args};
+    if (redirs_expand(sh, n, &st->redirs, &st->nredirs) == -1) return -1;
+
+    if (n->kind != N_SIMPLE) {
+        struct vm_unit *u = arena_alloc(a, sizeof(*u));
+        if (!u) goto oom;
+        *u = (struct vm_unit){p, n->unit};
+        st->body = run_unit;
+        st->arg = u;
+        st->subshell = n->kind == N_SUBSHELL;
+        return 0;
+    }
+
+    st->argv = expand_words(sh, a, n->simple.words, n->simple.n, &st->argc);
+    if (!st->argv) goto oom;
+    char **assigns = NULL;
+    if (n->simple.nassigns && !(assigns = assigns_expand(sh, n))) goto oom;
+    if (st->argc == 0) {
+        // Assignments alone set shell variables, in a forked stage they are lost
+        st->body = run_assigns;
+        st->arg = assigns;
+        return 0;
+    }
+    st->assigns = assigns;
+    // cpus= in front of a command places it instead of reaching its environment
+    for (size_t i = 0; i < n->simple.nassigns; i++) {
+        if (strncmp(assigns[i], "cpus=", 5) == 0) st->cpus = assigns[i] + 5;
+        else assigns[st->nassigns++] = assigns[i];
+    }
+    if (assigns) assigns[st->nassigns] = NULL;
+    const struct vm_func *f = vm_function(sh, st->argv[0]);
+    if (f) {
+        // A copy, the table may move before the stage runs
+        struct vm_func *copy = arena_alloc(a, sizeof(*copy));
+        if (!copy) goto oom;
+        *copy = *f;
+        st->body = run_function;
+        st->arg = copy;
+    }
+    return 0;
+
+oom:
+    perror("expand");
+    return -1;
+}
+
+/** Expand and run one pipeline node, releasing everything it allocated. */
+static void run_pipe(struct shell *sh, struct program *p, const struct node *n) {
+    struct arena *a = &sh->line_arena;
+    struct arena_mark m = arena_mark(a);
+    struct pipeline pl = {
+        .n = n->pipe.n, .background = n->pipe.background, .text = n->pipe.text, .time = n->pipe.time,
+    };
+    int status = W_EXITCODE(1, 0);
+    sh->vm.subst_status = 0;
+    pl.stages = arena_alloc(a, (pl.n ? pl.n : 1) * sizeof(*pl.stages));
+    bool ok = pl.stages != NULL;
+    for (size_t i = 0; ok && i < pl.n; i++) ok = stage_build(sh, p, n->pipe.cmds[i], &pl.stages[i]) == 0;
+    if (ok) status = execute_pipeline(sh, &pl);
+    else sh->last_status = 1;
+    arena_rewind(a, m);
+
+    sh->vm.wait = status;
+    if (status != -1 && ((WIFSIGNALED(status) && WTERMSIG(status) == SIGINT)
+                         || (WIFEXITED(status) && WEXITSTATUS(status) == 128 + SIGINT)))
+        sh->vm.interrupted = true;
+}
+
+/** Pick the case item whose pattern matches, n->cases.n if none does. */
+static size_t case_match(struct shell *sh, const struct node *n) {
+    struct arena *a = &sh->line_arena;
+    struct arena_mark m = arena_mark(a);
+    size_t i = n->cases.n;
+    const char *subject = expand_word(sh, a, &n->cases.subject);
+    for (size_t k = 0; subject && k < n->cases.n && i == n->cases.n; k++) {
+        const struct case_item *item = &n->cases.items[k];
+        for (size_t j = 0; j < item->npatterns; j++) {
+            const char *pat = expand_pattern(sh, a, &item->patterns[j]);
+            if (pat && fnmatch(pat, subject, 0) == 0) {
+                i = k;
+                break;
+            }
+        }
+    }
+    arena_rewind(a, m);
+    return i;
+}
+
+/** Status given to return, 2 with a message when it is not a number. */
+static int return_status(struct shell *sh, const struct node *cmd) {
+    struct arena *a = &sh->line_arena;
+    struct arena_mark m = arena_mark(a);
+    const char *w = expand_word(sh, a, &cmd->simple.words[1]);
+    char *end = NULL;
+    long v = w && *w ? strtol(w, &end, 10) : 0;
+    int status = (int)(v & 0xff);
+    if (!w || !*w || *end) {
+        fprintf(stderr, "return: %s: numeric argument required\n", w ? w : "");
+        status = 2;
+    }
+    arena_rewind(a, m);
+    return status;
+}
+
+/**
+ * Run code from pc until OP_END or OP_RETURN. Frames pushed on the way
+ * are popped before returning, whichever way the code ends.
+ */
+static void vm_exec(struct shell *sh, struct program *p, int32_t pc) {
+    struct vm_state *vm = &sh->vm;
+    size_t base = vm->nframes;
+    struct program *outer = vm->prog;
+    vm->prog = p;
+    for (;;) {
+        if (vm_sigint || vm->interrupted) {
+            vm->interrupted = true;
+            break;
+        }
+        const struct insn *in = &p->code[pc++];
+        struct vm_frame *top = vm->nframes ? &vm->frames[vm->nframes - 1] : NULL;
+        switch (in->op) {
+        case OP_PIPELINE:
+            run_pipe(sh, p, in->arg);
+            break;
+        case OP_NOT:
+            sh->last_status = !sh->last_status;
+            break;
+        case OP_JUMP:
+            pc = in->a;
+            break;
+        case OP_JUMP_IF_OK:
+            if (sh->last_status == 0) pc = in->a;
+            break;
+        case OP_JUMP_IF_FAIL:
+            if (sh->last_status != 0) pc = in->a;
+            break;
+        case OP_STATUS:
+            sh->last_status = in->a;
+            break;
+        case OP_LOOP:
+            if (!frame_push(sh, FRAME_LOOP)) goto fail;
+            break;
+        case OP_FOR:
+            if (for_begin(sh, in->arg) == -1) goto fail;
+            break;
+        case OP_NEXT: {
+            const struct node *n = in->arg;
+            if (top->next == top->nwords) pc = in->a;
+            else if (var_set(sh, n->loop.var, top->words[top->next++]) == -1) goto fail;
+            break;
+        }
+        case OP_SAVE:
+            top->status = sh->last_status;
+            break;
+        case OP_LEAVE: {
+            int status = top->status;
+            frames_drop(sh, vm->nframes - 1);
+            sh->last_status = status;
+            break;
+        }
+        case OP_BREAK:
+            frames_drop(sh, vm->nframes - in->n);
+            vm->frames[vm->nframes - 1].status = 0;
+            pc = in->a;
+            break;
+        case OP_CONTINUE:
+            frames_drop(sh, vm->nframes - in->n);
+            pc = in->a;
+            break;
+        case OP_REDIR:
+            if (redir_begin(sh, in->arg) == -1) {
+                sh->last_status = 1;
+                pc = in->a;
+            }
+            break;
+        case OP_UNREDIR:
+            frames_drop(sh, vm->nframes - 1);
+            break;
+        case OP_CASE:
+            pc += (int32_t)case_match(sh, in->arg);
+            sh->last_status = 0;
+            break;
+        case OP_DEFINE:
+            if (vm_define(sh, p, in->arg, in->a) == -1) goto fail;
+            sh->last_status = 0;
+            break;
+        case OP_RETURN:
+            if (in->arg) sh->last_status = return_status(sh, in->arg);
+            goto out;
+        case OP_END:
+            goto out;
+        }
+    }
+    goto out;
+
+fail:
+    perror("lab");
+    sh->last_status = 1;
+out:
+    frames_drop(sh, base);
+    vm->prog = outer;
+}
+
+/** Wait status for what program_run reports. */
+static int run_result(const struct shell *sh) {
+    int w = sh->vm.wait;
+    if (w == -1) return -1;
+    if (WIFSIGNALED(w) && 128 + WTERMSIG(w) == sh->last_status) return w;
+    return W_EXITCODE(sh->last_status & 0xff, 0);
+}
+
+/** Run a program from its first instruction. */
+int program_run(struct shell *sh, struct program *prog) {
+    struct vm_state *vm = &sh->vm;
+    // The interactive shell ignores ^C, catch it instead while commands
+    // run inside the shell so a loop of builtins can be stopped
+    struct sigaction sa = {.sa_handler = vm_on_sigint, .sa_flags = SA_RESTART}, saved;
+    bool catch = sh->shell_is_interactive && vm->depth == 0;
+    if (catch) {
+        vm_sigint = 0;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGINT, &sa, &saved);
+    }
+    prog->refs++;
+    vm->wait = W_EXITCODE(sh->last_status & 0xff, 0);
+    vm->interrupted = false;
+    vm_exec(sh, prog, 0);
+    vm->interrupted = false;
+    program_unref(prog);
+    if (catch) {
+        sigaction(SIGINT, &saved, NULL);
+        vm_sigint = 0;
+    }
+    return run_result(sh);
+}
+
+/* ---- builtins ---------------------------------------------------------- */
+
+/** break and continue outside of a loop. */
+int builtin_break(struct shell *sh, char **argv) {
+    UNUSED(sh)
+    fprintf(stderr, "%s: only meaningful in a `for', `while', or `until' loop\n", argv[0]);
+    return 0;
+}
+
+/** return outside of a function. */
+int builtin_return(struct shell *sh, char **argv) {
+    UNUSED(sh)
+    UNUSED(argv)
+    fprintf(stderr, "return: can only `return' from a function\n");
+    return 1;
+}
+
+/** Drop positional parameters. */
+int builtin_shift(struct shell *sh, char **argv) {
+    struct vm_state *vm = &sh->vm;
+    size_t n = 1;
+    if (argv[1]) {
+        char *end;
+        errno = 0;
+        long v = strtol(argv[1], &end, 10);
+        if (errno || *end || !*argv[1] || v < 0) {
+            fprintf(stderr, "shift: %s: numeric argument required\n", argv[1]);
+            return 1;
+        }
+        n = (size_t)v;
+    }
+    if (n > vm->argc) {
+        fprintf(stderr, "shift: %zu: shift count out of range\n", n);
+        return 1;
+    }
+    vm->argv += n;
+    vm->argc -= n;
+    return 0;
+}
@@ -0,0 +1,164 @@
+#ifndef VM_H
+#define VM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "arena.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct shell;
+struct node;
+struct capture;
+
+/**
+ * @brief One instruction. Control flow is resolved at compile time, so
+ * loops and conditionals are plain jumps between pipelines.
+ */
+struct insn {
+    uint16_t op;
+    uint16_t n;         // frames to drop for break and continue
+    int32_t a;          // jump target or immediate value
+    const void *arg;    // the syntax tree node the instruction works on
+};
+
+/**
+ * @brief A parsed and compiled piece of source. The syntax tree stays
+ * around because pipelines are expanded from it every time they run.
+ * Shell functions keep a reference to the program that defined them.
+ */
+struct program {
+    struct arena arena;     // the tree and every string it points to
+    struct insn *code;
+    size_t ncode;
+    size_t cap;
+    size_t refs;
+};
+
+/* A shell function, its code lives in the program that defined it */
+struct vm_func {
+    char *name;
+    struct program *prog;
+    int32_t entry;
+};
+
+struct vm_frame;
+
+/**
+ * @brief Interpreter state kept in the shell: functions, positional
+ * parameters and the frames of loops and redirected compound commands
+ * that are running. All zero is a valid empty state.
+ */
+struct vm_state {
+    struct vm_func *funcs;  // open addressing on the name
+    size_t nfuncs;
+    size_t funcs_cap;
+    struct vm_frame *frames;
+    size_t nframes;
+    size_t frames_cap;
+    char **argv;            // positional parameters $1 ..., not owned
+    size_t argc;
+    const char *arg0;       // $0
+    pid_t pid;              // $$, the shell's pid even in a subshell
+    unsigned depth;         // function calls in progress
+    struct program *prog;   // the program running, substitutions run its code
+    int subst_status;       // exit status of the last substitution of the pipeline being expanded
+    int wait;               // wait status of the last pipeline
+    bool interrupted;       // a command was stopped by ^C, abandon the program
+};
+
+/**
+ * @brief Parse src and compile it. Nothing is run and no state of the
+ * shell is touched.
+ *
+ * @param src The source text, one or more lines
+ * @param len Length of src
+ * @param out Receives the program, NULL unless 0 is returned
+ * @return 0, PARSE_ERROR after reporting a syntax error, or one of the
+ * PARSE_MORE codes when src is the start of a longer program
+ */
+int program_parse(const char *src, size_t len, struct program **out);
+
+/**
+ * @brief Run a program. Pipelines are expanded and started one at a
+ * time, everything they allocate from the line arena is released as soon
+ * as they are done, so a loop runs in constant memory. An interactive
+ * shell stops the program when ^C interrupts one of its commands.
+ *
+ * @param sh The shell
+ * @param prog The program
+ * @return The wait status of the last pipeline when it set the exit
+ * status, otherwise the exit status as a wait status, -1 if waiting failed
+ */
+int program_run(struct shell *sh, struct program *prog);
+
+/**
+ * @brief Run the command of a $(...) or backquote substitution in a
+ * subshell and read what it prints. The subshell stays in the shell's
+ * process group, like bash its status becomes $?.
+ *
+ * @param sh The shell, running the program the command was parsed in
+ * @param cmd The command of the WP_SUBST part, NULL for an empty one
+ * @param out Receives the output without trailing newlines, release it
+ * with capture_release on sh->capture
+ * @return 0 on success, -1 after reporting an error
+ */
+int vm_substitute(struct shell *sh, const struct node *cmd, struct capture *out);
+
+/**
+ * @brief Drop a reference, the program is freed with the last one
+ *
+ * @param prog The program, may be NULL
+ */
+void program_unref(struct program *prog);
+
+/**
+ * @brief Find a shell function
+ *
+ * @param sh The shell
+ * @param name The function name
+ * @return The function or NULL, valid until the next definition
+ */
+const struct vm_func *vm_function(const struct shell *sh, const char *name);
+
+/**
+ * @brief Remove a shell function, calls in progress finish normally
+ *
+ * @param sh The shell
+ * @param name The function name
+ * @return 0 if it was removed, -1 if there was no such function
+ */
+int vm_undefine(struct shell *sh, const char *name);
+
+/**
+ * @brief Free the functions and frames of the interpreter
+ *
+ * @param vm The state
+ */
+void vm_destroy(struct vm_state *vm);
+
+/**
+ * @brief break and continue where they do not end a loop, compiled ones
+ * never reach this
+ */
+int builtin_break(struct shell *sh, char **argv);
+
+/**
+ * @brief return outside of a function
+ */
+int builtin_return(struct shell *sh, char **argv);
+
+/**
+ * @brief shift [n], drop the first n positional parameters
+ */
+int builtin_shift(struct shell *sh, char **argv);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // VM_H
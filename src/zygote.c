@@ -0,0 +1,378 @@
+/**
+ * zygote.c
+ * The spawn helper. It is forked before the shell loads its history and
+ * caches and then only ever receives requests, so its own forks stay as
+ * cheap as they were at startup. A request carries everything the child
+ * needs that the helper cannot know: argv, the environment, the umask,
+ * the process group, the CPU and memory placement, and as SCM_RIGHTS the
+ * cwd and every descriptor the child inherits or the redirections copy.
+ * The child puts those back at the numbers they have in the shell before
+ * it runs the actions.
+ */
+
+#define _GNU_SOURCE
+#include "zygote.h"
+#include "lab.h"
+#include "launch.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* What a child reports back when it could not exec, as in launch.c */
+struct child_error {
+    int err;
+    int action;
+};
+
+/** The next string of a message, NULL if it runs past the end. */
+static char *next_string(char **at, char *end) {
+    char *s = *at;
+    char *nul = s < end ? memchr(s, '\0', (size_t)(end - s)) : NULL;
+    if (!nul) return NULL;
+    *at = nul + 1;
+    return s;
+}
+
+/**
+ * In the child: take over the shell's descriptors, cwd and group, then run
+ * the actions and exec. Only system calls from here on, the child comes
+ * from a raw clone that glibc does not know about.
+ */
+static void zygote_child(const struct zygote_msg *m, int *fds, const char *path, char **argv,
+                         char **envp, const struct launch_action *actions, int errfd) {
+    pid_t self = getpid();
+    pid_t pgid = m->pgid ? m->pgid : self;
+    setpgid(self, pgid);
+
+    // Lift everything above the numbers the descriptors are going to take
+    int top = 3;
+    for (uint32_t i = 1; i < m->nfds; i++)
+        if (m->fds[i] >= top) top = m->fds[i] + 1;
+    struct child_error ce = {0, -1};
+    if ((errfd = fcntl(errfd, F_DUPFD_CLOEXEC, top)) == -1) _exit(127);
+    for (uint32_t i = 0; i < m->nfds && !ce.err; i++) {
+        if ((fds[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, top)) == -1) ce.err = errno;
+    }
+    bool std_passed[3] = {false, false, false};
+    for (uint32_t i = 1; i < m->nfds && !ce.err; i++) {
+        if (dup2(fds[i], m->fds[i]) == -1) ce.err = errno;
+        if (m->fds[i] < 3) std_passed[m->fds[i]] = true;
+    }
+    // What the shell has closed is closed in the child as well
+    for (int fd = 0; fd < 3; fd++)
+        if (!std_passed[fd]) close(fd);
+    if (!ce.err && fchdir(fds[0]) == -1) ce.err = errno;
+    umask((mode_t)m->umask);
+    if (m->terminal >= 0) tcsetpgrp(m->terminal, pgid);
+    launch_child_signals();
+    placement_apply(&m->place);
+
+    for (uint32_t i = 0; i < m->nactions && !ce.err; i++) {
+        if (launch_apply(&actions[i]) == -1) {
+            ce.err = errno;
+            ce.action = (int)i;
+        }
+    }
+    if (!ce.err) {
+        launch_exec(path, argv, envp);
+        ce.err = errno;
+    }
+    ssize_t rc = write(errfd, &ce, sizeof(ce));
+    UNUSED(rc);
+    _exit(127);
+}
+
+/** Serve one request, returns the answer. */
+static struct zygote_reply zygote_serve(char *msg, size_t n, int *fds, size_t nfds) {
+    struct zygote_reply r = {-1, EPROTO, -1};
+    const struct zygote_msg *m = (const void *)msg;
+    if (n < sizeof(*m) || m->size != n || m->nfds != nfds || nfds == 0 || m->argc == 0 ||
+        m->nactions > (n - sizeof(*m)) / sizeof(struct zygote_action))
+        return r;
+
+    const struct zygote_action *za = (const void *)(msg + sizeof(*m));
+    char *at = (char *)(za + m->nactions), *end = msg + n;
+    char **argv = calloc(m->argc + 1, sizeof(*argv));
+    char **envp = calloc(m->envc + 1, sizeof(*envp));
+    struct launch_action *actions = calloc(m->nactions + 1, sizeof(*actions));
+    char *path = next_string(&at, end);
+    bool ok = argv && envp && actions && path;
+    for (uint32_t i = 0; i < m->argc && ok; i++) ok = (argv[i] = next_string(&at, end)) != NULL;
+    for (uint32_t i = 0; i < m->envc && ok; i++) ok = (envp[i] = next_string(&at, end)) != NULL;
+    for (uint32_t i = 0; i < m->nactions && ok; i++) {
+        actions[i] = (struct launch_action){
+            .op = za[i].op, .fd = za[i].fd, .src = za[i].src,
+            .flags = za[i].flags, .prealloc = (off_t)za[i].prealloc,
+        };
+        if (za[i].op == LAUNCH_OPEN) ok = (actions[i].path = next_string(&at, end)) != NULL;
+    }
+
+    int pipefd[2] = {-1, -1};
+    if (ok && pipe2(pipefd, O_CLOEXEC) == 0) {
+        // CLONE_PARENT makes the child the shell's, as if the shell had forked it
+        pid_t pid = (pid_t)syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL, NULL);
+        if (pid == 0) {
+            close(pipefd[0]);
+            zygote_child(m, fds, path, argv, envp, actions, pipefd[1]);
+        }
+        int err = errno;
+        close(pipefd[1]);
+        r = (struct zygote_reply){pid, pid == -1 ? err : 0, -1};
+        struct child_error ce;
+        ssize_t got = 0;
+        while (pid > 0 && (got = read(pipefd[0], &ce, sizeof(ce))) == -1 && errno == EINTR)
+            ;
+        if (pid > 0 && got == sizeof(ce)) {
+            r.err = ce.err;
+            r.action = ce.action;
+        }
+        close(pipefd[0]);
+    } else if (ok) {
+        r.err = errno;
+    }
+    free(argv);
+    free(envp);
+    free(actions);
+    return r;
+}
+
+/** The helper's loop, one request per message until the shell goes away. */
+static void zygote_main(int sock) {
+    prctl(PR_SET_NAME, "lab-zygote");
+    // Hold on to nothing of the shell's, a pipe on stdout would never see EOF
+    int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+    for (int fd = 0; fd < 3 && null != -1; fd++) dup2(null, fd);
+    if (sock > 3) close_range(3, (unsigned)sock - 1, 0);
+    close_range((unsigned)sock + 1, ~0u, 0);
+
+    char *buf = NULL;
+    size_t cap = 0;
+    for (;;) {
+        // The size of the next message without taking it
+        ssize_t n = recv(sock, NULL, 0, MSG_PEEK | MSG_TRUNC);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) _exit(0);
+        if ((size_t)n > cap) {
+            char *grown = realloc(buf, (size_t)n);
+            if (!grown) _exit(1);
+            buf = grown;
+            cap = (size_t)n;
+        }
+
+        union {
+            char buf[CMSG_SPACE(ZYGOTE_MAX_FDS * sizeof(int))];
+            struct cmsghdr align;
+        } ctl;
+        struct iovec iov = {buf, (size_t)n};
+        struct msghdr mh = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl.buf,
+                            .msg_controllen = sizeof(ctl.buf)};
+        while ((n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+            ;
+        if (n <= 0) _exit(0);
+
+        int fds[ZYGOTE_MAX_FDS];
+        size_t nfds = 0;
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&mh); c; c = CMSG_NXTHDR(&mh, c)) {
+            if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+            size_t k = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < k && nfds < ZYGOTE_MAX_FDS; i++)
+                memcpy(&fds[nfds++], CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+        }
+        struct zygote_reply r = (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+                                    ? (struct zygote_reply){-1, EPROTO, -1}
+                                    : zygote_serve(buf, (size_t)n, fds, nfds);
+        for (size_t i = 0; i < nfds; i++) close(fds[i]);
+        if (send(sock, &r, sizeof(r), MSG_NOSIGNAL) != (ssize_t)sizeof(r)) _exit(0);
+    }
+}
+
+/** Fork the helper. */
+int zygote_start(struct shell *sh) {
+    struct zygote *z = &sh->zygote;
+    if (z->pid) return 0;
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) return -1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(sv[0]);
+        zygote_main(sv[1]);
+    }
+    close(sv[1]);
+    if (pid == -1) {
+        int err = errno;
+        close(sv[0]);
+        errno = err;
+        return -1;
+    }
+    *z = (struct zygote){.fd = sv[0], .pid = pid, .owner = getpid()};
+    return 0;
+}
+
+/** Attach fd unless it is closed or already there, false when there is no room. */
+static bool add_fd(struct zygote_msg *m, int *fds, int fd) {
+    if (fd < 0 || fcntl(fd, F_GETFD) == -1) return true;
+    for (uint32_t i = 1; i < m->nfds; i++)
+        if (m->fds[i] == fd) return true;
+    if (m->nfds == ZYGOTE_MAX_FDS) return false;
+    fds[m->nfds] = fd;
+    m->fds[m->nfds++] = fd;
+    return true;
+}
+
+/* A message being built */
+struct mbuf {
+    char *s;
+    size_t len;
+    size_t cap;
+    bool failed;
+};
+
+/** Append len bytes of p. */
+static void mb_add(struct mbuf *b, const void *p, size_t len) {
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + len) cap *= 2;
+        char *grown = realloc(b->s, cap);
+        if (!grown) {
+            b->failed = true;
+            return;
+        }
+        b->s = grown;
+        b->cap = cap;
+    }
+    memcpy(b->s + b->len, p, len);
+    b->len += len;
+}
+
+/** Append a string with its NUL. */
+static void mb_str(struct mbuf *b, const char *s) {
+    mb_add(b, s, strlen(s) + 1);
+}
+
+/** Lay the request out as a message, the descriptors are already in m. */
+static int build_msg(struct mbuf *b, struct zygote_msg *m, const struct launch_req *req, char **envp) {
+    for (char **a = req->argv; *a; a++) m->argc++;
+    for (char **v = envp; *v; v++) m->envc++;
+    m->nactions = (uint32_t)req->nactions;
+    mb_add(b, m, sizeof(*m));
+    for (size_t i = 0; i < req->nactions; i++) {
+        const struct launch_action *a = &req->actions[i];
+        struct zygote_action za = {a->op, a->fd, a->src, a->flags, (int64_t)a->prealloc};
+        mb_add(b, &za, sizeof(za));
+    }
+    mb_str(b, req->path);
+    for (char **a = req->argv; *a; a++) mb_str(b, *a);
+    for (char **v = envp; *v; v++) mb_str(b, *v);
+    for (size_t i = 0; i < req->nactions; i++)
+        if (req->actions[i].op == LAUNCH_OPEN) mb_str(b, req->actions[i].path);
+    if (b->failed) return -1;
+    ((struct zygote_msg *)b->s)->size = (uint32_t)b->len;
+    return 0;
+}
+
+/** Send a request and wait for the answer, -1 if the helper cannot be used. */
+static int zygote_call(struct zygote *z, struct mbuf *b, const int *fds, uint32_t nfds,
+                       struct zygote_reply *r) {
+    union {
+        char buf[CMSG_SPACE(ZYGOTE_MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+    memset(&ctl, 0, sizeof(ctl));
+    struct iovec iov = {b->s, b->len};
+    struct msghdr mh = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl.buf,
+                        .msg_controllen = CMSG_SPACE(nfds * sizeof(int))};
+    struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(c), fds, nfds * sizeof(int));
+
+    ssize_t n;
+    while ((n = sendmsg(z->fd, &mh, MSG_NOSIGNAL)) == -1 && errno == EINTR)
+        ;
+    if (n == -1) {
+        // Too big for one message is this request's problem, the rest the helper's
+        if (errno != EMSGSIZE) zygote_stop(z);
+        return -1;
+    }
+    while ((n = recv(z->fd, r, sizeof(*r), 0)) == -1 && errno == EINTR)
+        ;
+    if (n != (ssize_t)sizeof(*r)) {
+        zygote_stop(z);
+        return -1;
+    }
+    return 0;
+}
+
+/** Start an external program through the helper. */
+pid_t zygote_launch(struct shell *sh, const struct launch_req *req, struct launch_error *e) {
+    struct zygote *z = &sh->zygote;
+    e->err = 0;
+    e->action = NULL;
+    // A forked copy of the shell would get children that are not its own
+    if (z->pid && z->owner != getpid()) return -1;
+    if (!z->pid && zygote_start(sh) == -1) return -1;
+
+    struct zygote_msg m = {.pgid = req->pgid, .terminal = -1, .nfds = 1};
+    const struct placement *place = affinity_current(sh);
+    if (place) m.place = *place;
+    if (req->foreground && sh->shell_is_interactive) m.terminal = sh->shell_terminal;
+    mode_t mask = umask(0);
+    umask(mask);
+    m.umask = mask;
+
+    int fds[ZYGOTE_MAX_FDS];
+    fds[0] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    m.fds[0] = -1;
+    if (fds[0] == -1) return -1;
+    bool room = add_fd(&m, fds, STDIN_FILENO) && add_fd(&m, fds, STDOUT_FILENO) &&
+                add_fd(&m, fds, STDERR_FILENO) && add_fd(&m, fds, m.terminal);
+    for (size_t i = 0; i < req->nactions && room; i++)
+        if (req->actions[i].op == LAUNCH_DUP2) room = add_fd(&m, fds, req->actions[i].src);
+
+    struct mbuf b = {0};
+    struct zygote_reply r;
+    int rc = room && build_msg(&b, &m, req, vars_environ(sh)) == 0 ? zygote_call(z, &b, fds, m.nfds, &r) : -1;
+    close(fds[0]);
+    free(b.s);
+    if (rc == -1) return -1;
+
+    if (r.pid <= 0) {
+        e->err = r.err ? r.err : EAGAIN;
+        return -1;
+    }
+    if (r.err) {
+        // The child is ours and exited with 127, reap it here like launch_fork
+        while (waitpid(r.pid, NULL, 0) == -1 && errno == EINTR)
+            ;
+        e->err = r.err;
+        e->action = r.action >= 0 && (size_t)r.action < req->nactions ? &req->actions[r.action] : NULL;
+        return -1;
+    }
+    // Set the group from this side too, the child may not have got there yet
+    pid_t pgid = req->pgid ? req->pgid : r.pid;
+    setpgid(r.pid, pgid);
+    if (m.terminal >= 0) tcsetpgrp(sh->shell_terminal, pgid);
+    return r.pid;
+}
+
+/** Stop the helper. */
+void zygote_stop(struct zygote *z) {
+    if (!z->pid) return;
+    close(z->fd);
+    if (z->owner == getpid()) {
+        kill(z->pid, SIGKILL);
+        while (waitpid(z->pid, NULL, 0) == -1 && errno == EINTR)
+            ;
+    }
+    memset(z, 0, sizeof(*z));
+}
@@ -0,0 +1,99 @@
+#ifndef ZYGOTE_H
+#define ZYGOTE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "affinity.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct shell;
+struct launch_req;
+struct launch_error;
+
+// Descriptors one request can hand over, the cwd and 0, 1 and 2 included
+#define ZYGOTE_MAX_FDS 32
+
+/**
+ * @brief A small helper process forked while the shell is still small,
+ * that starts external programs on the shell's behalf. Its fork copies
+ * its own few pages instead of the shell's, however large the shell has
+ * grown. Children are created with CLONE_PARENT, so they are the shell's
+ * children: waiting, job control and SIGCHLD work as if the shell had
+ * forked them. Requests go over a SOCK_SEQPACKET socketpair with the
+ * descriptors the child needs attached as SCM_RIGHTS. All zero means
+ * there is no helper.
+ */
+struct zygote {
+    int fd;         // the shell's end of the socketpair, valid while pid is set
+    pid_t pid;      // the helper, 0 when there is none
+    pid_t owner;    // the shell that started it, forked copies of it never use it
+};
+
+/* Request header, followed by the actions and then the strings */
+struct zygote_msg {
+    uint32_t size;          // of the whole message
+    int32_t pgid;           // group to join, 0 to lead a new one
+    int32_t terminal;       // descriptor to hand to the group, -1 for none
+    uint32_t umask;
+    uint32_t argc;
+    uint32_t envc;
+    uint32_t nactions;
+    uint32_t nfds;          // descriptors attached, the cwd first
+    int32_t fds[ZYGOTE_MAX_FDS];    // number each one has in the shell
+    struct placement place; // CPUs and memory node, nothing set to inherit
+};
+
+/* A launch_action as sent, the path of LAUNCH_OPEN is among the strings */
+struct zygote_action {
+    int32_t op;
+    int32_t fd;
+    int32_t src;
+    int32_t flags;
+    int64_t prealloc;
+};
+
+/* Answer to a request */
+struct zygote_reply {
+    int32_t pid;            // the child, also when it could not exec
+    int32_t err;            // errno of the failure, 0 when it runs
+    int32_t action;         // index of the action that failed, -1 for exec
+};
+
+/**
+ * @brief Fork the helper. The shell calls this from sh_init when the
+ * zygote option is on, before the history and caches are loaded.
+ *
+ * @param sh The shell
+ * @return 0 on success or if it is already running, -1 with errno set
+ */
+int zygote_start(struct shell *sh);
+
+/**
+ * @brief Start an external program through the helper, starting the
+ * helper first if there is none.
+ *
+ * @param sh The shell
+ * @param req What to start, fn and body must not be set
+ * @param e Receives the reason if the program could not be started
+ * @return The pid of the child. -1 with e->err set if the program could
+ * not be started, -1 with e->err 0 if the helper cannot take the request
+ * and the caller should start the program itself.
+ */
+pid_t zygote_launch(struct shell *sh, const struct launch_req *req, struct launch_error *e);
+
+/**
+ * @brief Stop the helper. A forked copy of the shell only closes its
+ * descriptor.
+ *
+ * @param z The helper
+ */
+void zygote_stop(struct zygote *z);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // ZYGOTE_H
@@ -1,6 +1,22 @@
+#include <stdio.h>
+#include <signal.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/wait.h>
 #include "harness/unity.h"
 #include "../src/lab.h"
+#include "../src/tokenize.h"
+#include "../src/pipeline.h"
+#include "../src/histdb.h"
+#include "../src/script.h"
+#include "../src/timing.h"
+#include "../src/parse.h"
+#include "../src/vm.h"
+#include "../src/glob.h"
+#include <sys/stat.h>
+#include <poll.h>
+#include <limits.h>
+#include <errno.h>
 
 void setUp(void) {
     // set stuff up here
@@ -34,6 +50,8 @@ void test_cmd_parse2(void) {
     free(expected[0]);
     free(expected[1]);
     free(expected);
+    cmd_free(actual);
+    free(stng);
 }
 
 void test_cmd_parse(void) {
@@ -124,20 +142,30 @@ void test_ch_dir_home(void) {
     char *line = (char*)calloc(10, sizeof(char));
     strncpy(line, "cd", 10);
     char **cmd = cmd_parse(line);
+    struct shell sh = {0};
     char *expected = getenv("HOME");
-    change_dir(cmd);
+    TEST_ASSERT_EQUAL_INT(0, var_set(&sh, "HOME", expected));
+    change_dir(&sh, cmd);
     char *actual = getcwd(NULL, 0);
     TEST_ASSERT_EQUAL_STRING(expected, actual);
+    free(actual);
+    // HOME set in the shell wins over the environment it started with
+    TEST_ASSERT_EQUAL_INT(0, var_set(&sh, "HOME", "/"));
+    change_dir(&sh, cmd);
+    actual = getcwd(NULL, 0);
+    TEST_ASSERT_EQUAL_STRING("/", actual);
     free(line);
     free(actual);
     cmd_free(cmd);
+    vars_destroy(&sh.vars);
 }
 
 void test_ch_dir_root(void) {
     char *line = (char*)calloc(10, sizeof(char));
     strncpy(line, "cd /", 10);
     char **cmd = cmd_parse(line);
-    change_dir(cmd);
+    struct shell sh = {0};
+    change_dir(&sh, cmd);
     char *actual = getcwd(NULL, 0);
     TEST_ASSERT_EQUAL_STRING("/", actual);
     free(line);
@@ -190,15 +218,1721 @@ void test_get_prompt_empty_env(void) {
 }
 
 void test_ch_dir_invalid_path(void) {
-    char *line = (char*)calloc(10, sizeof(char));
-    strncpy(line, "cd /invalid_path", 10);
+    char *line = (char*)calloc(20, sizeof(char));
+    strncpy(line, "cd /invalid_path", 20);
     char **cmd = cmd_parse(line);
-    int result = change_dir(cmd);
+    struct shell sh = {0};
+    int result = change_dir(&sh, cmd);
     TEST_ASSERT_EQUAL_INT(-1, result);
     free(line);
     cmd_free(cmd);
 }
 
+void test_cmd_parse_argc(void) {
+    char **rval = cmd_parse(" ls  -a -l ");
+    TEST_ASSERT_TRUE(rval);
+    TEST_ASSERT_EQUAL_INT(3, cmd_header(rval)->argc);
+    TEST_ASSERT_NULL(cmd_header(rval)->owner);
+    cmd_free(rval);
+}
+
+void test_cmd_parse_arena(void) {
+    struct arena a;
+    arena_init(&a, 64);
+    char **rval = cmd_parse_arena(&a, "grep -n foo bar.txt");
+    TEST_ASSERT_TRUE(rval);
+    TEST_ASSERT_EQUAL_STRING("grep", rval[0]);
+    TEST_ASSERT_EQUAL_STRING("bar.txt", rval[3]);
+    TEST_ASSERT_FALSE(rval[4]);
+    TEST_ASSERT_EQUAL_PTR(&a, cmd_header(rval)->owner);
+    // cmd_free is a no-op on arena backed lines
+    cmd_free(rval);
+
+    arena_reset(&a);
+    char **again = cmd_parse_arena(&a, "ls");
+    TEST_ASSERT_EQUAL_PTR(rval, again);
+    TEST_ASSERT_EQUAL_STRING("ls", again[0]);
+    arena_destroy(&a);
+}
+
+void test_arena_grows(void) {
+    struct arena a;
+    arena_init(&a, 16);
+    char *first = arena_alloc(&a, 8);
+    char *big = arena_alloc(&a, 1000);
+    TEST_ASSERT_NOT_NULL(first);
+    TEST_ASSERT_NOT_NULL(big);
+    memset(big, 'x', 1000);
+    first[0] = 'y';
+    TEST_ASSERT_EQUAL_CHAR('x', big[999]);
+    arena_destroy(&a);
+}
+void test_cmd_parse_tabs(void) {
+    char **rval = cmd_parse("ls\t-a \t -l\n");
+    TEST_ASSERT_TRUE(rval);
+    TEST_ASSERT_EQUAL_STRING("ls", rval[0]);
+    TEST_ASSERT_EQUAL_STRING("-a", rval[1]);
+    TEST_ASSERT_EQUAL_STRING("-l", rval[2]);
+    TEST_ASSERT_FALSE(rval[3]);
+    cmd_free(rval);
+}
+
+void test_cmd_parse_quotes(void) {
+    char **rval = cmd_parse("echo 'a  b' \"c \\\"d\\\"\" e\\ f x'y'\"z\"");
+    TEST_ASSERT_TRUE(rval);
+    TEST_ASSERT_EQUAL_STRING("echo", rval[0]);
+    TEST_ASSERT_EQUAL_STRING("a  b", rval[1]);
+    TEST_ASSERT_EQUAL_STRING("c \"d\"", rval[2]);
+    TEST_ASSERT_EQUAL_STRING("e f", rval[3]);
+    TEST_ASSERT_EQUAL_STRING("xyz", rval[4]);
+    TEST_ASSERT_FALSE(rval[5]);
+    cmd_free(rval);
+}
+
+void test_cmd_parse_unterminated_quote(void) {
+    TEST_ASSERT_NULL(cmd_parse("echo 'oops"));
+    TEST_ASSERT_NULL(cmd_parse("echo \"oops"));
+}
+
+void test_tokenize_operators(void) {
+    const char *line = "a|b 2>err >>out&&c;d";
+    struct tok_index idx;
+    tok_index_init(&idx);
+    TEST_ASSERT_EQUAL_INT(0, tokenize(line, strlen(line), &idx));
+    TEST_ASSERT_EQUAL_INT(12, idx.n);
+    TEST_ASSERT_EQUAL_INT(TOK_WORD, idx.tok[0].kind);
+    TEST_ASSERT_EQUAL_INT(TOK_OP, idx.tok[1].kind);
+    TEST_ASSERT_EQUAL_INT(TOK_IONUM, idx.tok[3].kind);
+    TEST_ASSERT_EQUAL_INT(1, idx.tok[4].len);
+    TEST_ASSERT_EQUAL_INT(2, idx.tok[6].len);
+    TEST_ASSERT_EQUAL_INT(TOK_OP, idx.tok[8].kind);
+    TEST_ASSERT_EQUAL_INT(2, idx.tok[8].len);
+    tok_index_free(&idx);
+}
+
+/* Every classifier available on this machine must agree with the scalar one */
+void test_tokenize_impls_agree(void) {
+    static const char alphabet[] = "ab \t'\"\\|&;<>()xyz019 \n";
+    char line[300];
+    unsigned seed = 1;
+    const char *impls[] = {"sse2", "avx2"};
+
+    for (int round = 0; round < 200; round++) {
+        size_t len = (size_t)(round * 7 % 290);
+        for (size_t i = 0; i < len; i++) {
+            seed = seed * 1103515245 + 12345;
+            line[i] = alphabet[(seed >> 16) % (sizeof(alphabet) - 1)];
+        }
+        line[len] = '\0';
+
+        struct tok_index want, got;
+        tok_index_init(&want);
+        tok_select("scalar");
+        int want_rc = tokenize(line, len, &want);
+        for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); k++) {
+            if (tok_select(impls[k]) == -1) continue;
+            tok_index_init(&got);
+            TEST_ASSERT_EQUAL_INT(want_rc, tokenize(line, len, &got));
+            if (want_rc == 0) {
+                TEST_ASSERT_EQUAL_INT(want.n, got.n);
+                for (size_t i = 0; i < want.n; i++) {
+                    TEST_ASSERT_EQUAL_INT(want.tok[i].off, got.tok[i].off);
+                    TEST_ASSERT_EQUAL_INT(want.tok[i].len, got.tok[i].len);
+                    TEST_ASSERT_EQUAL_INT(want.tok[i].out, got.tok[i].out);
+                    TEST_ASSERT_EQUAL_INT(want.tok[i].kind, got.tok[i].kind);
+                }
+            }
+            tok_index_free(&got);
+        }
+        tok_index_free(&want);
+    }
+    tok_select("auto");
+}
+void test_cmd_hash_lookup(void) {
+    struct cmd_hash h;
+    cmd_hash_init(&h);
+    int cached;
+    const char *path = cmd_hash_lookup(&h, "sh", &cached);
+    TEST_ASSERT_NOT_NULL(path);
+    TEST_ASSERT_FALSE(cached);
+    TEST_ASSERT_EQUAL_STRING("/sh", strrchr(path, '/'));
+    TEST_ASSERT_EQUAL_PTR(path, cmd_hash_lookup(&h, "sh", &cached));
+    TEST_ASSERT_TRUE(cached);
+    // Reporting where a command is does not count as running it
+    TEST_ASSERT_EQUAL_PTR(path, cmd_hash_find(&h, "sh"));
+    TEST_ASSERT_NOT_NULL(cmd_hash_find(&h, "env"));
+    for (size_t i = 0; i < h.cap; i++) {
+        if (!h.slots[i].name) continue;
+        TEST_ASSERT_EQUAL_UINT(strcmp(h.slots[i].name, "sh") == 0 ? 2 : 0, h.slots[i].hits);
+    }
+    TEST_ASSERT_NULL(cmd_hash_lookup(&h, "no-such-command-here", NULL));
+    TEST_ASSERT_EQUAL_STRING("./a.out", cmd_hash_lookup(&h, "./a.out", NULL));
+    cmd_hash_destroy(&h);
+}
+
+void test_cmd_hash_path_change(void) {
+    struct cmd_hash h;
+    cmd_hash_init(&h);
+    char *saved = strdup(getenv("PATH"));
+    TEST_ASSERT_NOT_NULL(cmd_hash_lookup(&h, "sh", NULL));
+    setenv("PATH", "/nonexistent", 1);
+    // Listing the table first drops what came from the old PATH
+    cmd_hash_refresh(&h);
+    TEST_ASSERT_EQUAL_INT(0, h.n);
+    TEST_ASSERT_NULL(cmd_hash_lookup(&h, "sh", NULL));
+    TEST_ASSERT_EQUAL_INT(0, h.n);
+    setenv("PATH", saved, 1);
+    free(saved);
+    cmd_hash_destroy(&h);
+}
+
+void test_cmd_hash_forget(void) {
+    struct cmd_hash h;
+    cmd_hash_init(&h);
+    char name[16];
+    // Enough entries to force collisions and a resize
+    for (int i = 0; i < 100; i++) {
+        snprintf(name, sizeof(name), "cmd%d", i);
+        TEST_ASSERT_EQUAL_INT(0, cmd_hash_set(&h, name, "/bin/true"));
+    }
+    for (int i = 0; i < 100; i += 2) {
+        snprintf(name, sizeof(name), "cmd%d", i);
+        TEST_ASSERT_EQUAL_INT(0, cmd_hash_forget(&h, name));
+    }
+    TEST_ASSERT_EQUAL_INT(50, h.n);
+    for (int i = 0; i < 100; i++) {
+        int cached;
+        snprintf(name, sizeof(name), "cmd%d", i);
+        const char *path = cmd_hash_lookup(&h, name, &cached);
+        TEST_ASSERT_EQUAL_INT(i % 2, cached);
+        if (i % 2) TEST_ASSERT_EQUAL_STRING("/bin/true", path);
+    }
+    cmd_hash_destroy(&h);
+}void test_pipeline_parse(void) {
+    struct arena a;
+    struct pipeline pl;
+    arena_init(&a, 0);
+    TEST_ASSERT_EQUAL_INT(0, pipeline_parse(&a, "ls -l|grep 'a|b' | wc -l", &pl));
+    TEST_ASSERT_EQUAL_INT(3, pl.n);
+    TEST_ASSERT_EQUAL_STRING("ls", pl.stages[0].argv[0]);
+    TEST_ASSERT_EQUAL_STRING("-l", pl.stages[0].argv[1]);
+    TEST_ASSERT_EQUAL_STRING("a|b", pl.stages[1].argv[1]);
+    TEST_ASSERT_EQUAL_INT(2, pl.stages[2].argc);
+    TEST_ASSERT_EQUAL_INT(0, pipeline_parse(&a, "  ", &pl));
+    TEST_ASSERT_EQUAL_INT(0, pl.n);
+    TEST_ASSERT_EQUAL_INT(-1, pipeline_parse(&a, "ls | | wc", &pl));
+    TEST_ASSERT_EQUAL_INT(-1, pipeline_parse(&a, "| wc", &pl));
+    TEST_ASSERT_EQUAL_INT(-1, pipeline_parse(&a, "ls |", &pl));
+    arena_destroy(&a);
+}
+void test_pipeline_parse_redirs(void) {
+    struct arena a;
+    struct pipeline pl;
+    arena_init(&a, 0);
+    TEST_ASSERT_EQUAL_INT(0, pipeline_parse(&a, "sort <in -r 2>>log >'out file' 2>&1 3>&-", &pl));
+    TEST_ASSERT_EQUAL_INT(1, pl.n);
+    struct stage *st = &pl.stages[0];
+    TEST_ASSERT_EQUAL_INT(2, st->argc);
+    TEST_ASSERT_EQUAL_STRING("-r", st->argv[1]);
+    TEST_ASSERT_EQUAL_INT(5, st->nredirs);
+    TEST_ASSERT_EQUAL_INT(REDIR_IN, st->redirs[0].type);
+    TEST_ASSERT_EQUAL_INT(0, st->redirs[0].fd);
+    TEST_ASSERT_EQUAL_INT(REDIR_APPEND, st->redirs[1].type);
+    TEST_ASSERT_EQUAL_INT(2, st->redirs[1].fd);
+    TEST_ASSERT_EQUAL_STRING("out file", st->redirs[2].word);
+    TEST_ASSERT_EQUAL_INT(REDIR_DUP, st->redirs[3].type);
+    TEST_ASSERT_EQUAL_INT(1, st->redirs[3].src);
+    TEST_ASSERT_EQUAL_INT(REDIR_CLOSE, st->redirs[4].type);
+    TEST_ASSERT_EQUAL_INT(3, st->redirs[4].fd);
+
+    TEST_ASSERT_EQUAL_INT(0, pipeline_parse(&a, "> truncate-me", &pl));
+    TEST_ASSERT_EQUAL_INT(0, pl.stages[0].argc);
+    TEST_ASSERT_EQUAL_INT(-1, pipeline_parse(&a, "ls >", &pl));
+    TEST_ASSERT_EQUAL_INT(-1, pipeline_parse(&a, "ls > | wc", &pl));
+    TEST_ASSERT_EQUAL_INT(-1, pipeline_parse(&a, "> x | wc", &pl));
+    arena_destroy(&a);
+}
+
+/* A non-interactive shell that does not touch the terminal */
+static void test_shell(struct shell *sh) {
+    memset(sh, 0, sizeof(*sh));
+    arena_init(&sh->line_arena, 0);
+    cmd_hash_init(&sh->cmd_hash);
+    jobs_init(&sh->jobs);
+    sh->history.fd = -1;
+}
+
+/** Create an empty file dir/name with the given mode. */
+static void make_file(const char *dir, const char *name, mode_t mode) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    TEST_ASSERT_TRUE(fd != -1);
+    close(fd);
+    TEST_ASSERT_EQUAL_INT(0, chmod(path, mode));
+}
+
+static void run_launch_backends(struct shell *sh) {
+    char **cmd = cmd_parse("sh -c 'exit 3'");
+    int status = execute_command(sh, cmd);
+    TEST_ASSERT_TRUE(WIFEXITED(status));
+    TEST_ASSERT_EQUAL_INT(3, WEXITSTATUS(status));
+    TEST_ASSERT_EQUAL_INT(3, sh->last_status);
+    cmd_free(cmd);
+
+    cmd = cmd_parse("/no/such/program");
+    status = execute_command(sh, cmd);
+    TEST_ASSERT_EQUAL_INT(127, WEXITSTATUS(status));
+    TEST_ASSERT_EQUAL_INT(127, sh->last_status);
+    cmd_free(cmd);
+
+    struct pipeline pl;
+    TEST_ASSERT_EQUAL_INT(0, pipeline_parse(&sh->line_arena,
+        "echo hello | tr a-z A-Z | sh -c 'read x; test \"$x\" = HELLO'", &pl));
+    status = execute_pipeline(sh, &pl);
+    TEST_ASSERT_TRUE(WIFEXITED(status));
+    TEST_ASSERT_EQUAL_INT(0, WEXITSTATUS(status));
+    arena_reset(&sh->line_arena);
+}
+
+void test_execute_command_fork(void) {
+    struct shell sh;
+    test_shell(&sh);
+    run_launch_backends(&sh);
+    sh_destroy(&sh);
+}
+
+void test_pipeline_relay(void) {
+    struct shell sh;
+    struct pipeline pl;
+    test_shell(&sh);
+    TEST_ASSERT_EQUAL_INT(0, sh_set_option(&sh, "relay", true));
+    TEST_ASSERT_EQUAL_INT(0, pipeline_parse(&sh.line_arena,
+        "set -o | grep -q 'relay.*on'", &pl));
+    int status = execute_pipeline(&sh, &pl);
+    TEST_ASSERT_EQUAL_INT(0, WEXITSTATUS(status));
+    TEST_ASSERT_EQUAL_INT(0, sh.last_status);
+
+    // Builtins that change the shell still get a subshell of their own
+    char before[PATH_MAX], after[PATH_MAX];
+    TEST_ASSERT_NOT_NULL(getcwd(before, sizeof(before)));
+    TEST_ASSERT_EQUAL_INT(0, pipeline_parse(&sh.line_arena, "exit 5 | cat", &pl));
+    TEST_ASSERT_EQUAL_INT(0, WEXITSTATUS(execute_pipeline(&sh, &pl)));
+    TEST_ASSERT_EQUAL_INT(0, pipeline_parse(&sh.line_arena, "cd / | cat", &pl));
+    TEST_ASSERT_EQUAL_INT(0, WEXITSTATUS(execute_pipeline(&sh, &pl)));
+    TEST_ASSERT_NOT_NULL(getcwd(after, sizeof(after)));
+    TEST_ASSERT_EQUAL_STRING(before, after);
+    TEST_ASSERT_FALSE(builtin_relays(&sh, "cd"));
+    TEST_ASSERT_TRUE(builtin_relays(&sh, "echo"));
+    sh_destroy(&sh);
+}
+
+static void run_redirections(struct shell *sh) {
+    char path[] = "/tmp/test-lab-XXXXXX";
+    int fd = mkstemp(path);
+    TEST_ASSERT_TRUE(fd != -1);
+    close(fd);
+
+    char line[256];
+    struct pipeline pl;
+    snprintf(line, sizeof(line), "tr a-z A-Z <<< 'here string' > %s", path);
+    TEST_ASSERT_EQUAL_INT(0, pipeline_parse(&sh->line_arena, line, &pl));
+    TEST_ASSERT_EQUAL_INT(0, WEXITSTATUS(execute_pipeline(sh, &pl)));
+    snprintf(line, sizeof(line), "sh -c 'echo err >&2' 2>>%s", path);
+    TEST_ASSERT_EQUAL_INT(0, pipeline_parse(&sh->line_arena, line, &pl));
+    TEST_ASSERT_EQUAL_INT(0, WEXITSTATUS(execute_pipeline(sh, &pl)));
+
+    char buf[64] = {0};
+    FILE *f = fopen(path, "r");
+    TEST_ASSERT_NOT_NULL(f);
+    TEST_ASSERT_EQUAL_INT(16, fread(buf, 1, sizeof(buf) - 1, f));
+    TEST_ASSERT_EQUAL_STRING("HERE STRING\nerr\n", buf);
+    fclose(f);
+    unlink(path);
+
+    TEST_ASSERT_EQUAL_INT(0, pipeline_parse(&sh->line_arena, "cat < /no/such/file", &pl));
+    TEST_ASSERT_EQUAL_INT(1, WEXITSTATUS(execute_pipeline(sh, &pl)));
+    arena_reset(&sh->line_arena);
+}
+
+void test_redirections_fork(void) {
+    struct shell sh;
+    test_shell(&sh);
+    run_redirections(&sh);
+    sh_destroy(&sh);
+}
+
+void test_redirections_spawn(void) {
+    struct shell sh;
+    test_shell(&sh);
+    TEST_ASSERT_EQUAL_INT(0, sh_set_option(&sh, "spawn", true));
+    TEST_ASSERT_EQUAL_INT(0, sh_set_option(&sh, "prealloc=64K", true));
+    TEST_ASSERT_EQUAL_INT(65536, sh.redir_prealloc);
+    TEST_ASSERT_EQUAL_INT(-1, sh_set_option(&sh, "prealloc=12Q", true));
+    run_redirections(&sh);
+    sh_destroy(&sh);
+}
+
+void test_execute_command_spawn(void) {
+    struct shell sh;
+    test_shell(&sh);
+    TEST_ASSERT_EQUAL_INT(0, sh_set_option(&sh, "spawn", true));
+    TEST_ASSERT_EQUAL_INT(-1, sh_set_option(&sh, "no-such-option", true));
+    run_launch_backends(&sh);
+    sh_destroy(&sh);
+}
+
+void test_pipeline_background(void) {
+    struct arena a;
+    struct pipeline pl;
+    arena_init(&a, 0);
+    TEST_ASSERT_EQUAL_INT(0, pipeline_parse(&a, "sleep 1 | cat  &", &pl));
+    TEST_ASSERT_TRUE(pl.background);
+    TEST_ASSERT_EQUAL_size_t(2, pl.n);
+    TEST_ASSERT_EQUAL_STRING("sleep 1 | cat", pl.text);
+    TEST_ASSERT_EQUAL_INT(0, pipeline_parse(&a, "ls", &pl));
+    TEST_ASSERT_FALSE(pl.background);
+    TEST_ASSERT_EQUAL_INT(-1, pipeline_parse(&a, "&", &pl));
+    TEST_ASSERT_EQUAL_INT(-1, pipeline_parse(&a, "sleep 1 & ls", &pl));
+    TEST_ASSERT_EQUAL_INT(-1, pipeline_parse(&a, "ls | &", &pl));
+    arena_destroy(&a);
+}
+
+void test_background_jobs(void) {
+    struct shell sh;
+    struct pipeline pl;
+    test_shell(&sh);
+
+    TEST_ASSERT_EQUAL_INT(0, pipeline_parse(&sh.line_arena, "sh -c 'exit 3' &", &pl));
+    TEST_ASSERT_EQUAL_INT(0, execute_pipeline(&sh, &pl));
+    TEST_ASSERT_EQUAL_INT(0, pipeline_parse(&sh.line_arena, "sleep 10 | cat &", &pl));
+    TEST_ASSERT_EQUAL_INT(0, execute_pipeline(&sh, &pl));
+    TEST_ASSERT_EQUAL_size_t(2, sh.jobs.n);
+    TEST_ASSERT_EQUAL_INT(2, sh.jobs.current);
+    TEST_ASSERT_EQUAL_INT(1, sh.jobs.previous);
+
+    char *wait1[] = {"wait", "%1", NULL};
+    TEST_ASSERT_TRUE(do_builtin(&sh, wait1));
+    TEST_ASSERT_EQUAL_INT(3, sh.last_status);
+    TEST_ASSERT_EQUAL_size_t(1, sh.jobs.n);
+
+    char *kill2[] = {"kill", "-s", "TERM", "%sleep", NULL};
+    TEST_ASSERT_TRUE(do_builtin(&sh, kill2));
+    TEST_ASSERT_EQUAL_INT(0, sh.last_status);
+    char *wait2[] = {"wait", "%+", NULL};
+    TEST_ASSERT_TRUE(do_builtin(&sh, wait2));
+    TEST_ASSERT_EQUAL_INT(128 + SIGTERM, sh.last_status);   // the whole group got it
+    TEST_ASSERT_EQUAL_size_t(0, sh.jobs.n);
+
+    TEST_ASSERT_TRUE(do_builtin(&sh, wait2));
+    TEST_ASSERT_EQUAL_INT(127, sh.last_status);
+    char *bad[] = {"kill", "-NOSUCHSIG", "1", NULL};
+    TEST_ASSERT_TRUE(do_builtin(&sh, bad));
+    TEST_ASSERT_EQUAL_INT(1, sh.last_status);
+    sh_destroy(&sh);
+}
+
+void test_parallel(void) {
+    struct shell sh;
+    test_shell(&sh);
+    char args[] = "/tmp/test-lab-XXXXXX";
+    int fd = mkstemp(args);
+    TEST_ASSERT_TRUE(fd != -1);
+    TEST_ASSERT_EQUAL_INT(7, write(fd, "0\n3\n\n0\n", 7));
+    close(fd);
+
+    char *ok[] = {"parallel", "-j", "2", "-a", args, "sh", "-c", "exit {}", NULL};
+    TEST_ASSERT_TRUE(do_builtin(&sh, ok));
+    TEST_ASSERT_EQUAL_INT(1, sh.last_status);   // one of three failed
+    char *missing[] = {"parallel", "-a", args, "/no/such/program", NULL};
+    TEST_ASSERT_TRUE(do_builtin(&sh, missing));
+    TEST_ASSERT_EQUAL_INT(3, sh.last_status);
+    char *usage[] = {"parallel", "-j", "0", "true", NULL};
+    TEST_ASSERT_TRUE(do_builtin(&sh, usage));
+    TEST_ASSERT_EQUAL_INT(2, sh.last_status);
+    unlink(args);
+    sh_destroy(&sh);
+}
+
+void test_histdb(void) {
+    char path[] = "/tmp/test-lab-XXXXXX";
+    int fd = mkstemp(path);
+    TEST_ASSERT_TRUE(fd != -1);
+    close(fd);
+
+    struct histdb a, b;
+    struct hist_entry e;
+    TEST_ASSERT_EQUAL_INT(0, histdb_open(&a, path));
+    TEST_ASSERT_EQUAL_INT(0, histdb_open(&b, path));
+    TEST_ASSERT_EQUAL_INT(0, histdb_append(&a, "make check", "/src", 1000, 250, 0));
+    TEST_ASSERT_EQUAL_INT(0, histdb_append(&b, "git status", "/src", 2000, 10, 0));
+    // a learns about b's append only once it looks at the file again
+    TEST_ASSERT_EQUAL_size_t(1, a.n);
+    TEST_ASSERT_EQUAL_INT(0, histdb_refresh(&a));
+    TEST_ASSERT_EQUAL_size_t(2, a.n);
+    TEST_ASSERT_EQUAL_INT(0, histdb_append(&a, "mak", "/", 3000, 5, 127));
+    TEST_ASSERT_EQUAL_size_t(3, a.n);
+    TEST_ASSERT_EQUAL_INT(0, histdb_get(&a, 1, &e));
+    TEST_ASSERT_EQUAL_STRING_LEN("git status", e.line, e.len);
+    TEST_ASSERT_EQUAL_STRING_LEN("/src", e.cwd, e.cwd_len);
+    TEST_ASSERT_EQUAL_INT(2000, e.start_us);
+    TEST_ASSERT_EQUAL_INT(10, e.duration_us);
+    TEST_ASSERT_EQUAL_INT(-1, histdb_get(&a, 3, &e));
+
+    TEST_ASSERT_EQUAL_INT(2, histdb_search(&a, "mak", true, a.n));
+    TEST_ASSERT_EQUAL_INT(0, histdb_search(&a, "make", true, a.n));
+    TEST_ASSERT_EQUAL_INT(0, histdb_search(&a, "mak", true, 2));
+    TEST_ASSERT_EQUAL_INT(1, histdb_search(&a, "stat", false, a.n));
+    TEST_ASSERT_EQUAL_INT(-1, histdb_search(&a, "stat", true, a.n));
+    histdb_close(&a);
+    histdb_close(&b);
+
+    // Everything is still there for the next shell
+    TEST_ASSERT_EQUAL_INT(0, histdb_open(&a, path));
+    TEST_ASSERT_EQUAL_size_t(3, a.n);
+    TEST_ASSERT_EQUAL_INT(0, histdb_get(&a, 2, &e));
+    TEST_ASSERT_EQUAL_INT(127, e.status);
+    histdb_close(&a);
+
+    // A record torn by a crash is skipped, later appends are still found
+    fd = open(path, O_WRONLY | O_APPEND);
+    TEST_ASSERT_EQUAL_INT(20, write(fd, "\xf1\x48\x4c\xfe\xff\x00\x00\x00garbage-tail", 20));
+    close(fd);
+    TEST_ASSERT_EQUAL_INT(0, histdb_open(&a, path));
+    TEST_ASSERT_EQUAL_INT(0, histdb_append(&a, "after crash", "/", 4000, 1, 0));
+    TEST_ASSERT_EQUAL_size_t(4, a.n);
+    TEST_ASSERT_EQUAL_INT(3, histdb_search(&a, "crash", false, a.n));
+    histdb_close(&a);
+
+    // Searches walk the trigram lists newest first, short patterns go
+    // through the slots
+    TEST_ASSERT_EQUAL_INT(0, histdb_open(&a, path));
+    char line[32];
+    for (int i = 0; i < 300; i++) {
+        snprintf(line, sizeof(line), "%s %d", i % 2 ? "ls" : "cmd", i);
+        TEST_ASSERT_EQUAL_INT(0, histdb_append(&a, line, "/", i, 0, 0));
+    }
+    struct hist_search s;
+    ssize_t at, last = (ssize_t)a.n;
+    size_t hits = 0;
+    histdb_search_start(&a, &s, "d 1", false, a.n);
+    while ((at = histdb_search_next(&a, &s)) != -1) {
+        TEST_ASSERT_TRUE(at < last);
+        TEST_ASSERT_EQUAL_INT(0, histdb_get(&a, (size_t)at, &e));
+        TEST_ASSERT_EQUAL_INT(0, strncmp(e.line, "cmd 1", 5));
+        last = at;
+        hits++;
+    }
+    // cmd 10 to cmd 18 and cmd 100 to cmd 198, the even ones
+    TEST_ASSERT_EQUAL_size_t(5 + 50, hits);
+    TEST_ASSERT_EQUAL_INT(4 + 299, histdb_search(&a, "ls", true, a.n));
+    TEST_ASSERT_EQUAL_INT(4 + 298, histdb_search(&a, "cmd 2", true, a.n));
+    TEST_ASSERT_EQUAL_INT(4 + 290, histdb_search(&a, "9", false, 4 + 291));
+    TEST_ASSERT_EQUAL_INT(-1, histdb_search(&a, "cmd 1", true, 4 + 10));
+    histdb_close(&a);
+
+    // Lost index files are rebuilt from the log
+    char side[sizeof(path) + 4];
+    snprintf(side, sizeof(side), "%s.tri", path);
+    TEST_ASSERT_EQUAL_INT(0, unlink(side));
+    TEST_ASSERT_EQUAL_INT(0, histdb_open(&a, path));
+    TEST_ASSERT_EQUAL_size_t(304, a.n);
+    TEST_ASSERT_EQUAL_INT(4 + 298, histdb_search(&a, "cmd 2", true, a.n));
+
+    // Another program truncating the log costs entries, not a fault
+    TEST_ASSERT_EQUAL_INT(0, histdb_open(&b, path));
+    TEST_ASSERT_EQUAL_INT(0, truncate(path, 8));
+    TEST_ASSERT_EQUAL_INT(-1, histdb_get(&b, 100, &e));
+    TEST_ASSERT_EQUAL_INT(-1, histdb_search(&b, "cmd 1", false, b.n));
+    TEST_ASSERT_EQUAL_INT(0, histdb_refresh(&a));
+    TEST_ASSERT_EQUAL_size_t(0, a.n);
+    TEST_ASSERT_EQUAL_INT(0, histdb_append(&a, "fresh start", "/", 5000, 1, 0));
+    // b picks up the index a rebuilt
+    TEST_ASSERT_EQUAL_INT(0, histdb_refresh(&b));
+    TEST_ASSERT_EQUAL_size_t(1, b.n);
+    TEST_ASSERT_EQUAL_INT(0, histdb_search(&b, "start", false, b.n));
+    histdb_close(&a);
+    histdb_close(&b);
+    unlink(path);
+    unlink(side);
+    snprintf(side, sizeof(side), "%s.idx", path);
+    unlink(side);
+
+    // Files that are not history files are left alone
+    TEST_ASSERT_EQUAL_INT(-1, histdb_open(&a, "/etc/passwd"));
+}
+
+void test_script_reader(void) {
+    struct arena a;
+    struct script sc;
+    arena_init(&a, 0);
+
+    script_open_string(&sc, "# comment\n\n  echo one\n\t# indented\nls -l");
+    TEST_ASSERT_EQUAL_STRING("echo one", script_next(&sc, &a));
+    TEST_ASSERT_EQUAL_size_t(3, sc.line_no);
+    TEST_ASSERT_EQUAL_STRING("ls -l", script_next(&sc, &a));
+    TEST_ASSERT_EQUAL_size_t(5, sc.line_no);
+    TEST_ASSERT_NULL(script_next(&sc, &a));
+    script_close(&sc);
+
+    // A pipe is streamed, the long line forces the buffer to grow
+    size_t big = 200 * 1024;
+    char *line = malloc(big + 1);
+    TEST_ASSERT_NOT_NULL(line);
+    memset(line, 'x', big);
+    line[big] = '\0';
+    int p[2];
+    TEST_ASSERT_EQUAL_INT(0, pipe(p));
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(p[0]);
+        FILE *f = fdopen(p[1], "w");
+        fprintf(f, "first\n%s\nlast\n", line);
+        fclose(f);
+        _exit(0);
+    }
+    close(p[1]);
+    TEST_ASSERT_EQUAL_INT(0, script_open_fd(&sc, p[0]));
+    TEST_ASSERT_FALSE(sc.mapped);
+    TEST_ASSERT_EQUAL_STRING("first", script_next(&sc, &a));
+    TEST_ASSERT_EQUAL_STRING(line, script_next(&sc, &a));
+    TEST_ASSERT_EQUAL_STRING("last", script_next(&sc, &a));
+    TEST_ASSERT_NULL(script_next(&sc, &a));
+    script_close(&sc);
+    close(p[0]);
+    waitpid(pid, NULL, 0);
+    free(line);
+
+    // A regular file is mapped and its offset follows the lines read
+    char path[] = "/tmp/test-lab-XXXXXX";
+    int fd = mkstemp(path);
+    TEST_ASSERT_EQUAL_INT(12, write(fd, "pwd\ntrue\nid", 12));
+    lseek(fd, 0, SEEK_SET);
+    TEST_ASSERT_EQUAL_INT(0, script_open_fd(&sc, fd));
+    TEST_ASSERT_TRUE(sc.mapped);
+    TEST_ASSERT_EQUAL_STRING("pwd", script_next(&sc, &a));
+    TEST_ASSERT_EQUAL_INT(4, lseek(fd, 0, SEEK_CUR));
+    TEST_ASSERT_EQUAL_STRING("true", script_next(&sc, &a));
+    TEST_ASSERT_EQUAL_STRING("id", script_next(&sc, &a));
+    TEST_ASSERT_NULL(script_next(&sc, &a));
+    script_close(&sc);
+    close(fd);
+    unlink(path);
+    TEST_ASSERT_EQUAL_INT(-1, script_open_file(&sc, "/no/such/script"));
+    arena_destroy(&a);
+}
+
+void test_pipeline_time(void) {
+    struct arena a;
+    struct pipeline pl;
+    arena_init(&a, 0);
+    TEST_ASSERT_EQUAL_INT(0, pipeline_parse(&a, "time -p sleep 1 | cat", &pl));
+    TEST_ASSERT_EQUAL_INT(PL_TIME | PL_TIME_POSIX, pl.time);
+    TEST_ASSERT_EQUAL_size_t(2, pl.n);
+    TEST_ASSERT_EQUAL_STRING("sleep", pl.stages[0].argv[0]);
+    TEST_ASSERT_EQUAL_INT(0, pipeline_parse(&a, "time -pe -- -x", &pl));
+    TEST_ASSERT_EQUAL_INT(PL_TIME | PL_TIME_POSIX | PL_TIME_COUNTERS, pl.time);
+    TEST_ASSERT_EQUAL_STRING("-x", pl.stages[0].argv[0]);
+    TEST_ASSERT_EQUAL_INT(0, pipeline_parse(&a, "time", &pl));
+    TEST_ASSERT_EQUAL_INT(PL_TIME, pl.time);
+    TEST_ASSERT_EQUAL_size_t(0, pl.n);
+    // Only an unquoted time in front is the keyword
+    TEST_ASSERT_EQUAL_INT(0, pipeline_parse(&a, "'time' ls", &pl));
+    TEST_ASSERT_EQUAL_INT(0, pl.time);
+    TEST_ASSERT_EQUAL_INT(0, pipeline_parse(&a, "ls | time cat", &pl));
+    TEST_ASSERT_EQUAL_INT(0, pl.time);
+    TEST_ASSERT_EQUAL_STRING("time", pl.stages[1].argv[0]);
+    arena_destroy(&a);
+}
+
+void test_time_report(void) {
+    struct time_report tr = {
+        .real = 61.5, .user = 0.25, .sys = 0.125, .maxrss = 2048, .majflt = 1, .minflt = 2,
+        .nvcsw = 3, .nivcsw = 4,
+    };
+    char *out = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&out, &len);
+    time_print(f, "%R|%2U|%lR|%1lS|%M|%F|%f|%w|%c|%y|%%|%q|%", &tr);
+    tr.have_counters = true;
+    tr.counters[TIME_INSTRUCTIONS] = 42;
+    time_print(f, "%i\\t%3i", &tr);
+    fclose(f);
+    TEST_ASSERT_EQUAL_STRING("61.500|0.25|1m1.500s|0m0.1s|2048|1|2|3|4|-|%|%q|%\n42\t42\n", out);
+    free(out);
+    TEST_ASSERT_TRUE(time_format_counters("%3ly"));
+    TEST_ASSERT_FALSE(time_format_counters("%%y %R"));
+
+    // Children are accounted for once they were reaped
+    struct shell sh;
+    struct time_probe tp;
+    char **cmd = cmd_parse("sleep 0.1");
+    test_shell(&sh);
+    time_start(&sh, &tp, false);
+    execute_command(&sh, cmd);
+    time_stop(&sh, &tp, &tr);
+    TEST_ASSERT_TRUE(tr.real >= 0.1);
+    TEST_ASSERT_TRUE(tr.maxrss > 0);
+    TEST_ASSERT_TRUE(tr.minflt > 0);
+    TEST_ASSERT_FALSE(tr.have_counters);
+    cmd_free(cmd);
+    sh_destroy(&sh);
+}
+
+/** Run a builtin with stdout going to a file, its output ends up in out. */
+static int capture_builtin(struct shell *sh, char **argv, char *out, size_t size) {
+    FILE *tmp = tmpfile();
+    TEST_ASSERT_NOT_NULL(tmp);
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    dup2(fileno(tmp), STDOUT_FILENO);
+    TEST_ASSERT_TRUE(do_builtin(sh, argv));
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    rewind(tmp);
+    size_t n = fread(out, 1, size - 1, tmp);
+    out[n] = '\0';
+    fclose(tmp);
+    return sh->last_status;
+}
+
+void test_builtin_echo_printf(void) {
+    struct shell sh;
+    char out[256];
+    test_shell(&sh);
+
+    char *echo1[] = {"echo", "-n", "a", "b", NULL};
+    TEST_ASSERT_EQUAL_INT(0, capture_builtin(&sh, echo1, out, sizeof(out)));
+    TEST_ASSERT_EQUAL_STRING("a b", out);
+    char *echo2[] = {"echo", "-e", "x\\ty\\0101\\x42", "z\\cgone", "never", NULL};
+    capture_builtin(&sh, echo2, out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("x\tyAB z", out);
+    char *echo3[] = {"echo", "-nx", "\\t", NULL};
+    capture_builtin(&sh, echo3, out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("-nx \\t\n", out);
+
+    char *pf1[] = {"printf", "%s=%03d %-3s|%x %.1f%%\\n", "a", "7", "b", "255", "2.25", "c", "8", NULL};
+    TEST_ASSERT_EQUAL_INT(0, capture_builtin(&sh, pf1, out, sizeof(out)));
+    TEST_ASSERT_EQUAL_STRING("a=007 b  |ff 2.2%\nc=008    |0 0.0%\n", out);
+    char *pf2[] = {"printf", "[%*s][%b][%c]\\101", "4", "x", "1\\n2", "yz", NULL};
+    capture_builtin(&sh, pf2, out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("[   x][1\n2][y]A", out);
+    char *pf3[] = {"printf", "%d|%d", "'a", "12x", NULL};
+    TEST_ASSERT_EQUAL_INT(1, capture_builtin(&sh, pf3, out, sizeof(out)));
+    TEST_ASSERT_EQUAL_STRING("97|12", out);
+    char *pf4[] = {"printf", NULL};
+    TEST_ASSERT_EQUAL_INT(2, capture_builtin(&sh, pf4, out, sizeof(out)));
+    sh_destroy(&sh);
+}
+
+/** Exit status of test with the given arguments. */
+static int run_test_builtin(struct shell *sh, char **argv) {
+    TEST_ASSERT_TRUE(do_builtin(sh, argv));
+    return sh->last_status;
+}
+
+void test_builtin_test(void) {
+    struct shell sh;
+    test_shell(&sh);
+    char *t1[] = {"test", "abc", "=", "abc", NULL};
+    TEST_ASSERT_EQUAL_INT(0, run_test_builtin(&sh, t1));
+    char *t2[] = {"[", "3", "-lt", "2", "]", NULL};
+    TEST_ASSERT_EQUAL_INT(1, run_test_builtin(&sh, t2));
+    char *t3[] = {"[", "-d", "/", "-a", "!", "-f", "/", "]", NULL};
+    TEST_ASSERT_EQUAL_INT(0, run_test_builtin(&sh, t3));
+    char *t4[] = {"test", "(", "", ")", "-o", "-n", "x", NULL};
+    TEST_ASSERT_EQUAL_INT(0, run_test_builtin(&sh, t4));
+    // By argument count = is a string here, not an operator
+    char *t5[] = {"test", "=", NULL};
+    TEST_ASSERT_EQUAL_INT(0, run_test_builtin(&sh, t5));
+    char *t6[] = {"test", "!", "=", "=", "=", NULL};
+    TEST_ASSERT_EQUAL_INT(1, run_test_builtin(&sh, t6));
+    char *t7[] = {"test", NULL};
+    TEST_ASSERT_EQUAL_INT(1, run_test_builtin(&sh, t7));
+    char *e1[] = {"[", "1", "-eq", "1", NULL};
+    TEST_ASSERT_EQUAL_INT(2, run_test_builtin(&sh, e1));
+    char *e2[] = {"test", "x", "-gt", "1", NULL};
+    TEST_ASSERT_EQUAL_INT(2, run_test_builtin(&sh, e2));
+    char *e3[] = {"test", "a", "b", "c", "d", "e", NULL};
+    TEST_ASSERT_EQUAL_INT(2, run_test_builtin(&sh, e3));
+    char *t8[] = {"false", NULL};
+    TEST_ASSERT_EQUAL_INT(1, run_test_builtin(&sh, t8));
+    char *t9[] = {"true", "ignored", NULL};
+    TEST_ASSERT_EQUAL_INT(0, run_test_builtin(&sh, t9));
+    sh_destroy(&sh);
+}
+
+void test_builtin_pwd_sleep(void) {
+    struct shell sh;
+    char out[PATH_MAX + 2], cwd[PATH_MAX];
+    test_shell(&sh);
+    TEST_ASSERT_NOT_NULL(getcwd(cwd, sizeof(cwd)));
+    strcat(cwd, "\n");
+    char *pwd[] = {"pwd", "-P", NULL};
+    TEST_ASSERT_EQUAL_INT(0, capture_builtin(&sh, pwd, out, sizeof(out)));
+    TEST_ASSERT_EQUAL_STRING(cwd, out);
+
+    struct timespec a, b;
+    char *sleep1[] = {"sleep", "0.03", "0.02s", NULL};
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    TEST_ASSERT_EQUAL_INT(0, run_test_builtin(&sh, sleep1));
+    clock_gettime(CLOCK_MONOTONIC, &b);
+    TEST_ASSERT_TRUE((b.tv_sec - a.tv_sec) * 1000000000L + (b.tv_nsec - a.tv_nsec) >= 50000000L);
+    char *sleep2[] = {"sleep", "1x", NULL};
+    TEST_ASSERT_EQUAL_INT(1, run_test_builtin(&sh, sleep2));
+    sh_destroy(&sh);
+}
+
+static int registered_calls;
+
+/** A builtin as an embedding program would add it. */
+static int test_registered(struct shell *sh, char **argv) {
+    UNUSED(sh)
+    registered_calls++;
+    return argv[1] ? atoi(argv[1]) : 0;
+}
+
+void test_register_builtin(void) {
+    struct shell sh;
+    struct pipeline pl;
+    test_shell(&sh);
+    TEST_ASSERT_TRUE(is_builtin(&sh, "["));
+    TEST_ASSERT_FALSE(is_builtin(&sh, "mybuiltin"));
+    TEST_ASSERT_NULL(builtin_lookup(&sh, NULL));
+
+    TEST_ASSERT_EQUAL_INT(0, sh_register_builtin(&sh, "mybuiltin", test_registered));
+    char *run[] = {"mybuiltin", "7", NULL};
+    TEST_ASSERT_TRUE(do_builtin(&sh, run));
+    TEST_ASSERT_EQUAL_INT(7, sh.last_status);
+    TEST_ASSERT_EQUAL_INT(1, registered_calls);
+
+    // Shadows the compiled in echo, and works as a stage of a pipeline
+    TEST_ASSERT_EQUAL_INT(0, sh_register_builtin(&sh, "echo", test_registered));
+    char *echo[] = {"echo", "3", NULL};
+    TEST_ASSERT_TRUE(do_builtin(&sh, echo));
+    TEST_ASSERT_EQUAL_INT(3, sh.last_status);
+    TEST_ASSERT_EQUAL_INT(0, pipeline_parse(&sh.line_arena, "mybuiltin 5 | mybuiltin 4", &pl));
+    int status = execute_pipeline(&sh, &pl);
+    TEST_ASSERT_EQUAL_INT(4, WEXITSTATUS(status));
+
+    // Growing keeps every earlier entry
+    char name[16];
+    for (int i = 0; i < 100; i++) {
+        snprintf(name, sizeof(name), "cmd%d", i);
+        TEST_ASSERT_EQUAL_INT(0, sh_register_builtin(&sh, name, test_registered));
+    }
+    TEST_ASSERT_EQUAL_size_t(102, sh.builtins.n);
+    TEST_ASSERT_TRUE(is_builtin(&sh, "cmd0"));
+    TEST_ASSERT_TRUE(is_builtin(&sh, "cmd99"));
+    TEST_ASSERT_TRUE(is_builtin(&sh, "mybuiltin"));
+    TEST_ASSERT_TRUE(is_builtin(&sh, "cd"));
+    TEST_ASSERT_FALSE(is_builtin(&sh, "cmd100"));
+
+    TEST_ASSERT_EQUAL_INT(-1, sh_register_builtin(&sh, "", test_registered));
+    TEST_ASSERT_EQUAL_INT(-1, sh_register_builtin(&sh, "a/b", test_registered));
+    TEST_ASSERT_EQUAL_INT(-1, sh_register_builtin(&sh, "x", NULL));
+    sh_destroy(&sh);
+}
+
+void test_program_parse(void) {
+    struct program *p;
+    const char *ok[] = {
+        "", "# only a comment", "echo a; echo b &", "a && b || ! c",
+        "if a; then b; elif c; then d; else e; fi",
+        "for i in 1 2; do echo $i; done", "for i do :; done",
+        "while a\ndo b\ndone > f", "until a; do b; done",
+        "case $x in a|b) x;; (c) ;; *) y ; esac", "f() { a | b; }", "function g { :; }",
+        "( a; b ) | { c; } 2>&1", "time -p { a; }", "echo \"it's\" 'a \"b\"'",
+    };
+    for (size_t i = 0; i < sizeof(ok) / sizeof(ok[0]); i++) {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(0, program_parse(ok[i], strlen(ok[i]), &p), ok[i]);
+        TEST_ASSERT_NOT_NULL(p);
+        program_unref(p);
+    }
+
+    const char *more[][2] = {
+        {"echo a |", "1"}, {"a &&", "1"}, {"echo \\", "1"}, {"echo 'abc", "2"}, {"echo \"a", "2"},
+        {"if true; then", "3"}, {"for i in 1 2; do echo", "3"}, {"f() {", "3"}, {"( a", "3"},
+        {"case x in", "3"}, {"cat <<EOF", "1"}, {"cat <<EOF\nbody\nEOFX", "1"}, {"cat <<'EOF", "2"},
+    };
+    for (size_t i = 0; i < sizeof(more) / sizeof(more[0]); i++) {
+        int rc = program_parse(more[i][0], strlen(more[i][0]), &p);
+        TEST_ASSERT_EQUAL_INT_MESSAGE(more[i][1][0] - '0', rc, more[i][0]);
+        TEST_ASSERT_NULL(p);
+    }
+
+    const char *bad[] = {"fi", "if a; then fi", "a | | b", "done", "echo ;;", "f() a", "cat << ;"};
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+        TEST_ASSERT_EQUAL_INT_MESSAGE(PARSE_ERROR, program_parse(bad[i], strlen(bad[i]), &p), bad[i]);
+
+    // Lines that cannot close a compound command are not worth a parse
+    TEST_ASSERT_FALSE(parse_may_complete(PARSE_MORE_CLOSE, "echo more"));
+    TEST_ASSERT_TRUE(parse_may_complete(PARSE_MORE_CLOSE, "done"));
+    TEST_ASSERT_FALSE(parse_may_complete(PARSE_MORE_QUOTE, "no quote here"));
+    TEST_ASSERT_TRUE(parse_may_complete(PARSE_MORE, "anything"));
+}
+
+/** Parse and run src with stdout going to a file, its output ends up in out. */
+static int capture_program(struct shell *sh, const char *src, char *out, size_t size) {
+    struct program *p;
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, program_parse(src, strlen(src), &p), src);
+    FILE *tmp = tmpfile();
+    TEST_ASSERT_NOT_NULL(tmp);
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    dup2(fileno(tmp), STDOUT_FILENO);
+    program_run(sh, p);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    program_unref(p);
+    rewind(tmp);
+    size_t n = fread(out, 1, size - 1, tmp);
+    out[n] = '\0';
+    fclose(tmp);
+    arena_reset(&sh->line_arena);
+    return sh->last_status;
+}
+
+void test_vm_control_flow(void) {
+    struct shell sh;
+    char out[512];
+    test_shell(&sh);
+    char *args[] = {"x", "y", "z", NULL};
+    sh.vm.argv = args;
+    sh.vm.argc = 3;
+
+    capture_program(&sh, "for i in 1 2 3; do if [ $i = 1 ]; then echo one; elif [ $i = 2 ]; then "
+                         "echo two; else echo \"other $i\"; fi; done", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("one\ntwo\nother 3\n", out);
+
+    // while and until leave with the status of the last pass, shift walks $@
+    TEST_ASSERT_EQUAL_INT(0, capture_program(&sh, "while [ $# -gt 0 ]; do echo $1; shift; done; "
+                                                  "until true; do :; done", out, sizeof(out)));
+    TEST_ASSERT_EQUAL_STRING("x\ny\nz\n", out);
+    TEST_ASSERT_EQUAL_size_t(0, sh.vm.argc);
+
+    capture_program(&sh, "for a in 1 2 3; do for b in x y; do [ $b = y ] && continue 2; "
+                         "[ $a = 3 ] && break 2; echo $a$b; done; done; echo end", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("1x\n2x\nend\n", out);
+
+    capture_program(&sh, "case foo.c in *.h) echo h;; *.c | *.cc) echo c;; *) echo any;; esac; "
+                         "case '*' in \"*\") echo star;; esac; case x in y) ;; esac; echo $?",
+                    out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("c\nstar\n0\n", out);
+
+    TEST_ASSERT_EQUAL_INT(1, capture_program(&sh, "true && false || echo or; ! true; echo $?; "
+                                                  "false && echo never; false", out, sizeof(out)));
+    TEST_ASSERT_EQUAL_STRING("or\n1\n", out);
+
+    // A redirected loop applies its redirection once and still breaks out
+    char path[] = "/tmp/lab-vm-XXXXXX";
+    int fd = mkstemp(path);
+    TEST_ASSERT_TRUE(fd != -1);
+    close(fd);
+    char src[256];
+    snprintf(src, sizeof(src), "while true; do echo in; break; echo never; done > %s; cat %s", path, path);
+    capture_program(&sh, src, out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("in\n", out);
+    unlink(path);
+
+    // Nothing a loop expands stays in the line arena
+    const char *loop = "for i in 1 2 3 4 5 6 7 8; do for j in a b c d; do : $i $j; done; done";
+    struct program *p;
+    TEST_ASSERT_EQUAL_INT(0, program_parse(loop, strlen(loop), &p));
+    TEST_ASSERT_NOT_NULL(arena_alloc(&sh.line_arena, 1));
+    struct arena_mark before = arena_mark(&sh.line_arena);
+    program_run(&sh, p);
+    struct arena_mark after = arena_mark(&sh.line_arena);
+    TEST_ASSERT_TRUE(before.chunk == after.chunk && before.used == after.used);
+    TEST_ASSERT_EQUAL_size_t(0, sh.vm.nframes);
+    program_unref(p);
+    sh_destroy(&sh);
+}
+
+void test_vm_functions(void) {
+    struct shell sh;
+    char out[512];
+    test_shell(&sh);
+
+    TEST_ASSERT_EQUAL_INT(3, capture_program(&sh, "f() { echo \"f:$#:$1\"; return 3; echo never; }; "
+                                                  "f a b; echo $?; f", out, sizeof(out)));
+    TEST_ASSERT_EQUAL_STRING("f:2:a\n3\nf:0:\n", out);
+    TEST_ASSERT_NOT_NULL(vm_function(&sh, "f"));
+    TEST_ASSERT_NULL(vm_function(&sh, "g"));
+
+    // Functions outlive the program that defined them and can be redefined
+    capture_program(&sh, "function f { for a in \"$@\"; do echo \"[$a]\"; done; }", out, sizeof(out));
+    capture_program(&sh, "f '1 2' 3; f", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("[1 2]\n[3]\n", out);
+
+    // Compound commands and functions as stages of a pipeline
+    capture_program(&sh, "up() { tr a-z A-Z; }; { echo ab; echo cd; } | up | while true; do cat; "
+                         "break; done", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("AB\nCD\n", out);
+    TEST_ASSERT_EQUAL_INT(4, capture_program(&sh, "( echo sub; exit 4 )", out, sizeof(out)));
+    TEST_ASSERT_EQUAL_STRING("sub\n", out);
+
+    // return and break where they mean nothing, and runaway recursion
+    TEST_ASSERT_EQUAL_INT(1, capture_program(&sh, "return", out, sizeof(out)));
+    TEST_ASSERT_EQUAL_INT(0, capture_program(&sh, "break", out, sizeof(out)));
+    TEST_ASSERT_EQUAL_INT(1, capture_program(&sh, "r() { r; }; r", out, sizeof(out)));
+    TEST_ASSERT_EQUAL_INT(0, sh.vm.depth);
+    sh_destroy(&sh);
+}
+
+/** Index of the envp entry equal to want, -1 if there is none. */
+static int env_index(char **envp, const char *want) {
+    for (int i = 0; envp[i]; i++)
+        if (strcmp(envp[i], want) == 0) return i;
+    return -1;
+}
+
+void test_vars(void) {
+    struct shell sh;
+    test_shell(&sh);
+    char *env[] = {"A=1", "B=two", "C=", "bogus", NULL};
+    TEST_ASSERT_EQUAL_INT(0, vars_import(&sh, env));
+    TEST_ASSERT_EQUAL_STRING("two", var_get(&sh, "B"));
+    TEST_ASSERT_EQUAL_STRING("", var_get(&sh, "C"));
+    TEST_ASSERT_NULL(var_get(&sh, "bogus"));
+
+    char **envp = vars_environ(&sh);
+    TEST_ASSERT_EQUAL_size_t(3, sh.vars.nenv);
+    int b = env_index(envp, "B=two");
+    TEST_ASSERT_TRUE(b >= 0 && env_index(envp, "A=1") >= 0 && env_index(envp, "C=") >= 0);
+
+    // Only changed entries are rewritten, untouched ones keep their string
+    char *kept = envp[b];
+    TEST_ASSERT_EQUAL_INT(0, var_set(&sh, "A", "3"));
+    TEST_ASSERT_EQUAL_INT(0, var_set(&sh, "local", "x"));
+    TEST_ASSERT_EQUAL_size_t(1, sh.vars.ndirty);
+    envp = vars_environ(&sh);
+    TEST_ASSERT_EQUAL_PTR(kept, envp[b]);
+    TEST_ASSERT_TRUE(env_index(envp, "A=3") >= 0);
+    TEST_ASSERT_EQUAL_INT(-1, env_index(envp, "local=x"));
+
+    // Unset and unexport drop entries, export adds one
+    TEST_ASSERT_EQUAL_INT(0, var_unset(&sh, "A"));
+    TEST_ASSERT_EQUAL_INT(0, var_flag(&sh, "C", 0, VAR_EXPORT));
+    TEST_ASSERT_EQUAL_INT(0, var_flag(&sh, "local", VAR_EXPORT, 0));
+    envp = vars_environ(&sh);
+    TEST_ASSERT_EQUAL_size_t(2, sh.vars.nenv);
+    TEST_ASSERT_TRUE(env_index(envp, "B=two") >= 0 && env_index(envp, "local=x") >= 0);
+    TEST_ASSERT_NULL(envp[2]);
+    TEST_ASSERT_NULL(var_get(&sh, "A"));
+    TEST_ASSERT_NOT_NULL(var_find(&sh, "A"));
+
+    // readonly refuses changes and unset
+    TEST_ASSERT_EQUAL_INT(0, var_flag(&sh, "B", VAR_READONLY, 0));
+    TEST_ASSERT_EQUAL_INT(-1, var_set(&sh, "B", "three"));
+    TEST_ASSERT_EQUAL_INT(-1, var_unset(&sh, "B"));
+    TEST_ASSERT_EQUAL_STRING("two", var_get(&sh, "B"));
+
+    // Temporary assignments come and go, even repeated ones
+    char *assigns[] = {"C=tmp", "N=new", "C=tmp2"};
+    struct var_scope scope;
+    TEST_ASSERT_EQUAL_INT(0, vars_push(&sh, assigns, 3, &scope));
+    TEST_ASSERT_EQUAL_STRING("tmp2", var_get(&sh, "C"));
+    TEST_ASSERT_TRUE(env_index(vars_environ(&sh), "N=new") >= 0);
+    vars_pop(&sh, &scope);
+    TEST_ASSERT_EQUAL_STRING("", var_get(&sh, "C"));
+    TEST_ASSERT_NULL(var_get(&sh, "N"));
+    TEST_ASSERT_EQUAL_INT(-1, env_index(vars_environ(&sh), "N=new"));
+    char *ro[] = {"N=1", "B=x"};
+    TEST_ASSERT_EQUAL_INT(-1, vars_push(&sh, ro, 2, &scope));
+    TEST_ASSERT_NULL(var_get(&sh, "N"));
+
+    // Growing the table keeps every variable and envp index
+    char name[16];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(name, sizeof(name), "V%d", i);
+        TEST_ASSERT_EQUAL_INT(0, var_set(&sh, name, name));
+        if (i % 3 == 0) var_flag(&sh, name, VAR_EXPORT, 0);
+    }
+    envp = vars_environ(&sh);
+    TEST_ASSERT_EQUAL_size_t(2 + 334, sh.vars.nenv);
+    TEST_ASSERT_EQUAL_STRING("V999", var_get(&sh, "V999"));
+    TEST_ASSERT_TRUE(env_index(envp, "V999=V999") >= 0);
+    TEST_ASSERT_EQUAL_INT(0, var_unset(&sh, "V0"));
+    envp = vars_environ(&sh);
+    for (size_t i = 0; i < sh.vars.nenv; i++)
+        TEST_ASSERT_EQUAL_INT((int)i, (int)var_find(&sh, sh.vars.env_names[i])->env);
+    sh_destroy(&sh);
+}
+
+void test_vm_assignments(void) {
+    struct shell sh;
+    char out[512];
+    test_shell(&sh);
+    char *env[] = {"PATH=/usr/bin:/bin", NULL};
+    TEST_ASSERT_EQUAL_INT(0, vars_import(&sh, env));
+
+    capture_program(&sh, "x=1 y=\"a b\"; echo \"$x:$y\"; for i in 1 2; do n=$i$x; done; echo $n",
+                    out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("1:a b\n21\n", out);
+    TEST_ASSERT_FALSE(var_find(&sh, "x")->flags & VAR_EXPORT);
+
+    // In front of a command a variable reaches only that command
+    capture_program(&sh, "V=only sh -c 'echo \"$V\"'; echo \"[$V]\"; export E=e; sh -c 'echo $E'; "
+                         "export -n E; sh -c 'echo \"<$E>\"'", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("only\n[]\ne\n<>\n", out);
+    capture_program(&sh, "f() { echo \"$T\"; }; T=tmp f; echo \"[$T]\"; unset -f f; unset T",
+                    out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("tmp\n[]\n", out);
+    TEST_ASSERT_NULL(vm_function(&sh, "f"));
+
+    // PATH is the shell's own, not the process environment's
+    TEST_ASSERT_EQUAL_INT(127, capture_program(&sh, "PATH=/nonexistent; sh -c true", out, sizeof(out)));
+    TEST_ASSERT_EQUAL_INT(0, capture_program(&sh, "PATH=/usr/bin:/bin; sh -c true", out, sizeof(out)));
+
+    TEST_ASSERT_EQUAL_INT(1, capture_program(&sh, "readonly R=1; R=2", out, sizeof(out)));
+    TEST_ASSERT_EQUAL_INT(1, capture_program(&sh, "export 1x", out, sizeof(out)));
+    capture_program(&sh, "export Q='a\"b'; export", out, sizeof(out));
+    TEST_ASSERT_NOT_NULL(strstr(out, "export Q=\"a\\\"b\"\n"));
+    sh_destroy(&sh);
+}
+
+void test_command_substitution(void) {
+    struct shell sh;
+    char out[512];
+    test_shell(&sh);
+    char *env[] = {"PATH=/usr/bin:/bin", NULL};
+    TEST_ASSERT_EQUAL_INT(0, vars_import(&sh, env));
+
+    capture_program(&sh, "echo $(echo a   b) `echo c` \"[$(printf 'x\\n\\n')]\" $(echo $(echo in))",
+                    out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("a b c [x] in\n", out);
+    capture_program(&sh, "echo \"$(echo \"it's\")\" '$(no)' \"\\$(no)\"; for i in $(echo 1 2); do echo $i; done",
+                    out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("it's $(no) $(no)\n1\n2\n", out);
+    capture_program(&sh, "f() { echo \"<$(echo $1)>\"; }; case $(f z) in '<z>') echo ok;; esac", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("ok\n", out);
+
+    // An assignment on its own takes the status of the substitution
+    TEST_ASSERT_EQUAL_INT(3, capture_program(&sh, "x=$(exit 3)", out, sizeof(out)));
+    TEST_ASSERT_EQUAL_INT(0, capture_program(&sh, "x=$(false) true", out, sizeof(out)));
+
+    // Output beyond a pooled buffer goes through a memfd
+    capture_program(&sh, "x=$(printf '%0200000d\\n\\n' 7); echo \"$x\" | wc -c", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("200001\n", out);
+    TEST_ASSERT_TRUE(sh.capture.nfree > 0);
+
+    struct program *p;
+    const char *more[] = {"echo $(echo a", "echo `ls", "echo \"$(echo \")"};
+    for (size_t i = 0; i < sizeof(more) / sizeof(more[0]); i++) {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(PARSE_MORE, program_parse(more[i], strlen(more[i]), &p), more[i]);
+        TEST_ASSERT_NULL(p);
+    }
+    TEST_ASSERT_EQUAL_INT(PARSE_ERROR, program_parse("echo $(fi)", 10, &p));
+    // Arithmetic is refused rather than run as a subshell, a space keeps one
+    const char *arith[] = {"echo $((1+2))", "echo \"$((1))\"", "x=$((2*3))"};
+    for (size_t i = 0; i < sizeof(arith) / sizeof(arith[0]); i++) {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(PARSE_ERROR, program_parse(arith[i], strlen(arith[i]), &p), arith[i]);
+        TEST_ASSERT_NULL(p);
+    }
+    capture_program(&sh, "echo $( (echo sub) )", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("sub\n", out);
+    sh_destroy(&sh);
+}
+
+void test_here_documents(void) {
+    struct shell sh;
+    char out[512];
+    test_shell(&sh);
+    char *env[] = {"PATH=/usr/bin:/bin", NULL};
+    TEST_ASSERT_EQUAL_INT(0, vars_import(&sh, env));
+
+    capture_program(&sh, "x=v\ncat <<EOF\n$x $(echo s) \\$x \\\nj \"q\" # c\nEOF\n"
+                         "cat <<-'E'; cat <<\"F\"\n\t\t$x\n\tE\n$x\nF\necho after",
+                    out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("v s $x j \"q\" # c\n$x\n$x\nafter\n", out);
+    capture_program(&sh, "f() {\n cat <<EOF\n<$1>\nEOF\n}\nf a; echo $(cat <<EOF\nin\nEOF\n)", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("<a>\nin\n", out);
+    capture_program(&sh, "while cat; do break; done <<EOF\nloop\nEOF", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("loop\n", out);
+
+    // Small bodies go through a pipe, big ones through a sealed memfd
+    capture_program(&sh, "readlink /proc/self/fd/0 <<EOF | cut -c1-5\nsmall\nEOF\n"
+                         "readlink /proc/self/fd/0 <<EOF | cut -d' ' -f1\n$(printf '%0100000d' 1)\nEOF\n"
+                         "wc -c <<EOF\n$(printf '%0100000d' 1)\nEOF\nwc -c <<< $(printf '%0100000d' 1)",
+                    out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("pipe:\n/memfd:lab-heredoc\n100001\n100001\n", out);
+    sh_destroy(&sh);
+}
+
+void test_affinity(void) {
+    struct shell sh;
+    char out[512];
+    test_shell(&sh);
+    char *env[] = {"PATH=/usr/bin:/bin", NULL};
+    TEST_ASSERT_EQUAL_INT(0, vars_import(&sh, env));
+
+    struct placement p;
+    TEST_ASSERT_EQUAL_INT(0, placement_parse(&sh, "0", &p));
+    TEST_ASSERT_TRUE(p.has_cpus && !p.has_node && p.cpus[0] == 1);
+    TEST_ASSERT_EQUAL_INT(0, placement_parse(&sh, "node0", &p));
+    TEST_ASSERT_TRUE(p.has_cpus && p.has_node && p.node == 0);
+    TEST_ASSERT_EQUAL_INT(0, placement_parse(&sh, "all", &p));
+    TEST_ASSERT_FALSE(p.has_cpus || p.has_node);
+    const char *bad[] = {"", "0-", "3-1", "1,,2", "5000", "node", "node99", "x"};
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+        TEST_ASSERT_EQUAL_INT_MESSAGE(-1, placement_parse(&sh, bad[i], &p), bad[i]);
+
+    // The prefix places one command and stays out of its environment
+    capture_program(&sh, "cpus=node0 head -1 /proc/self/numa_maps | grep -c prefer:0; "
+                         "cpus=0 sh -c 'echo \"[$cpus]\"'; head -1 /proc/self/numa_maps | grep -c prefer",
+                    out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("1\n[]\n0\n", out);
+    capture_program(&sh, "set -o zygote; affinity node0; head -1 /proc/self/numa_maps | grep -c prefer:0; "
+                         "affinity; affinity all; set +o zygote", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("1\nsession cpus=0 node=0\nnode0 cpus=0\n", out);
+    TEST_ASSERT_EQUAL_INT(1, capture_program(&sh, "cpus=4096 true", out, sizeof(out)));
+    TEST_ASSERT_EQUAL_INT(2, capture_program(&sh, "affinity 0 1", out, sizeof(out)));
+
+    // Spreading on a made up machine with two nodes of two CPUs
+    affinity_destroy(&sh.affinity);
+    struct affinity *a = &sh.affinity;
+    a->loaded = true;
+    a->allowed[0] = 0xf;
+    a->nodes = calloc(2, sizeof(*a->nodes));
+    TEST_ASSERT_NOT_NULL(a->nodes);
+    a->nodes[0] = (struct affinity_node){0, {0x3}};
+    a->nodes[1] = (struct affinity_node){1, {0xc}};
+    a->nnodes = 2;
+    TEST_ASSERT_FALSE(affinity_spread(&sh, &p));
+    sh.options[SH_OPT_SPREAD] = true;
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT_TRUE(affinity_spread(&sh, &p));
+        TEST_ASSERT_EQUAL_INT(i % 2, p.node);
+        TEST_ASSERT_EQUAL_UINT64(i % 2 ? 0xc : 0x3, p.cpus[0]);
+    }
+    // Within one node the jobs get a CPU each, going on from slot 3
+    TEST_ASSERT_EQUAL_INT(0, placement_parse(&sh, "node1", &a->session));
+    const uint64_t cpu[] = {0x8, 0x4, 0x8};
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT_TRUE(affinity_spread(&sh, &p));
+        TEST_ASSERT_TRUE(p.has_node && p.node == 1);
+        TEST_ASSERT_EQUAL_UINT64(cpu[i], p.cpus[0]);
+    }
+    sh_destroy(&sh);
+}
+
+void test_glob_match(void) {
+    TEST_ASSERT_TRUE(glob_match("*.log", "a.log"));
+    TEST_ASSERT_TRUE(glob_match("*.log", ".log"));
+    TEST_ASSERT_FALSE(glob_match("*.log", "a.log.1"));
+    TEST_ASSERT_TRUE(glob_match("a*b*c", "aXbYbZc"));
+    TEST_ASSERT_FALSE(glob_match("a*b*c", "aXbYbZ"));
+    TEST_ASSERT_TRUE(glob_match("?x?", "axb"));
+    TEST_ASSERT_FALSE(glob_match("?x?", "ax"));
+    TEST_ASSERT_TRUE(glob_match("[a-c]1", "b1"));
+    TEST_ASSERT_FALSE(glob_match("[!a-c]1", "b1"));
+    TEST_ASSERT_TRUE(glob_match("[]x]", "]"));
+    TEST_ASSERT_TRUE(glob_match("[[:digit:]][[:upper:]]", "7Q"));
+    TEST_ASSERT_TRUE(glob_match("\\*\\?", "*?"));
+    TEST_ASSERT_FALSE(glob_match("\\*", "a"));
+    TEST_ASSERT_TRUE(glob_match("[ab", "[ab"));
+
+    TEST_ASSERT_TRUE(glob_magic("a*", 2));
+    TEST_ASSERT_TRUE(glob_magic("[ab]", 4));
+    TEST_ASSERT_FALSE(glob_magic("[ab", 3));
+    TEST_ASSERT_FALSE(glob_magic("\\*x", 3));
+    TEST_ASSERT_FALSE(glob_magic("[", 1));
+}
+
+/** Join the matches of pattern dir/pat with spaces, the dir prefix left out. */
+static void glob_list(struct glob_cache *cache, const char *dir, const char *pat, char *out, size_t size) {
+    struct arena a;
+    struct glob_result r = {0};
+    char full[256];
+    arena_init(&a, 0);
+    snprintf(full, sizeof(full), "%s/%s", dir, pat);
+    TEST_ASSERT_EQUAL_INT(0, glob_expand(cache, &a, full, &r));
+    out[0] = '\0';
+    for (size_t i = 0; i < r.n; i++) {
+        TEST_ASSERT_EQUAL_INT(0, strncmp(r.v[i], dir, strlen(dir)));
+        snprintf(out + strlen(out), size - strlen(out), "%s%s", i ? " " : "", r.v[i] + strlen(dir) + 1);
+    }
+    free(r.v);
+    arena_destroy(&a);
+}
+
+void test_glob_expand(void) {
+    char dir[] = "/tmp/test-lab-XXXXXX", sub[64], deep[64], out[512];
+    TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+    snprintf(sub, sizeof(sub), "%s/sub", dir);
+    snprintf(deep, sizeof(deep), "%s/sub/deep", dir);
+    TEST_ASSERT_EQUAL_INT(0, mkdir(sub, 0755));
+    TEST_ASSERT_EQUAL_INT(0, mkdir(deep, 0755));
+    const char *files[] = {"b.log", "a.log", "c.txt", ".hidden", "sub/x.c", "sub/deep/y.c"};
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) make_file(dir, files[i], 0644);
+
+    glob_list(NULL, dir, "*.log", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("a.log b.log", out);
+    glob_list(NULL, dir, "*", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("a.log b.log c.txt sub", out);
+    glob_list(NULL, dir, ".*", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING(".hidden", out);
+    glob_list(NULL, dir, "*/", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("sub/", out);
+    glob_list(NULL, dir, "s?b/*.c", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("sub/x.c", out);
+    glob_list(NULL, dir, "**/*.c", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("sub/deep/y.c sub/x.c", out);
+    glob_list(NULL, dir, "sub/**", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("sub/ sub/deep sub/deep/y.c sub/x.c", out);
+    glob_list(NULL, dir, "[ab].log", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("a.log b.log", out);
+    glob_list(NULL, dir, "\\*.log", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("", out);
+    glob_list(NULL, dir, "nothing/*", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("", out);
+
+    // A listing is kept only once the directory has been quiet for a while
+    struct glob_cache cache = {0};
+    glob_list(&cache, dir, "*.log", out, sizeof(out));
+    TEST_ASSERT_EQUAL_size_t(0, cache.bytes);
+    struct timespec old[2] = {{.tv_sec = time(NULL) - 60}, {.tv_sec = time(NULL) - 60}};
+    TEST_ASSERT_EQUAL_INT(0, utimensat(AT_FDCWD, dir, old, 0));
+    glob_list(&cache, dir, "*.log", out, sizeof(out));
+    TEST_ASSERT_TRUE(cache.bytes > 0);
+    glob_list(&cache, dir, "*.txt", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("c.txt", out);
+    // A new file moves the mtime, so the listing is read again
+    make_file(dir, "d.log", 0644);
+    glob_list(&cache, dir, "*.log", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("a.log b.log d.log", out);
+    glob_cache_destroy(&cache);
+
+    // Through the shell: quoted wildcards are literal, unmatched patterns stay
+    struct shell sh;
+    char src[512], cwd[PATH_MAX];
+    TEST_ASSERT_NOT_NULL(getcwd(cwd, sizeof(cwd)));
+    test_shell(&sh);
+    snprintf(src, sizeof(src),
+             "cd %s; echo *.log; echo '*'.log \"*\"; echo *.none; p='*.txt'; echo $p \"$p\"; "
+             "for f in sub/*; do echo [$f]; done; echo [ab", dir);
+    capture_program(&sh, src, out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("a.log b.log d.log\n*.log *\n*.none\nc.txt *.txt\n[sub/deep]\n[sub/x.c]\n[ab\n", out);
+    TEST_ASSERT_EQUAL_INT(0, chdir(cwd));
+    sh_destroy(&sh);
+
+    const char *cleanup[] = {"sub/deep/y.c", "sub/x.c", "a.log", "b.log", "c.txt", "d.log", ".hidden"};
+    for (size_t i = 0; i < sizeof(cleanup) / sizeof(cleanup[0]); i++) {
+        snprintf(src, sizeof(src), "%s/%s", dir, cleanup[i]);
+        unlink(src);
+    }
+    rmdir(deep);
+    rmdir(sub);
+    rmdir(dir);
+}
+
+/** Join the candidates for prefix with spaces. */
+static void complete_list(struct shell *sh, const char *prefix, char *out, size_t size) {
+    struct completion c;
+    TEST_ASSERT_EQUAL_INT(0, complete_command(sh, prefix, &c));
+    out[0] = '\0';
+    for (size_t i = 0; i < c.n; i++) snprintf(out + strlen(out), size - strlen(out), "%s%s", i ? " " : "", c.v[i]);
+    completion_free(&c);
+}
+
+void test_complete_command(void) {
+    char a[] = "/tmp/test-lab-XXXXXX", b[] = "/tmp/test-lab-XXXXXX", path[64], file[128], out[512];
+    TEST_ASSERT_NOT_NULL(mkdtemp(a));
+    TEST_ASSERT_NOT_NULL(mkdtemp(b));
+    make_file(a, "zq-one", 0755);
+    make_file(a, "zq-two", 0755);
+    make_file(a, "zq-data", 0644);
+    make_file(b, "zq-one", 0755);
+    make_file(b, "zq-bee", 0755);
+
+    struct shell sh;
+    test_shell(&sh);
+    snprintf(path, sizeof(path), "%s::%s:%s", a, b, a);
+    var_set(&sh, "PATH", path);
+    complete_list(&sh, "zq-", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("zq-bee zq-one zq-two", out);
+    TEST_ASSERT_EQUAL_size_t(2, sh.complete.ndirs);
+
+    // Builtins and functions are merged in
+    struct program *p;
+    TEST_ASSERT_EQUAL_INT(0, program_parse("zq-fn() { :; }", 14, &p));
+    program_run(&sh, p);
+    program_unref(p);
+    sh_register_builtin(&sh, "zq-built", run_test_builtin);
+    sh_register_builtin(&sh, "zq-one", run_test_builtin);
+    complete_list(&sh, "zq-", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("zq-bee zq-built zq-fn zq-one zq-two", out);
+    complete_list(&sh, "expo", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("export", out);
+    complete_list(&sh, "zq-nothing", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("", out);
+
+    // Changes reach the trie through inotify, without a rebuild
+    size_t nodes = sh.complete.n;
+    make_file(a, "zq-new", 0755);
+    snprintf(file, sizeof(file), "%s/zq-two", a);
+    unlink(file);
+    snprintf(file, sizeof(file), "%s/zq-data", a);
+    TEST_ASSERT_EQUAL_INT(0, chmod(file, 0755));
+    snprintf(file, sizeof(file), "%s/zq-one", b);
+    unlink(file);
+    complete_list(&sh, "zq-", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("zq-bee zq-built zq-data zq-fn zq-new zq-one", out);
+    TEST_ASSERT_TRUE(sh.complete.n > nodes);
+    TEST_ASSERT_FALSE(sh.complete.stale);
+
+    // A new PATH builds a new trie
+    var_set(&sh, "PATH", b);
+    complete_list(&sh, "zq-b", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("zq-bee zq-built", out);
+    TEST_ASSERT_EQUAL_size_t(1, sh.complete.ndirs);
+    sh_destroy(&sh);
+
+    const char *names[] = {"zq-one", "zq-data", "zq-new", "zq-bee"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        snprintf(file, sizeof(file), "%s/%s", a, names[i]);
+        unlink(file);
+        snprintf(file, sizeof(file), "%s/%s", b, names[i]);
+        unlink(file);
+    }
+    rmdir(a);
+    rmdir(b);
+}
+
+/** A slow segment for the tests. */
+static int segment_answer(const char *cwd, char *out, size_t size, char *dep, size_t dep_size) {
+    UNUSED(cwd);
+    UNUSED(dep_size);
+    snprintf(out, size, "forty-two");
+    dep[0] = '\0';
+    return 0;
+}
+
+void test_prompt(void) {
+    char dir[] = "/tmp/test-lab-XXXXXX", path[128], old[PATH_MAX];
+    TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+    TEST_ASSERT_NOT_NULL(getcwd(old, sizeof(old)));
+    TEST_ASSERT_EQUAL_INT(0, chdir(dir));
+
+    struct shell sh;
+    test_shell(&sh);
+    sh.last_status = 3;
+    var_set(&sh, "HOME", dir);
+    char *s = prompt_expand(&sh, "[\\?|\\j|\\\\|\\q|\\w|\\[x\\]]\\$ ");
+    char want[64];
+    snprintf(want, sizeof(want), "[3|0|\\|\\q|~|\001x\002]%s ", geteuid() == 0 ? "#" : "$");
+    TEST_ASSERT_EQUAL_STRING(want, s);
+    free(s);
+    s = prompt_expand(&sh, "\\W");
+    TEST_ASSERT_EQUAL_STRING(strrchr(dir, '/') + 1, s);
+    free(s);
+    TEST_ASSERT_EQUAL_INT(-1, prompt_fd(&sh));
+
+    // A slow segment shows up once the thread computed it
+    TEST_ASSERT_EQUAL_INT(0, prompt_add_segment(&sh, "answer", segment_answer));
+    var_set(&sh, "MY_PROMPT", "<\\{answer}\\{nothing}>");
+    s = prompt_render(&sh);
+    TEST_ASSERT_EQUAL_STRING("<\\{nothing}>", s);
+    free(s);
+    struct pollfd pfd = {.fd = prompt_fd(&sh), .events = POLLIN};
+    TEST_ASSERT_TRUE(pfd.fd != -1);
+    TEST_ASSERT_EQUAL_INT(1, poll(&pfd, 1, 5000));
+    s = prompt_update(&sh);
+    TEST_ASSERT_EQUAL_STRING("<forty-two\\{nothing}>", s);
+    free(s);
+    s = prompt_render(&sh);
+    TEST_ASSERT_EQUAL_STRING("<forty-two\\{nothing}>", s);
+    free(s);
+    // Subshells forked while the thread runs exit without waiting for it
+    char out[PROMPT_SEGMENT_MAX];
+    TEST_ASSERT_EQUAL_INT(3, capture_program(&sh, "(exit 3)", out, sizeof(out)));
+    TEST_ASSERT_EQUAL_INT(0, capture_program(&sh, "exit 4 | cat", out, sizeof(out)));
+
+    // The git branch comes from .git/HEAD, also in a subdirectory
+    snprintf(path, sizeof(path), "%s/.git", dir);
+    TEST_ASSERT_EQUAL_INT(0, mkdir(path, 0755));
+    snprintf(path, sizeof(path), "%s/.git/HEAD", dir);
+    FILE *f = fopen(path, "w");
+    TEST_ASSERT_NOT_NULL(f);
+    fputs("ref: refs/heads/topic\n", f);
+    fclose(f);
+    snprintf(path, sizeof(path), "%s/sub", dir);
+    TEST_ASSERT_EQUAL_INT(0, mkdir(path, 0755));
+    char dep[PATH_MAX];
+    TEST_ASSERT_EQUAL_INT(0, prompt_segment_git(path, out, sizeof(out), dep, sizeof(dep)));
+    TEST_ASSERT_EQUAL_STRING("topic", out);
+    snprintf(path, sizeof(path), "%s/.git/HEAD", dir);
+    TEST_ASSERT_EQUAL_STRING(path, dep);
+    TEST_ASSERT_EQUAL_INT(-1, prompt_segment_git("/", out, sizeof(out), dep, sizeof(dep)));
+    sh_destroy(&sh);
+
+    TEST_ASSERT_EQUAL_INT(0, chdir(old));
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/.git", dir);
+    rmdir(path);
+    snprintf(path, sizeof(path), "%s/sub", dir);
+    rmdir(path);
+    rmdir(dir);
+}
+
+void test_dirs_stack(void) {
+    char dir[] = "/tmp/test-lab-XXXXXX", old[PATH_MAX], src[1024], want[2048], out[2048];
+    TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+    TEST_ASSERT_NOT_NULL(getcwd(old, sizeof(old)));
+    snprintf(src, sizeof(src), "%s/one", dir);
+    TEST_ASSERT_EQUAL_INT(0, mkdir(src, 0755));
+    snprintf(src, sizeof(src), "%s/two", dir);
+    TEST_ASSERT_EQUAL_INT(0, mkdir(src, 0755));
+
+    struct shell sh;
+    test_shell(&sh);
+    var_set(&sh, "HOME", "/nonexistent");
+    // cd - goes back and prints where it went, CDPATH finds relative names
+    snprintf(src, sizeof(src), "cd %s/one; cd /; cd -; CDPATH=:%s; cd two; echo $PWD; cd one; cd $OLDPWD",
+             dir, dir);
+    capture_program(&sh, src, out, sizeof(out));
+    snprintf(want, sizeof(want), "%s/one\n%s/two\n%s/two\n%s/one\n", dir, dir, dir, dir);
+    TEST_ASSERT_EQUAL_STRING(want, out);
+    TEST_ASSERT_EQUAL_INT(0, sh.last_status);
+
+    // pushd, rotation, popd and dirs
+    snprintf(src, sizeof(src), "cd %s; pushd one; pushd ../two; pushd +2; dirs -v; popd; popd +1; dirs -c; dirs", dir);
+    capture_program(&sh, src, out, sizeof(out));
+    snprintf(want, sizeof(want),
+             "%s/one %s\n%s/two %s/one %s\n%s %s/two %s/one\n 0  %s\n 1  %s/two\n 2  %s/one\n"
+             "%s/two %s/one\n%s/two\n%s/two\n",
+             dir, dir, dir, dir, dir, dir, dir, dir, dir, dir, dir, dir, dir, dir, dir);
+    TEST_ASSERT_EQUAL_STRING(want, out);
+    TEST_ASSERT_EQUAL_size_t(0, sh.dirs.n);
+
+    TEST_ASSERT_EQUAL_INT(1, capture_program(&sh, "popd", out, sizeof(out)));
+    TEST_ASSERT_EQUAL_INT(1, capture_program(&sh, "cd /nonexistent/dir", out, sizeof(out)));
+    TEST_ASSERT_EQUAL_INT(1, capture_program(&sh, "j anything", out, sizeof(out)));
+    sh_destroy(&sh);
+
+    TEST_ASSERT_EQUAL_INT(0, chdir(old));
+    snprintf(src, sizeof(src), "%s/one", dir);
+    rmdir(src);
+    snprintf(src, sizeof(src), "%s/two", dir);
+    rmdir(src);
+    rmdir(dir);
+}
+
+void test_dirdb(void) {
+    char dir[] = "/tmp/test-lab-XXXXXX", file[64], a[128], b[64], out[DIRDB_PATH_MAX];
+    TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+    snprintf(file, sizeof(file), "%s/db", dir);
+    snprintf(a, sizeof(a), "%s/src-Lib", dir);
+    snprintf(b, sizeof(b), "%s/lib", dir);
+    TEST_ASSERT_EQUAL_INT(0, mkdir(a, 0755));
+    TEST_ASSERT_EQUAL_INT(0, mkdir(b, 0755));
+
+    char *lib[] = {"lib"}, *src_lib[] = {"src", "lib"}, *upper[] = {"Lib"}, *none[] = {"nothing"};
+    TEST_ASSERT_TRUE(dirdb_match("/w/src/lib", src_lib, 2));
+    TEST_ASSERT_FALSE(dirdb_match("/w/lib/src", src_lib, 2));
+    TEST_ASSERT_FALSE(dirdb_match("/w/lib/x", lib, 1));
+    TEST_ASSERT_TRUE(dirdb_match("/w/LIB", lib, 1));
+    TEST_ASSERT_FALSE(dirdb_match("/w/LIB", upper, 1));
+
+    // A visit an hour ago beats two a week ago
+    struct dirdb db, other;
+    int64_t now = 1000000000;
+    TEST_ASSERT_EQUAL_INT(0, dirdb_open(&db, file));
+    TEST_ASSERT_EQUAL_INT(0, dirdb_add(&db, b, now - 8 * 86400));
+    TEST_ASSERT_EQUAL_INT(0, dirdb_add(&db, b, now - 8 * 86400));
+    TEST_ASSERT_EQUAL_INT(0, dirdb_add(&db, a, now - 60));
+    TEST_ASSERT_EQUAL_INT(0, dirdb_best(&db, lib, 1, NULL, now, out, sizeof(out)));
+    TEST_ASSERT_EQUAL_STRING(a, out);
+    TEST_ASSERT_EQUAL_INT(0, dirdb_best(&db, lib, 1, a, now, out, sizeof(out)));
+    TEST_ASSERT_EQUAL_STRING(b, out);
+    TEST_ASSERT_EQUAL_INT(0, dirdb_best(&db, upper, 1, NULL, now, out, sizeof(out)));
+    TEST_ASSERT_EQUAL_STRING(a, out);
+    TEST_ASSERT_EQUAL_INT(-1, dirdb_best(&db, none, 1, NULL, now, out, sizeof(out)));
+
+    // Another shell sees the same file, directories that are gone are skipped
+    TEST_ASSERT_EQUAL_INT(0, dirdb_open(&other, file));
+    TEST_ASSERT_EQUAL_UINT32(2, other.map->n);
+    TEST_ASSERT_EQUAL_INT(0, rmdir(a));
+    TEST_ASSERT_EQUAL_INT(0, dirdb_best(&other, lib, 1, NULL, now, out, sizeof(out)));
+    TEST_ASSERT_EQUAL_STRING(b, out);
+    dirdb_close(&other);
+
+    // Aging keeps the total bounded and forgets what falls below one
+    for (int i = 0; i < 12000; i++) dirdb_add(&db, b, now);
+    TEST_ASSERT_TRUE(db.map->total <= DIRDB_MAX_RANK);
+    TEST_ASSERT_EQUAL_UINT32(1, db.map->n);
+    dirdb_close(&db);
+
+    // Not a database
+    TEST_ASSERT_EQUAL_INT(0, truncate(file, 100));
+    TEST_ASSERT_EQUAL_INT(-1, dirdb_open(&db, file));
+    TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+
+    // j in a shell with a database
+    struct shell sh;
+    char old[PATH_MAX], res[256];
+    TEST_ASSERT_NOT_NULL(getcwd(old, sizeof(old)));
+    unlink(file);
+    test_shell(&sh);
+    TEST_ASSERT_EQUAL_INT(0, dirdb_open(&sh.dirs.db, file));
+    snprintf(a, sizeof(a), "cd %s; cd /; j li; j nothing", b);
+    TEST_ASSERT_EQUAL_INT(1, capture_program(&sh, a, res, sizeof(res)));
+    snprintf(a, sizeof(a), "%s\n", b);
+    TEST_ASSERT_EQUAL_STRING(a, res);
+    sh_destroy(&sh);
+    TEST_ASSERT_EQUAL_INT(0, chdir(old));
+
+    unlink(file);
+    rmdir(b);
+    rmdir(dir);
+}
+
+void test_zygote(void) {
+    char dir[] = "/tmp/test-lab-XXXXXX", old[PATH_MAX], src[512], want[512], out[512];
+    TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+    TEST_ASSERT_NOT_NULL(getcwd(old, sizeof(old)));
+    struct shell sh;
+    test_shell(&sh);
+    TEST_ASSERT_EQUAL_INT(0, sh_set_option(&sh, "zygote", true));
+
+    // Children see the shell's cwd, stdout and redirections and are its own
+    snprintf(src, sizeof(src),
+             "cd %s; /bin/pwd; /bin/echo x > f; /bin/cat < f | /bin/cat; "
+             "/bin/sh -c 'echo $PPID; exit 3'; echo $?; /bin/cat < missing; echo $?", dir);
+    capture_program(&sh, src, out, sizeof(out));
+    snprintf(want, sizeof(want), "%s\nx\n%d\n3\n1\n", dir, (int)getpid());
+    TEST_ASSERT_EQUAL_STRING(want, out);
+    TEST_ASSERT_TRUE(sh.zygote.pid > 0);
+    pid_t helper = sh.zygote.pid;
+
+    // A file that cannot be executed fails the way it does without the helper
+    TEST_ASSERT_EQUAL_INT(126, capture_program(&sh, "./f", out, sizeof(out)));
+    TEST_ASSERT_EQUAL_INT(helper, sh.zygote.pid);
+
+    TEST_ASSERT_EQUAL_INT(0, sh_set_option(&sh, "zygote", false));
+    TEST_ASSERT_EQUAL_INT(0, sh.zygote.pid);
+    TEST_ASSERT_EQUAL_INT(-1, kill(helper, 0));
+    sh_destroy(&sh);
+
+    TEST_ASSERT_EQUAL_INT(0, chdir(old));
+    snprintf(src, sizeof(src), "%s/f", dir);
+    unlink(src);
+    rmdir(dir);
+}
+
+/* What the event loop callbacks saw */
+struct ev_seen {
+    int calls;
+    int fd;
+    unsigned events;
+    int status;
+};
+
+static void ev_note(struct evloop *l, int fd, unsigned events, void *arg) {
+    struct ev_seen *seen = arg;
+    (void)l;
+    seen->calls++;
+    seen->fd = fd;
+    seen->events = events;
+}
+
+static void ev_note_child(struct evloop *l, int fd, unsigned events, void *arg) {
+    struct ev_seen *seen = arg;
+    siginfo_t si = {0};
+    ev_note(l, fd, events, arg);
+    // The pidfd is still good, reap through it
+    TEST_ASSERT_EQUAL_INT(0, waitid(P_PIDFD, (id_t)fd, &si, WEXITED));
+    seen->status = si.si_status;
+}
+
+/** ev_run_once past signals, the SIGCHLD of an earlier test may come in. */
+static int ev_run_quiet(struct evloop *l, int timeout_ms) {
+    int n;
+    while ((n = ev_run_once(l, timeout_ms)) == -1 && errno == EINTR) {
+    }
+    return n;
+}
+
+static void check_evloop(enum ev_backend backend) {
+    struct evloop l;
+    if (ev_init(&l, backend) == -1) {
+        TEST_ASSERT_EQUAL_INT(EV_URING, backend);
+        return;
+    }
+    TEST_ASSERT_EQUAL_INT(backend, l.backend);
+
+    // Level-triggered: a byte left unread is reported again
+    int p[2];
+    TEST_ASSERT_EQUAL_INT(0, pipe(p));
+    fcntl(p[0], F_SETFL, O_NONBLOCK);
+    fcntl(p[1], F_SETFL, O_NONBLOCK);
+    struct ev_seen seen = {0};
+    int id = ev_add(&l, p[0], EV_READ, ev_note, &seen);
+    TEST_ASSERT_TRUE(id >= 0);
+    TEST_ASSERT_EQUAL_INT(0, ev_run_quiet(&l, 20));
+    TEST_ASSERT_EQUAL_INT(1, write(p[1], "x", 1));
+    TEST_ASSERT_EQUAL_INT(1, ev_run_quiet(&l, 1000));
+    TEST_ASSERT_EQUAL_INT(1, ev_run_quiet(&l, 1000));
+    TEST_ASSERT_EQUAL_INT(2, seen.calls);
+    TEST_ASSERT_EQUAL_INT(p[0], seen.fd);
+    TEST_ASSERT_TRUE(seen.events & EV_READ);
+    ev_del(&l, id);
+    ev_del(&l, id);
+    TEST_ASSERT_EQUAL_INT(0, ev_run_quiet(&l, 20));
+    TEST_ASSERT_EQUAL_INT(2, seen.calls);
+    TEST_ASSERT_EQUAL_INT(0, (int)l.live);
+
+    // Timers fire once and are gone by the time they are called
+    struct timespec after = {.tv_nsec = 5000000};
+    seen = (struct ev_seen){0};
+    TEST_ASSERT_TRUE(ev_timer(&l, &after, ev_note, &seen) >= 0);
+    while (!seen.calls) TEST_ASSERT_TRUE(ev_run_quiet(&l, 1000) >= 0);
+    TEST_ASSERT_EQUAL_INT(-1, seen.fd);
+    TEST_ASSERT_EQUAL_INT(0, (int)l.live);
+
+    // Children are reported once, with their pidfd
+    pid_t pid = fork();
+    TEST_ASSERT_TRUE(pid != -1);
+    if (pid == 0) _exit(7);
+    seen = (struct ev_seen){0};
+    TEST_ASSERT_TRUE(ev_child(&l, pid, ev_note_child, &seen) >= 0);
+    while (!seen.calls) TEST_ASSERT_TRUE(ev_run_quiet(&l, 1000) >= 0);
+    TEST_ASSERT_EQUAL_INT(7, seen.status);
+    TEST_ASSERT_EQUAL_INT(0, (int)l.live);
+
+    // Waiting for a full pipe to drain, then the write end is really closed
+    char buf[65536];
+    memset(buf, 'x', sizeof(buf));
+    while (write(p[1], buf, sizeof(buf)) > 0) {
+    }
+    TEST_ASSERT_EQUAL_INT(0, ev_wait(&l, p[1], EV_WRITE, 20));
+    while (read(p[0], buf, sizeof(buf)) > 0) {
+    }
+    TEST_ASSERT_EQUAL_INT(1, ev_wait(&l, p[1], EV_WRITE, 1000));
+    close(p[1]);
+    TEST_ASSERT_EQUAL_INT(0, read(p[0], buf, sizeof(buf)));
+    close(p[0]);
+    ev_destroy(&l);
+}
+
+void test_evloop(void) {
+    check_evloop(EV_URING);
+    check_evloop(EV_EPOLL);
+
+    // A builtin's output waits in the loop for a reader that falls behind
+    struct shell sh;
+    char out[64];
+    test_shell(&sh);
+    TEST_ASSERT_EQUAL_INT(0, sh_set_option(&sh, "relay", true));
+    capture_program(&sh, "printf '%0900000d%0900000d' 1 2 | sh -c 'sleep 0.2; wc -c'", out, sizeof(out));
+    TEST_ASSERT_EQUAL_STRING("1800000\n", out);
+    TEST_ASSERT_EQUAL_INT(0, capture_program(&sh, "sleep 0.01", out, sizeof(out)));
+    TEST_ASSERT_EQUAL_INT(0, (int)sh.loop.live);
+    sh_destroy(&sh);
+}
 
 int main(void) {
     UNITY_BEGIN();
@@ -221,5 +1955,50 @@ int main(void) {
     RUN_TEST(test_trim_white_tabs);
     RUN_TEST(test_get_prompt_empty_env);
     RUN_TEST(test_ch_dir_invalid_path);
+    RUN_TEST(test_cmd_parse_argc);
+    RUN_TEST(test_cmd_parse_arena);
+    RUN_TEST(test_arena_grows);
+    RUN_TEST(test_cmd_parse_tabs);
+    RUN_TEST(test_cmd_parse_quotes);
+    RUN_TEST(test_cmd_parse_unterminated_quote);
+    RUN_TEST(test_tokenize_operators);
+    RUN_TEST(test_tokenize_impls_agree);
+    RUN_TEST(test_cmd_hash_lookup);
+    RUN_TEST(test_cmd_hash_path_change);
+    RUN_TEST(test_cmd_hash_forget);
+    RUN_TEST(test_execute_command_fork);
+    RUN_TEST(test_execute_command_spawn);
+    RUN_TEST(test_pipeline_parse);
+    RUN_TEST(test_pipeline_relay);
+    RUN_TEST(test_pipeline_parse_redirs);
+    RUN_TEST(test_redirections_fork);
+    RUN_TEST(test_redirections_spawn);
+    RUN_TEST(test_pipeline_background);
+    RUN_TEST(test_background_jobs);
+    RUN_TEST(test_parallel);
+    RUN_TEST(test_histdb);
+    RUN_TEST(test_script_reader);
+    RUN_TEST(test_pipeline_time);
+    RUN_TEST(test_time_report);
+    RUN_TEST(test_builtin_echo_printf);
+    RUN_TEST(test_builtin_test);
+    RUN_TEST(test_builtin_pwd_sleep);
+    RUN_TEST(test_register_builtin);
+    RUN_TEST(test_program_parse);
+    RUN_TEST(test_vm_control_flow);
+    RUN_TEST(test_vm_functions);
+    RUN_TEST(test_vars);
+    RUN_TEST(test_vm_assignments);
+    RUN_TEST(test_command_substitution);
+    RUN_TEST(test_here_documents);
+    RUN_TEST(test_affinity);
+    RUN_TEST(test_glob_match);
+    RUN_TEST(test_glob_expand);
+    RUN_TEST(test_complete_command);
+    RUN_TEST(test_prompt);
+    RUN_TEST(test_dirs_stack);
+    RUN_TEST(test_dirdb);
+    RUN_TEST(test_zygote);
+    RUN_TEST(test_evloop);
     return UNITY_END();
 }
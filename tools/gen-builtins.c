@@ -0,0 +1,89 @@
+/**
+ * gen-builtins.c
+ * Turns src/builtins.def into a perfect hash table for lab.c. Tries seeds
+ * for builtin_name_hash until every name lands in a slot of its own,
+ * doubling the table whenever a size has no such seed. A third word
+ * "relay" marks a builtin that only writes output.
+ *
+ * usage: gen-builtins builtins.def > builtins.gen.h
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "../src/builtins.h"
+
+#define MAX_BUILTINS 256
+#define MAX_SEEDS (1u << 20)
+
+struct def {
+    char name[64];
+    char fn[64];
+    char flag[16];
+};
+
+/** True when seed puts every name in a different one of size slots. */
+static bool collision_free(const struct def *defs, size_t n, uint32_t seed, size_t size) {
+    unsigned char used[MAX_BUILTINS * 4] = {0};
+    for (size_t i = 0; i < n; i++) {
+        size_t slot = builtin_name_hash(defs[i].name, seed) & (size - 1);
+        if (used[slot]) return false;
+        used[slot] = 1;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s builtins.def\n", argv[0]);
+        return 2;
+    }
+    FILE *f = fopen(argv[1], "r");
+    if (!f) {
+        perror(argv[1]);
+        return 1;
+    }
+    static struct def defs[MAX_BUILTINS];
+    size_t n = 0;
+    char line[256];
+    for (int no = 1; fgets(line, sizeof(line), f); no++) {
+        char *p = line + strspn(line, " \t");
+        if (*p == '#' || *p == '\n' || *p == '\0') continue;
+        int got = n == MAX_BUILTINS ? 0 : sscanf(p, "%63s %63s %15s", defs[n].name, defs[n].fn, defs[n].flag);
+        if (got < 2 || (got == 3 && strcmp(defs[n].flag, "relay") != 0)) {
+            fprintf(stderr, "%s:%d: expected \"name function [relay]\"\n", argv[1], no);
+            return 1;
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (strcmp(defs[i].name, defs[n].name) == 0) {
+                fprintf(stderr, "%s:%d: %s defined twice\n", argv[1], no, defs[n].name);
+                return 1;
+            }
+        }
+        n++;
+    }
+    fclose(f);
+
+    size_t size = 1;
+    while (size < n) size *= 2;
+    uint32_t seed = 0;
+    for (;; size *= 2) {
+        if (size > MAX_BUILTINS * 4) {
+            fprintf(stderr, "%s: no perfect hash found\n", argv[1]);
+            return 1;
+        }
+        for (seed = 0; seed < MAX_SEEDS && !collision_free(defs, n, seed, size); seed++)
+            ;
+        if (seed < MAX_SEEDS) break;
+    }
+
+    printf("/* Generated by tools/gen-builtins from %s, do not edit */\n\n", argv[1]);
+    printf("#define BUILTIN_SEED %uu\n", seed);
+    printf("#define BUILTIN_MASK %zuu\n\n", size - 1);
+    printf("static const struct builtin_entry builtin_table[%zu] = {\n", size);
+    for (size_t i = 0; i < n; i++)
+        printf("    [%u] = {\"%s\", %s, %s},\n", builtin_name_hash(defs[i].name, seed) & (uint32_t)(size - 1),
+               defs[i].name, defs[i].fn, defs[i].flag[0] ? "true" : "false");
+    printf("};\n");
+    return 0;
+}